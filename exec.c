@@ -58,6 +58,8 @@
 
 #if !defined(CONFIG_USER_ONLY)
 static bool in_migration;
+/* Protects the sub-page dirty state */
+static QemuMutex dirty_subpage_lock;
 
 RAMList ram_list = { .blocks = QTAILQ_HEAD_INITIALIZER(ram_list.blocks) };
 
@@ -406,6 +408,7 @@ void cpu_exec_init_all(void)
 {
 #if !defined(CONFIG_USER_ONLY)
     qemu_mutex_init(&ram_list.mutex);
+    qemu_mutex_init(&dirty_subpage_lock);
     memory_map_init();
     io_mem_init();
 #endif
@@ -777,22 +780,226 @@ static void tlb_reset_dirty_range_all(ram_addr_t start, ram_addr_t length)
     cpu_tlb_reset_dirty_all(start1, length);
 }
 
+/* Sub-page tracking of DIRTY_MEMORY_SUBPAGE. Writes through the not dirty
+ * path to pages with users only set the bits of the blocks they hit, the
+ * page bit stays clear so the TLB keeps sending writes there. The page bit takes over once
+ * all blocks are dirty or the page used up its write budget, so bulk writes
+ * don't trap for every word. */
+#define DIRTY_SUBPAGE_BLOCKS       16
+#define DIRTY_SUBPAGE_BLOCK_SIZE   (TARGET_PAGE_SIZE / DIRTY_SUBPAGE_BLOCKS)
+#define DIRTY_SUBPAGE_ALL_BLOCKS   ((1 << DIRTY_SUBPAGE_BLOCKS) - 1)
+#define DIRTY_SUBPAGE_WRITE_BUDGET 64
+
+typedef struct DirtySubpage {
+    uint16_t users; /* Ranges using the page */
+    uint16_t dirty; /* Bit per block written since the last reset */
+    uint16_t writes; /* Traps since the last reset */
+} DirtySubpage;
+
+/* Per RAM page up to dirty_subpage_pages, NULL until the first user.
+ * Writes and reads look at users without the lock, so the array is
+ * allocated once and never moves. */
+static DirtySubpage *dirty_subpage;
+static ram_addr_t dirty_subpage_pages;
+
+/* Whether any page in [page, end) has users. Readers without the lock can
+ * rely on the page bit for pages without users: a page loses its last user
+ * only after its blocks went to the page bit. */
+static bool dirty_subpage_has_users(ram_addr_t page, ram_addr_t end)
+{
+    ram_addr_t pages = atomic_read(&dirty_subpage_pages);
+
+    smp_rmb();
+    for (end = MIN(end, pages); page < end; page++) {
+        if (atomic_read(&dirty_subpage[page].users)) {
+            return true;
+        }
+    }
+    smp_rmb();
+    return false;
+}
+
+/* Blocks of page which overlap [start, end) */
+static uint16_t dirty_subpage_blocks(ram_addr_t page, ram_addr_t start,
+                                     ram_addr_t end)
+{
+    ram_addr_t page_start = page << TARGET_PAGE_BITS;
+    unsigned int first, last;
+
+    first = (MAX(start, page_start) - page_start) / DIRTY_SUBPAGE_BLOCK_SIZE;
+    last = (MIN(end, page_start + TARGET_PAGE_SIZE) - 1 - page_start)
+           / DIRTY_SUBPAGE_BLOCK_SIZE;
+    return ((2 << last) - 1) & ~((1 << first) - 1);
+}
+
+void cpu_physical_memory_set_subpage_log(ram_addr_t start, ram_addr_t length,
+                                         bool log)
+{
+    const uint8_t mask = 1 << DIRTY_MEMORY_SUBPAGE;
+    ram_addr_t page, end;
+
+    if (length == 0) {
+        return;
+    }
+    end = TARGET_PAGE_ALIGN(start + length) >> TARGET_PAGE_BITS;
+
+    qemu_mutex_lock(&dirty_subpage_lock);
+    if (dirty_subpage == NULL) {
+        ram_addr_t pages = last_ram_offset() >> TARGET_PAGE_BITS;
+        dirty_subpage = g_new0(DirtySubpage, pages);
+        smp_wmb();
+        atomic_set(&dirty_subpage_pages, pages);
+    }
+    assert(end <= dirty_subpage_pages);
+    for (page = start >> TARGET_PAGE_BITS; page < end; page++) {
+        DirtySubpage *s = &dirty_subpage[page];
+        if (log) {
+            assert(s->users < UINT16_MAX);
+            atomic_set(&s->users, s->users + 1);
+        } else {
+            assert(s->users > 0);
+            if (s->users == 1 && s->dirty) {
+                /* Nobody looks at the blocks any more */
+                atomic_or(&ram_list.dirty_memory[page], mask);
+                s->dirty = 0;
+                s->writes = 0;
+            }
+            atomic_set(&s->users, s->users - 1);
+        }
+    }
+    qemu_mutex_unlock(&dirty_subpage_lock);
+}
+
+/* Returns false if the write isn't to a page with sub-page users, the
+ * caller has to set the page bit then */
+static bool cpu_physical_memory_set_dirty_subpage(ram_addr_t addr,
+                                                  unsigned size)
+{
+    const uint8_t mask = 1 << DIRTY_MEMORY_SUBPAGE;
+    ram_addr_t page = addr >> TARGET_PAGE_BITS;
+    bool tracked = false;
+
+    if (likely(!dirty_subpage_has_users(page, page + 1))) {
+        return false;
+    }
+    qemu_mutex_lock(&dirty_subpage_lock);
+    DirtySubpage *s = &dirty_subpage[page];
+    if (s->users && !(ram_list.dirty_memory[page] & mask)) {
+        s->dirty |= dirty_subpage_blocks(page, addr, addr + size);
+        if (s->dirty == DIRTY_SUBPAGE_ALL_BLOCKS ||
+            ++s->writes >= DIRTY_SUBPAGE_WRITE_BUDGET) {
+            atomic_or(&ram_list.dirty_memory[page], mask);
+            s->dirty = 0;
+        }
+        tracked = true;
+    }
+    qemu_mutex_unlock(&dirty_subpage_lock);
+    return tracked;
+}
+
+bool cpu_physical_memory_get_dirty_subpage(ram_addr_t start,
+                                           ram_addr_t length)
+{
+    const uint8_t mask = 1 << DIRTY_MEMORY_SUBPAGE;
+    ram_addr_t page = start >> TARGET_PAGE_BITS;
+    ram_addr_t end = TARGET_PAGE_ALIGN(start + length) >> TARGET_PAGE_BITS;
+    bool dirty;
+
+    if (likely(!dirty_subpage_has_users(page, end))) {
+        return bytemap_find(ram_list.dirty_memory, page, end, mask) < end;
+    }
+    /* Writes move blocks into the page bit, look at both at once */
+    qemu_mutex_lock(&dirty_subpage_lock);
+    dirty = bytemap_find(ram_list.dirty_memory, page, end, mask) < end;
+    for (; !dirty && page < MIN(end, dirty_subpage_pages); page++) {
+        dirty = dirty_subpage[page].dirty &
+                dirty_subpage_blocks(page, start, start + MAX(length, 1));
+    }
+    qemu_mutex_unlock(&dirty_subpage_lock);
+    return dirty;
+}
+
+/* Pages with users keep the blocks outside the range */
+static void cpu_physical_memory_clear_dirty_subpage(ram_addr_t start,
+                                                    ram_addr_t length)
+{
+    const uint8_t mask = 1 << DIRTY_MEMORY_SUBPAGE;
+    ram_addr_t page = start >> TARGET_PAGE_BITS;
+    ram_addr_t end = TARGET_PAGE_ALIGN(start + length) >> TARGET_PAGE_BITS;
+    ram_addr_t next;
+
+    qemu_mutex_lock(&dirty_subpage_lock);
+    while (page < end) {
+        if (page >= dirty_subpage_pages) {
+            bytemap_clear(ram_list.dirty_memory, page, end, mask);
+            break;
+        }
+        if (!dirty_subpage[page].users) {
+            for (next = page + 1; next < MIN(end, dirty_subpage_pages) &&
+                                  !dirty_subpage[next].users; next++) {
+            }
+            bytemap_clear(ram_list.dirty_memory, page, next, mask);
+            page = next;
+            continue;
+        }
+        DirtySubpage *s = &dirty_subpage[page];
+        if (atomic_fetch_and(&ram_list.dirty_memory[page],
+                             (uint8_t)~mask) & mask) {
+            s->dirty = DIRTY_SUBPAGE_ALL_BLOCKS;
+        }
+        s->dirty &= ~dirty_subpage_blocks(page, start, start + length);
+        s->writes = 0;
+        page++;
+    }
+    qemu_mutex_unlock(&dirty_subpage_lock);
+}
+
 /* Note: start and end must be within the same ram block.  */
 void cpu_physical_memory_reset_dirty(ram_addr_t start, ram_addr_t length,
                                      unsigned client)
 {
     if (length == 0)
         return;
-    cpu_physical_memory_clear_dirty_range(start, length, client);
+    if (client == DIRTY_MEMORY_SUBPAGE &&
+        dirty_subpage_has_users(start >> TARGET_PAGE_BITS,
+                                TARGET_PAGE_ALIGN(start + length)
+                                    >> TARGET_PAGE_BITS)) {
+        cpu_physical_memory_clear_dirty_subpage(start, length);
+    } else {
+        cpu_physical_memory_clear_dirty_range(start, length, client);
+    }
 
     if (tcg_enabled()) {
         tlb_reset_dirty_range_all(start, length);
     }
 }
 
+/* Users of each dirty client that can be switched off */
+static unsigned int dirty_client_users[DIRTY_MEMORY_NUM];
+
+void cpu_physical_memory_log_client(unsigned client, bool enable)
+{
+    assert(client < DIRTY_MEMORY_NUM);
+    if ((1 << client) & DIRTY_CLIENTS_ALWAYS) {
+        return;
+    }
+    if (enable) {
+        dirty_client_users[client]++;
+        return;
+    }
+    assert(dirty_client_users[client] > 0);
+    if (--dirty_client_users[client] == 0) {
+        /* Nobody resets the bit any more, set it everywhere so writes
+         * don't keep taking the not dirty path for it */
+        bytemap_set(ram_list.dirty_memory, 0,
+                    last_ram_offset() >> TARGET_PAGE_BITS, 1 << client);
+    }
+}
+
 static void cpu_physical_memory_set_dirty_tracking(bool enable)
 {
     in_migration = enable;
+    cpu_physical_memory_log_client(DIRTY_MEMORY_MIGRATION, enable);
 }
 
 hwaddr memory_region_section_get_iotlb(CPUState *cpu,
@@ -1317,12 +1524,10 @@ ram_addr_t qemu_ram_alloc_from_ptr(ram_addr_t size, void *host,
     new_ram_size = last_ram_offset() >> TARGET_PAGE_BITS;
 
     if (new_ram_size > old_ram_size) {
-        int i;
-        for (i = 0; i < DIRTY_MEMORY_NUM; i++) {
-            ram_list.dirty_memory[i] =
-                bitmap_zero_extend(ram_list.dirty_memory[i],
-                                   old_ram_size, new_ram_size);
-       }
+        ram_list.dirty_memory = g_realloc(ram_list.dirty_memory,
+                                          new_ram_size);
+        memset(ram_list.dirty_memory + old_ram_size, 0,
+               new_ram_size - old_ram_size);
     }
     cpu_physical_memory_set_dirty_range(new_block->offset, size);
 
@@ -1534,6 +1739,8 @@ found:
 static void notdirty_mem_write(void *opaque, hwaddr ram_addr,
                                uint64_t val, unsigned size)
 {
+    uint8_t clients = DIRTY_CLIENTS_NOCODE;
+
     if (!cpu_physical_memory_get_dirty_flag(ram_addr, DIRTY_MEMORY_CODE)) {
         tb_invalidate_phys_page_fast(ram_addr, size);
     }
@@ -1550,12 +1757,10 @@ static void notdirty_mem_write(void *opaque, hwaddr ram_addr,
     default:
         abort();
     }
-    cpu_physical_memory_set_dirty_flag(ram_addr, DIRTY_MEMORY_MIGRATION);
-    cpu_physical_memory_set_dirty_flag(ram_addr, DIRTY_MEMORY_VGA);
-    //FIXME: FIXME FIXME MORE EXPERIMENTAL STUFF
-    cpu_physical_memory_set_dirty_flag(ram_addr, DIRTY_MEMORY_NV2A_GPU_ZETA);
-    cpu_physical_memory_set_dirty_flag(ram_addr, DIRTY_MEMORY_NV2A_GPU_COLOR);
-    cpu_physical_memory_set_dirty_flag(ram_addr, DIRTY_MEMORY_NV2A_GPU_RESOURCE);
+    if (cpu_physical_memory_set_dirty_subpage(ram_addr, size)) {
+        clients &= ~(1 << DIRTY_MEMORY_SUBPAGE);
+    }
+    cpu_physical_memory_set_dirty_clients(ram_addr, clients);
     /* we remove the notdirty callback only if the code has been
        flushed */
     if (!cpu_physical_memory_is_clean(ram_addr)) {
@@ -1962,12 +2167,7 @@ static void invalidate_and_set_dirty(hwaddr addr,
         /* invalidate code */
         tb_invalidate_phys_page_range(addr, addr + length, 0);
         /* set dirty bit */
-        cpu_physical_memory_set_dirty_flag(addr, DIRTY_MEMORY_VGA);
-        cpu_physical_memory_set_dirty_flag(addr, DIRTY_MEMORY_MIGRATION);
-        //FIXME: FIXME FIXME MORE EXPERIMENTAL STUFF
-        cpu_physical_memory_set_dirty_flag(addr, DIRTY_MEMORY_NV2A_GPU_ZETA);
-        cpu_physical_memory_set_dirty_flag(addr, DIRTY_MEMORY_NV2A_GPU_COLOR);
-        cpu_physical_memory_set_dirty_flag(addr, DIRTY_MEMORY_NV2A_GPU_RESOURCE);
+        cpu_physical_memory_set_dirty_clients(addr, DIRTY_CLIENTS_NOCODE);
     }
     xen_modified_memory(addr, length);
 }
@@ -2569,13 +2769,8 @@ void stl_phys_notdirty(AddressSpace *as, hwaddr addr, uint32_t val)
                 /* invalidate code */
                 tb_invalidate_phys_page_range(addr1, addr1 + 4, 0);
                 /* set dirty bit */
-                cpu_physical_memory_set_dirty_flag(addr1,
-                                                   DIRTY_MEMORY_MIGRATION);
-                cpu_physical_memory_set_dirty_flag(addr1, DIRTY_MEMORY_VGA);
-                //FIXME FIXME FIXME: EXPIREMENTAL ADD!
-                cpu_physical_memory_set_dirty_flag(addr1, DIRTY_MEMORY_NV2A_GPU_ZETA);
-                cpu_physical_memory_set_dirty_flag(addr1, DIRTY_MEMORY_NV2A_GPU_COLOR);
-                cpu_physical_memory_set_dirty_flag(addr1, DIRTY_MEMORY_NV2A_GPU_RESOURCE);
+                cpu_physical_memory_set_dirty_clients(addr1,
+                                                      DIRTY_CLIENTS_NOCODE);
             }
         }
     }
@@ -74,6 +74,12 @@ void* glo_get_extension_proc(const GLubyte *extProc);
  * GLO_ constants */
 extern GloContext *glo_context_create(int formatFlags);
 
+/* Create another context which shares textures, buffers, shaders and
+ * programs with shareContext, to be made current on a different thread.
+ * Returns NULL if that isn't possible. */
+extern GloContext *glo_context_create_shared(int formatFlags,
+                                             GloContext *shareContext);
+
 /* Destroy a previouslu created OpenGL context */
 extern void glo_context_destroy(GloContext *context);
 
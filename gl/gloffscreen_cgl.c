@@ -43,6 +43,12 @@ struct _GloContext {
 /* Create an OpenGL context for a certain pixel format. formatflags are from 
  * the GLO_ constants */
 GloContext *glo_context_create(int formatFlags)
+{
+    return glo_context_create_shared(formatFlags, NULL);
+}
+
+GloContext *glo_context_create_shared(int formatFlags,
+                                      GloContext *shareContext)
 {
     CGLError err;
 
@@ -59,7 +65,9 @@ GloContext *glo_context_create(int formatFlags)
     err = CGLChoosePixelFormat(attributes, &pix, &num);
     if (err) return NULL;
 
-    err = CGLCreateContext(pix, NULL, &context->cglContext);
+    err = CGLCreateContext(pix,
+                           shareContext ? shareContext->cglContext : NULL,
+                           &context->cglContext);
     if (err) return NULL;
 
     CGLDestroyPixelFormat(pix);
@@ -62,15 +62,23 @@ static const char* eglGetErrorString(void)
     return "<Unknown EGL Error>";
 }
 
+static bool initialized = false;
+
 /* Create an OpenGL context for a certain pixel format. formatflags are from 
  * the GLO_ constants */
 GloContext *glo_context_create(int formatFlags)
 {
-    EGLint err;
+    return glo_context_create_shared(formatFlags, NULL);
+}
 
-    static bool initialized = false;
+GloContext *glo_context_create_shared(int formatFlags,
+                                      GloContext *shareContext)
+{
+    EGLint err;
 
-    if (!initialized) {
+    if (shareContext) {
+        assert(initialized);
+    } else if (!initialized) {
         EGLint major, minor;
         egl_display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
         if (egl_display == EGL_NO_DISPLAY) { return NULL; }
@@ -123,7 +131,10 @@ GloContext *glo_context_create(int formatFlags)
     EGLint ctxattr[] = {
       EGL_NONE
     };
-    context->egl_context = eglCreateContext(egl_display, config, EGL_NO_CONTEXT, ctxattr);
+    context->egl_context = eglCreateContext(egl_display, config,
+                                            shareContext ? shareContext->egl_context
+                                                         : EGL_NO_CONTEXT,
+                                            ctxattr);
     if (context->egl_context == EGL_NO_CONTEXT) return NULL;
     glo_set_current(context);
 
@@ -43,14 +43,23 @@ struct _GloContext {
 static Display* x_display;
 
 
+static bool initialized = false;
+
 /* Create an OpenGL context for a certain pixel format. formatflags are from 
  * the GLO_ constants */
 GloContext *glo_context_create(int formatFlags)
 {
+    return glo_context_create_shared(formatFlags, NULL);
+}
 
-    static bool initialized = false;
-
-    if (!initialized) {    
+GloContext *glo_context_create_shared(int formatFlags,
+                                      GloContext *shareContext)
+{
+    if (shareContext) {
+        assert(initialized);
+    } else if (!initialized) {
+        /* Shared contexts are used from other threads */
+        XInitThreads();
         x_display = XOpenDisplay(0);     
 	      printf("gloffscreen: GLX_VERSION = %s\n", glXGetClientString(x_display, GLX_VERSION));
 	      printf("gloffscreen: GLX_VENDOR = %s\n", glXGetClientString(x_display, GLX_VENDOR));
@@ -74,7 +83,9 @@ GloContext *glo_context_create(int formatFlags)
     if (nelements == 0) { return NULL; }
 
     /* Create GLX context */
-    context->glx_context = glXCreateNewContext(x_display, configs[0], GLX_RGBA_TYPE, NULL, True);
+    context->glx_context = glXCreateNewContext(x_display, configs[0], GLX_RGBA_TYPE,
+                                               shareContext ? shareContext->glx_context : NULL,
+                                               True);
     if (context->glx_context == NULL) { return NULL; }
 
 #if 1
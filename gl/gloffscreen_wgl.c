@@ -188,6 +188,11 @@ static void glo_kill(void) {
 /* Create an OpenGL context for a certain pixel format. formatflags are from
  * the GLO_ constants */
 GloContext *glo_context_create(int formatFlags) {
+    return glo_context_create_shared(formatFlags, NULL);
+}
+
+GloContext *glo_context_create_shared(int formatFlags,
+                                      GloContext *shareContext) {
     GloContext *context;
     /* pixel format attributes */
     int pf_attri[] = {
@@ -249,6 +254,15 @@ GloContext *glo_context_create(int formatFlags) {
         printf("Unable to create GL context\n");
         exit(EXIT_FAILURE);
     }
+    /* Has to happen before the new context owns any objects */
+    if (shareContext &&
+        !wglShareLists(shareContext->hContext, context->hContext)) {
+        wglDeleteContext(context->hContext);
+        wglReleasePbufferDCARB(context->hPBuffer, context->hDC);
+        wglDestroyPbufferARB(context->hPBuffer);
+        free(context);
+        return NULL;
+    }
     glo_set_current(context);
     return context;
 }
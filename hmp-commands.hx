@@ -1746,6 +1746,8 @@ show current migration capabilities
 show current migration XBZRLE cache size
 @item info balloon
 show balloon information
+@item info nv2a-stats
+show where the NV2A GPU spent the last frame and recent frame times
 @item info qtree
 show device tree
 @item info qdm
@@ -531,6 +531,57 @@ void hmp_info_balloon(Monitor *mon, const QDict *qdict)
     qapi_free_BalloonInfo(info);
 }
 
+void hmp_info_nv2a_stats(Monitor *mon, const QDict *qdict)
+{
+    NV2AStats *info;
+    NV2AStageStatsList *stage;
+    NV2AMethodStatsList *method;
+    NV2AFrameTimeBucketList *bucket;
+    Error *err = NULL;
+
+    info = qmp_query_nv2a_stats(&err);
+    if (err) {
+        monitor_printf(mon, "%s\n", error_get_pretty(err));
+        error_free(err);
+        return;
+    }
+
+    monitor_printf(mon, "frame %" PRId64 ": %" PRId64 " us, %" PRId64
+                   " draws, %" PRId64 " KiB uploaded\n",
+                   info->frame, info->frame_ns / 1000, info->draws,
+                   info->upload_bytes >> 10);
+
+    monitor_printf(mon, "stages:\n");
+    for (stage = info->stages; stage; stage = stage->next) {
+        monitor_printf(mon, "  %-16s %8" PRId64 " x %8" PRId64 " us\n",
+                       stage->value->name, stage->value->count,
+                       stage->value->ns / 1000);
+    }
+
+    monitor_printf(mon, "methods:\n");
+    for (method = info->methods; method; method = method->next) {
+        monitor_printf(mon, "  0x%02" PRIx64 " 0x%04" PRIx64 " %8" PRId64
+                       " x %8" PRId64 " us %s\n",
+                       method->value->graphics_class, method->value->method,
+                       method->value->count, method->value->ns / 1000,
+                       method->value->has_name ? method->value->name : "");
+    }
+
+    monitor_printf(mon, "frame times:\n");
+    for (bucket = info->histogram; bucket; bucket = bucket->next) {
+        if (bucket->next) {
+            monitor_printf(mon, "  %3" PRId64 "-%3" PRId64 " ms",
+                           bucket->value->min_ms, bucket->next->value->min_ms);
+        } else {
+            monitor_printf(mon, "  %3" PRId64 "+     ms",
+                           bucket->value->min_ms);
+        }
+        monitor_printf(mon, " %5" PRId64 "\n", bucket->value->frames);
+    }
+
+    qapi_free_NV2AStats(info);
+}
+
 static void hmp_info_pci_device(Monitor *mon, const PciDeviceInfo *dev)
 {
     PciMemoryRegionList *region;
@@ -0,0 +1,182 @@
+/*
+ * QEMU index range scan
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ *
+ */
+
+#include <assert.h>
+
+#include "qemu-common.h"
+#include "hw/xbox/index_range.h"
+
+/* SSE2 only has signed compares. Flipping the top bit maps unsigned order
+   onto signed order, for 16 bit values min and max work directly on the
+   flipped values, 32 bit values need a compare and a select. */
+
+#if defined(CONFIG_CPUID_H) && (defined(__x86_64__) || defined(__i386__))
+#define INDEX_RANGE_SSE2
+#include <cpuid.h>
+#include <emmintrin.h>
+#endif
+
+static bool have_sse2;
+static bool force_generic;
+
+static void index_range_init(void) __attribute__((constructor));
+static void index_range_init(void)
+{
+#ifdef INDEX_RANGE_SSE2
+    unsigned int a, b, c, d;
+    if (__get_cpuid_max(0, 0) >= 1) {
+        __cpuid(1, a, b, c, d);
+        have_sse2 = (d & bit_SSE2) != 0;
+    }
+#endif
+}
+
+const char *index_range_get_implementation(void)
+{
+    if (have_sse2 && !force_generic) {
+        return "sse2";
+    }
+    return "generic";
+}
+
+void index_range_force_generic(bool force)
+{
+    force_generic = force;
+}
+
+static inline bool use_sse2(void)
+{
+    return have_sse2 && !force_generic;
+}
+
+#ifdef INDEX_RANGE_SSE2
+
+/* Returns the number of indices done, the rest is left for the generic
+   code. *min and *max are only written if that isn't 0. */
+__attribute__((target("sse2")))
+static unsigned int range_u16_sse2(const uint16_t *indices,
+                                   unsigned int count,
+                                   uint32_t *min, uint32_t *max)
+{
+    const __m128i bias = _mm_set1_epi16(-0x8000);
+    __m128i lo = _mm_set1_epi16(0x7FFF);
+    __m128i hi = _mm_set1_epi16(-0x8000);
+    unsigned int i;
+
+    if (count < 8) {
+        return 0;
+    }
+    for (i = 0; i + 8 <= count; i += 8) {
+        __m128i v = _mm_xor_si128(
+            _mm_loadu_si128((const __m128i *)&indices[i]), bias);
+        lo = _mm_min_epi16(lo, v);
+        hi = _mm_max_epi16(hi, v);
+    }
+
+    /* Fold the 8 lanes */
+    lo = _mm_min_epi16(lo, _mm_shuffle_epi32(lo, _MM_SHUFFLE(1, 0, 3, 2)));
+    hi = _mm_max_epi16(hi, _mm_shuffle_epi32(hi, _MM_SHUFFLE(1, 0, 3, 2)));
+    lo = _mm_min_epi16(lo, _mm_shuffle_epi32(lo, _MM_SHUFFLE(2, 3, 0, 1)));
+    hi = _mm_max_epi16(hi, _mm_shuffle_epi32(hi, _MM_SHUFFLE(2, 3, 0, 1)));
+    lo = _mm_min_epi16(lo, _mm_srli_epi32(lo, 16));
+    hi = _mm_max_epi16(hi, _mm_srli_epi32(hi, 16));
+
+    *min = (uint16_t)(_mm_cvtsi128_si32(lo) ^ 0x8000);
+    *max = (uint16_t)(_mm_cvtsi128_si32(hi) ^ 0x8000);
+    return i;
+}
+
+__attribute__((target("sse2")))
+static inline __m128i min_epi32_sse2(__m128i a, __m128i b)
+{
+    __m128i greater = _mm_cmpgt_epi32(a, b);
+    return _mm_or_si128(_mm_and_si128(greater, b),
+                        _mm_andnot_si128(greater, a));
+}
+
+__attribute__((target("sse2")))
+static inline __m128i max_epi32_sse2(__m128i a, __m128i b)
+{
+    __m128i greater = _mm_cmpgt_epi32(a, b);
+    return _mm_or_si128(_mm_and_si128(greater, a),
+                        _mm_andnot_si128(greater, b));
+}
+
+__attribute__((target("sse2")))
+static unsigned int range_u32_sse2(const uint32_t *indices,
+                                   unsigned int count,
+                                   uint32_t *min, uint32_t *max)
+{
+    const __m128i bias = _mm_set1_epi32(INT32_MIN);
+    __m128i lo = _mm_set1_epi32(INT32_MAX);
+    __m128i hi = _mm_set1_epi32(INT32_MIN);
+    unsigned int i;
+
+    if (count < 4) {
+        return 0;
+    }
+    for (i = 0; i + 4 <= count; i += 4) {
+        __m128i v = _mm_xor_si128(
+            _mm_loadu_si128((const __m128i *)&indices[i]), bias);
+        lo = min_epi32_sse2(lo, v);
+        hi = max_epi32_sse2(hi, v);
+    }
+
+    lo = min_epi32_sse2(lo, _mm_shuffle_epi32(lo, _MM_SHUFFLE(1, 0, 3, 2)));
+    hi = max_epi32_sse2(hi, _mm_shuffle_epi32(hi, _MM_SHUFFLE(1, 0, 3, 2)));
+    lo = min_epi32_sse2(lo, _mm_shuffle_epi32(lo, _MM_SHUFFLE(2, 3, 0, 1)));
+    hi = max_epi32_sse2(hi, _mm_shuffle_epi32(hi, _MM_SHUFFLE(2, 3, 0, 1)));
+
+    *min = (uint32_t)_mm_cvtsi128_si32(lo) ^ 0x80000000;
+    *max = (uint32_t)_mm_cvtsi128_si32(hi) ^ 0x80000000;
+    return i;
+}
+
+#endif
+
+void index_range_u16(const uint16_t *indices, unsigned int count,
+                     uint32_t *min, uint32_t *max)
+{
+    uint32_t lo = UINT16_MAX;
+    uint32_t hi = 0;
+    unsigned int i = 0;
+
+    assert(count > 0);
+#ifdef INDEX_RANGE_SSE2
+    if (use_sse2()) {
+        i = range_u16_sse2(indices, count, &lo, &hi);
+    }
+#endif
+    for (; i < count; i++) {
+        lo = MIN(lo, indices[i]);
+        hi = MAX(hi, indices[i]);
+    }
+    *min = lo;
+    *max = hi;
+}
+
+void index_range_u32(const uint32_t *indices, unsigned int count,
+                     uint32_t *min, uint32_t *max)
+{
+    uint32_t lo = UINT32_MAX;
+    uint32_t hi = 0;
+    unsigned int i = 0;
+
+    assert(count > 0);
+#ifdef INDEX_RANGE_SSE2
+    if (use_sse2()) {
+        i = range_u32_sse2(indices, count, &lo, &hi);
+    }
+#endif
+    for (; i < count; i++) {
+        lo = MIN(lo, indices[i]);
+        hi = MAX(hi, indices[i]);
+    }
+    *min = lo;
+    *max = hi;
+}
@@ -0,0 +1,27 @@
+/*
+ * QEMU index range scan
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ *
+ */
+
+#ifndef HW_XBOX_INDEX_RANGE_H
+#define HW_XBOX_INDEX_RANGE_H
+
+#include <stdint.h>
+#include "qemu/osdep.h"
+
+/* Smallest and largest of count indices, count has to be at least 1 */
+void index_range_u16(const uint16_t *indices, unsigned int count,
+                     uint32_t *min, uint32_t *max);
+void index_range_u32(const uint32_t *indices, unsigned int count,
+                     uint32_t *min, uint32_t *max);
+
+/* Name of the kernels picked for this host, for benchmarks and tests */
+const char *index_range_get_implementation(void);
+
+/* Only use the portable kernels (for tests) */
+void index_range_force_generic(bool force);
+
+#endif
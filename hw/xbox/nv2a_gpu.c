@@ -26,10 +26,19 @@
 #include "hw/display/vga_int.h"
 #include "qemu/queue.h"
 #include "qemu/thread.h"
+#include "qemu/atomic.h"
+#include "qemu/bitmap.h"
+#include "qemu/main-loop.h"
+#include "qemu/config-file.h"
+#include "sysemu/sysemu.h"
 #include "qapi/qmp/qstring.h"
+#include "qapi/qmp/qerror.h"
+#include "qmp-commands.h"
 #include "gl/gloffscreen.h"
 
 #include "hw/xbox/swizzle.h"
+#include "hw/xbox/yuv.h"
+#include "hw/xbox/index_range.h"
 #include "hw/xbox/u_format_r11g11b10f.h"
 
 #include "hw/xbox/nv2a_gpu_vsh.h"
@@ -50,6 +59,21 @@
 
 #define DEBUG_NV2A_GPU_DISABLE_MIPMAP
 //#define DEBUG_NV2A_GPU_EXPORT
+//#define DEBUG_NV2A_GPU_FIFO_STATS
+//#define DEBUG_NV2A_GPU_RAMIN_CACHE_STATS
+//#define DEBUG_NV2A_GPU_TEXTURE_CACHE_STATS
+//#define DEBUG_NV2A_GPU_TEXTURE_DECODE_STATS
+//#define DEBUG_NV2A_GPU_TEXTURE_GPU_DECODE_VERIFY
+//#define DEBUG_NV2A_GPU_VERTEX_CACHE_STATS
+//#define DEBUG_NV2A_GPU_INDEX_CACHE_STATS
+//#define DEBUG_NV2A_GPU_SHADER_CACHE_STATS
+//#define DEBUG_NV2A_GPU_SHADER_COMPILE_STATS
+//#define DEBUG_NV2A_GPU_DRAW_TIMING
+//#define DEBUG_NV2A_GPU_GL_STATE_STATS
+//#define DEBUG_NV2A_GPU_IMAGE_BLIT_STATS
+//#define DEBUG_NV2A_GPU_FAST_CLEAR_STATS
+//#define DEBUG_NV2A_GPU_SCANOUT_STATS
+//#define DEBUG_NV2A_GPU_SUBPAGE_DIRTY_STATS
 //#define DEBUG_NV2A_GPU
 #ifdef DEBUG_NV2A_GPU
 # define NV2A_GPU_DPRINTF(format, ...)       printf("nv2a: " format, ## __VA_ARGS__)
@@ -181,10 +205,19 @@ printf("%i levels\n",levels);
     return out;
 }
 
-static inline void* convert_cr8yb8cb8ya8_to_a8r8g8b8(unsigned int w, unsigned int h, unsigned int pitch, unsigned int levels, const void* in)
+/* Video textures, the result is tightly packed A8R8G8B8 */
+static void* convert_yuv422_to_a8r8g8b8(unsigned int texture_format, unsigned int width, unsigned int height, unsigned int pitch, const void* data)
 {
-    //FIXME: Do the actual conversion..
-    return convert_a8r8g8b8_to_a8r8g8b8(w,h,pitch,levels,in);
+    YUV422Format format =
+        (texture_format == NV097_SET_TEXTURE_FORMAT_COLOR_LC_IMAGE_YB8CR8YA8CB8) ?
+            YUV422_UYVY : YUV422_YUYV;
+    uint8_t* out = g_malloc(width * height * 4);
+    unsigned int y;
+    for (y = 0; y < height; y++) {
+        yuv422_to_bgra(format, (const uint8_t*)data + y * pitch, width,
+                       out + y * width * 4);
+    }
+    return out;
 }
 
 typedef struct {
@@ -279,11 +312,14 @@ static const TextureFormatInfo kelvin_texture_format_map[] = {
         {4, false, GL_RGB,  GL_BGRA, GL_UNSIGNED_INT_8_8_8_8_REV },
 
     [NV097_SET_TEXTURE_FORMAT_COLOR_LC_IMAGE_CR8YB8CB8YA8] =
-        {4, false, GL_RGB,  GL_RGBA, GL_UNSIGNED_INT_8_8_8_8_REV, convert_cr8yb8cb8ya8_to_a8r8g8b8},
+        {2, true, GL_RGB,  GL_BGRA, GL_UNSIGNED_INT_8_8_8_8_REV, convert_yuv422_to_a8r8g8b8},
+    [NV097_SET_TEXTURE_FORMAT_COLOR_LC_IMAGE_YB8CR8YA8CB8] =
+        {2, true, GL_RGB,  GL_BGRA, GL_UNSIGNED_INT_8_8_8_8_REV, convert_yuv422_to_a8r8g8b8},
 
-    /* TODO: 8-bit palettized textures */
+    /* Expanded with the palette by the decode, gl_format and gl_type are
+     * those of the result */
     [NV097_SET_TEXTURE_FORMAT_COLOR_SZ_I8_A8R8G8B8] =
-        {1, false, GL_RGBA, GL_COLOR_INDEX, GL_UNSIGNED_BYTE }, /*FIXME: glColorTable or do this in a conversion function, this also means conversion functions must be able to modify the hash or dirty regions */
+        {1, false, GL_RGBA, GL_BGRA, GL_UNSIGNED_INT_8_8_8_8_REV},
 
     [NV097_SET_TEXTURE_FORMAT_COLOR_L_DXT1_A1R5G5B5] =
         {4, false, GL_COMPRESSED_RGBA_S3TC_DXT1_EXT, 0, GL_RGBA},
@@ -347,7 +383,34 @@ static const TextureFormatInfo kelvin_texture_format_map[] = {
 #define NV2A_GPU_MAX_VERTEXSHADER_LENGTH 136
 #define NV2A_GPU_VERTEXSHADER_CONSTANTS 192
 #define NV2A_GPU_VERTEXSHADER_ATTRIBUTES 16
+
+/* Guest bytes the texture cache may hold before evicting textures */
+#define NV2A_GPU_TEXTURE_CACHE_BUDGET (64 * 1024 * 1024)
+/* Bytes of vertex data kept in buffer objects */
+#define NV2A_GPU_VERTEX_CACHE_BUDGET (32 * 1024 * 1024)
+/* Cached vertex data which changed this often is streamed instead */
+#define NV2A_GPU_VERTEX_CACHE_MAX_REWRITES 8
+/* Bytes of index lists kept, both the copies and the buffer objects */
+#define NV2A_GPU_INDEX_CACHE_BUDGET (8 * 1024 * 1024)
+/* Shorter index lists are always streamed */
+#define NV2A_GPU_INDEX_CACHE_MIN_SIZE 256
+/* Streaming buffer, each segment is fenced before it's written again */
+#define NV2A_GPU_VERTEX_RING_SIZE (16 * 1024 * 1024)
+#define NV2A_GPU_VERTEX_RING_SEGMENTS 4
+/* Finished frames kept for the display, enough for triple buffering */
+#define NV2A_GPU_SCANOUT_FRAMES 3
+/* Frame times kept for the histogram of info nv2a-stats */
+#define NV2A_GPU_PROFILE_HISTORY 256
+/* Most expensive methods of a frame info nv2a-stats shows */
+#define NV2A_GPU_PROFILE_TOP_METHODS 16
 #define NV2A_GPU_MAX_TEXTURES 4
+#define NV2A_GPU_TEXTURE_MAX_LEVELS 16
+/* Texture decode workers, the render thread helps out while it waits */
+#define NV2A_GPU_TEXTURE_DECODE_THREADS 3
+/* Decode buffers kept around for reuse */
+#define NV2A_GPU_TEXTURE_STAGING_BUFFERS 16
+/* Buckets of the shader compile latency histogram, see shader_compile_ms */
+#define NV2A_GPU_SHADER_COMPILE_BUCKETS 9
 
 #define GET_MASK(v, mask) (((v) & (mask)) >> (ffs(mask)-1))
 
@@ -406,6 +469,17 @@ typedef struct DMAObject {
     hwaddr limit;
 } DMAObject;
 
+typedef struct RAMHTCacheEntry {
+    uint64_t key; /* channel_id << 32 | handle */
+    hwaddr address; /* Of the RAMHT entry in RAMIN */
+    RAMHTEntry entry;
+} RAMHTCacheEntry;
+
+typedef struct DMACacheEntry {
+    uint64_t address; /* Of the DMA object in RAMIN */
+    DMAObject dma;
+} DMACacheEntry;
+
 typedef struct VertexAttribute {
     bool dma_select;
     hwaddr offset;
@@ -423,8 +497,6 @@ typedef struct VertexAttribute {
 
     void(*converter)(void); //FIXME: Type..
     bool needs_conversion;
-    uint8_t *converted_buffer;
-    unsigned int converted_elements;
     unsigned int converted_size;
     unsigned int converted_count;
 
@@ -434,7 +506,6 @@ typedef struct VertexAttribute {
 } VertexAttribute;
 
 typedef struct VertexShaderConstant {
-    bool dirty;
     uint32_t data[4];
 } VertexShaderConstant;
 
@@ -474,10 +545,10 @@ typedef struct KelvinTexture {
     bool dma_select;
     hwaddr offset;
 
-    GLuint gl_texture;
-    /* once bound as GL_TEXTURE_RECTANGLE_ARB, it seems textures
-     * can't be rebound as GL_TEXTURE_*D... */
-    GLuint gl_texture_rect;
+    /* Colors of I8_A8R8G8B8 textures */
+    bool palette_dma_select;
+    unsigned int palette_length; /* In entries */
+    hwaddr palette_offset;
 } KelvinTexture;
 
 //FIXME: Use and remove kelvintexture..
@@ -503,6 +574,41 @@ typedef struct ShaderState {
 
 } ShaderState;
 
+/* Linked programs are looked up by this. The vertex shader hash in the state
+   only picks the bucket, the transform program itself is compared. */
+typedef struct ShaderKey {
+    ShaderState state;
+    uint32_t* transform_program;
+    unsigned int transform_program_length; /* In words */
+} ShaderKey;
+
+typedef enum ShaderCompilePolicy {
+    SHADER_COMPILE_BLOCK, /* Draws wait for their program */
+    SHADER_COMPILE_SKIP, /* Draws are dropped until it's linked */
+    SHADER_COMPILE_FALLBACK, /* A program with the same vertex shader is
+                                used meanwhile, draws without one are
+                                dropped */
+} ShaderCompilePolicy;
+
+/* A program built by the shader compile thread */
+typedef struct ShaderCompileJob {
+    ShaderKey key; /* Owns its transform program, the guest may change it */
+    int64_t queued_ns;
+
+    /* Set by the compile thread */
+    QString* vertex_code;
+    QString* fragment_code;
+    GLuint vertex_shader;
+    GLuint fragment_shader;
+    GLuint program;
+    GLsync fence; /* The render thread waits on it before using program */
+    char* error; /* NULL if the program linked */
+    int64_t done_ns;
+    bool done; /* Protected by the lock */
+
+    QTAILQ_ENTRY(ShaderCompileJob) entry;
+} ShaderCompileJob;
+
 typedef struct Surface {
     unsigned int pitch;
     unsigned int format;
@@ -576,6 +682,129 @@ typedef struct GraphicsContext {
 } GraphicsContext;
 
 
+/* Capabilities in GLState */
+enum GLStateCap {
+    GL_STATE_ALPHA_TEST,
+    GL_STATE_BLEND,
+    GL_STATE_CULL_FACE,
+    GL_STATE_DEPTH_TEST,
+    GL_STATE_FOG,
+    GL_STATE_SCISSOR_TEST,
+    GL_STATE_STENCIL_TEST,
+    GL_STATE_CAP_COUNT
+};
+
+/* The GL state pgraph changes for draws and clears */
+typedef struct GLState {
+    bool caps[GL_STATE_CAP_COUNT];
+    GLenum alpha_func;
+    GLfloat alpha_ref;
+    GLenum blend_sfactor, blend_dfactor;
+    GLenum cull_face;
+    GLenum front_face;
+    GLenum depth_func;
+    GLenum stencil_func;
+    GLint stencil_ref;
+    GLuint stencil_read_mask;
+    GLenum stencil_fail, stencil_zfail, stencil_zpass;
+    GLboolean color_mask[4];
+    GLboolean depth_mask;
+    GLuint stencil_write_mask;
+    GLfloat fog_color[4];
+    GLint fog_mode;
+    GLenum shade_model;
+    GLfloat point_size;
+    GLint viewport[4];
+    GLint scissor[4];
+    GLfloat clear_color[4];
+    GLdouble clear_depth;
+    GLint clear_stencil;
+} GLState;
+
+/* Full surface clear which wasn't done yet, see pgraph_fast_clear */
+typedef struct FastClear {
+    bool pending;
+    /* Same layout as the Pixels of the surface */
+    hwaddr address;
+    size_t size;
+    bool swizzled;
+    unsigned int width, height;
+    unsigned int pitch;
+    unsigned int bytes_per_pixel;
+    uint32_t value; /* Raw pixel for memory fills */
+    GLbitfield gl_mask;
+    GLfloat gl_color[4];
+    GLdouble gl_depth;
+    GLint gl_stencil;
+} FastClear;
+
+/* Finished frame copied off the GPU for the display, see
+   pgraph_capture_scanout */
+typedef struct ScanoutFrame {
+    /* Copy the GPU is still working on, stored top-down */
+    struct {
+        hwaddr address;
+        unsigned int width, height;
+        unsigned int pitch;
+        GLuint gl_buffer;
+        size_t gl_buffer_size;
+        GLsync fence;
+    } readback;
+    /* Published frame, gfx_update reads it under scanout.lock */
+    bool valid;
+    hwaddr address;
+    unsigned int width, height;
+    unsigned int pitch;
+    unsigned int serial;
+    uint8_t *data;
+} ScanoutFrame;
+
+/* Where the render thread spends its time. Stages nest, the time is always
+   billed to the innermost one, see profile_enter. */
+typedef enum ProfileStage {
+    PROFILE_STAGE_OTHER,
+    PROFILE_STAGE_IDLE, /* Waiting for methods or vblank */
+    PROFILE_STAGE_SURFACE_UPDATE,
+    PROFILE_STAGE_TEXTURE_BIND,
+    PROFILE_STAGE_SHADER_BIND,
+    PROFILE_STAGE_VERTEX_BIND,
+    PROFILE_STAGE_DRAW,
+    PROFILE_STAGE_READBACK,
+    PROFILE_STAGE_COUNT
+} ProfileStage;
+
+/* Classes with per method counters */
+enum {
+    PROFILE_CLASS_KELVIN,
+    PROFILE_CLASS_SURFACES_2D,
+    PROFILE_CLASS_IMAGE_BLIT,
+    PROFILE_CLASS_COUNT
+};
+
+typedef struct ProfileCounter {
+    uint64_t count;
+    int64_t ticks; /* cpu_get_real_ticks */
+} ProfileCounter;
+
+typedef struct ProfileMethod {
+    unsigned int graphics_class;
+    unsigned int method;
+    uint64_t count;
+    int64_t ns;
+} ProfileMethod;
+
+/* Totals of a finished frame */
+typedef struct ProfileFrame {
+    uint64_t frame;
+    int64_t ns;
+    uint64_t draws;
+    uint64_t upload_bytes;
+    uint64_t stage_count[PROFILE_STAGE_COUNT];
+    int64_t stage_ns[PROFILE_STAGE_COUNT];
+    unsigned int methods; /* Used entries of top_methods */
+    ProfileMethod top_methods[NV2A_GPU_PROFILE_TOP_METHODS];
+} ProfileFrame;
+
 typedef struct PGRAPHState {
     QemuMutex lock;
 
@@ -602,10 +831,6 @@ typedef struct PGRAPHState {
     bool channel_valid;
     GraphicsContext context[NV2A_GPU_NUM_CHANNELS];
 
-    int FIXME_REMOVEME_comp_src; /*/ FIXME: REMOVEME! This is to see how
-                                            applications upload the composite
-                                            matrix */
-
     hwaddr dma_color, dma_zeta;
     Surface surface_color, surface_zeta;
     uint8_t surface_type;
@@ -647,14 +872,245 @@ typedef struct PGRAPHState {
     struct {
         GHashTable* pixels;
         GHashTable* texture_2d;
+        GHashTable* texture;
         GHashTable* framebuffer;
+        GHashTable* vertexshader;
+        GHashTable* fragmentshader;
+        GHashTable* shaderprogram;
         // Old cache which will possibly renamed or removed?
         GHashTable *shader;
+        GHashTable* shader_binding;
+        GHashTable* vertex_buffer;
+        GHashTable* index_buffer;
     } cache;
 
+    /* Address ordered indices into the caches */
+    struct {
+        struct MemoryBlockNode* pixels;
+        struct MemoryBlockNode* texture_2d;
+        struct MemoryBlockNode* texture;
+        struct MemoryBlockNode* vertex_buffer;
+    } cache_index;
+
+    /* Pixels with GPU results which aren't in memory yet */
+    QLIST_HEAD(, Pixels) draw_dirty_pixels;
+
+    struct {
+        QTAILQ_HEAD(, Texture) lru; /* Least recently used first */
+        size_t size; /* Guest bytes held by all textures */
+        size_t budget;
+        unsigned int bind_stamp;
+        uint64_t hits;
+        uint64_t hash_hits; /* Memory was written but contents unchanged */
+        uint64_t misses;
+        uint64_t evictions;
+    } texture_cache;
+
+    /* See nv2a_gpu_texture.h */
+    struct {
+        QemuMutex lock;
+        QemuCond work_cond; /* Jobs were queued */
+        QemuCond done_cond; /* A job finished */
+        QTAILQ_HEAD(, TextureDecodeJob) queue;
+        bool exit;
+        QemuThread threads[NV2A_GPU_TEXTURE_DECODE_THREADS];
+
+        /* Only used by the render thread */
+        struct TextureDecode *prefetch[NV2A_GPU_MAX_TEXTURES];
+        unsigned int prefetch_stages; /* Stages with new texture state */
+        struct {
+            uint8_t *data;
+            size_t size;
+        } staging[NV2A_GPU_TEXTURE_STAGING_BUFFERS];
+        unsigned int staging_count;
+        uint64_t decodes;
+        uint64_t prefetch_hits;
+        uint64_t prefetch_misses;
+    } texture_decode;
+
+    /* See nv2a_gpu_texture_gl.h */
+    struct {
+        uint64_t formats; /* Color formats decoded by GL, a bit each */
+        size_t max_size; /* Biggest buffer texture in bytes */
+        GLuint gl_program;
+        struct {
+            GLint kind;
+            GLint swizzled;
+            GLint height;
+            GLint log_min_size;
+            GLint pitch;
+            GLint bytes_per_pixel;
+            GLint level_offset;
+        } uniform;
+        GLuint gl_vertex_array;
+        GLuint gl_vertex_buffer;
+        GLuint gl_buffer; /* Palette and guest bytes */
+        GLuint gl_buffer_texture;
+        GLuint gl_framebuffer;
+        uint64_t decodes;
+        uint64_t rejected; /* Selected, but decoded by the workers */
+    } texture_gpu_decode;
+
+    struct {
+        QTAILQ_HEAD(, VertexBuffer) lru; /* Least recently used first */
+        size_t size; /* Bytes held by all vertex buffers */
+        size_t budget;
+        unsigned int bind_stamp;
+        uint64_t hits;
+        uint64_t hash_hits; /* Memory was written but contents unchanged */
+        uint64_t misses;
+        uint64_t evictions;
+        uint64_t streamed; /* Bytes which went through the ring */
+    } vertex_cache;
+
+    struct {
+        QTAILQ_HEAD(, IndexBuffer) lru; /* Least recently used first */
+        size_t size;
+        uint64_t hits;
+        uint64_t uploads; /* Lists which got a buffer object */
+        uint64_t misses;
+        uint64_t evictions;
+        uint64_t streamed; /* Bytes which went through the ring */
+    } index_cache;
+
+    struct {
+        GLuint gl_buffer;
+        uint8_t* map; /* Persistent mapping, NULL without ARB_buffer_storage */
+        uint8_t* scratch; /* Staging memory if there is no mapping */
+        size_t offset; /* Next free byte */
+        unsigned int segment; /* Segment offset is in */
+        GLsync fence[NV2A_GPU_VERTEX_RING_SEGMENTS];
+    } vertex_ring;
+
+    struct {
+        char* dir; /* NULL if the on-disk cache is disabled */
+        bool binaries; /* Driver supports program binaries */
+        FILE* states_file;
+        FILE* programs_file;
+        GHashTable* states; /* ShaderKeys in states_file */
+        GHashTable* programs; /* ShaderKeys in programs_file */
+        size_t size; /* Bytes in both files */
+        size_t size_limit;
+        unsigned int loaded;
+        unsigned int rejected; /* Binaries the driver didn't take */
+        unsigned int prewarmed;
+        unsigned int compiled;
+        unsigned int stored;
+        unsigned int dropped; /* Not written, the files are full */
+    } shader_disk_cache;
+
+    /* Programs which weren't in any cache are linked by a thread with its
+     * own GL context, which shares objects with ours, unless the policy
+     * is to block. The lock protects the queue and the done flags. */
+    struct {
+        ShaderCompilePolicy policy;
+        GloContext* gl_context;
+        QemuMutex lock;
+        QemuCond work_cond;
+        QTAILQ_HEAD(, ShaderCompileJob) queue;
+        bool exit;
+        QemuThread thread;
+        bool parallel; /* Driver links several programs at once */
+
+        /* Only used by the render thread */
+        GHashTable* pending; /* ShaderKey -> ShaderCompileJob */
+        GHashTable* fallback; /* Vertex shader hash -> last program */
+        bool skip_draw; /* No program for the current draw */
+        unsigned int latency[NV2A_GPU_SHADER_COMPILE_BUCKETS];
+        int64_t latency_max_ns;
+        unsigned int skipped_draws;
+        unsigned int fallback_draws;
+    } shader_compile;
+
+    struct {
+        unsigned int draws;
+        unsigned int constant_uploads; /* glUniform4fv calls for c[] */
+        int64_t setup_ns; /* CPU time spent preparing draws */
+        int64_t bind_shaders_ns;
+    } draw_timing;
+
+    /* Work done since the last flip, reported by replays */
+    struct {
+        unsigned int draws; /* glDraw* calls */
+        uint64_t upload_bytes; /* Texture and vertex data handed to GL */
+    } frame_stats;
+
+    /* Always on profiling, only touched by the render thread. Every flip
+     * the counters are published for info nv2a-stats and reset. */
+    struct {
+        ProfileCounter methods[PROFILE_CLASS_COUNT][0x2000 / 4];
+        ProfileCounter stages[PROFILE_STAGE_COUNT];
+        ProfileStage stage;
+        int64_t stage_start; /* ticks */
+        int64_t frame_start; /* ticks */
+        int64_t frame_start_ns;
+
+        QemuMutex lock; /* Protects the published fields below */
+        ProfileFrame last;
+        uint64_t frames;
+        int64_t history_ns[NV2A_GPU_PROFILE_HISTORY]; /* Ring of frame times */
+    } profile;
+
     struct Framebuffer* framebuffer;
+    GLuint blit_framebuffer[2]; /* Read and draw side of NV09F blits */
+    struct {
+        unsigned int gpu;
+        unsigned int cpu;
+    } image_blit_stats;
+
+    FastClear color_fast_clear;
+    FastClear zeta_fast_clear;
+    struct {
+        unsigned int recorded;
+        unsigned int gpu; /* Done by glClear before a draw */
+        unsigned int memory; /* Filled in memory for the CPU */
+    } fast_clear_stats;
+
+    /* Pixels track CPU writes to their memory below page granularity, so
+     * writes to other data in the same pages don't make them upload */
+    struct {
+        bool enabled;
+        /* Syncs which found the pages dirty but not the pixels in them.
+         * Page granularity would have uploaded on the first of these after
+         * each write, so this is an upper bound. */
+        unsigned int uploads_avoided;
+    } subpage_dirty;
+
+    /* Frames gfx_update can show instead of letting VGA read them from
+     * memory. The lock protects the published frames and the counters. */
+    struct {
+        QemuMutex lock;
+        ScanoutFrame frames[NV2A_GPU_SCANOUT_FRAMES];
+        unsigned int next; /* Slot a new surface address replaces */
+        unsigned int serial;
+        GLuint gl_framebuffer; /* Flipped copy of the surface */
+        GLuint gl_renderbuffer;
+        unsigned int width, height; /* Of the renderbuffer */
+        /* Only touched by gfx_update */
+        bool presenting;
+        unsigned int presented_serial;
+        /* Counters since the last report */
+        unsigned int published;
+        unsigned int gpu_refreshes;
+        unsigned int memory_refreshes;
+    } scanout;
 
     GLuint gl_program;
+    struct ShaderBinding* shader_binding;
+
+    /* Methods only change wanted, gl_state_flush makes GL match it right
+     * before a draw or clear. Programs and textures are needed right away
+     * and are set immediately, but also only if they changed. */
+    struct {
+        GLState wanted;
+        GLState current;
+        GLuint program;
+        GLenum active_texture;
+        GLuint texture[NV2A_GPU_MAX_TEXTURES][2]; /* 2D, rectangle */
+        /* Calls made or skipped since the last report */
+        unsigned int requested;
+        unsigned int issued;
+    } gl_state;
 
     float eye_vector[3];
 
@@ -683,13 +1139,19 @@ typedef struct PGRAPHState {
 
     unsigned int constant_load_slot;
     VertexShaderConstant constants[NV2A_GPU_VERTEXSHADER_CONSTANTS];
+    /* Written since the last draw, not yet handed to the shader bindings */
+    DECLARE_BITMAP(constants_dirty, NV2A_GPU_VERTEXSHADER_CONSTANTS);
 
     VertexAttribute vertex_attributes[NV2A_GPU_VERTEXSHADER_ATTRIBUTES];
 
     unsigned int inline_array_length;
     uint32_t inline_array[NV2A_GPU_MAX_BATCH_LENGTH];
 
+    /* ARRAY_ELEMENT16 indices stay 16 bit until an ARRAY_ELEMENT32 one
+       shows up in the same draw */
     unsigned int inline_elements_length;
+    bool inline_elements_wide; /* inline_elements is used */
+    uint16_t inline_elements16[NV2A_GPU_MAX_BATCH_LENGTH];
     uint32_t inline_elements[NV2A_GPU_MAX_BATCH_LENGTH];
 
     unsigned int inline_buffer_length;
@@ -699,12 +1161,17 @@ typedef struct PGRAPHState {
 } PGRAPHState;
 
 
-typedef struct CacheEntry {
-    QSIMPLEQ_ENTRY(CacheEntry) entry;
+/* Number of entries in the CACHE1 ring, must be a power of two */
+#define NV2A_GPU_CACHE1_SIZE 4096
+/* The pusher publishes its entries to the puller in batches this big */
+#define NV2A_GPU_CACHE1_PUSH_BATCH 64
+/* Longest method burst the puller hands to pgraph in one call */
+#define NV2A_GPU_MAX_BURST_LENGTH 2048
 
-    unsigned int method : 14;
-    unsigned int subchannel : 3;
-    bool nonincreasing;
+typedef struct CacheEntry {
+    uint32_t method : 14;
+    uint32_t subchannel : 3;
+    uint32_t nonincreasing : 1;
     uint32_t parameter;
 } CacheEntry;
 
@@ -738,13 +1205,84 @@ typedef struct Cache1State {
     enum FIFOEngine bound_engines[NV2A_GPU_NUM_SUBCHANNELS];
     enum FIFOEngine last_engine;
 
-    /* The actual command queue */
+    /* The actual command queue.
+     * This is a single producer (pusher) / single consumer (puller) ring.
+     * cache_put is only written by the pusher, cache_get only by the puller,
+     * both are free running and wrap at NV2A_GPU_CACHE1_SIZE when used as
+     * an index. cache_lock and cache_cond are only used to put the puller
+     * to sleep when the ring runs dry. */
     QemuMutex cache_lock;
     QemuCond cache_cond;
-    int cache_size;
-    QSIMPLEQ_HEAD(, CacheEntry) cache;
+    bool cache_puller_waiting;
+    bool cache_pusher_stalled;
+    unsigned int cache_put;
+    unsigned int cache_get;
+    CacheEntry cache[NV2A_GPU_CACHE1_SIZE];
+
+    /* Statistics, stalls are counted by the pusher, the rest by the puller */
+    struct {
+        unsigned int high_water;
+        uint64_t words;
+        uint64_t wakeups;
+        uint64_t stalls;
+    } cache_stats;
 } Cache1State;
 
+/* Number of commands and parameter words the puller may run ahead of the
+ * render thread, both must be powers of two */
+#define NV2A_GPU_RENDER_QUEUE_LENGTH 1024
+#define NV2A_GPU_RENDER_QUEUE_WORDS (64 * 1024)
+
+/* A method burst with all objects resolved, the parameters are copied to
+ * the word ring so the command doesn't depend on guest memory */
+typedef struct RenderCommand {
+    uint32_t method : 14;
+    uint32_t subchannel : 3;
+    uint32_t nonincreasing : 1;
+    unsigned int count;
+    unsigned int first; /* First parameter in words */
+} RenderCommand;
+
+/* Methods the puller decoded, replayed by the render thread which owns the
+ * GL context. All indices are free running like in Cache1State. */
+typedef struct RenderQueue {
+    QemuMutex lock;
+    QemuCond cond;
+    unsigned int waiting; /* Threads sleeping on cond */
+    bool exit;
+    unsigned int put;
+    unsigned int get;
+    unsigned int word_put;
+    unsigned int word_get; /* Everything before this was executed */
+    RenderCommand commands[NV2A_GPU_RENDER_QUEUE_LENGTH];
+    uint32_t words[NV2A_GPU_RENDER_QUEUE_WORDS];
+
+    struct {
+        unsigned int high_water;
+        uint64_t stalls; /* Puller had to wait for room */
+        uint64_t drains; /* Puller had to wait for the queue to run dry */
+    } stats;
+} RenderQueue;
+
+/* Method stream capture and replay, the file format is in nv2a_gpu_trace.h */
+typedef struct TraceState {
+    QemuMutex lock; /* Serialises the render thread and MMIO writes */
+    FILE *capture;
+    bool snapshot; /* Next memory sync is the first one */
+
+    /* The whole capture, only set while the render thread replays it */
+    uint8_t *replay;
+    size_t replay_size;
+
+    unsigned int frame;
+    int64_t frame_start;
+    struct {
+        int64_t ns;
+        uint64_t draws;
+        uint64_t upload_bytes;
+    } totals;
+} TraceState;
+
 typedef struct ChannelControl {
     hwaddr dma_put;
     hwaddr dma_get;
@@ -765,6 +1303,20 @@ typedef struct NV2A_GPUState {
     MemoryRegion ramin;
     uint8_t *ramin_ptr;
 
+    /* Decoded RAMHT entries and DMA objects. The guest only reaches RAMIN
+     * through pramin_write, which drops what it overwrites. */
+    struct {
+        QemuMutex lock;
+        GHashTable *ramht;
+        GHashTable *dma;
+        uint64_t ramht_hits;
+        uint64_t ramht_misses;
+        uint64_t dma_hits;
+        uint64_t dma_misses;
+        uint64_t invalidations;
+        uint64_t reads; /* RAMIN words read by lookups */
+    } ramin_cache;
+
     MemoryRegion mmio;
 
     MemoryRegion block_mmio[NV_NUM_BLOCKS];
@@ -788,6 +1340,9 @@ typedef struct NV2A_GPUState {
 
         QemuThread puller_thread;
 
+        /* Restarts the pusher once the puller made room in the cache */
+        QEMUBH *pusher_bh;
+
         /* Weather the fifo chanels are PIO or DMA */
         uint32_t channel_modes;
 
@@ -796,6 +1351,10 @@ typedef struct NV2A_GPUState {
         Cache1State cache1;
     } pfifo;
 
+    QemuThread render_thread;
+    RenderQueue render_queue;
+    TraceState trace;
+
     struct {
         uint32_t regs[0x1000];
     } pvideo;
@@ -845,16 +1404,551 @@ static const char* nv2a_gpu_reg_names[] = {};
 static const char* nv2a_gpu_method_names[] = {};
 #endif
 
+/* Returns NULL if the method has no name */
+static const char* pgraph_method_name(unsigned int graphics_class,
+                                      unsigned int method)
+{
+    uint32_t nmethod = 0;
+    switch (graphics_class) {
+        case NV_KELVIN_PRIMITIVE:
+            nmethod = method | (0x5c << 16);
+            break;
+        case NV_CONTEXT_SURFACES_2D:
+            nmethod = method | (0x6d << 16);
+            break;
+        default:
+            break;
+    }
+    if (nmethod != 0
+        && nmethod < sizeof(nv2a_gpu_method_names)/sizeof(const char*)) {
+        return nv2a_gpu_method_names[nmethod];
+    }
+    return NULL;
+}
+
 static inline void pgraph_update_surfaces(NV2A_GPUState *d, bool upload, bool zeta, bool color); //FIXME: Remove!
 #include "hw/xbox/nv2a_gpu_debugger.h"
 
+/* GL state shadowing */
+
+static const GLenum gl_state_cap_map[GL_STATE_CAP_COUNT] = {
+    [GL_STATE_ALPHA_TEST] = GL_ALPHA_TEST,
+    [GL_STATE_BLEND] = GL_BLEND,
+    [GL_STATE_CULL_FACE] = GL_CULL_FACE,
+    [GL_STATE_DEPTH_TEST] = GL_DEPTH_TEST,
+    [GL_STATE_FOG] = GL_FOG,
+    [GL_STATE_SCISSOR_TEST] = GL_SCISSOR_TEST,
+    [GL_STATE_STENCIL_TEST] = GL_STENCIL_TEST
+};
+
+static inline void gl_state_enable(PGRAPHState* pg, enum GLStateCap cap,
+                                   bool enable)
+{
+    pg->gl_state.requested++;
+    pg->gl_state.wanted.caps[cap] = enable;
+}
+
+static inline void gl_state_alpha_func(PGRAPHState* pg, GLenum func,
+                                       GLfloat ref)
+{
+    pg->gl_state.requested++;
+    pg->gl_state.wanted.alpha_func = func;
+    pg->gl_state.wanted.alpha_ref = ref;
+}
+
+static inline void gl_state_blend_func(PGRAPHState* pg, GLenum sfactor,
+                                       GLenum dfactor)
+{
+    pg->gl_state.requested++;
+    pg->gl_state.wanted.blend_sfactor = sfactor;
+    pg->gl_state.wanted.blend_dfactor = dfactor;
+}
+
+static inline void gl_state_cull_face(PGRAPHState* pg, GLenum mode)
+{
+    pg->gl_state.requested++;
+    pg->gl_state.wanted.cull_face = mode;
+}
+
+static inline void gl_state_front_face(PGRAPHState* pg, GLenum mode)
+{
+    pg->gl_state.requested++;
+    pg->gl_state.wanted.front_face = mode;
+}
+
+static inline void gl_state_depth_func(PGRAPHState* pg, GLenum func)
+{
+    pg->gl_state.requested++;
+    pg->gl_state.wanted.depth_func = func;
+}
+
+static inline void gl_state_stencil_func(PGRAPHState* pg, GLenum func,
+                                         GLint ref, GLuint mask)
+{
+    pg->gl_state.requested++;
+    pg->gl_state.wanted.stencil_func = func;
+    pg->gl_state.wanted.stencil_ref = ref;
+    pg->gl_state.wanted.stencil_read_mask = mask;
+}
+
+static inline void gl_state_stencil_op(PGRAPHState* pg, GLenum fail,
+                                       GLenum zfail, GLenum zpass)
+{
+    pg->gl_state.requested++;
+    pg->gl_state.wanted.stencil_fail = fail;
+    pg->gl_state.wanted.stencil_zfail = zfail;
+    pg->gl_state.wanted.stencil_zpass = zpass;
+}
+
+static inline void gl_state_color_mask(PGRAPHState* pg, bool red, bool green,
+                                       bool blue, bool alpha)
+{
+    pg->gl_state.requested++;
+    pg->gl_state.wanted.color_mask[0] = red ? GL_TRUE : GL_FALSE;
+    pg->gl_state.wanted.color_mask[1] = green ? GL_TRUE : GL_FALSE;
+    pg->gl_state.wanted.color_mask[2] = blue ? GL_TRUE : GL_FALSE;
+    pg->gl_state.wanted.color_mask[3] = alpha ? GL_TRUE : GL_FALSE;
+}
+
+static inline void gl_state_depth_mask(PGRAPHState* pg, bool mask)
+{
+    pg->gl_state.requested++;
+    pg->gl_state.wanted.depth_mask = mask ? GL_TRUE : GL_FALSE;
+}
+
+static inline void gl_state_stencil_mask(PGRAPHState* pg, GLuint mask)
+{
+    pg->gl_state.requested++;
+    pg->gl_state.wanted.stencil_write_mask = mask;
+}
+
+static inline void gl_state_fog_color(PGRAPHState* pg, const GLfloat color[4])
+{
+    pg->gl_state.requested++;
+    memcpy(pg->gl_state.wanted.fog_color, color,
+           sizeof(pg->gl_state.wanted.fog_color));
+}
+
+static inline void gl_state_fog_mode(PGRAPHState* pg, GLint mode)
+{
+    pg->gl_state.requested++;
+    pg->gl_state.wanted.fog_mode = mode;
+}
+
+static inline void gl_state_shade_model(PGRAPHState* pg, GLenum mode)
+{
+    pg->gl_state.requested++;
+    pg->gl_state.wanted.shade_model = mode;
+}
+
+static inline void gl_state_point_size(PGRAPHState* pg, GLfloat size)
+{
+    pg->gl_state.requested++;
+    pg->gl_state.wanted.point_size = size;
+}
+
+static inline void gl_state_viewport(PGRAPHState* pg, GLint x, GLint y,
+                                     GLint width, GLint height)
+{
+    pg->gl_state.requested++;
+    pg->gl_state.wanted.viewport[0] = x;
+    pg->gl_state.wanted.viewport[1] = y;
+    pg->gl_state.wanted.viewport[2] = width;
+    pg->gl_state.wanted.viewport[3] = height;
+}
+
+static inline void gl_state_scissor(PGRAPHState* pg, GLint x, GLint y,
+                                    GLint width, GLint height)
+{
+    pg->gl_state.requested++;
+    pg->gl_state.wanted.scissor[0] = x;
+    pg->gl_state.wanted.scissor[1] = y;
+    pg->gl_state.wanted.scissor[2] = width;
+    pg->gl_state.wanted.scissor[3] = height;
+}
+
+static inline void gl_state_clear_color(PGRAPHState* pg, GLfloat red,
+                                        GLfloat green, GLfloat blue,
+                                        GLfloat alpha)
+{
+    pg->gl_state.requested++;
+    pg->gl_state.wanted.clear_color[0] = red;
+    pg->gl_state.wanted.clear_color[1] = green;
+    pg->gl_state.wanted.clear_color[2] = blue;
+    pg->gl_state.wanted.clear_color[3] = alpha;
+}
+
+static inline void gl_state_clear_depth(PGRAPHState* pg, GLdouble depth)
+{
+    pg->gl_state.requested++;
+    pg->gl_state.wanted.clear_depth = depth;
+}
+
+static inline void gl_state_clear_stencil(PGRAPHState* pg, GLint stencil)
+{
+    pg->gl_state.requested++;
+    pg->gl_state.wanted.clear_stencil = stencil;
+}
+
+#define GL_STATE_CHANGED(field) \
+    (force || memcmp(&w->field, &c->field, sizeof(w->field)))
+
+/* Issues the GL calls for everything which differs from the last flush */
+static void gl_state_apply(PGRAPHState* pg, bool force)
+{
+    GLState* w = &pg->gl_state.wanted;
+    GLState* c = &pg->gl_state.current;
+    unsigned int issued = 0;
+    int i;
+
+    for (i = 0; i < GL_STATE_CAP_COUNT; i++) {
+        if (GL_STATE_CHANGED(caps[i])) {
+            if (w->caps[i]) {
+                glEnable(gl_state_cap_map[i]);
+            } else {
+                glDisable(gl_state_cap_map[i]);
+            }
+            issued++;
+        }
+    }
+    if (GL_STATE_CHANGED(alpha_func) || GL_STATE_CHANGED(alpha_ref)) {
+        glAlphaFunc(w->alpha_func, w->alpha_ref);
+        issued++;
+    }
+    if (GL_STATE_CHANGED(blend_sfactor) || GL_STATE_CHANGED(blend_dfactor)) {
+        glBlendFunc(w->blend_sfactor, w->blend_dfactor);
+        issued++;
+    }
+    if (GL_STATE_CHANGED(cull_face)) {
+        glCullFace(w->cull_face);
+        issued++;
+    }
+    if (GL_STATE_CHANGED(front_face)) {
+        glFrontFace(w->front_face);
+        issued++;
+    }
+    if (GL_STATE_CHANGED(depth_func)) {
+        glDepthFunc(w->depth_func);
+        issued++;
+    }
+    if (GL_STATE_CHANGED(stencil_func) || GL_STATE_CHANGED(stencil_ref)
+        || GL_STATE_CHANGED(stencil_read_mask)) {
+        glStencilFunc(w->stencil_func, w->stencil_ref, w->stencil_read_mask);
+        issued++;
+    }
+    if (GL_STATE_CHANGED(stencil_fail) || GL_STATE_CHANGED(stencil_zfail)
+        || GL_STATE_CHANGED(stencil_zpass)) {
+        glStencilOp(w->stencil_fail, w->stencil_zfail, w->stencil_zpass);
+        issued++;
+    }
+    if (GL_STATE_CHANGED(color_mask)) {
+        glColorMask(w->color_mask[0], w->color_mask[1],
+                    w->color_mask[2], w->color_mask[3]);
+        issued++;
+    }
+    if (GL_STATE_CHANGED(depth_mask)) {
+        glDepthMask(w->depth_mask);
+        issued++;
+    }
+    if (GL_STATE_CHANGED(stencil_write_mask)) {
+        glStencilMask(w->stencil_write_mask);
+        issued++;
+    }
+    if (GL_STATE_CHANGED(fog_color)) {
+        glFogfv(GL_FOG_COLOR, w->fog_color);
+        issued++;
+    }
+    if (GL_STATE_CHANGED(fog_mode)) {
+        glFogi(GL_FOG_MODE, w->fog_mode);
+        issued++;
+    }
+    if (GL_STATE_CHANGED(shade_model)) {
+        glShadeModel(w->shade_model);
+        issued++;
+    }
+    if (GL_STATE_CHANGED(point_size)) {
+        glPointSize(w->point_size);
+        issued++;
+    }
+    if (GL_STATE_CHANGED(viewport)) {
+        glViewport(w->viewport[0], w->viewport[1],
+                   w->viewport[2], w->viewport[3]);
+        issued++;
+    }
+    if (GL_STATE_CHANGED(scissor)) {
+        glScissor(w->scissor[0], w->scissor[1],
+                  w->scissor[2], w->scissor[3]);
+        issued++;
+    }
+    if (GL_STATE_CHANGED(clear_color)) {
+        glClearColor(w->clear_color[0], w->clear_color[1],
+                     w->clear_color[2], w->clear_color[3]);
+        issued++;
+    }
+    if (GL_STATE_CHANGED(clear_depth)) {
+        glClearDepth(w->clear_depth);
+        issued++;
+    }
+    if (GL_STATE_CHANGED(clear_stencil)) {
+        glClearStencil(w->clear_stencil);
+        issued++;
+    }
+
+    *c = *w;
+    pg->gl_state.issued += issued;
+}
+
+#undef GL_STATE_CHANGED
+
+static inline void gl_state_flush(PGRAPHState* pg)
+{
+    gl_state_apply(pg, false);
+}
+
+/* Programs and texture bindings are used right away (uniforms, uploads) */
+
+static inline void gl_state_use_program(PGRAPHState* pg, GLuint program)
+{
+    pg->gl_state.requested++;
+    if (pg->gl_state.program != program) {
+        glUseProgram(program);
+        pg->gl_state.program = program;
+        pg->gl_state.issued++;
+    }
+}
+
+static inline void gl_state_active_texture(PGRAPHState* pg, GLenum unit)
+{
+    pg->gl_state.requested++;
+    if (pg->gl_state.active_texture != unit) {
+        glActiveTexture(unit);
+        pg->gl_state.active_texture = unit;
+        pg->gl_state.issued++;
+    }
+}
+
+static inline void gl_state_bind_texture(PGRAPHState* pg, GLenum target,
+                                         GLuint texture)
+{
+    unsigned int unit = pg->gl_state.active_texture - GL_TEXTURE0;
+    assert(unit < NV2A_GPU_MAX_TEXTURES);
+    assert(target == GL_TEXTURE_2D || target == GL_TEXTURE_RECTANGLE_ARB);
+    GLuint* bound = &pg->gl_state.texture[unit][
+                        target == GL_TEXTURE_RECTANGLE_ARB ? 1 : 0];
+    pg->gl_state.requested++;
+    if (*bound != texture) {
+        glBindTexture(target, texture);
+        *bound = texture;
+        pg->gl_state.issued++;
+    }
+}
+
+/* Deleted textures are unbound by GL and their name might be reused */
+static void gl_state_forget_texture(PGRAPHState* pg, GLuint texture)
+{
+    int i, j;
+    for (i = 0; i < NV2A_GPU_MAX_TEXTURES; i++) {
+        for (j = 0; j < 2; j++) {
+            if (pg->gl_state.texture[i][j] == texture) {
+                pg->gl_state.texture[i][j] = 0;
+            }
+        }
+    }
+}
+
+/* Sets the GL defaults and makes sure GL really has them */
+static void gl_state_init(PGRAPHState* pg)
+{
+    GLState* w = &pg->gl_state.wanted;
+    memset(w, 0, sizeof(*w));
+    w->alpha_func = GL_ALWAYS;
+    w->blend_sfactor = GL_ONE;
+    w->blend_dfactor = GL_ZERO;
+    w->cull_face = GL_BACK;
+    w->front_face = GL_CCW;
+    w->depth_func = GL_LESS;
+    w->stencil_func = GL_ALWAYS;
+    w->stencil_read_mask = ~0;
+    w->stencil_fail = GL_KEEP;
+    w->stencil_zfail = GL_KEEP;
+    w->stencil_zpass = GL_KEEP;
+    memset(w->color_mask, GL_TRUE, sizeof(w->color_mask));
+    w->depth_mask = GL_TRUE;
+    w->stencil_write_mask = ~0;
+    w->fog_mode = GL_EXP;
+    w->shade_model = GL_SMOOTH;
+    w->point_size = 1.0f;
+    w->clear_depth = 1.0;
+    gl_state_apply(pg, true);
+
+    /* Probably not necessary, but we should attempt to get the best fog */
+    glHint(GL_FOG_HINT, GL_NICEST);
+
+    glUseProgram(0);
+    pg->gl_state.program = 0;
+    glActiveTexture(GL_TEXTURE0);
+    pg->gl_state.active_texture = GL_TEXTURE0;
+    memset(pg->gl_state.texture, 0, sizeof(pg->gl_state.texture));
+
+    pg->gl_state.requested = 0;
+    pg->gl_state.issued = 0;
+}
+
+#ifdef DEBUG_NV2A_GPU_GL_STATE_STATS
+static void gl_state_report_stats(PGRAPHState* pg)
+{
+    printf("nv2a: gl state: %u calls, %u issued, %u elided\n",
+           pg->gl_state.requested, pg->gl_state.issued,
+           pg->gl_state.requested - pg->gl_state.issued);
+    pg->gl_state.requested = 0;
+    pg->gl_state.issued = 0;
+}
+#endif
+
+/* Profiling */
+
+static const char* profile_stage_names[PROFILE_STAGE_COUNT] = {
+    [PROFILE_STAGE_OTHER] = "other",
+    [PROFILE_STAGE_IDLE] = "idle",
+    [PROFILE_STAGE_SURFACE_UPDATE] = "surface-update",
+    [PROFILE_STAGE_TEXTURE_BIND] = "texture-bind",
+    [PROFILE_STAGE_SHADER_BIND] = "shader-bind",
+    [PROFILE_STAGE_VERTEX_BIND] = "vertex-bind",
+    [PROFILE_STAGE_DRAW] = "draw",
+    [PROFILE_STAGE_READBACK] = "readback",
+};
+
+static const unsigned int profile_classes[PROFILE_CLASS_COUNT] = {
+    [PROFILE_CLASS_KELVIN] = NV_KELVIN_PRIMITIVE,
+    [PROFILE_CLASS_SURFACES_2D] = NV_CONTEXT_SURFACES_2D,
+    [PROFILE_CLASS_IMAGE_BLIT] = NV_IMAGE_BLIT,
+};
+
+/* Bills the time since the last stage change to the current stage and
+ * switches to stage. Returns the stage to hand to profile_leave. */
+static inline ProfileStage profile_enter(PGRAPHState *pg, ProfileStage stage)
+{
+    int64_t now = cpu_get_real_ticks();
+    ProfileStage outer = pg->profile.stage;
+    pg->profile.stages[outer].ticks += now - pg->profile.stage_start;
+    pg->profile.stages[stage].count++;
+    pg->profile.stage = stage;
+    pg->profile.stage_start = now;
+    return outer;
+}
+
+static inline void profile_leave(PGRAPHState *pg, ProfileStage outer)
+{
+    int64_t now = cpu_get_real_ticks();
+    pg->profile.stages[pg->profile.stage].ticks += now - pg->profile.stage_start;
+    pg->profile.stage = outer;
+    pg->profile.stage_start = now;
+}
+
+/* class_method is (graphics_class << 16) | method like in the method burst,
+ * start is the cpu_get_real_ticks when the first of count words began */
+static inline void profile_method(PGRAPHState *pg, uint32_t class_method,
+                                  unsigned int count, int64_t start)
+{
+    unsigned int graphics_class = class_method >> 16;
+    unsigned int i;
+    for (i = 0; i < PROFILE_CLASS_COUNT; i++) {
+        if (profile_classes[i] == graphics_class) {
+            ProfileCounter *counter =
+                &pg->profile.methods[i][(class_method & 0x1FFF) / 4];
+            counter->count += count;
+            counter->ticks += cpu_get_real_ticks() - start;
+            return;
+        }
+    }
+}
+
+/* Adds m to the top methods of frame which are sorted by time */
+static void profile_add_top_method(ProfileFrame *frame,
+                                   const ProfileMethod *m)
+{
+    unsigned int i = frame->methods;
+    if (i == NV2A_GPU_PROFILE_TOP_METHODS) {
+        if (frame->top_methods[i - 1].ns >= m->ns) {
+            return;
+        }
+        i--;
+    } else {
+        frame->methods++;
+    }
+    while (i > 0 && frame->top_methods[i - 1].ns < m->ns) {
+        frame->top_methods[i] = frame->top_methods[i - 1];
+        i--;
+    }
+    frame->top_methods[i] = *m;
+}
+
+/* Called on every flip, publishes the counters and starts the next frame */
+static void profile_finish_frame(PGRAPHState *pg)
+{
+    ProfileFrame frame;
+    unsigned int i, j;
+
+    /* Bill the running stage up to here, it carries on in the next frame */
+    profile_leave(pg, pg->profile.stage);
+
+    int64_t ticks = cpu_get_real_ticks() - pg->profile.frame_start;
+    int64_t now_ns = get_clock();
+    double ns_per_tick = (ticks > 0)
+        ? (double)(now_ns - pg->profile.frame_start_ns) / ticks : 0.0;
+
+    memset(&frame, 0, sizeof(frame));
+    frame.ns = now_ns - pg->profile.frame_start_ns;
+    frame.draws = pg->frame_stats.draws;
+    frame.upload_bytes = pg->frame_stats.upload_bytes;
+    for (i = 0; i < PROFILE_STAGE_COUNT; i++) {
+        frame.stage_count[i] = pg->profile.stages[i].count;
+        frame.stage_ns[i] = pg->profile.stages[i].ticks * ns_per_tick;
+    }
+    for (i = 0; i < PROFILE_CLASS_COUNT; i++) {
+        for (j = 0; j < ARRAY_SIZE(pg->profile.methods[i]); j++) {
+            ProfileCounter *counter = &pg->profile.methods[i][j];
+            if (counter->count == 0) {
+                continue;
+            }
+            ProfileMethod m = {
+                .graphics_class = profile_classes[i],
+                .method = j * 4,
+                .count = counter->count,
+                .ns = counter->ticks * ns_per_tick,
+            };
+            profile_add_top_method(&frame, &m);
+        }
+    }
+
+    memset(pg->profile.methods, 0, sizeof(pg->profile.methods));
+    memset(pg->profile.stages, 0, sizeof(pg->profile.stages));
+
+    qemu_mutex_lock(&pg->profile.lock);
+    frame.frame = pg->profile.frames;
+    pg->profile.last = frame;
+    pg->profile.history_ns[pg->profile.frames % NV2A_GPU_PROFILE_HISTORY] =
+        frame.ns;
+    pg->profile.frames++;
+    qemu_mutex_unlock(&pg->profile.lock);
+
+    pg->profile.frame_start = cpu_get_real_ticks();
+    pg->profile.frame_start_ns = now_ns;
+}
+
 //FIXME: Move to top and use c file
 #include "hw/xbox/nv2a_gpu_cache.h"
+#include "hw/xbox/nv2a_gpu_trace.h"
+#include "hw/xbox/nv2a_gpu_texture.h"
+#include "hw/xbox/nv2a_gpu_texture_gl.h"
 
 
 #define NV2A_GPU_DEVICE(obj) \
     OBJECT_CHECK(NV2A_GPUState, (obj), "nv2a")
 
+/* For the monitor, there's only ever one */
+static NV2A_GPUState *nv2a_gpu_device;
+
 /* new style (work in function) so we can easily restore the state anytime */
 
 static inline uint32_t map_method_to_register_func(uint32_t method_func) {
@@ -955,14 +2049,11 @@ static inline GLenum map_register_to_gl_func(uint32_t method_func)
 }
 
 // Updates a dirty state and its dirty bit, returns the new state
-static inline bool update_gl_state(GLenum cap, bool state, bool* dirty)
+static inline bool update_gl_state(PGRAPHState* pg, enum GLStateCap cap,
+                                   bool state, bool* dirty)
 {
     if (*dirty) {
-        if (state) {
-            glEnable(cap);
-        } else {
-            glDisable(cap);
-        }
+        gl_state_enable(pg, cap, state);
         *dirty = false;
     }
     return state;
@@ -971,12 +2062,13 @@ static inline bool update_gl_state(GLenum cap, bool state, bool* dirty)
 static inline void update_gl_stencil_test_op(PGRAPHState* pg)
 {
     if (pg->dirty.stencil_test_op) {
-        glStencilOp(map_register_to_gl_stencil_op(
-                        GET_PG_REG(pg, CONTROL_2, STENCIL_OP_FAIL)),
-                    map_register_to_gl_stencil_op(
-                        GET_PG_REG(pg, CONTROL_2, STENCIL_OP_ZFAIL)),
-                    map_register_to_gl_stencil_op(
-                        GET_PG_REG(pg, CONTROL_2, STENCIL_OP_ZPASS)));
+        gl_state_stencil_op(pg,
+                            map_register_to_gl_stencil_op(
+                                GET_PG_REG(pg, CONTROL_2, STENCIL_OP_FAIL)),
+                            map_register_to_gl_stencil_op(
+                                GET_PG_REG(pg, CONTROL_2, STENCIL_OP_ZFAIL)),
+                            map_register_to_gl_stencil_op(
+                                GET_PG_REG(pg, CONTROL_2, STENCIL_OP_ZPASS)));
         pg->dirty.stencil_test_op = false;
     }
 }
@@ -984,10 +2076,11 @@ static inline void update_gl_stencil_test_op(PGRAPHState* pg)
 static inline void update_gl_stencil_test_func(PGRAPHState* pg)
 {
     if (pg->dirty.stencil_test_func) {
-        glStencilFunc(map_register_to_gl_func(
-                          GET_PG_REG(pg, CONTROL_1, STENCIL_FUNC)),
-                      GET_PG_REG(pg, CONTROL_1, STENCIL_REF),
-                      GET_PG_REG(pg, CONTROL_1, STENCIL_MASK_READ));
+        gl_state_stencil_func(pg,
+                              map_register_to_gl_func(
+                                  GET_PG_REG(pg, CONTROL_1, STENCIL_FUNC)),
+                              GET_PG_REG(pg, CONTROL_1, STENCIL_REF),
+                              GET_PG_REG(pg, CONTROL_1, STENCIL_MASK_READ));
         pg->dirty.stencil_test_func = false;
     }
 }
@@ -995,16 +2088,17 @@ static inline void update_gl_stencil_test_func(PGRAPHState* pg)
 static inline void update_gl_alpha_test_func(PGRAPHState* pg)
 {
     if (pg->dirty.alpha_test_func) {
-        glAlphaFunc(map_register_to_gl_func(
-                        GET_PG_REG(pg, CONTROL_0, ALPHAFUNC)),
-                    GET_PG_REG(pg, CONTROL_0, ALPHAREF) / 255.0f);
+        gl_state_alpha_func(pg,
+                            map_register_to_gl_func(
+                                GET_PG_REG(pg, CONTROL_0, ALPHAFUNC)),
+                            GET_PG_REG(pg, CONTROL_0, ALPHAREF) / 255.0f);
         pg->dirty.alpha_test_func = false;
     }
 }
 
 static inline void update_gl_alpha_test(PGRAPHState* pg)
 {
-    if (update_gl_state(GL_ALPHA_TEST,
+    if (update_gl_state(pg, GL_STATE_ALPHA_TEST,
                         GET_PG_REG(pg, CONTROL_0, ALPHATESTENABLE),
                         &pg->dirty.alpha_test)) {
         update_gl_alpha_test_func(pg);
@@ -1014,15 +2108,15 @@ static inline void update_gl_alpha_test(PGRAPHState* pg)
 static inline void update_gl_depth_test_func(PGRAPHState* pg)
 {
     if (pg->dirty.depth_test_func) {
-        glDepthFunc(map_register_to_gl_func(
-                        GET_PG_REG(pg, CONTROL_0, ZFUNC)));
+        gl_state_depth_func(pg, map_register_to_gl_func(
+                                    GET_PG_REG(pg, CONTROL_0, ZFUNC)));
         pg->dirty.depth_test_func = false;
     }
 }
 
 static inline void update_gl_depth_test(PGRAPHState* pg)
 {
-    if (update_gl_state(GL_DEPTH_TEST,
+    if (update_gl_state(pg, GL_STATE_DEPTH_TEST,
                         GET_PG_REG(pg, CONTROL_0, ZENABLE),
                         &pg->dirty.depth_test)) {
         update_gl_depth_test_func(pg);
@@ -1038,7 +2132,7 @@ static inline void update_gl_fog_color(PGRAPHState* pg)
             GET_PG_REG(pg, FOGCOLOR, BLUE) / 255.0f,
             GET_PG_REG(pg, FOGCOLOR, ALPHA) / 255.0f
         };
-        glFogfv(GL_FOG_COLOR, gl_color);
+        gl_state_fog_color(pg, gl_color);
         pg->dirty.fog_color = false;
     }
 }
@@ -1067,19 +2161,18 @@ static inline void update_gl_fog_mode(PGRAPHState* pg)
         default:
             assert(0);
         }
-        glFogi(GL_FOG_MODE, gl_mode);
+        gl_state_fog_mode(pg, gl_mode);
         pg->dirty.fog_mode = false;
     }
 }
 
 static inline void update_gl_fog(PGRAPHState* pg)
 {
-    if (update_gl_state(GL_FOG,
+    if (update_gl_state(pg, GL_STATE_FOG,
                         GET_PG_REG(pg, CONTROL_3, FOGENABLE),
                         &pg->dirty.fog)) {
         update_gl_fog_mode(pg);
         update_gl_fog_color(pg);
-        glHint(GL_FOG_HINT, GL_NICEST); // Not sure if necessary, but we should attempt to get the best fog possible
     }
 }
 
@@ -1090,10 +2183,7 @@ static inline void update_gl_color_mask(PGRAPHState* pg)
         bool mask_red = GET_PG_REG(pg, CONTROL_0, RED_WRITE_ENABLE);
         bool mask_green = GET_PG_REG(pg, CONTROL_0, GREEN_WRITE_ENABLE);
         bool mask_blue = GET_PG_REG(pg, CONTROL_0, BLUE_WRITE_ENABLE);
-        glColorMask(mask_red?GL_TRUE:GL_FALSE,
-                    mask_green?GL_TRUE:GL_FALSE,
-                    mask_blue?GL_TRUE:GL_FALSE,
-                    mask_alpha?GL_TRUE:GL_FALSE);
+        gl_state_color_mask(pg, mask_red, mask_green, mask_blue, mask_alpha);
         pg->dirty.color_mask = false;
     }
 }
@@ -1102,8 +2192,8 @@ static inline void update_gl_stencil_mask(PGRAPHState* pg)
 {
     if (pg->dirty.stencil_mask) {
         GLuint gl_mask = GET_PG_REG(pg, CONTROL_1, STENCIL_MASK_WRITE);
-        glStencilMask(GET_PG_REG(pg, CONTROL_0, STENCIL_WRITE_ENABLE)?
-                      gl_mask:0x00);
+        gl_state_stencil_mask(pg,
+            GET_PG_REG(pg, CONTROL_0, STENCIL_WRITE_ENABLE) ? gl_mask : 0x00);
         pg->dirty.stencil_mask = false;
     }
 }
@@ -1111,14 +2201,14 @@ static inline void update_gl_stencil_mask(PGRAPHState* pg)
 static inline void update_gl_depth_mask(PGRAPHState* pg)
 {
     if (pg->dirty.depth_mask) {
-        glDepthMask(GET_PG_REG(pg, CONTROL_0, ZWRITEENABLE)?GL_TRUE:GL_FALSE);
+        gl_state_depth_mask(pg, GET_PG_REG(pg, CONTROL_0, ZWRITEENABLE));
         pg->dirty.depth_mask = false;
     }
 }
 
 static inline void update_gl_stencil_test(PGRAPHState* pg)
 {
-    if (update_gl_state(GL_STENCIL_TEST,
+    if (update_gl_state(pg, GL_STATE_STENCIL_TEST,
                         GET_PG_REG(pg, CONTROL_1, STENCIL_TEST_ENABLE),
                         &pg->dirty.stencil_test)) {
         update_gl_stencil_test_func(pg);
@@ -1128,16 +2218,13 @@ static inline void update_gl_stencil_test(PGRAPHState* pg)
 
 /* old style (work in parameter) */
 
-static inline void set_gl_state(GLenum cap, bool state)
+static inline void set_gl_state(PGRAPHState* pg, enum GLStateCap cap,
+                                bool state)
 {
-    if (state) {
-        glEnable(cap);
-    } else {
-        glDisable(cap);
-    }
+    gl_state_enable(pg, cap, state);
 }
 
-static inline void set_gl_front_face(uint32_t mode) {
+static inline void set_gl_front_face(PGRAPHState* pg, uint32_t mode) {
     GLenum gl_mode;
     switch(mode) {
         case NV097_SET_FRONT_FACE_CW: gl_mode = GL_CW; break;
@@ -1145,10 +2232,10 @@ static inline void set_gl_front_face(uint32_t mode) {
         default:
             assert(0);
     }
-    glFrontFace(gl_mode);
+    gl_state_front_face(pg, gl_mode);
 }
 
-static inline void set_gl_cull_face(uint32_t mode) {
+static inline void set_gl_cull_face(PGRAPHState* pg, uint32_t mode) {
     GLenum gl_mode;
     switch(mode) {
         case NV097_SET_CULL_FACE_FRONT: gl_mode = GL_FRONT; break;
@@ -1159,7 +2246,7 @@ static inline void set_gl_cull_face(uint32_t mode) {
         default:
             assert(0);
     }
-    glCullFace(gl_mode);
+    gl_state_cull_face(pg, gl_mode);
 }
 
 static inline GLenum map_gl_wrap_mode(uint32_t mode) {
@@ -1185,7 +2272,8 @@ static inline GLenum map_gl_wrap_mode(uint32_t mode) {
     return gl_mode;
 }
 
-static inline void set_gl_blend_func(uint32_t sfactor, uint32_t dfactor) {
+static inline void set_gl_blend_func(PGRAPHState* pg,
+                                     uint32_t sfactor, uint32_t dfactor) {
     GLenum gl_sfactor, gl_dfactor;
     switch(sfactor) {
         case NV097_SET_BLEND_FUNC_SFACTOR_ZERO:
@@ -1285,7 +2373,7 @@ static inline void set_gl_blend_func(uint32_t sfactor, uint32_t dfactor) {
         default:
             assert(0);
     }
-    glBlendFunc(gl_sfactor,gl_dfactor);
+    gl_state_blend_func(pg, gl_sfactor, gl_dfactor);
 }
 
 
@@ -1347,7 +2435,20 @@ static RAMHTEntry ramht_lookup(NV2A_GPUState *d, uint32_t handle)
     uint8_t *entry_ptr;
     uint32_t entry_handle;
     uint32_t entry_context;
+    RAMHTCacheEntry *cached;
+    RAMHTEntry entry;
 
+    uint64_t key = ((uint64_t)d->pfifo.cache1.channel_id << 32) | handle;
+
+    qemu_mutex_lock(&d->ramin_cache.lock);
+    cached = g_hash_table_lookup(d->ramin_cache.ramht, &key);
+    if (cached != NULL) {
+        d->ramin_cache.ramht_hits++;
+        entry = cached->entry;
+        qemu_mutex_unlock(&d->ramin_cache.lock);
+        return entry;
+    }
+    d->ramin_cache.ramht_misses++;
 
     hash = ramht_hash(d, handle);
     assert(hash * 8 < d->pfifo.ramht_size);
@@ -1356,34 +2457,136 @@ static RAMHTEntry ramht_lookup(NV2A_GPUState *d, uint32_t handle)
 
     entry_handle = ldl_le_p(entry_ptr);
     entry_context = ldl_le_p(entry_ptr + 4);
+    d->ramin_cache.reads += 2;
 
-    return (RAMHTEntry){
+    entry = (RAMHTEntry){
         .handle = entry_handle,
         .instance = (entry_context & NV_RAMHT_INSTANCE) << 4,
         .engine = (entry_context & NV_RAMHT_ENGINE) >> 16,
         .channel_id = (entry_context & NV_RAMHT_CHID) >> 24,
         .valid = entry_context & NV_RAMHT_STATUS,
     };
+
+    cached = g_malloc(sizeof(RAMHTCacheEntry));
+    cached->key = key;
+    cached->address = d->pfifo.ramht_address + hash * 8;
+    cached->entry = entry;
+    g_hash_table_replace(d->ramin_cache.ramht, &cached->key, cached);
+    qemu_mutex_unlock(&d->ramin_cache.lock);
+
+    return entry;
 }
 
 static DMAObject nv_dma_load(NV2A_GPUState *d, hwaddr dma_obj_address)
 {
     assert(dma_obj_address < memory_region_size(&d->ramin));
 
+    DMACacheEntry *cached;
+    DMAObject dma;
+    uint64_t key = dma_obj_address;
+
+    qemu_mutex_lock(&d->ramin_cache.lock);
+    cached = g_hash_table_lookup(d->ramin_cache.dma, &key);
+    if (cached != NULL) {
+        d->ramin_cache.dma_hits++;
+        dma = cached->dma;
+        qemu_mutex_unlock(&d->ramin_cache.lock);
+        return dma;
+    }
+    d->ramin_cache.dma_misses++;
+
     uint32_t *dma_obj = (uint32_t*)(d->ramin_ptr + dma_obj_address);
     uint32_t flags = ldl_le_p(dma_obj);
     uint32_t limit = ldl_le_p(dma_obj + 1);
     uint32_t frame = ldl_le_p(dma_obj + 2);
+    d->ramin_cache.reads += 3;
 
-    return (DMAObject){
+    dma = (DMAObject){
         .dma_class = GET_MASK(flags, NV_DMA_CLASS),
         .dma_target = GET_MASK(flags, NV_DMA_TARGET),
         .address = (frame & NV_DMA_ADDRESS) | GET_MASK(flags, NV_DMA_ADJUST),
         .limit = limit,
     };
+
+    /* Instances are 16 byte aligned, ramin_cache_invalidate relies on it */
+    if ((dma_obj_address & 0xF) == 0) {
+        cached = g_malloc(sizeof(DMACacheEntry));
+        cached->address = key;
+        cached->dma = dma;
+        g_hash_table_replace(d->ramin_cache.dma, &cached->address, cached);
+    }
+    qemu_mutex_unlock(&d->ramin_cache.lock);
+
+    return dma;
 }
 
-static void *nv_dma_map(NV2A_GPUState *d, DMAObject* dma, hwaddr *len)
+static gboolean ramht_cache_entry_overlaps(gpointer key, gpointer value,
+                                           gpointer opaque)
+{
+    const RAMHTCacheEntry *cached = value;
+    const hwaddr *range = opaque;
+    return (cached->address < range[1]) && (range[0] < cached->address + 8);
+}
+
+/* Drops everything decoded from RAMIN in [addr, addr + size), called with
+ * the ramin cache lock held */
+static void ramin_cache_invalidate(NV2A_GPUState *d, hwaddr addr, hwaddr size)
+{
+    hwaddr range[2] = { addr, addr + size };
+    uint64_t instance;
+
+    if (size > 0x1000) {
+        d->ramin_cache.invalidations += g_hash_table_size(d->ramin_cache.dma);
+        d->ramin_cache.invalidations += g_hash_table_size(d->ramin_cache.ramht);
+        g_hash_table_remove_all(d->ramin_cache.dma);
+        g_hash_table_remove_all(d->ramin_cache.ramht);
+        return;
+    }
+
+    /* DMA objects are 12 bytes long */
+    for (instance = addr & ~0xF; instance < addr + size; instance += 16) {
+        if (g_hash_table_remove(d->ramin_cache.dma, &instance)) {
+            d->ramin_cache.invalidations++;
+        }
+    }
+
+    if (addr < d->pfifo.ramht_address + d->pfifo.ramht_size
+        && d->pfifo.ramht_address < addr + size) {
+        d->ramin_cache.invalidations +=
+            g_hash_table_foreach_remove(d->ramin_cache.ramht,
+                                        ramht_cache_entry_overlaps, range);
+    }
+}
+
+#ifdef DEBUG_NV2A_GPU_RAMIN_CACHE_STATS
+static void ramin_cache_report_stats(NV2A_GPUState *d)
+{
+    qemu_mutex_lock(&d->ramin_cache.lock);
+    /* Without the cache every hit would have been read again */
+    uint64_t uncached_reads = d->ramin_cache.reads
+                              + d->ramin_cache.ramht_hits * 2
+                              + d->ramin_cache.dma_hits * 3;
+    unsigned int draws = MAX(d->pgraph.frame_stats.draws, 1);
+    printf("nv2a: ramin cache: ramht %" PRIu64 " hits, %" PRIu64 " misses, "
+           "dma %" PRIu64 " hits, %" PRIu64 " misses, "
+           "%" PRIu64 " invalidations, "
+           "%.1f RAMIN reads per draw (%.1f without cache)\n",
+           d->ramin_cache.ramht_hits, d->ramin_cache.ramht_misses,
+           d->ramin_cache.dma_hits, d->ramin_cache.dma_misses,
+           d->ramin_cache.invalidations,
+           (double)d->ramin_cache.reads / draws,
+           (double)uncached_reads / draws);
+    d->ramin_cache.ramht_hits = 0;
+    d->ramin_cache.ramht_misses = 0;
+    d->ramin_cache.dma_hits = 0;
+    d->ramin_cache.dma_misses = 0;
+    d->ramin_cache.invalidations = 0;
+    d->ramin_cache.reads = 0;
+    qemu_mutex_unlock(&d->ramin_cache.lock);
+}
+#endif
+
+static void *nv_dma_map(NV2A_GPUState *d, DMAObject* dma, hwaddr *len)
 {
     /* TODO: Handle targets and classes properly */
     //FIXME: only commented out for debug builds! assert(dma.address + dma.limit < memory_region_size(d->vram));
@@ -1460,135 +2663,106 @@ static void get_surface_dimensions(PGRAPHState* pg, unsigned int* draw_width, un
     if (draw_height) { *draw_height = h; }
 }
 
-static void pgraph_bind_converted_vertex_attributes(NV2A_GPUState *d,
-                                                    bool inline_array,
-                                                    unsigned int num_elements)
-{
-    int i, j;
-    for (i=0; i<NV2A_GPU_VERTEXSHADER_ATTRIBUTES; i++) {
-        VertexAttribute *attribute = &d->pgraph.vertex_attributes[i];
-        if (attribute->count && attribute->needs_conversion) {
-
-            uint8_t *data;
-            if (inline_array) {
-                data = (uint8_t*)d->pgraph.inline_array
-                        + attribute->inline_array_offset;
-            } else {
-                hwaddr dma_len;
-                if (attribute->dma_select) {
-                    data = nv_dma_load_and_map(d, d->pgraph.dma_vertex_b, &dma_len);
-                } else {
-                    data = nv_dma_load_and_map(d, d->pgraph.dma_vertex_a, &dma_len);
-                }
-
-                assert(attribute->offset < dma_len);
-                data += attribute->offset;
-            }
-
-            unsigned int stride = attribute->converted_size
-                                    * attribute->converted_count;
-            
-            if (num_elements > attribute->converted_elements) {
-                attribute->converted_buffer = realloc(
-                    attribute->converted_buffer,
-                    num_elements * stride);
-            }
-
-            for (j=attribute->converted_elements; j<num_elements; j++) {
-                uint8_t *in = data + j * attribute->stride; //FIXME: This wouldn't work for inline_arrays!
-                uint8_t *out = attribute->converted_buffer + j * stride;
-
-                switch (attribute->format) {
-                case NV097_SET_VERTEX_DATA_ARRAY_FORMAT_TYPE_CMP:
-                    r11g11b10f_to_float3(ldl_le_p(in),
-                                         (float*)out);
-                    break;
-                default:
-                    assert(false);
-                }
-            }
-
-            attribute->converted_elements = num_elements;
-
-            glVertexAttribPointer(i,
-                attribute->converted_count,
-                attribute->gl_type,
-                attribute->gl_normalize,
-                stride,
-                data);
-
-        }
-    }
-}
-
+/* Streams the inline array through the vertex ring and returns how many
+   vertices it holds */
 static unsigned int pgraph_bind_inline_array(NV2A_GPUState *d)
 {
+    PGRAPHState *pg = &d->pgraph;
     int i;
     unsigned int offset = 0;
     for (i=0; i<NV2A_GPU_VERTEXSHADER_ATTRIBUTES; i++) {
-        VertexAttribute *attribute = &d->pgraph.vertex_attributes[i];
+        VertexAttribute *attribute = &pg->vertex_attributes[i];
         if (attribute->count) {
             offset += attribute->size * attribute->count;
         }
     }
     unsigned int stride = offset;
+    unsigned int index_count = pg->inline_array_length*4 / stride;
+    debugger_message("%d bytes of inline data, vertex is %d bytes",
+                     pg->inline_array_length*4, stride);
+
+    /* Attributes GL can read directly use the array as it is */
+    size_t size = pg->inline_array_length * 4;
+    size_t array_offset;
+    uint8_t *out = vertex_ring_begin_write(pg, size, &array_offset);
+    memcpy(out, pg->inline_array, size);
+    vertex_ring_end_write(pg, array_offset, size);
+
     offset = 0;
     for (i=0; i<NV2A_GPU_VERTEXSHADER_ATTRIBUTES; i++) {
-        VertexAttribute *attribute = &d->pgraph.vertex_attributes[i];
+        VertexAttribute *attribute = &pg->vertex_attributes[i];
         if (attribute->count) {
 
             glEnableVertexAttribArray(i);
 
             attribute->inline_array_offset = offset;
 
-            if (!attribute->needs_conversion) {
+            if (attribute->needs_conversion) {
+                size_t converted_offset = stream_vertex_attribute(pg,
+                    attribute, (uint8_t*)pg->inline_array + offset, stride,
+                    index_count);
+                glVertexAttribPointer(i,
+                    attribute->converted_count,
+                    attribute->gl_type,
+                    attribute->gl_normalize,
+                    vertex_attribute_gl_stride(attribute, stride),
+                    (void*)converted_offset);
+            } else {
                 glVertexAttribPointer(i,
                     attribute->gl_size,
                     attribute->gl_type,
                     attribute->gl_normalize,
                     stride,
-                    (uint8_t*)d->pgraph.inline_array + offset);
+                    (void*)(array_offset + offset));
             }
 
             offset += attribute->size * attribute->count;
         }
     }
-    return offset;
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    return index_count;
 }
 
-static void pgraph_bind_vertex_attributes(NV2A_GPUState *d)
+/* Binds the vertex arrays in guest memory, num_elements is the highest
+   vertex index used by the draw plus one */
+static void pgraph_bind_vertex_attributes(NV2A_GPUState *d,
+                                          unsigned int num_elements)
 {
     int i;
 
     debugger_push_group("NV2A: pgraph_bind_vertex_attributes");
 
+    memory_region_sync_dirty_bitmap(d->vram);
+    d->pgraph.vertex_cache.bind_stamp++;
+
     for (i=0; i<NV2A_GPU_VERTEXSHADER_ATTRIBUTES; i++) {
         VertexAttribute *attribute = &d->pgraph.vertex_attributes[i];
         debugger_push_group("VA %i: count=%d, stride=%i, kelvin_format=0x%x, needs_conversion=%d",i,attribute->count,attribute->stride,attribute->format,attribute->needs_conversion);
         if (attribute->count) {
             glEnableVertexAttribArray(i);
 
-            if (!attribute->needs_conversion) {
-                hwaddr dma_len;
-                uint8_t *vertex_data;
+            hwaddr dma_len;
+            uint8_t *vertex_data;
 
-                //TODO: Load (and even map..) DMA Object once and re-use later, however, we don't know if the object is valid so we must delay the load until we want to use it
-                /* TODO: cache coherence */
-                if (attribute->dma_select) {
-                    vertex_data = nv_dma_load_and_map(d, d->pgraph.dma_vertex_b, &dma_len);
-                } else {
-                    vertex_data = nv_dma_load_and_map(d, d->pgraph.dma_vertex_a, &dma_len);
-                }
-                assert(attribute->offset < dma_len);
-                vertex_data += attribute->offset;
-                glVertexAttribPointer(i,
-                    attribute->gl_size,
-                    attribute->gl_type,
-                    attribute->gl_normalize,
-                    attribute->stride,
-                    vertex_data);
-                debugger_message("apitrace bug?"); /* glVertexAttribPointer not shown! */
+            //TODO: Load (and even map..) DMA Object once and re-use later, however, we don't know if the object is valid so we must delay the load until we want to use it
+            if (attribute->dma_select) {
+                vertex_data = nv_dma_load_and_map(d, d->pgraph.dma_vertex_b, &dma_len);
+            } else {
+                vertex_data = nv_dma_load_and_map(d, d->pgraph.dma_vertex_a, &dma_len);
             }
+            assert(attribute->offset < dma_len);
+            vertex_data += attribute->offset;
+
+            GLsizei stride;
+            size_t offset = bind_vertex_buffer(d, attribute, vertex_data,
+                                               num_elements, &stride);
+            glVertexAttribPointer(i,
+                attribute->needs_conversion ? attribute->converted_count
+                                            : attribute->gl_size,
+                attribute->gl_type,
+                attribute->gl_normalize,
+                stride,
+                (void*)offset);
         } else {
             glDisableVertexAttribArray(i);
 
@@ -1596,6 +2770,7 @@ static void pgraph_bind_vertex_attributes(NV2A_GPUState *d)
         }
         debugger_pop_group();
     }
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
 
     debugger_pop_group();
 
@@ -1612,19 +2787,261 @@ static void pgraph_update_state(PGRAPHState* pg) {
     update_gl_fog(pg);
 }
 
+/* Returns how many bytes of guest memory the texture uses */
+static size_t pgraph_get_texture_data_size(const KelvinTexture *texture,
+                                           const TextureFormatInfo *f,
+                                           unsigned int width,
+                                           unsigned int height,
+                                           unsigned int levels)
+{
+    size_t size = 0;
+    unsigned int level;
+
+    if (f->linear) {
+        return texture->pitch * height;
+    }
+
+    for (level = 0; level < levels; level++) {
+        if (f->gl_format == 0) { /* compressed */
+            unsigned int block_size;
+            if (f->gl_internal_format == GL_COMPRESSED_RGBA_S3TC_DXT1_EXT) {
+                block_size = 8;
+            } else {
+                block_size = 16;
+            }
+            if (width < 4) { width = 4; }
+            if (height < 4) { height = 4; }
+            size += width/4 * height/4 * block_size;
+        } else {
+            size += width * height * f->bytes_per_pixel;
+        }
+        width /= 2;
+        height /= 2;
+    }
+    return size;
+}
+
+static void pgraph_bind_texture_parameters(const KelvinTexture *texture,
+                                           GLenum gl_target)
+{
+    glTexParameteri(gl_target, GL_TEXTURE_MIN_FILTER,
+        kelvin_texture_min_filter_map[texture->min_filter]);
+    glTexParameteri(gl_target, GL_TEXTURE_MAG_FILTER,
+        kelvin_texture_mag_filter_map[texture->mag_filter]);
+
+    glTexParameteri(gl_target, GL_TEXTURE_WRAP_S,
+        map_gl_wrap_mode(texture->wrap_u));
+    glTexParameteri(gl_target, GL_TEXTURE_WRAP_T,
+        map_gl_wrap_mode(texture->wrap_v));
+    /* FIXME: P and Q wrapping unhandled! */
+}
+
+/* Locates the texture of a stage and fills in the key the cache knows it
+ * by. Returns false if the texture doesn't start inside its DMA object.
+ * The colors of palettized textures are copied to palette, entries past
+ * the end of the palette are black. */
+static bool pgraph_get_texture_source(NV2A_GPUState *d,
+                                      const KelvinTexture *texture,
+                                      const TextureFormatInfo *f,
+                                      GLenum *gl_target,
+                                      struct TextureKey *key,
+                                      uint8_t **data,
+                                      size_t *data_size,
+                                      uint32_t palette[256])
+{
+    unsigned int width, height;
+    unsigned int levels;
+    if (f->linear) {
+        /* linear textures use unnormalised texcoords.
+         * GL_TEXTURE_RECTANGLE_ARB conveniently also does, but
+         * does not allow repeat and mirror wrap modes.
+         *  (or mipmapping, but xbox d3d says 'Non swizzled and non
+         *   compressed textures cannot be mip mapped.')
+         * Not sure if that'll be an issue. */
+        *gl_target = GL_TEXTURE_RECTANGLE_ARB;
+
+        width = texture->rect_width;
+        height = texture->rect_height;
+        levels = 1;
+    } else {
+        *gl_target = GL_TEXTURE_2D;
+
+        width = 1 << texture->log_width;
+        height = 1 << texture->log_height;
+
+        levels = texture->levels;
+        if (texture->max_mipmap_level < levels) {
+            levels = texture->max_mipmap_level;
+        }
+#ifdef DEBUG_NV2A_GPU_DISABLE_MIPMAP
+        levels = 1;
+#endif
+    }
+
+//FIXME: 3D textures plox!
+
+    /* Load texture DMA object */
+    hwaddr dma_len;
+    uint8_t *texture_data;
+    DMAObject dma = nv_dma_load(d, texture->dma_select?d->pgraph.dma_b:
+                                                       d->pgraph.dma_a);
+
+    /* Locate texture data */
+    texture_data = nv_dma_map(d, &dma, &dma_len);
+    if (texture->offset >= dma_len) {
+        return false;
+    }
+    *data = texture_data + texture->offset;
+
+    *data_size = pgraph_get_texture_data_size(texture, f, width, height,
+                                              levels);
+    *data_size = MIN(*data_size, dma_len - texture->offset);
+
+    /* The key can't have padding */
+    memset(key, 0, sizeof(*key));
+    key->address = dma.address + texture->offset;
+    key->color_format = texture->color_format;
+    key->width = width;
+    key->height = height;
+    key->pitch = texture->pitch;
+    key->levels = levels;
+
+    if (texture->color_format == NV097_SET_TEXTURE_FORMAT_COLOR_SZ_I8_A8R8G8B8) {
+        hwaddr palette_len;
+        DMAObject palette_dma = nv_dma_load(d, texture->palette_dma_select ?
+                                                   d->pgraph.dma_b :
+                                                   d->pgraph.dma_a);
+        uint8_t *palette_data = nv_dma_map(d, &palette_dma, &palette_len);
+        size_t palette_size = texture->palette_length * 4;
+        memset(palette, 0, 256 * 4);
+        if (texture->palette_offset < palette_len) {
+            memcpy(palette, palette_data + texture->palette_offset,
+                   MIN(palette_size, palette_len - texture->palette_offset));
+        }
+        /* Never 0, which is what the key has without a palette */
+        key->palette_hash = XXH32(palette, 256 * 4, 0) | 1;
+    }
+    return true;
+}
+
+/* Starts decoding the textures of the stages whose texture state changed.
+ * Textures which are cached and weren't written to are left alone. */
+static void pgraph_prefetch_textures(NV2A_GPUState *d)
+{
+    PGRAPHState *pg = &d->pgraph;
+    unsigned int i;
+
+    for (i = 0; i < NV2A_GPU_MAX_TEXTURES; i++) {
+        if (!(pg->texture_decode.prefetch_stages & (1 << i))) {
+            continue;
+        }
+
+        KelvinTexture *texture = &pg->textures[i];
+        TextureDecode *decode = pg->texture_decode.prefetch[i];
+        if (!texture->enabled || texture->dimensionality != 2
+            || texture->color_format >= ARRAY_SIZE(kelvin_texture_format_map)) {
+            continue;
+        }
+
+        TextureFormatInfo f = kelvin_texture_format_map[texture->color_format];
+        if (f.bytes_per_pixel == 0 || f.gl_format == 0
+            || texture_gpu_decode_selected(pg, texture->color_format)) {
+            /* Unhandled, compressed or for GL, nothing to decode */
+            continue;
+        }
+
+        GLenum gl_target;
+        struct TextureKey key;
+        uint8_t *texture_data;
+        size_t data_size;
+        uint32_t palette[256];
+        /* The state might be junk until the draw, only decode textures
+         * which are completely in memory */
+        if (!pgraph_get_texture_source(d, texture, &f, &gl_target, &key,
+                                       &texture_data, &data_size, palette)
+            || data_size != pgraph_get_texture_data_size(texture, &f,
+                                                         key.width,
+                                                         key.height,
+                                                         key.levels)
+            || key.address + data_size > memory_region_size(d->vram)) {
+            continue;
+        }
+
+        if (decode != NULL) {
+            if (memcmp(&decode->key, &key, sizeof(key)) == 0) {
+                continue;
+            }
+            texture_decode_release(pg, decode);
+            pg->texture_decode.prefetch[i] = NULL;
+            pg->texture_decode.prefetch_misses++;
+        }
+
+        Texture *cache_texture = g_hash_table_lookup(pg->cache.texture, &key);
+        if (cache_texture != NULL) {
+            MemoryBlock memory_block = { key.address, data_size };
+            sync_all_resources_memory_dirty(d, &memory_block);
+            if (!cache_texture->dirty) {
+                continue;
+            }
+            /* bind_texture can take the hash unless it's written again */
+            cache_texture->prefetched = true;
+        }
+
+        pg->texture_decode.prefetch[i] =
+            texture_decode_start(pg, &key, &f, texture_data, data_size,
+                                 palette, true,
+                                 cache_texture ? &cache_texture->data_hash
+                                               : NULL);
+    }
+    pg->texture_decode.prefetch_stages = 0;
+}
+
+/* Returns the finished decode of a texture whose contents hash to
+ * data_hash, the claimed prefetch if it's still good */
+static TextureDecode *pgraph_decode_texture(NV2A_GPUState *d,
+                                            TextureDecode *decode,
+                                            const struct TextureKey *key,
+                                            const TextureFormatInfo *f,
+                                            const uint8_t *data,
+                                            size_t data_size,
+                                            const uint32_t *palette,
+                                            uint32_t data_hash)
+{
+    PGRAPHState *pg = &d->pgraph;
+
+    if (decode != NULL) {
+        if (!decode->skipped && decode->hashed
+            && decode->data_hash == data_hash) {
+            pg->texture_decode.prefetch_hits++;
+            return decode;
+        }
+        /* Written to since the prefetch */
+        texture_decode_release(pg, decode);
+        pg->texture_decode.prefetch_misses++;
+    }
+
+    decode = texture_decode_start(pg, key, f, data, data_size, palette,
+                                  false, NULL);
+    texture_decode_wait(pg, decode);
+    return decode;
+}
+
 static void pgraph_bind_textures(NV2A_GPUState *d)
 {
     int i;
 
     debugger_push_group("NV2A: pgraph_bind_textures");
 
+    /* Textures used from here on must not be evicted */
+    d->pgraph.texture_cache.bind_stamp++;
+
     for (i=0; i<NV2A_GPU_MAX_TEXTURES; i++) {
 
         KelvinTexture *texture = &d->pgraph.textures[i];
 
         if (texture->dimensionality != 2) continue;
         
-        glActiveTexture(GL_TEXTURE0_ARB + i);
+        gl_state_active_texture(&d->pgraph, GL_TEXTURE0 + i);
         if (texture->enabled) {
             
             assert(texture->color_format
@@ -1645,89 +3062,65 @@ static void pgraph_bind_textures(NV2A_GPUState *d)
             }
 
             GLenum gl_target;
-            GLuint gl_texture;
-            unsigned int width, height, depth;
-            if (f.linear) {
-                /* linear textures use unnormalised texcoords.
-                 * GL_TEXTURE_RECTANGLE_ARB conveniently also does, but
-                 * does not allow repeat and mirror wrap modes.
-                 *  (or mipmapping, but xbox d3d says 'Non swizzled and non
-                 *   compressed textures cannot be mip mapped.')
-                 * Not sure if that'll be an issue. */
-                gl_target = GL_TEXTURE_RECTANGLE_ARB;
-                gl_texture = texture->gl_texture_rect;
-                
-                width = texture->rect_width;
-                height = texture->rect_height;
-            } else {
-                gl_target = GL_TEXTURE_2D;
-                gl_texture = texture->gl_texture;
-
-                width = 1 << texture->log_width;
-                height = 1 << texture->log_height;
-                depth = 1 << texture->log_depth;
+            struct TextureKey key;
+            uint8_t *texture_data;
+            size_t data_size;
+            uint32_t palette[256];
+            bool valid = pgraph_get_texture_source(d, texture, &f,
+                                                   &gl_target, &key,
+                                                   &texture_data,
+                                                   &data_size, palette);
+            assert(valid);
+
+            /* Render-to-texture results might not be in memory yet */
+            MemoryBlock texture_memory_block = { key.address, data_size };
+            flush_pixels_to_memory(d, &texture_memory_block);
+
+            /* A prefetch hashed the contents already */
+            TextureDecode *decode = texture_decode_claim(&d->pgraph, i, &key);
+            if (decode != NULL) {
+                texture_decode_wait(&d->pgraph, decode);
             }
 
-//FIXME: 3D textures plox!
-
-            glBindTexture(gl_target, gl_texture);
-
-
-            /* Load texture DMA object */
-            hwaddr dma_len;
-            uint8_t *texture_data;
-            DMAObject dma = nv_dma_load(d, texture->dma_select?d->pgraph.dma_b:
-                                                               d->pgraph.dma_a);
+            /* Find the texture in the cache */
+            bool upload;
+            Texture *cache_texture = bind_texture(d, &key, gl_target,
+                                                  texture_data, data_size,
+                                                  decode != NULL
+                                                      ? &decode->data_hash
+                                                      : NULL,
+                                                  &upload);
 
             /* Label the texture so we can find it in the debugger */
-            debugger_label(GL_TEXTURE, gl_texture,
+            debugger_label(GL_TEXTURE, cache_texture->gl_texture,
                            "NV2A: 0x%X: { "
                            "color_format: 0x%X%s; "
                            "pitch: %i }",
-                           dma.address + texture->offset,
+                           key.address,
                            texture->color_format,
                            f.linear?"":" (Swizzled)",
                            texture->pitch);
 
-            memory_region_sync_dirty_bitmap(d->vram);
-            bool resource_dirty = memory_region_get_dirty(d->vram,
-                                      dma.address + texture->offset,
-                                      texture->pitch * height,
-                                      DIRTY_MEMORY_NV2A_GPU_RESOURCE);
+            /* Sampler state might have changed even if the contents didn't */
+            pgraph_bind_texture_parameters(texture, gl_target);
+            texture->dirty = false;
 
-            /* Texture state and the texture content didn't change? Abort! */
-            if (!texture->dirty && !resource_dirty) {
+            /* The texture content didn't change? Abort! */
+            if (!upload) {
+                if (decode != NULL) {
+                    if (!decode->skipped) {
+                        d->pgraph.texture_decode.prefetch_misses++;
+                    }
+                    texture_decode_release(&d->pgraph, decode);
+                }
                 continue;
             }
 
-#if 0
-            // FIXME: Really have to handle overlapping resources before claiming this is clean, check my wiki
-            memory_region_reset_dirty(d->vram,
-                                      dma.address + texture->offset,
-                                      texture->pitch * height,
-                                      DIRTY_MEMORY_NV2A_GPU_RESOURCE);
-#endif
-
-
-            /* Locate texture data */
-            texture_data = nv_dma_map(d, &dma, &dma_len);
-            assert(texture->offset < dma_len);
-            texture_data += texture->offset;
-
             glBindBuffer(GL_PIXEL_UNPACK_BUFFER_ARB, 0);
 
-            /* convert texture formats the host can't handle natively */
-            uint8_t* converted_texture_data = NULL;
-            if (f.convert_to_gl != NULL) {
-                /* FIXME: Unswizzle before? */
-                /* FIXME: Handle multiple levels etc. */
-                converted_texture_data = f.convert_to_gl(texture->color_format,
-                                                   width,height,
-                                                   texture->pitch,
-                                                   texture_data);
-                texture_data = converted_texture_data;
-                assert(texture_data != NULL);
-            }
+            unsigned int width = key.width;
+            unsigned int height = key.height;
+            unsigned int levels = key.levels;
 
             NV2A_GPU_DPRINTF(" texture %d is format 0x%x, (%d, %d; %d),"
                             " filter %x %x, levels %d-%d %d bias %d\n",
@@ -1737,120 +3130,78 @@ static void pgraph_bind_textures(NV2A_GPUState *d)
                          texture->min_mipmap_level, texture->max_mipmap_level, texture->levels,
                          texture->lod_bias);
 
-            if (f.linear) {
-                /* Can't handle retarded strides */
-                assert(texture->pitch % f.bytes_per_pixel == 0);
-                glPixelStorei(GL_UNPACK_ROW_LENGTH,
-                              texture->pitch / f.bytes_per_pixel);
-
-                void* buffer = g_malloc(texture->pitch*height);
-                flip(texture_data,
-                     texture->pitch,
-                     width,
-                     height,
-                     buffer,
-                     texture->pitch,
-                     f.bytes_per_pixel);
-                glTexImage2D(gl_target, 0, f.gl_internal_format,
-                             width, height, 0,
-                             f.gl_format, f.gl_type,
-                             buffer);
-                g_free(buffer);
-
-                glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
-            } else {
-                unsigned int levels = texture->levels;
-                if (texture->max_mipmap_level < levels) {
-                    levels = texture->max_mipmap_level;
-                }
-
-#ifdef DEBUG_NV2A_GPU_DISABLE_MIPMAP
-                int level;
-#if 0
-//FIXME: This hack causes problems with compressed textures
-         They might be broken with normal mipmapping too
-                printf("MIPMAP Hack: %dx%d requested %d level(s)\n", width, height, levels);
-                for (level = 0; (level < (levels-1)) && (level < 3); level++) {
-                    texture_data += width * height * f.bytes_per_pixel;
-                    width /= 2;
-                    height /= 2;
-                }              
-                printf("MIPMAP Hack: %dx%d returned\n", width, height);
-#endif
-                levels = 1;
-#else
+            int level;
+#ifndef DEBUG_NV2A_GPU_DISABLE_MIPMAP
+            if (!f.linear) {
                 glTexParameteri(gl_target, GL_TEXTURE_BASE_LEVEL,
                     texture->min_mipmap_level);
                 glTexParameteri(gl_target, GL_TEXTURE_MAX_LEVEL,
                     levels-1);
-
-                int level;
+            }
 #endif
+
+            if (f.gl_format == 0) { /* retarded way of indicating compressed */
+                unsigned int block_size;
+                assert(decode == NULL); /* Compressed ones aren't prefetched */
+                if (f.gl_internal_format == GL_COMPRESSED_RGBA_S3TC_DXT1_EXT) {
+                    block_size = 8;
+                } else {
+                    block_size = 16;
+                }
                 for (level = 0; level < levels; level++) {
-                    if (f.gl_format == 0) { /* retarded way of indicating compressed */
-                        unsigned int block_size;
-                        if (f.gl_internal_format == GL_COMPRESSED_RGBA_S3TC_DXT1_EXT) {
-                            block_size = 8;
-                        } else {
-                            block_size = 16;
-                        }
-
-                        if (width < 4) { width = 4; }
-                        if (height < 4) { height = 4; }
-                    
-                        //FIXME: Flip texture!!!
-                        glCompressedTexImage2D(gl_target, level, f.gl_internal_format,
-                                               width, height, 0,
-                                               width/4 * height/4 * block_size,
-                                               texture_data);
-
-                        /* Advance pointer to next mipmap */
-                        texture_data += width/4 * height/4 * block_size;
-                        assert(levels == 1); //FIXME: Untested code path if mipmapping is done
-
-                    } else {
-                        unsigned int pitch = width * f.bytes_per_pixel;
-                        uint8_t *unswizzled = g_malloc(height * pitch);
-                        unswizzle_and_flip(texture_data, width, height,
-                                           unswizzled, pitch, f.bytes_per_pixel);
-
-                        glTexImage2D(gl_target, level, f.gl_internal_format,
-                                     width, height, 0,
-                                     f.gl_format, f.gl_type,
-                                     unswizzled);
-
-                        g_free(unswizzled);
-
-                        /* Advance pointer to next mipmap */
-                        texture_data += width * height * f.bytes_per_pixel;
-                    }
+                    if (width < 4) { width = 4; }
+                    if (height < 4) { height = 4; }
+                
+                    //FIXME: Flip texture!!!
+                    glCompressedTexImage2D(gl_target, level, f.gl_internal_format,
+                                           width, height, 0,
+                                           width/4 * height/4 * block_size,
+                                           texture_data);
+                    d->pgraph.frame_stats.upload_bytes +=
+                        width/4 * height/4 * block_size;
+
+                    /* Advance pointer to next mipmap */
+                    texture_data += width/4 * height/4 * block_size;
+                    assert(levels == 1); //FIXME: Untested code path if mipmapping is done
+
                     /* Modify size for next mipmap */
                     width /= 2;
                     height /= 2;
                 }
-
-            }
-
-            /* Free the buffer if this texture had to be converted */
-            if (converted_texture_data != NULL) {
-                g_free(converted_texture_data);
+            } else if (texture_gpu_decode_selected(&d->pgraph,
+                                                   texture->color_format)
+                       && texture_gpu_decode(d, cache_texture->gl_texture,
+                                             gl_target, &key, &f,
+                                             texture_data, data_size,
+                                             key.palette_hash ? palette
+                                                              : NULL)) {
+                /* Decoded by GL, there's no prefetch for it to use */
+                if (decode != NULL) {
+                    texture_decode_release(&d->pgraph, decode);
+                    d->pgraph.texture_decode.prefetch_misses++;
+                }
+            } else {
+                /* Unswizzled, converted and flipped by the decode workers */
+                decode = pgraph_decode_texture(d, decode, &key, &f,
+                                               texture_data, data_size,
+                                               key.palette_hash ? palette
+                                                                : NULL,
+                                               cache_texture->data_hash);
+                for (level = 0; level < decode->levels; level++) {
+                    TextureDecodeLevel *l = &decode->level[level];
+                    glPixelStorei(GL_UNPACK_ROW_LENGTH, l->row_length);
+                    glTexImage2D(gl_target, level, f.gl_internal_format,
+                                 l->width, l->height, 0,
+                                 f.gl_format, f.gl_type,
+                                 l->data);
+                    d->pgraph.frame_stats.upload_bytes += l->size;
+                }
+                glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+                texture_decode_release(&d->pgraph, decode);
             }
-
-            glTexParameteri(gl_target, GL_TEXTURE_MIN_FILTER,
-                kelvin_texture_min_filter_map[texture->min_filter]);
-            glTexParameteri(gl_target, GL_TEXTURE_MAG_FILTER,
-                kelvin_texture_mag_filter_map[texture->mag_filter]);
-
-            glTexParameteri(gl_target, GL_TEXTURE_WRAP_S,
-                map_gl_wrap_mode(texture->wrap_u));
-            glTexParameteri(gl_target, GL_TEXTURE_WRAP_T,
-                map_gl_wrap_mode(texture->wrap_v));
-            /* FIXME: P and Q wrapping unhandled! */
-
-            texture->dirty = false;
         } else {
-            glBindTexture(GL_TEXTURE_2D, 0);
-            glBindTexture(GL_TEXTURE_RECTANGLE_ARB, 0);
+            gl_state_bind_texture(&d->pgraph, GL_TEXTURE_2D, 0);
+            gl_state_bind_texture(&d->pgraph, GL_TEXTURE_RECTANGLE_ARB, 0);
         }
         assert(glGetError() == 0);
 
@@ -1887,187 +3238,800 @@ static gboolean shader_equal(gconstpointer a, gconstpointer b)
     return memcmp(as, bs, sizeof(ShaderState)) == 0;
 }
 
-//FIXME: Split this into vertex, fragment and program functions and make sure to only use information which also influences the hash!
-static GLuint generate_shaders(PGRAPHState* pg, ShaderState state)
+static guint shader_key_hash(gconstpointer key)
 {
-    int i;
+    const ShaderKey* k = key;
+    return shader_hash(&k->state);
+}
+
+static gboolean shader_key_equal(gconstpointer a, gconstpointer b)
+{
+    const ShaderKey *ak = a, *bk = b;
+    return shader_equal(&ak->state, &bk->state)
+        && ak->transform_program_length == bk->transform_program_length
+        && memcmp(ak->transform_program, bk->transform_program,
+                  ak->transform_program_length * 4) == 0;
+}
+
+static ShaderKey* shader_key_copy(const ShaderKey* key)
+{
+    ShaderKey* copy = g_malloc(sizeof(ShaderKey));
+    copy->state = key->state;
+    copy->transform_program = g_memdup(key->transform_program,
+                                       key->transform_program_length * 4);
+    copy->transform_program_length = key->transform_program_length;
+    return copy;
+}
+
+static void shader_key_free(gpointer key)
+{
+    ShaderKey* k = key;
+    g_free(k->transform_program);
+    g_free(k);
+}
+
+/* Everything of the state the fragment shader is generated from */
+static void get_fragmentshader_key(const ShaderState* state,
+                                   struct FragmentshaderKey* key)
+{
+    memset(key, 0, sizeof(*key));
+    key->combiner_control = state->combiner_control;
+    key->shader_stage_program = state->shader_stage_program;
+    key->other_stage_input = state->other_stage_input;
+    key->final_inputs_0 = state->final_inputs_0;
+    key->final_inputs_1 = state->final_inputs_1;
+    memcpy(key->rgb_inputs, state->rgb_inputs, sizeof(state->rgb_inputs));
+    memcpy(key->rgb_outputs, state->rgb_outputs, sizeof(state->rgb_outputs));
+    memcpy(key->alpha_inputs, state->alpha_inputs, sizeof(state->alpha_inputs));
+    memcpy(key->alpha_outputs, state->alpha_outputs,
+           sizeof(state->alpha_outputs));
+    memcpy(key->rect_tex, state->rect_tex, sizeof(state->rect_tex));
+    memcpy(key->compare_mode, state->compare_mode, sizeof(state->compare_mode));
+    memcpy(key->alphakill, state->alphakill, sizeof(state->alphakill));
+}
+
+/* The stages are cached separately, so a change to the combiners doesn't
+   recompile the vertex shader and the other way round */
+static GLuint generate_shaders(PGRAPHState* pg, ShaderState state,
+                               uint32_t* transform_program,
+                               unsigned int transform_program_length)
+{
+    Vertexshader* vertexshader = create_vertexshader(pg,
+                                     state.vertex_shader_hash,
+                                     transform_program,
+                                     transform_program_length);
+
+    struct FragmentshaderKey fragmentshader_key;
+    get_fragmentshader_key(&state, &fragmentshader_key);
+    Fragmentshader* fragmentshader = create_fragmentshader(pg,
+                                         &fragmentshader_key);
+
+    Shaderprogram* shaderprogram = create_shaderprogram(pg, vertexshader,
+                                                        fragmentshader);
+    return shaderprogram->program;
+}
+
+/* On-disk shader cache
+ *
+ * The cache directory holds 2 files:
+ *  - nv2a-states.bin lists every ShaderState we generated a program for,
+ *    together with the transform program it was generated from. It doesn't
+ *    depend on the GL driver, so all programs in it can be rebuilt at
+ *    startup. A list recorded elsewhere can be copied in to pre-warm.
+ *  - nv2a-programs-<driver>.bin holds the GL program binaries, <driver> is
+ *    a hash of the GL vendor, renderer and version strings. Loading these
+ *    saves us from compiling at all.
+ * Both files are append-only, entries are never removed. Once the files
+ * reach the size limit no new entries are written.
+ */
 
-    GLuint program = glCreateProgram();
-
-    GLuint vertex_shader = glCreateShader(GL_VERTEX_SHADER);
-    glAttachShader(program, vertex_shader);
-
-    GLint compiled;
-
-    const char *vertex_shader_code;
-    QString *transform_program_code;
-
-    //XXX: This is a loosy check for fixed function
-    if (state.vertex_shader_hash == 0) {
-        /* generate vertex shader mimicking fixed function */
-
-        vertex_shader_code =
-          "#version 110\n"
-          "\n"
-          "attribute vec4 position;\n"
-          "attribute vec3 normal;\n"
-          "attribute vec4 diffuse;\n"
-          "attribute vec4 specular;\n"
-          "attribute float fogCoord;\n"
-          "attribute vec4 multiTexCoord0;\n"
-          "attribute vec4 multiTexCoord1;\n"
-          "attribute vec4 multiTexCoord2;\n"
-          "attribute vec4 multiTexCoord3;\n"
-
-          "uniform mat4 composite;\n"
-          "uniform mat4 textureMatrix0;\n"
-          "uniform mat4 textureMatrix1;\n"
-          "uniform mat4 textureMatrix2;\n"
-          "uniform mat4 textureMatrix3;\n"
-          "uniform mat4 invViewport;\n"
-          "void main() {\n"
-          "   gl_Position = invViewport * (position * composite);\n"
-          /* temp hack: the composite matrix includes the view transform... */
-          //"   gl_Position = position * composite;\n"
-          //"   gl_Position.x = (gl_Position.x - 320.0) / 320.0;\n"
-          //"   gl_Position.y = -(gl_Position.y - 240.0) / 240.0;\n"
-          "   gl_FogFragCoord = 0.5;\n" //FIXME!!! Probably generated from the vertex attrib?
-          "   gl_Position.z = gl_Position.z * 2.0 - gl_Position.w;\n"
-          "   gl_FrontColor = diffuse;\n"
-          "   gl_TexCoord[0] = textureMatrix0 * multiTexCoord0;\n"
-          "   gl_TexCoord[1] = textureMatrix1 * multiTexCoord1;\n"
-          "   gl_TexCoord[2] = textureMatrix2 * multiTexCoord2;\n"
-          "   gl_TexCoord[3] = textureMatrix3 * multiTexCoord3;\n"
-          "}\n";
+#define NV2A_GPU_SHADER_CACHE_MAGIC 0x4832564e /* "NV2H" */
+#define NV2A_GPU_SHADER_CACHE_VERSION 3
+#define NV2A_GPU_SHADER_CACHE_SIZE (64 * 1024 * 1024)
+
+typedef struct ShaderCacheHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t state_size; /* sizeof(ShaderState) of the writer */
+    uint32_t driver_hash; /* 0 for the states file */
+} ShaderCacheHeader;
+
+typedef struct ShaderCacheStateRecord {
+    ShaderState state;
+    uint32_t transform_program_length; /* In words, follows the record */
+} ShaderCacheStateRecord;
+
+typedef struct ShaderCacheProgramRecord {
+    ShaderState state;
+    uint32_t transform_program_length; /* In words, follows the record */
+    uint32_t binary_format;
+    uint32_t binary_length; /* In bytes, follows the transform program */
+} ShaderCacheProgramRecord;
+
+/* Reads all records after the header into contents. Returns a file to
+   append new records to, which is reset if it wasn't usable. */
+static FILE* shader_disk_cache_open(PGRAPHState* pg, const char* name,
+                                    uint32_t driver_hash,
+                                    gchar** contents, gsize* length)
+{
+    const char* dir = pg->shader_disk_cache.dir;
+    gchar* path = g_build_filename(dir, name, NULL);
+    ShaderCacheHeader header = {
+        .magic = NV2A_GPU_SHADER_CACHE_MAGIC,
+        .version = NV2A_GPU_SHADER_CACHE_VERSION,
+        .state_size = sizeof(ShaderState),
+        .driver_hash = driver_hash
+    };
+    FILE* file;
+
+    *contents = NULL;
+    *length = 0;
+    if (g_file_get_contents(path, contents, length, NULL)
+        && *length >= sizeof(header)
+        && memcmp(*contents, &header, sizeof(header)) == 0) {
+        *length -= sizeof(header);
+        memmove(*contents, *contents + sizeof(header), *length);
+        pg->shader_disk_cache.size += *length + sizeof(header);
+        file = fopen(path, "ab");
     } else {
-        VertexShader *shader = &pg->vertexshader;
-        transform_program_code = vsh_translate(VSH_VERSION_XVS,
-                                                        &shader->program_data[pg->vertexshader_start_slot*4],
-                                                        (NV2A_GPU_MAX_VERTEXSHADER_LENGTH-pg->vertexshader_start_slot)*4);
-        vertex_shader_code = qstring_get_str(transform_program_code);
-    }
-
-    glShaderSource(vertex_shader, 1, &vertex_shader_code, NULL);
-    glCompileShader(vertex_shader);
-
-    NV2A_GPU_DPRINTF("bind new vertex shader, code:\n%s\n", vertex_shader_code);
-
-    /* Check it compiled */
-    glGetShaderiv(vertex_shader, GL_COMPILE_STATUS, &compiled);
-    if (!compiled) {
-        GLchar log[GLSL_LOG_LENGTH];
-        glGetShaderInfoLog(vertex_shader, GLSL_LOG_LENGTH, NULL, log);
-        log[GLSL_LOG_LENGTH - 1] = '\0';
-        fprintf(stderr, "\n\n%s\n", vertex_shader_code);
-        fprintf(stderr, "nv2a: vertex shader compilation failed: %s\n", log);
-        abort();
+        g_free(*contents);
+        *contents = NULL;
+        *length = 0;
+        file = fopen(path, "wb");
+        if (file) {
+            fwrite(&header, sizeof(header), 1, file);
+            fflush(file);
+            pg->shader_disk_cache.size += sizeof(header);
+        }
     }
+    if (file == NULL) {
+        fprintf(stderr, "nv2a: could not open shader cache %s\n", path);
+    }
+    g_free(path);
+    return file;
+}
 
-    //XXX: Again: This is a check for fixed function..
-    if (state.vertex_shader_hash == 0) {
-        /* Bind attributes for fixed function pipeline */
-        glBindAttribLocation(program, NV2A_GPU_VERTEX_ATTR_POSITION, "position");
-        glBindAttribLocation(program, NV2A_GPU_VERTEX_ATTR_DIFFUSE, "diffuse");
-        glBindAttribLocation(program, NV2A_GPU_VERTEX_ATTR_SPECULAR, "specular");
-        glBindAttribLocation(program, NV2A_GPU_VERTEX_ATTR_FOG, "fog");
-        glBindAttribLocation(program, NV2A_GPU_VERTEX_ATTR_TEXTURE0, "multiTexCoord0");
-        glBindAttribLocation(program, NV2A_GPU_VERTEX_ATTR_TEXTURE1, "multiTexCoord1");
-        glBindAttribLocation(program, NV2A_GPU_VERTEX_ATTR_TEXTURE2, "multiTexCoord2");
-        glBindAttribLocation(program, NV2A_GPU_VERTEX_ATTR_TEXTURE3, "multiTexCoord3");
-    } else {
-        /* Release shader string */
-        QDECREF(transform_program_code);
-        /* Bind attributes for transform program*/
-        char tmp[4];
-        for(i = 0; i < 16; i++) {
-            sprintf(tmp,"v%d",i);
-            glBindAttribLocation(program, i, tmp);
+static bool shader_disk_cache_reserve(PGRAPHState* pg, size_t size)
+{
+    if (pg->shader_disk_cache.size + size > pg->shader_disk_cache.size_limit) {
+        pg->shader_disk_cache.dropped++;
+        return false;
+    }
+    pg->shader_disk_cache.size += size;
+    return true;
+}
+
+static void shader_disk_cache_record_state(PGRAPHState* pg,
+                                           const ShaderKey* key)
+{
+    FILE* file = pg->shader_disk_cache.states_file;
+    if (file == NULL
+        || g_hash_table_contains(pg->shader_disk_cache.states, key)) {
+        return;
+    }
+
+    ShaderCacheStateRecord record = {
+        .state = key->state,
+        .transform_program_length = key->transform_program_length
+    };
+    size_t size = sizeof(record) + key->transform_program_length * 4;
+    if (!shader_disk_cache_reserve(pg, size)) {
+        return;
+    }
+    fwrite(&record, sizeof(record), 1, file);
+    fwrite(key->transform_program, 4, key->transform_program_length, file);
+    fflush(file);
+    g_hash_table_add(pg->shader_disk_cache.states, shader_key_copy(key));
+}
+
+static void shader_disk_cache_store_program(PGRAPHState* pg,
+                                            const ShaderKey* key,
+                                            GLuint program)
+{
+    FILE* file = pg->shader_disk_cache.programs_file;
+    if (file == NULL
+        || g_hash_table_contains(pg->shader_disk_cache.programs, key)) {
+        return;
+    }
+
+    GLint binary_length = 0;
+    glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &binary_length);
+    if (binary_length <= 0) {
+        return;
+    }
+    if (!shader_disk_cache_reserve(pg, sizeof(ShaderCacheProgramRecord)
+                                           + key->transform_program_length * 4
+                                           + binary_length)) {
+        return;
+    }
+
+    ShaderCacheProgramRecord record = {
+        .state = key->state,
+        .transform_program_length = key->transform_program_length
+    };
+    GLenum binary_format;
+    void* binary = g_malloc(binary_length);
+    glGetProgramBinary(program, binary_length, &binary_length,
+                       &binary_format, binary);
+    assert(glGetError() == GL_NO_ERROR);
+    record.binary_format = binary_format;
+    record.binary_length = binary_length;
+    fwrite(&record, sizeof(record), 1, file);
+    fwrite(key->transform_program, 4, key->transform_program_length, file);
+    fwrite(binary, 1, binary_length, file);
+    fflush(file);
+    g_free(binary);
+
+    g_hash_table_add(pg->shader_disk_cache.programs, shader_key_copy(key));
+    pg->shader_disk_cache.stored++;
+}
+
+/* Creates the programs of all binaries the driver still accepts */
+static void shader_disk_cache_load_programs(PGRAPHState* pg,
+                                            const gchar* contents,
+                                            gsize length)
+{
+    gsize offset = 0;
+    while (length - offset >= sizeof(ShaderCacheProgramRecord)) {
+        ShaderCacheProgramRecord record;
+        memcpy(&record, &contents[offset], sizeof(record));
+        offset += sizeof(record);
+        if (record.transform_program_length
+                > NV2A_GPU_MAX_VERTEXSHADER_LENGTH * 4
+            || record.transform_program_length * 4 > length - offset
+            || record.binary_length
+                > length - offset - record.transform_program_length * 4) {
+            break; /* Truncated by a crash */
+        }
+        uint32_t transform_program[NV2A_GPU_MAX_VERTEXSHADER_LENGTH * 4];
+        memcpy(transform_program, &contents[offset],
+               record.transform_program_length * 4);
+        offset += record.transform_program_length * 4;
+        const gchar* binary = &contents[offset];
+        offset += record.binary_length;
+
+        ShaderKey key = {
+            .state = record.state,
+            .transform_program = transform_program,
+            .transform_program_length = record.transform_program_length
+        };
+        g_hash_table_add(pg->shader_disk_cache.programs,
+                         shader_key_copy(&key));
+        if (g_hash_table_contains(pg->cache.shader, &key)) {
+            continue;
         }
 
-#ifdef DEBUG_NV2A_GPU_SHADER_FEEDBACK
-        debugger_prepare_feedback(program, 0xFFFF+1); // This should be enough?
-#endif
+        GLuint program = glCreateProgram();
+        glProgramBinary(program, record.binary_format,
+                        binary, record.binary_length);
+        GLint linked = 0;
+        glGetProgramiv(program, GL_LINK_STATUS, &linked);
+        if (!linked) {
+            /* Driver update, we'll compile and store it again */
+            glDeleteProgram(program);
+            glGetError();
+            g_hash_table_remove(pg->shader_disk_cache.programs, &key);
+            pg->shader_disk_cache.rejected++;
+            continue;
+        }
+        pgraph_setup_program(pg, program);
 
+        g_hash_table_insert(pg->cache.shader, shader_key_copy(&key),
+                            GUINT_TO_POINTER(program));
+        pg->shader_disk_cache.loaded++;
     }
+}
 
+/* Generates the programs for all recorded states we have no binary for */
+static void shader_disk_cache_prewarm(PGRAPHState* pg,
+                                      const gchar* contents, gsize length)
+{
+    gsize offset = 0;
+    while (length - offset >= sizeof(ShaderCacheStateRecord)) {
+        ShaderCacheStateRecord record;
+        memcpy(&record, &contents[offset], sizeof(record));
+        offset += sizeof(record);
+        if (record.transform_program_length
+                > NV2A_GPU_MAX_VERTEXSHADER_LENGTH * 4
+            || record.transform_program_length * 4 > length - offset) {
+            break; /* Truncated or corrupt */
+        }
+        uint32_t transform_program[NV2A_GPU_MAX_VERTEXSHADER_LENGTH * 4];
+        memcpy(transform_program, &contents[offset],
+               record.transform_program_length * 4);
+        offset += record.transform_program_length * 4;
+
+        ShaderKey key = {
+            .state = record.state,
+            .transform_program = transform_program,
+            .transform_program_length = record.transform_program_length
+        };
+        g_hash_table_add(pg->shader_disk_cache.states, shader_key_copy(&key));
+        if (g_hash_table_contains(pg->cache.shader, &key)) {
+            continue;
+        }
 
-    /* generate a fragment hader from register combiners */
-    GLuint fragment_shader = glCreateShader(GL_FRAGMENT_SHADER);
-    glAttachShader(program, fragment_shader);
+        GLuint program = generate_shaders(pg, record.state, transform_program,
+                                          record.transform_program_length);
+        g_hash_table_insert(pg->cache.shader, shader_key_copy(&key),
+                            GUINT_TO_POINTER(program));
+        shader_disk_cache_store_program(pg, &key, program);
+        pg->shader_disk_cache.prewarmed++;
+    }
+}
 
-    QString *fragment_shader_code = psh_translate(state.combiner_control,
-                   state.shader_stage_program,
-                   state.other_stage_input,
-                   state.rgb_inputs, state.rgb_outputs,
-                   state.alpha_inputs, state.alpha_outputs,
-                   /* constant_0, constant_1, */
-                   state.final_inputs_0, state.final_inputs_1,
-                   /* final_constant_0, final_constant_1, */
-                   state.rect_tex, state.compare_mode, state.alphakill);
+static void shader_disk_cache_init(PGRAPHState* pg)
+{
+    QemuOpts *machine_opts = qemu_opts_find(qemu_find_opts("machine"), 0);
+    if (!machine_opts) {
+        return;
+    }
+    const char* dir = qemu_opt_get(machine_opts, "nv2a_shader_cache");
+    if (!dir) {
+        return;
+    }
+    if (g_mkdir_with_parents(dir, 0755) != 0) {
+        fprintf(stderr, "nv2a: could not create shader cache %s\n", dir);
+        return;
+    }
+    pg->shader_disk_cache.dir = g_strdup(dir);
+    pg->shader_disk_cache.size_limit =
+        qemu_opt_get_size(machine_opts, "nv2a_shader_cache_size",
+                          NV2A_GPU_SHADER_CACHE_SIZE);
+    pg->shader_disk_cache.states = g_hash_table_new_full(shader_key_hash,
+                                                         shader_key_equal,
+                                                         shader_key_free,
+                                                         NULL);
+    pg->shader_disk_cache.programs = g_hash_table_new_full(shader_key_hash,
+                                                           shader_key_equal,
+                                                           shader_key_free,
+                                                           NULL);
+
+    gchar* contents;
+    gsize length;
+
+    /* Binaries first, everything they cover doesn't have to be compiled */
+    GLint binary_formats = 0;
+    if (glo_check_extension((const GLubyte *)"GL_ARB_get_program_binary")) {
+        glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &binary_formats);
+    }
+    pg->shader_disk_cache.binaries = binary_formats > 0;
+    if (pg->shader_disk_cache.binaries) {
+        gchar* driver = g_strdup_printf("%s\n%s\n%s",
+                                        glGetString(GL_VENDOR),
+                                        glGetString(GL_RENDERER),
+                                        glGetString(GL_VERSION));
+        uint32_t driver_hash = XXH32(driver, strlen(driver), 0);
+        gchar* name = g_strdup_printf("nv2a-programs-%08x.bin", driver_hash);
+        pg->shader_disk_cache.programs_file =
+            shader_disk_cache_open(pg, name, driver_hash, &contents, &length);
+        shader_disk_cache_load_programs(pg, contents, length);
+        g_free(contents);
+        g_free(name);
+        g_free(driver);
+    }
 
-    const char *fragment_shader_code_str = qstring_get_str(fragment_shader_code);
+    pg->shader_disk_cache.states_file =
+        shader_disk_cache_open(pg, "nv2a-states.bin", 0, &contents, &length);
+    shader_disk_cache_prewarm(pg, contents, length);
+    g_free(contents);
 
-    NV2A_GPU_DPRINTF("bind new fragment shader, code:\n%s\n", fragment_shader_code_str);
+    NV2A_GPU_DPRINTF("nv2a: shader cache: %u programs loaded, %u rejected, "
+                     "%u pre-warmed\n",
+                     pg->shader_disk_cache.loaded,
+                     pg->shader_disk_cache.rejected,
+                     pg->shader_disk_cache.prewarmed);
+}
 
-    glShaderSource(fragment_shader, 1, &fragment_shader_code_str, NULL);
-    glCompileShader(fragment_shader);
+static void shader_disk_cache_destroy(PGRAPHState* pg)
+{
+    if (pg->shader_disk_cache.dir == NULL) {
+        return;
+    }
+    if (pg->shader_disk_cache.states_file) {
+        fclose(pg->shader_disk_cache.states_file);
+    }
+    if (pg->shader_disk_cache.programs_file) {
+        fclose(pg->shader_disk_cache.programs_file);
+    }
+    g_hash_table_destroy(pg->shader_disk_cache.states);
+    g_hash_table_destroy(pg->shader_disk_cache.programs);
+    g_free(pg->shader_disk_cache.dir);
+    pg->shader_disk_cache.dir = NULL;
+}
 
-    /* Check it compiled */
-    glGetShaderiv(fragment_shader, GL_COMPILE_STATUS, &compiled);
-    if (!compiled) {
-        GLchar log[GLSL_LOG_LENGTH];
-        glGetShaderInfoLog(fragment_shader, GLSL_LOG_LENGTH, NULL, log);
-        log[GLSL_LOG_LENGTH - 1] = '\0';
-        fprintf(stderr, "\n\n%s\n", fragment_shader_code_str);
-        fprintf(stderr, "nv2a: fragment shader compilation failed: %s\n", log);
-        abort();
+#ifdef DEBUG_NV2A_GPU_SHADER_CACHE_STATS
+static void shader_disk_cache_report_stats(PGRAPHState* pg)
+{
+    printf("nv2a: shader cache: %u loaded, %u rejected, %u pre-warmed, "
+           "%u compiled, %u stored, %u dropped, %zu / %zu bytes\n",
+           pg->shader_disk_cache.loaded,
+           pg->shader_disk_cache.rejected,
+           pg->shader_disk_cache.prewarmed,
+           pg->shader_disk_cache.compiled,
+           pg->shader_disk_cache.stored,
+           pg->shader_disk_cache.dropped,
+           pg->shader_disk_cache.size,
+           pg->shader_disk_cache.size_limit);
+}
+#endif
+
+/* Asynchronous shader compilation
+ *
+ * Translating, compiling and linking a program the first time a state is
+ * seen can take tens of milliseconds. Unless the policy is to block, a
+ * missing program is handed to the shader compile thread, which builds it
+ * in a GL context sharing objects with the render thread's. Draws which
+ * need it meanwhile are dropped or use a program with the same vertex
+ * shader, depending on the policy. With KHR/ARB_parallel_shader_compile
+ * the thread issues all queued programs before it waits for any of them,
+ * so the driver can build them side by side.
+ */
+
+typedef void (GLAPIENTRY *MaxShaderCompilerThreadsProc)(GLuint count);
+
+/* Upper bounds of the latency histogram buckets, the last one is open */
+static const unsigned int
+shader_compile_ms[NV2A_GPU_SHADER_COMPILE_BUCKETS - 1] = {
+    1, 2, 5, 10, 20, 50, 100, 200
+};
+
+static void shader_compile_record_latency(PGRAPHState* pg, int64_t ns)
+{
+    unsigned int i;
+    for (i = 0; i < ARRAY_SIZE(shader_compile_ms); i++) {
+        if (ns < shader_compile_ms[i] * 1000000LL) {
+            break;
+        }
     }
-    assert(glGetError() == GL_NO_ERROR);
+    pg->shader_compile.latency[i]++;
+    pg->shader_compile.latency_max_ns =
+        MAX(pg->shader_compile.latency_max_ns, ns);
+}
 
-    QDECREF(fragment_shader_code);
+static void shader_compile_source(GLuint shader, QString* code)
+{
+    const char* str = qstring_get_str(code);
+    glShaderSource(shader, 1, &str, NULL);
+    glCompileShader(shader);
+}
 
+/* Issues the whole program without asking for any result, which would wait
+   for the driver */
+static void shader_compile_build(PGRAPHState* pg, ShaderCompileJob* job)
+{
+    struct FragmentshaderKey fragmentshader_key;
+    get_fragmentshader_key(&job->key.state, &fragmentshader_key);
+
+    job->vertex_code =
+        generate_vertexshader_code(job->key.state.vertex_shader_hash,
+                                   job->key.transform_program,
+                                   job->key.transform_program_length);
+    job->fragment_code = generate_fragmentshader_code(&fragmentshader_key);
+
+    job->vertex_shader = glCreateShader(GL_VERTEX_SHADER);
+    shader_compile_source(job->vertex_shader, job->vertex_code);
+    job->fragment_shader = glCreateShader(GL_FRAGMENT_SHADER);
+    shader_compile_source(job->fragment_shader, job->fragment_code);
+
+    job->program = glCreateProgram();
+    glAttachShader(job->program, job->vertex_shader);
+    glAttachShader(job->program, job->fragment_shader);
+    bind_program_attributes(job->program,
+                            job->key.state.vertex_shader_hash == 0);
+    if (pg->shader_disk_cache.binaries) {
+        glProgramParameteri(job->program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT,
+                            GL_TRUE);
+    }
+    glLinkProgram(job->program);
+}
 
+static char* shader_compile_stage_error(GLuint shader, QString* code,
+                                        const char* name)
+{
+    GLint compiled = 0;
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &compiled);
+    if (compiled) {
+        return NULL;
+    }
+    GLchar log[GLSL_LOG_LENGTH];
+    glGetShaderInfoLog(shader, GLSL_LOG_LENGTH, NULL, log);
+    log[GLSL_LOG_LENGTH - 1] = '\0';
+    return g_strdup_printf("\n\n%s\nnv2a: %s shader compilation failed: %s\n",
+                           qstring_get_str(code), name, log);
+}
 
-    /* link the program */
-    glLinkProgram(program);
+/* Waits for the link, the shader objects aren't needed after it */
+static void shader_compile_finish(ShaderCompileJob* job)
+{
     GLint linked = 0;
-    glGetProgramiv(program, GL_LINK_STATUS, &linked);
-    if(!linked) {
-        GLchar log[GLSL_LOG_LENGTH];
-        glGetProgramInfoLog(program, GLSL_LOG_LENGTH, NULL, log);
-        log[GLSL_LOG_LENGTH - 1] = '\0';
-        fprintf(stderr, "nv2a: shader linking failed: %s\n", log);
-        abort();
+    glGetProgramiv(job->program, GL_LINK_STATUS, &linked);
+    if (!linked) {
+        job->error = shader_compile_stage_error(job->vertex_shader,
+                                                job->vertex_code, "vertex");
+        if (job->error == NULL) {
+            job->error = shader_compile_stage_error(job->fragment_shader,
+                                                    job->fragment_code,
+                                                    "fragment");
+        }
+        if (job->error == NULL) {
+            GLchar log[GLSL_LOG_LENGTH];
+            glGetProgramInfoLog(job->program, GLSL_LOG_LENGTH, NULL, log);
+            log[GLSL_LOG_LENGTH - 1] = '\0';
+            job->error = g_strdup_printf("nv2a: shader linking failed: %s\n",
+                                         log);
+        }
     }
 
-    glUseProgram(program);
-    assert(glGetError() == 0);
+    glDetachShader(job->program, job->vertex_shader);
+    glDetachShader(job->program, job->fragment_shader);
+    glDeleteShader(job->vertex_shader);
+    glDeleteShader(job->fragment_shader);
+    QDECREF(job->vertex_code);
+    QDECREF(job->fragment_code);
+    job->vertex_code = NULL;
+    job->fragment_code = NULL;
+
+    /* The other context may only use the program once this completed */
+    job->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    glFlush();
+    assert(glGetError() == GL_NO_ERROR);
+    job->done_ns = get_clock();
+}
 
-    /* set texture samplers */
-    for (i = 0; i < NV2A_GPU_MAX_TEXTURES; i++) {
-        char samplerName[16];
-        snprintf(samplerName, sizeof(samplerName), "texSamp%d", i);
-        GLint texSampLoc = glGetUniformLocation(program, samplerName);
-        if (texSampLoc >= 0) {
-            glUniform1i(texSampLoc, i);
+static void* shader_compile_thread(void* opaque)
+{
+    PGRAPHState* pg = opaque;
+    QTAILQ_HEAD(, ShaderCompileJob) batch;
+    ShaderCompileJob* job;
+    ShaderCompileJob* next;
+
+    glo_set_current(pg->shader_compile.gl_context);
+
+    if (pg->shader_compile.parallel) {
+        MaxShaderCompilerThreadsProc max_threads = glo_get_extension_proc(
+            (const GLubyte *)"glMaxShaderCompilerThreadsKHR");
+        if (max_threads == NULL) {
+            max_threads = glo_get_extension_proc(
+                (const GLubyte *)"glMaxShaderCompilerThreadsARB");
+        }
+        if (max_threads) {
+            /* As many as the driver likes */
+            max_threads(0xFFFFFFFF);
         }
     }
 
-    glValidateProgram(program);
-    GLint valid = 0;
-    glGetProgramiv(program, GL_VALIDATE_STATUS, &valid);
-    if (!valid) {
-        GLchar log[GLSL_LOG_LENGTH];
-        glGetProgramInfoLog(program, GLSL_LOG_LENGTH, NULL, log);
-        log[GLSL_LOG_LENGTH - 1] = '\0';
-        fprintf(stderr, "nv2a: shader validation failed: %s\n", log);
+    qemu_mutex_lock(&pg->shader_compile.lock);
+    while (!pg->shader_compile.exit) {
+        if (QTAILQ_EMPTY(&pg->shader_compile.queue)) {
+            qemu_cond_wait(&pg->shader_compile.work_cond,
+                           &pg->shader_compile.lock);
+            continue;
+        }
+        QTAILQ_INIT(&batch);
+        while ((job = QTAILQ_FIRST(&pg->shader_compile.queue))) {
+            QTAILQ_REMOVE(&pg->shader_compile.queue, job, entry);
+            QTAILQ_INSERT_TAIL(&batch, job, entry);
+        }
+        qemu_mutex_unlock(&pg->shader_compile.lock);
+
+        QTAILQ_FOREACH(job, &batch, entry) {
+            shader_compile_build(pg, job);
+        }
+        /* The render thread frees jobs once they are done */
+        QTAILQ_FOREACH_SAFE(job, &batch, entry, next) {
+            shader_compile_finish(job);
+            qemu_mutex_lock(&pg->shader_compile.lock);
+            job->done = true;
+            qemu_mutex_unlock(&pg->shader_compile.lock);
+        }
+
+        qemu_mutex_lock(&pg->shader_compile.lock);
+    }
+    qemu_mutex_unlock(&pg->shader_compile.lock);
+
+    glo_set_current(NULL);
+    return NULL;
+}
+
+static void shader_compile_free_job(ShaderCompileJob* job)
+{
+    g_free(job->key.transform_program);
+    g_free(job->error);
+    g_free(job);
+}
+
+/* Takes a finished program into the caches, like a synchronous compile
+   would have */
+static GLuint shader_compile_complete(PGRAPHState* pg, ShaderCompileJob* job)
+{
+    GLuint program = job->program;
+
+    if (job->error) {
+        fprintf(stderr, "%s", job->error);
         abort();
     }
-    assert(glGetError() == GL_NO_ERROR);
 
+    glWaitSync(job->fence, 0, GL_TIMEOUT_IGNORED);
+    glDeleteSync(job->fence);
+    pgraph_setup_program(pg, program);
+
+    shader_compile_record_latency(pg, job->done_ns - job->queued_ns);
+    pg->shader_disk_cache.compiled++;
+
+    g_hash_table_insert(pg->cache.shader, shader_key_copy(&job->key),
+                        (gpointer)program);
+
+    shader_disk_cache_record_state(pg, &job->key);
+    shader_disk_cache_store_program(pg, &job->key, program);
+
+    g_hash_table_remove(pg->shader_compile.pending, &job->key);
+    shader_compile_free_job(job);
     return program;
 }
 
+/* Returns the program for key once the compile thread linked it, queueing
+   it if it's new. Until then *ready is false and the return value is the
+   program to draw with meanwhile, 0 if the draw has to be dropped. */
+static GLuint shader_compile_get(PGRAPHState* pg, const ShaderKey* key,
+                                 bool* ready)
+{
+    ShaderCompileJob* job = g_hash_table_lookup(pg->shader_compile.pending,
+                                                key);
+    if (job == NULL) {
+        job = g_malloc0(sizeof(ShaderCompileJob));
+        job->key.state = key->state;
+        job->key.transform_program =
+            g_memdup(key->transform_program,
+                     key->transform_program_length * 4);
+        job->key.transform_program_length = key->transform_program_length;
+        job->queued_ns = get_clock();
+        g_hash_table_insert(pg->shader_compile.pending, &job->key, job);
+
+        qemu_mutex_lock(&pg->shader_compile.lock);
+        QTAILQ_INSERT_TAIL(&pg->shader_compile.queue, job, entry);
+        qemu_cond_signal(&pg->shader_compile.work_cond);
+        qemu_mutex_unlock(&pg->shader_compile.lock);
+    }
+
+    qemu_mutex_lock(&pg->shader_compile.lock);
+    bool done = job->done;
+    qemu_mutex_unlock(&pg->shader_compile.lock);
+    if (done) {
+        *ready = true;
+        return shader_compile_complete(pg, job);
+    }
+
+    *ready = false;
+    if (pg->shader_compile.policy == SHADER_COMPILE_FALLBACK) {
+        GLuint program = GPOINTER_TO_UINT(g_hash_table_lookup(
+            pg->shader_compile.fallback,
+            GUINT_TO_POINTER(key->state.vertex_shader_hash)));
+        if (program) {
+            pg->shader_compile.fallback_draws++;
+            return program;
+        }
+    }
+    pg->shader_compile.skipped_draws++;
+    return 0;
+}
+
+static void shader_compile_init(PGRAPHState* pg)
+{
+    pg->shader_compile.policy = SHADER_COMPILE_BLOCK;
+
+    QemuOpts *machine_opts = qemu_opts_find(qemu_find_opts("machine"), 0);
+    if (!machine_opts) {
+        return;
+    }
+    const char* policy = qemu_opt_get(machine_opts, "nv2a_shader_compile");
+    if (!policy || !strcmp(policy, "block")) {
+        return;
+    } else if (!strcmp(policy, "skip")) {
+        pg->shader_compile.policy = SHADER_COMPILE_SKIP;
+    } else if (!strcmp(policy, "fallback")) {
+        pg->shader_compile.policy = SHADER_COMPILE_FALLBACK;
+    } else {
+        fprintf(stderr, "nv2a: unknown shader compile policy %s\n", policy);
+        return;
+    }
+
+    pg->shader_compile.gl_context =
+        glo_context_create_shared(GLO_FF_DEFAULT, pg->gl_context);
+    /* Creating it made it current */
+    glo_set_current(pg->gl_context);
+    if (!pg->shader_compile.gl_context) {
+        fprintf(stderr, "nv2a: no shared GL context, shaders are compiled "
+                        "synchronously\n");
+        pg->shader_compile.policy = SHADER_COMPILE_BLOCK;
+        return;
+    }
+
+    pg->shader_compile.parallel =
+        glo_check_extension((const GLubyte *)
+                            "GL_KHR_parallel_shader_compile") ||
+        glo_check_extension((const GLubyte *)
+                            "GL_ARB_parallel_shader_compile");
+    pg->shader_compile.pending = g_hash_table_new(shader_key_hash,
+                                                  shader_key_equal);
+    pg->shader_compile.fallback = g_hash_table_new(g_direct_hash,
+                                                   g_direct_equal);
+    qemu_mutex_init(&pg->shader_compile.lock);
+    qemu_cond_init(&pg->shader_compile.work_cond);
+    QTAILQ_INIT(&pg->shader_compile.queue);
+    qemu_thread_create(&pg->shader_compile.thread, "nv2a/shaders",
+                       shader_compile_thread, pg, QEMU_THREAD_JOINABLE);
+}
+
+/* Needs the render thread's context, the compile thread's is destroyed
+   after */
+static void shader_compile_destroy(PGRAPHState* pg)
+{
+    if (!pg->shader_compile.gl_context) {
+        return;
+    }
+
+    qemu_mutex_lock(&pg->shader_compile.lock);
+    pg->shader_compile.exit = true;
+    qemu_cond_signal(&pg->shader_compile.work_cond);
+    qemu_mutex_unlock(&pg->shader_compile.lock);
+    qemu_thread_join(&pg->shader_compile.thread);
+
+    GHashTableIter iter;
+    gpointer value;
+    g_hash_table_iter_init(&iter, pg->shader_compile.pending);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        ShaderCompileJob* job = value;
+        if (job->done) {
+            glDeleteSync(job->fence);
+            glDeleteProgram(job->program);
+        }
+        shader_compile_free_job(job);
+    }
+    g_hash_table_destroy(pg->shader_compile.pending);
+    g_hash_table_destroy(pg->shader_compile.fallback);
+
+    qemu_mutex_destroy(&pg->shader_compile.lock);
+    qemu_cond_destroy(&pg->shader_compile.work_cond);
+}
+
+#ifdef DEBUG_NV2A_GPU_SHADER_COMPILE_STATS
+static void shader_compile_report_stats(PGRAPHState* pg)
+{
+    unsigned int i;
+    printf("nv2a: shader compile: %u draws dropped, %u with a fallback, "
+           "max %" PRId64 " us, ms",
+           pg->shader_compile.skipped_draws,
+           pg->shader_compile.fallback_draws,
+           pg->shader_compile.latency_max_ns / 1000);
+    for (i = 0; i < ARRAY_SIZE(shader_compile_ms); i++) {
+        printf(" <%u: %u", shader_compile_ms[i],
+               pg->shader_compile.latency[i]);
+    }
+    printf(" >=%u: %u\n", shader_compile_ms[i - 1],
+           pg->shader_compile.latency[i]);
+    memset(pg->shader_compile.latency, 0,
+           sizeof(pg->shader_compile.latency));
+    pg->shader_compile.latency_max_ns = 0;
+    pg->shader_compile.skipped_draws = 0;
+    pg->shader_compile.fallback_draws = 0;
+}
+#endif
+
+#ifdef DEBUG_NV2A_GPU_DRAW_TIMING
+static void draw_timing_report(PGRAPHState* pg)
+{
+    unsigned int draws = MAX(pg->draw_timing.draws, 1);
+    printf("nv2a: %u draws, setup %" PRId64 " ns/draw, "
+           "bind_shaders %" PRId64 " ns/draw, %u constant uploads\n",
+           pg->draw_timing.draws,
+           pg->draw_timing.setup_ns / draws,
+           pg->draw_timing.bind_shaders_ns / draws,
+           pg->draw_timing.constant_uploads);
+    memset(&pg->draw_timing, 0, sizeof(pg->draw_timing));
+}
+#endif
+
 static void pgraph_bind_shaders(PGRAPHState *pg)
 {
     debugger_push_group("NV2A: pgraph_bind_shaders");
@@ -2076,21 +4040,27 @@ static void pgraph_bind_shaders(PGRAPHState *pg)
     bool fixed_function = GET_MASK(pg->regs[NV_PGRAPH_CSV0_D],
                                    NV_PGRAPH_CSV0_D_MODE) == 0;
 
+    pg->shader_compile.skip_draw = false;
+
     if (pg->dirty.shaders) {
+        bool ready = true;
 
         /* Hash the vertex shader if it exists */
         guint vertex_shader_hash;
+        unsigned int start = pg->vertexshader_start_slot;
+        uint32_t* transform_program = &pg->vertexshader.program_data[start * 4];
+        unsigned int transform_program_length = 0;
         if (fixed_function) {
             vertex_shader_hash = 0;
         } else {
             //FIXME: This will currently ignore the dirty bit..
-            unsigned int start = pg->vertexshader_start_slot;
-            uint32_t* transform_program = &pg->vertexshader.program_data[start * 4];
             /* Search for the final instruction */
             for(i = 0; i < (NV2A_GPU_MAX_VERTEXSHADER_LENGTH - start); i++) {
                 if (transform_program[i * 4 + 3] & 1) { i++; break; }
             }
-            vertex_shader_hash = hash(transform_program, i * 4);
+            transform_program_length = i * 4;
+            vertex_shader_hash = hash(transform_program,
+                                      transform_program_length * 4);
         }
 
         ShaderState state = {
@@ -2130,33 +4100,57 @@ static void pgraph_bind_shaders(PGRAPHState *pg)
             state.alphakill[i] = pg->textures[i].alphakill;
         }
 
-        /* if the shader changed / is dirty, dirty all the constants so they will be uploaded again */
-        for (i=0; i<NV2A_GPU_VERTEXSHADER_CONSTANTS; i++) {
-            pg->constants[i].dirty = true;
-        }
-
 #if 1
-        //FIXME: Add vertex shader to cache! - we should probably cache the 3 of them individually (vertex, fragment, program)
-        gpointer cached_shader = g_hash_table_lookup(pg->cache.shader, &state);
+        ShaderKey key = {
+            .state = state,
+            .transform_program = transform_program,
+            .transform_program_length = transform_program_length
+        };
+        gpointer cached_shader = g_hash_table_lookup(pg->cache.shader, &key);
         if (cached_shader) {
             pg->gl_program = (GLuint)cached_shader;
+        } else if (pg->shader_compile.policy != SHADER_COMPILE_BLOCK) {
+            GLuint program = shader_compile_get(pg, &key, &ready);
+            if (program == 0) {
+                /* Try again at the next draw */
+                pg->shader_compile.skip_draw = true;
+                debugger_pop_group();
+                return;
+            }
+            pg->gl_program = program;
         } else {
-            pg->gl_program = generate_shaders(pg, state);
+            int64_t compile_start = get_clock();
+            pg->gl_program = generate_shaders(pg, state, transform_program,
+                                              transform_program_length);
+            shader_compile_record_latency(pg, get_clock() - compile_start);
+            pg->shader_disk_cache.compiled++;
 
             /* cache it */
-            
-            ShaderState *cache_state = g_malloc(sizeof(*cache_state));
-            memcpy(cache_state, &state, sizeof(*cache_state));
-            g_hash_table_insert(pg->cache.shader, cache_state,
+            g_hash_table_insert(pg->cache.shader, shader_key_copy(&key),
                                 (gpointer)pg->gl_program);
+
+            /* and remember it for the next boot */
+            shader_disk_cache_record_state(pg, &key);
+            shader_disk_cache_store_program(pg, &key, pg->gl_program);
         }
 #else
-        pg->gl_program = generate_shaders(pg, state);
+        pg->gl_program = generate_shaders(pg, state, transform_program,
+                                          transform_program_length);
 #endif
-        pg->dirty.shaders = false;
+        if (ready && pg->shader_compile.fallback) {
+            g_hash_table_insert(pg->shader_compile.fallback,
+                                GUINT_TO_POINTER(state.vertex_shader_hash),
+                                GUINT_TO_POINTER(pg->gl_program));
+        }
+        pg->shader_binding = get_shader_binding(pg, pg->gl_program);
+        /* A fallback has to be replaced once the real program is done */
+        pg->dirty.shaders = !ready;
     }
 
-    glUseProgram(pg->gl_program);
+    ShaderBinding* binding = pg->shader_binding;
+    assert(binding->program == pg->gl_program);
+
+    gl_state_use_program(pg, pg->gl_program);
     assert(glGetError() == 0);
 
 
@@ -2177,9 +4171,7 @@ static void pgraph_bind_shaders(PGRAPHState *pg)
 
         int j;
         for (j = 0; j < 2; j++) {
-            char tmp[8];
-            snprintf(tmp, sizeof(tmp), "c_%d_%d", i, j);
-            GLint loc = glGetUniformLocation(pg->gl_program, tmp);
+            GLint loc = binding->combiner_constant_loc[i][j];
             if (loc != -1) {
                 float value[4];
                 value[0] = (float) ((constant[j] >> 16) & 0xFF) / 255.0f;
@@ -2191,16 +4183,14 @@ static void pgraph_bind_shaders(PGRAPHState *pg)
             }
         }
 
-        /* Set eye vector for combiner */
-        if (pg->dirty.eye_vector) {
-            GLint loc = glGetUniformLocation(pg->gl_program, "eye_vector");
-            if (loc != -1) {
-                glUniform3fv(loc, 1, pg->eye_vector);
-            }
-            pg->dirty.eye_vector = false;
-        }
+    }
 
+    /* Set eye vector for combiner, the flag can't tell which programs have
+       seen it so it's always sent */
+    if (binding->eye_vector_loc != -1) {
+        glUniform3fv(binding->eye_vector_loc, 1, pg->eye_vector);
     }
+    pg->dirty.eye_vector = false;
 
     debugger_pop_group();
 
@@ -2220,10 +4210,8 @@ static void pgraph_bind_shaders(PGRAPHState *pg)
 
         */
 
-        assert(pg->FIXME_REMOVEME_comp_src == 2);
-
-        GLint comMatLoc = glGetUniformLocation(pg->gl_program, "composite");
-        glUniformMatrix4fv(comMatLoc, 1, GL_FALSE, pg->composite_matrix);
+        glUniformMatrix4fv(binding->composite_matrix_loc, 1, GL_FALSE,
+                           pg->composite_matrix);
 
         /* FIXME: Disabling texture matrices should probably be done in the shader? */
         const float identity_matrix[4*4] = {
@@ -2233,14 +4221,10 @@ static void pgraph_bind_shaders(PGRAPHState *pg)
             0.0f, 0.0f, 0.0f, 1.0f
         };
 
-        GLint texMat0Loc = glGetUniformLocation(pg->gl_program, "textureMatrix0");
-        glUniformMatrix4fv(texMat0Loc, 1, GL_FALSE, pg->texture_matrix_enable[0]?pg->texture_matrix0:identity_matrix);
-        GLint texMat1Loc = glGetUniformLocation(pg->gl_program, "textureMatrix1");
-        glUniformMatrix4fv(texMat1Loc, 1, GL_FALSE, pg->texture_matrix_enable[1]?pg->texture_matrix1:identity_matrix);
-        GLint texMat2Loc = glGetUniformLocation(pg->gl_program, "textureMatrix2");
-        glUniformMatrix4fv(texMat2Loc, 1, GL_FALSE, pg->texture_matrix_enable[2]?pg->texture_matrix2:identity_matrix);
-        GLint texMat3Loc = glGetUniformLocation(pg->gl_program, "textureMatrix3");
-        glUniformMatrix4fv(texMat3Loc, 1, GL_FALSE, pg->texture_matrix_enable[3]?pg->texture_matrix3:identity_matrix);
+        glUniformMatrix4fv(binding->texture_matrix_loc[0], 1, GL_FALSE, pg->texture_matrix_enable[0]?pg->texture_matrix0:identity_matrix);
+        glUniformMatrix4fv(binding->texture_matrix_loc[1], 1, GL_FALSE, pg->texture_matrix_enable[1]?pg->texture_matrix1:identity_matrix);
+        glUniformMatrix4fv(binding->texture_matrix_loc[2], 1, GL_FALSE, pg->texture_matrix_enable[2]?pg->texture_matrix2:identity_matrix);
+        glUniformMatrix4fv(binding->texture_matrix_loc[3], 1, GL_FALSE, pg->texture_matrix_enable[3]?pg->texture_matrix3:identity_matrix);
 
         /* estimate the viewport by assuming it matches the clip region ... */
 #if 0
@@ -2291,37 +4275,22 @@ h = pg->clip_height;
             -1.0, 1.0, -m43/m33, 1.0
         };
 #endif
-        GLint viewLoc = glGetUniformLocation(pg->gl_program, "invViewport");
-        glUniformMatrix4fv(viewLoc, 1, GL_FALSE, &invViewport[0]);
+        glUniformMatrix4fv(binding->inv_viewport_loc, 1, GL_FALSE,
+                           &invViewport[0]);
 
     } else {
 
-        //FIXME: Uniforms are *PER SHADER PROGRAM!* - Our cache / dirty system has to represent that..
-
         /* load constants */
-        for (i=0; i<NV2A_GPU_VERTEXSHADER_CONSTANTS; i++) {
-            VertexShaderConstant *constant = &pg->constants[i];
-            //if (!constant->dirty) continue;
-
-            char tmp[7];
-            sprintf(tmp,"c[%d]",i);
-            GLint loc = glGetUniformLocation(pg->gl_program, tmp);
-            if (loc != -1) {
-                glUniform4fv(loc, 1, (const GLfloat*)constant->data);
-                //constant->dirty = false;
-            }
-        }
+        shader_bindings_mark_constants_dirty(pg);
+        shader_binding_upload_constants(pg, binding);
 
         {
-            GLint loc = glGetUniformLocation(pg->gl_program, "cliprange");
-            glUniform2f(loc, zclip_min, zclip_max);
+            glUniform2f(binding->cliprange_loc, zclip_min, zclip_max);
             //glDepthRangef();
         }
 
         for(i=0; i<NV2A_GPU_MAX_TEXTURES; i++) {
-            char tmp[9];
-            sprintf(tmp, "texSize%d", i); 
-            GLint loc = glGetUniformLocation(pg->gl_program, tmp);
+            GLint loc = binding->tex_size_loc[i];
             if (loc != -1) {
                 glUniform2f(loc, pg->textures[i].rect_width, pg->textures[i].rect_height);
             }
@@ -2364,8 +4333,8 @@ static void bind_gl_framebuffer(NV2A_GPUState *d, bool zeta, bool color) {
            might not be updated only because the *new* buffer has different
            surfaces */
         if (pg->framebuffer) {
-            start_framebuffer_to_pixels_download(pg->framebuffer, true, true);
-            download_all_pixels_to_memory(d);
+            start_framebuffer_to_pixels_download(d, pg->framebuffer, true, true);
+            download_all_pixels_to_memory(d, false);
         }
     
         /* Get surface dimensions and make sure it can exist */
@@ -2440,59 +4409,473 @@ static void bind_gl_framebuffer(NV2A_GPUState *d, bool zeta, bool color) {
         } else {
             color_texture = NULL;
         }
-
-        /* Last chance to early out */
-        if (!zeta_texture && !color_texture) {
-            debugger_message("No framebuffer bound: no zeta, no color!");
-            pg->framebuffer = NULL;
-            pg->dirty.framebuffer = false;
-            assert(0); //FIXME: Untested code path!
-            return;
+
+        /* Last chance to early out */
+        if (!zeta_texture && !color_texture) {
+            debugger_message("No framebuffer bound: no zeta, no color!");
+            pg->framebuffer = NULL;
+            pg->dirty.framebuffer = false;
+            assert(0); //FIXME: Untested code path!
+            return;
+        }
+
+        /* Framebuffer */
+        pg->framebuffer = bind_framebuffer(pg,
+                                           zeta_texture,
+                                           has_stencil,
+                                           color_texture);
+
+        pg->dirty.framebuffer = false;
+    }
+
+}
+
+static inline void pgraph_update_surfaces(NV2A_GPUState *d, bool upload, bool zeta, bool color)
+{
+
+    ProfileStage outer_stage = profile_enter(&d->pgraph,
+                                             PROFILE_STAGE_SURFACE_UPDATE);
+    debugger_push_group("pgraph_update_surfaces(upload: %i, zeta: %i, color: %i)",upload,zeta,color);
+    memory_region_sync_dirty_bitmap(d->vram); //FIXME: Ideally done elsewhere for all resources
+    if (upload) {
+        d->pgraph.dirty.framebuffer = true; //FIXME: HACK: REMOVEME: some trouble to get the right fbo.. Probably caused by not downloading modified pixels before using them in other textures
+        bind_gl_framebuffer(d, zeta, color);
+        apply_fast_clears_on_gpu(&d->pgraph);
+    } else {
+        Framebuffer* framebuffer = d->pgraph.framebuffer;
+        /* Surfaces which were only cleared didn't make it to memory yet */
+        flush_fast_clears_to_memory(d, NULL);
+#ifndef ALWAYS_DOWNLOAD_PIXELS
+        if (framebuffer) {
+            start_framebuffer_to_pixels_download(d, framebuffer,
+                                                 zeta,
+                                                 color);
+        }
+        download_all_pixels_to_memory(d, false);
+#endif
+    }
+    debugger_pop_group();
+    profile_leave(&d->pgraph, outer_stage);
+    return;
+
+}
+
+/* Fills in where bind_gl_framebuffer will keep the surface */
+static void set_fast_clear_layout(NV2A_GPUState *d, FastClear* fast_clear,
+                                  Surface* surface, hwaddr dma_obj_address,
+                                  unsigned int texture_format,
+                                  unsigned int width, unsigned int height)
+{
+    const TextureFormatInfo* mapped_format =
+        &kelvin_texture_format_map[texture_format];
+    fast_clear->swizzled = !mapped_format->linear;
+    fast_clear->bytes_per_pixel = mapped_format->bytes_per_pixel;
+    fast_clear->width = width;
+    fast_clear->height = height;
+    fast_clear->pitch = surface->pitch;
+    fast_clear->address = load_surface(d, surface, dma_obj_address);
+    fast_clear->size = fast_clear->swizzled ?
+                           (surface->pitch * height) :
+                           (width * height * fast_clear->bytes_per_pixel);
+}
+
+static void record_fast_clear(NV2A_GPUState *d, FastClear* pending,
+                              const FastClear* fast_clear)
+{
+    /* An older clear of another surface still has to happen */
+    if (pending->pending &&
+        ((pending->address != fast_clear->address) ||
+         (pending->size != fast_clear->size) ||
+         (pending->swizzled != fast_clear->swizzled) ||
+         (pending->bytes_per_pixel != fast_clear->bytes_per_pixel))) {
+        MemoryBlock memory_block = get_fast_clear_memory_block(pending);
+        flush_fast_clears_to_memory(d, &memory_block);
+    }
+    *pending = *fast_clear;
+    pending->pending = true;
+    d->pgraph.fast_clear_stats.recorded++;
+}
+
+/* Clears of whole surfaces don't need the old contents, so they are only
+   recorded here. The next draw does them with glClear right after binding
+   the surfaces, which then don't have to be uploaded. If someone needs the
+   memory first it's filled by flush_fast_clears_to_memory instead.
+   Returns false if the clear has to be done right away. */
+static bool pgraph_fast_clear(NV2A_GPUState *d, uint32_t parameter,
+                              unsigned int xmin, unsigned int ymin,
+                              unsigned int xmax, unsigned int ymax)
+{
+    PGRAPHState *pg = &d->pgraph;
+    bool write_depth = parameter & NV097_CLEAR_SURFACE_Z;
+    bool write_stencil = parameter & NV097_CLEAR_SURFACE_STENCIL;
+    bool write_zeta = write_depth || write_stencil;
+    bool write_color = parameter & NV097_CLEAR_SURFACE_COLOR;
+    bool swizzled = (pg->surface_type == NV097_SET_SURFACE_FORMAT_TYPE_SWIZZLE);
+    FastClear zeta_fast_clear = { .pending = false };
+    FastClear color_fast_clear = { .pending = false };
+    unsigned int w;
+    unsigned int h;
+
+    /* Same dimensions as bind_gl_framebuffer */
+    get_surface_dimensions(pg, &w, &h);
+    if ((w == 0) || (h == 0)) {
+        return false;
+    }
+    if (swizzled) {
+        w = 1 << pg->surface_swizzle_width_shift;
+        h = 1 << pg->surface_swizzle_height_shift;
+    } else {
+        w = pg->clip_width;
+        h = pg->clip_height;
+    }
+
+    if ((xmin != 0) || (ymin != 0) || (xmax + 1 < w) || (ymax + 1 < h)) {
+        return false;
+    }
+
+    if (write_zeta) {
+        uint32_t clear_zstencil = pg->regs[NV_PGRAPH_ZSTENCILCLEARVALUE];
+        unsigned int bytes_per_pixel;
+        switch (pg->surface_zeta.format) {
+        case NV097_SET_SURFACE_FORMAT_ZETA_Z16:
+            if (!write_depth) {
+                return false;
+            }
+            bytes_per_pixel = 2;
+            zeta_fast_clear.value = clear_zstencil & 0xFFFF;
+            zeta_fast_clear.gl_mask = GL_DEPTH_BUFFER_BIT;
+            zeta_fast_clear.gl_depth = (clear_zstencil & 0xFFFF)
+                                           / (double)0xFFFF;
+            break;
+        case NV097_SET_SURFACE_FORMAT_ZETA_Z24S8:
+            /* A memory fill can't keep half of each pixel */
+            if (!write_depth || !write_stencil) {
+                return false;
+            }
+            bytes_per_pixel = 4;
+            zeta_fast_clear.value = clear_zstencil;
+            zeta_fast_clear.gl_mask = GL_DEPTH_BUFFER_BIT
+                                          | GL_STENCIL_BUFFER_BIT;
+            zeta_fast_clear.gl_depth = (clear_zstencil >> 8)
+                                           / (double)0xFFFFFF;
+            zeta_fast_clear.gl_stencil = clear_zstencil & 0xFF;
+            break;
+        default:
+            return false;
+        }
+        const ZetaSurfaceFormatInfo* zeta_surface_format_info =
+            &kelvin_zeta_surface_format_map[pg->surface_zeta.format];
+        set_fast_clear_layout(d, &zeta_fast_clear,
+                              &pg->surface_zeta, pg->dma_zeta,
+                              swizzled ?
+                                  zeta_surface_format_info->swizzled_texture_format :
+                                  zeta_surface_format_info->unswizzled_texture_format,
+                              w, h);
+        if (zeta_fast_clear.bytes_per_pixel != bytes_per_pixel) {
+            return false;
+        }
+    }
+
+    if (write_color) {
+        /* Masked channels have to stay */
+        if ((parameter & NV097_CLEAR_SURFACE_COLOR)
+                != NV097_CLEAR_SURFACE_COLOR) {
+            return false;
+        }
+        switch (pg->surface_color.format) {
+        case NV097_SET_SURFACE_FORMAT_COLOR_LE_X8R8G8B8_Z8R8G8B8:
+        case NV097_SET_SURFACE_FORMAT_COLOR_LE_A8R8G8B8:
+            break;
+        default:
+            return false;
+        }
+        uint32_t clear_color = pg->regs[NV_PGRAPH_COLORCLEARVALUE];
+        color_fast_clear.value = clear_color;
+        color_fast_clear.gl_mask = GL_COLOR_BUFFER_BIT;
+        color_fast_clear.gl_color[0] = ((clear_color >> 16) & 0xFF) / 255.0f;
+        color_fast_clear.gl_color[1] = ((clear_color >> 8) & 0xFF) / 255.0f;
+        color_fast_clear.gl_color[2] = (clear_color & 0xFF) / 255.0f;
+        color_fast_clear.gl_color[3] = ((clear_color >> 24) & 0xFF) / 255.0f;
+        const ColorSurfaceFormatInfo* color_surface_format_info =
+            &kelvin_color_surface_format_map[pg->surface_color.format];
+        set_fast_clear_layout(d, &color_fast_clear,
+                              &pg->surface_color, pg->dma_color,
+                              swizzled ?
+                                  color_surface_format_info->swizzled_texture_format :
+                                  color_surface_format_info->unswizzled_texture_format,
+                              w, h);
+        if (color_fast_clear.bytes_per_pixel != 4) {
+            return false;
+        }
+    }
+
+    if (write_zeta) {
+        record_fast_clear(d, &pg->zeta_fast_clear, &zeta_fast_clear);
+    }
+    if (write_color) {
+        record_fast_clear(d, &pg->color_fast_clear, &color_fast_clear);
+    }
+    return true;
+}
+
+#ifdef DEBUG_NV2A_GPU_FAST_CLEAR_STATS
+static void fast_clear_report_stats(PGRAPHState* pg)
+{
+    printf("nv2a: fast clears: %u recorded, %u on gpu, %u to memory\n",
+           pg->fast_clear_stats.recorded, pg->fast_clear_stats.gpu,
+           pg->fast_clear_stats.memory);
+    memset(&pg->fast_clear_stats, 0, sizeof(pg->fast_clear_stats));
+}
+#endif
+
+/* CPU writes to memory_block make the frames copied from it outdated.
+   If memory_block is NULL all frames are dropped. */
+static void invalidate_scanout_frames(PGRAPHState* pg,
+                                      const MemoryBlock* memory_block)
+{
+    unsigned int i;
+    for (i = 0; i < NV2A_GPU_SCANOUT_FRAMES; i++) {
+        ScanoutFrame* frame = &pg->scanout.frames[i];
+        if (frame->readback.fence) {
+            MemoryBlock readback_block = {
+                frame->readback.address,
+                frame->readback.pitch * frame->readback.height
+            };
+            if (!memory_block || overlaps(&readback_block, memory_block)) {
+                glDeleteSync(frame->readback.fence);
+                frame->readback.fence = NULL;
+            }
+        }
+        if (frame->valid) {
+            MemoryBlock frame_block = {
+                frame->address, frame->pitch * frame->height
+            };
+            if (!memory_block || overlaps(&frame_block, memory_block)) {
+                qemu_mutex_lock(&pg->scanout.lock);
+                frame->valid = false;
+                qemu_mutex_unlock(&pg->scanout.lock);
+            }
         }
+    }
+}
 
-        /* Framebuffer */
-        pg->framebuffer = bind_framebuffer(pg,
-                                           zeta_texture,
-                                           has_stencil,
-                                           color_texture);
-
-        pg->dirty.framebuffer = false;
+static void delete_scanout_frames(PGRAPHState* pg)
+{
+    unsigned int i;
+    invalidate_scanout_frames(pg, NULL);
+    for (i = 0; i < NV2A_GPU_SCANOUT_FRAMES; i++) {
+        ScanoutFrame* frame = &pg->scanout.frames[i];
+        if (frame->readback.gl_buffer) {
+            glDeleteBuffersARB(1, &frame->readback.gl_buffer);
+            frame->readback.gl_buffer = 0;
+        }
+        g_free(frame->data);
+        frame->data = NULL;
     }
+    glDeleteFramebuffersEXT(1, &pg->scanout.gl_framebuffer);
+    glDeleteRenderbuffersEXT(1, &pg->scanout.gl_renderbuffer);
+}
 
+/* Hands the scanout copies the GPU finished to the display */
+static void pgraph_publish_scanout_frames(PGRAPHState *pg)
+{
+    unsigned int i;
+    for (i = 0; i < NV2A_GPU_SCANOUT_FRAMES; i++) {
+        ScanoutFrame* frame = &pg->scanout.frames[i];
+        if (frame->readback.fence == NULL) {
+            continue;
+        }
+        GLenum status = glClientWaitSync(frame->readback.fence,
+                                         GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+        assert(status != GL_WAIT_FAILED);
+        if (status == GL_TIMEOUT_EXPIRED) {
+            continue;
+        }
+        glDeleteSync(frame->readback.fence);
+        frame->readback.fence = NULL;
+
+        glBindBufferARB(GL_PIXEL_PACK_BUFFER_ARB, frame->readback.gl_buffer);
+        const uint8_t* src = glMapBufferARB(GL_PIXEL_PACK_BUFFER_ARB,
+                                            GL_READ_ONLY_ARB);
+        assert(src);
+        size_t size = frame->readback.width * frame->readback.height * 4;
+
+        qemu_mutex_lock(&pg->scanout.lock);
+        frame->data = g_realloc(frame->data, size);
+        memcpy(frame->data, src, size);
+        frame->address = frame->readback.address;
+        frame->width = frame->readback.width;
+        frame->height = frame->readback.height;
+        frame->pitch = frame->readback.pitch;
+        frame->serial = ++pg->scanout.serial;
+        frame->valid = true;
+        pg->scanout.published++;
+        qemu_mutex_unlock(&pg->scanout.lock);
+
+        glUnmapBufferARB(GL_PIXEL_PACK_BUFFER_ARB);
+        glBindBufferARB(GL_PIXEL_PACK_BUFFER_ARB, 0);
+    }
 }
 
-static inline void pgraph_update_surfaces(NV2A_GPUState *d, bool upload, bool zeta, bool color)
+/* Starts copying the finished color surface off the GPU, so the display
+   doesn't have to wait until it's written back and read from memory.
+   Only linear 32 bit surfaces can be scanned out. */
+static void pgraph_capture_scanout(NV2A_GPUState *d)
 {
+    PGRAPHState *pg = &d->pgraph;
+    unsigned int i;
 
-    debugger_push_group("pgraph_update_surfaces(upload: %i, zeta: %i, color: %i)",upload,zeta,color);
-    memory_region_sync_dirty_bitmap(d->vram); //FIXME: Ideally done elsewhere for all resources
-    if (upload) {
-        d->pgraph.dirty.framebuffer = true; //FIXME: HACK: REMOVEME: some trouble to get the right fbo.. Probably caused by not downloading modified pixels before using them in other textures
-        bind_gl_framebuffer(d, zeta, color);
-    } else {
-        Framebuffer* framebuffer = d->pgraph.framebuffer;
-#ifndef ALWAYS_DOWNLOAD_PIXELS
-        if (framebuffer) {
-            start_framebuffer_to_pixels_download(framebuffer,
-                                                 zeta,
-                                                 color);
+    pgraph_publish_scanout_frames(pg);
+
+    if (pg->framebuffer == NULL) {
+        return;
+    }
+    Texture2D* texture = pg->framebuffer->key.color_texture;
+    if (texture == NULL) {
+        return;
+    }
+    const TextureFormatInfo* mapped_format =
+        &kelvin_texture_format_map[texture->key.format];
+    Pixels* pixels = texture->buffer[0];
+    if (!mapped_format->linear || (mapped_format->bytes_per_pixel != 4) ||
+        (mapped_format->gl_format != GL_BGRA) ||
+        (mapped_format->gl_type != GL_UNSIGNED_INT_8_8_8_8_REV) ||
+        (pixels == NULL)) {
+        return;
+    }
+
+    /* CPU writes after the draws win, VGA will show them */
+    sync_all_resources_memory_dirty(d, &pixels->key.memory_block);
+    if (pixels->dirty) {
+        return;
+    }
+
+    /* Reuse the slot of this surface, otherwise replace the oldest one */
+    ScanoutFrame* frame = NULL;
+    for (i = 0; i < NV2A_GPU_SCANOUT_FRAMES; i++) {
+        ScanoutFrame* slot = &pg->scanout.frames[i];
+        if ((slot->valid && (slot->address == texture->key.address)) ||
+            (slot->readback.fence &&
+             (slot->readback.address == texture->key.address))) {
+            frame = slot;
+            break;
         }
-        download_all_pixels_to_memory(d);
-#endif
     }
+    if (frame == NULL) {
+        frame = &pg->scanout.frames[pg->scanout.next];
+        pg->scanout.next = (pg->scanout.next + 1) % NV2A_GPU_SCANOUT_FRAMES;
+    }
+    if (frame->readback.fence) {
+        glDeleteSync(frame->readback.fence);
+        frame->readback.fence = NULL;
+    }
+
+    unsigned int width = texture->key.width;
+    unsigned int height = texture->key.height;
+
+    debugger_push_group("NV2A: capture scanout 0x%x", texture->key.address);
+
+    if ((pg->scanout.width != width) || (pg->scanout.height != height)) {
+        glBindRenderbufferEXT(GL_RENDERBUFFER_EXT, pg->scanout.gl_renderbuffer);
+        glRenderbufferStorageEXT(GL_RENDERBUFFER_EXT, GL_RGBA8, width, height);
+        glBindRenderbufferEXT(GL_RENDERBUFFER_EXT, 0);
+        glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, pg->scanout.gl_framebuffer);
+        glFramebufferRenderbufferEXT(GL_FRAMEBUFFER_EXT,
+                                     GL_COLOR_ATTACHMENT0_EXT,
+                                     GL_RENDERBUFFER_EXT,
+                                     pg->scanout.gl_renderbuffer);
+        pg->scanout.width = width;
+        pg->scanout.height = height;
+    }
+
+    /* The scissor test also applies to glBlitFramebuffer */
+    gl_state_flush(pg);
+    assert(!pg->gl_state.current.caps[GL_STATE_SCISSOR_TEST]);
+
+    /* Surfaces are stored bottom-up, the display wants the top row first */
+    glBindFramebufferEXT(GL_READ_FRAMEBUFFER_EXT, pg->blit_framebuffer[0]);
+    glFramebufferTexture2DEXT(GL_READ_FRAMEBUFFER_EXT,
+                              GL_COLOR_ATTACHMENT0_EXT,
+                              GL_TEXTURE_2D, texture->gl_texture, 0);
+    glBindFramebufferEXT(GL_DRAW_FRAMEBUFFER_EXT, pg->scanout.gl_framebuffer);
+    glBlitFramebufferEXT(0, 0, width, height,
+                         0, height, width, 0,
+                         GL_COLOR_BUFFER_BIT, GL_NEAREST);
+
+    size_t size = width * height * 4;
+    if (frame->readback.gl_buffer == 0) {
+        glGenBuffersARB(1, &frame->readback.gl_buffer);
+    }
+    glBindBufferARB(GL_PIXEL_PACK_BUFFER_ARB, frame->readback.gl_buffer);
+    if (frame->readback.gl_buffer_size != size) {
+        glBufferDataARB(GL_PIXEL_PACK_BUFFER_ARB, size, NULL,
+                        GL_STREAM_READ_ARB);
+        frame->readback.gl_buffer_size = size;
+    }
+    glBindFramebufferEXT(GL_READ_FRAMEBUFFER_EXT, pg->scanout.gl_framebuffer);
+    glReadPixels(0, 0, width, height, GL_BGRA, GL_UNSIGNED_INT_8_8_8_8_REV, 0);
+    glBindBufferARB(GL_PIXEL_PACK_BUFFER_ARB, 0);
+    frame->readback.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    frame->readback.address = texture->key.address;
+    frame->readback.width = width;
+    frame->readback.height = height;
+    frame->readback.pitch = texture->key.pitch;
+
+    glBindFramebufferEXT(GL_FRAMEBUFFER_EXT,
+                         pg->framebuffer->gl_framebuffer);
+    assert(glGetError() == GL_NO_ERROR);
+
     debugger_pop_group();
-    return;
+}
+
+#ifdef DEBUG_NV2A_GPU_SCANOUT_STATS
+static void scanout_report_stats(PGRAPHState* pg)
+{
+    qemu_mutex_lock(&pg->scanout.lock);
+    printf("nv2a: scanout: %u frames from the gpu, "
+           "%u refreshes from the gpu, %u from memory\n",
+           pg->scanout.published, pg->scanout.gpu_refreshes,
+           pg->scanout.memory_refreshes);
+    pg->scanout.published = 0;
+    pg->scanout.gpu_refreshes = 0;
+    pg->scanout.memory_refreshes = 0;
+    qemu_mutex_unlock(&pg->scanout.lock);
+}
+#endif
 
+static void subpage_dirty_init(PGRAPHState* pg)
+{
+    QemuOpts *machine_opts = qemu_opts_find(qemu_find_opts("machine"), 0);
+    if (!machine_opts) {
+        return;
+    }
+    pg->subpage_dirty.enabled =
+        qemu_opt_get_bool(machine_opts, "nv2a_subpage_dirty", false);
 }
 
-static void pgraph_init(PGRAPHState *pg)
+#ifdef DEBUG_NV2A_GPU_SUBPAGE_DIRTY_STATS
+static void subpage_dirty_report_stats(PGRAPHState* pg)
 {
-    int i;
+    printf("nv2a: sub-page dirty tracking: %u uploads avoided\n",
+           pg->subpage_dirty.uploads_avoided);
+    pg->subpage_dirty.uploads_avoided = 0;
+}
+#endif
 
+static void pgraph_init(PGRAPHState *pg)
+{
     qemu_mutex_init(&pg->lock);
     qemu_cond_init(&pg->interrupt_cond);
     qemu_cond_init(&pg->fifo_access_cond);
     qemu_sem_init(&pg->read_3d, 0);
+    qemu_mutex_init(&pg->scanout.lock);
+    qemu_mutex_init(&pg->profile.lock);
+    pg->profile.stage = PROFILE_STAGE_OTHER;
+    pg->profile.stage_start = cpu_get_real_ticks();
+    pg->profile.frame_start = pg->profile.stage_start;
+    pg->profile.frame_start_ns = get_clock();
+    texture_decode_init(pg);
+    subpage_dirty_init(pg);
 
     /* fire up opengl */
 
@@ -2509,6 +4892,9 @@ static void pgraph_init(PGRAPHState *pg)
     assert(glo_check_extension((const GLubyte *)
                              "GL_EXT_framebuffer_object"));
 
+    assert(glo_check_extension((const GLubyte *)
+                             "GL_EXT_framebuffer_blit"));
+
     assert(glo_check_extension((const GLubyte *)
                              "GL_ARB_texture_rectangle"));
 
@@ -2518,6 +4904,9 @@ static void pgraph_init(PGRAPHState *pg)
     assert(glo_check_extension((const GLubyte *)
                              "GL_EXT_packed_depth_stencil"));
 
+    assert(glo_check_extension((const GLubyte *)
+                             "GL_ARB_sync"));
+
 #ifdef DEBUG_NV2A_GPU_SHADER_FEEDBACK
     assert(glo_check_extension((const GLubyte *)
                              "GL_EXT_transform_feedback"));
@@ -2539,24 +4928,45 @@ static void pgraph_init(PGRAPHState *pg)
 
     //glPolygonMode( GL_FRONT_AND_BACK, GL_LINE );
 
-    pg->dirty.shaders = true;
+    gl_state_init(pg);
 
-    /* generate textures */
-    debugger_push_group("NV2A: generate textures");
-    for (i = 0; i < NV2A_GPU_MAX_TEXTURES; i++) {
-        KelvinTexture *texture = &pg->textures[i];
-        glGenTextures(1, &texture->gl_texture);
-        glGenTextures(1, &texture->gl_texture_rect);
-    }
-    debugger_pop_group();
+    pg->dirty.shaders = true;
 
     //FIXME: Move to cache init routine
-    pg->cache.shader = g_hash_table_new(shader_hash, shader_equal);
+    pg->cache.shader = g_hash_table_new(shader_key_hash, shader_key_equal);
+    pg->cache.shader_binding = g_hash_table_new_full(g_direct_hash,
+                                                     g_direct_equal,
+                                                     NULL, g_free);
+    pg->cache.vertexshader = g_hash_table_new(vertexshader_hash,
+                                              vertexshader_equal);
+    pg->cache.fragmentshader = g_hash_table_new(fragmentshader_hash,
+                                                fragmentshader_equal);
+    pg->cache.shaderprogram = g_hash_table_new(shaderprogram_hash,
+                                               shaderprogram_equal);
     pg->cache.pixels = g_hash_table_new(pixels_hash, pixels_equal);
     pg->cache.texture_2d = g_hash_table_new(texture_2d_hash, texture_2d_equal);
+    QLIST_INIT(&pg->draw_dirty_pixels);
+    pg->cache.texture = g_hash_table_new(texture_hash, texture_equal);
+    QTAILQ_INIT(&pg->texture_cache.lru);
+    pg->texture_cache.budget = NV2A_GPU_TEXTURE_CACHE_BUDGET;
+    pg->cache.vertex_buffer = g_hash_table_new(vertex_buffer_hash,
+                                               vertex_buffer_equal);
+    QTAILQ_INIT(&pg->vertex_cache.lru);
+    pg->vertex_cache.budget = NV2A_GPU_VERTEX_CACHE_BUDGET;
+    pg->cache.index_buffer = g_hash_table_new(index_buffer_hash,
+                                              index_buffer_equal);
+    QTAILQ_INIT(&pg->index_cache.lru);
+    vertex_ring_init(pg);
     pg->cache.framebuffer = g_hash_table_new(framebuffer_hash, framebuffer_equal);
+    glGenFramebuffersEXT(2, pg->blit_framebuffer);
+    glGenFramebuffersEXT(1, &pg->scanout.gl_framebuffer);
+    glGenRenderbuffersEXT(1, &pg->scanout.gl_renderbuffer);
     //pgraph_cache_init(pg); ?
 
+    texture_gpu_decode_init(pg);
+    shader_disk_cache_init(pg);
+    shader_compile_init(pg);
+
     assert(glGetError() == GL_NO_ERROR);
 
     debugger_pop_group();
@@ -2566,12 +4976,13 @@ static void pgraph_init(PGRAPHState *pg)
 
 static void pgraph_destroy(PGRAPHState *pg)
 {
-    int i;
-
     qemu_mutex_destroy(&pg->lock);
     qemu_cond_destroy(&pg->interrupt_cond);
     qemu_cond_destroy(&pg->fifo_access_cond);
     qemu_sem_destroy(&pg->read_3d);
+    qemu_mutex_destroy(&pg->scanout.lock);
+    qemu_mutex_destroy(&pg->profile.lock);
+    texture_decode_destroy(pg);
 
     glo_set_current(pg->gl_context);
 
@@ -2581,21 +4992,150 @@ static void pgraph_destroy(PGRAPHState *pg)
 #if 0
     glDeleteFramebuffersEXT(1, &pg->gl_framebuffer);
 #endif
+    glDeleteFramebuffersEXT(2, pg->blit_framebuffer);
+    delete_scanout_frames(pg);
 
-//FIXME: Go through list of textures for cleanup
-    for (i = 0; i < NV2A_GPU_MAX_TEXTURES; i++) {
-        KelvinTexture *texture = &pg->textures[i];
-        glDeleteTextures(1, &texture->gl_texture);
-        glDeleteTextures(1, &texture->gl_texture_rect);
-    }
+    delete_all_textures(container_of(pg, NV2A_GPUState, pgraph));
+    g_hash_table_destroy(pg->cache.texture);
+    texture_gpu_decode_destroy(pg);
+
+    delete_all_vertex_buffers(pg);
+    g_hash_table_destroy(pg->cache.vertex_buffer);
+    delete_all_index_buffers(pg);
+    g_hash_table_destroy(pg->cache.index_buffer);
+    vertex_ring_destroy(pg);
+
+    shader_compile_destroy(pg);
+    g_hash_table_destroy(pg->cache.shader_binding);
+    shader_disk_cache_destroy(pg);
 
     debugger_pop_group();
 
     glo_set_current(NULL);
 
+    glo_context_destroy(pg->shader_compile.gl_context);
     glo_context_destroy(pg->gl_context);
 }
 
+/* Copies the blit rectangle between two surface textures without a trip
+   through guest memory. Returns false if either end isn't on the GPU. */
+static bool pgraph_image_blit_on_gpu(NV2A_GPUState *d,
+                                     const MemoryBlock* source_block,
+                                     unsigned int source_pitch,
+                                     const MemoryBlock* dest_block,
+                                     unsigned int dest_pitch,
+                                     unsigned int width, unsigned int height,
+                                     unsigned int bytes_per_pixel)
+{
+    PGRAPHState *pg = &d->pgraph;
+
+    /* GL doesn't define overlapping blits within one image */
+    if (overlaps(source_block, dest_block)) {
+        return false;
+    }
+
+    unsigned int source_x, source_y;
+    Texture2D* source = find_gpu_surface(d, source_block, source_pitch,
+                                         bytes_per_pixel, width, height,
+                                         &source_x, &source_y);
+    if (source == NULL) {
+        return false;
+    }
+    unsigned int dest_x, dest_y;
+    Texture2D* dest = find_gpu_surface(d, dest_block, dest_pitch,
+                                       bytes_per_pixel, width, height,
+                                       &dest_x, &dest_y);
+    if ((dest == NULL) || (dest->key.format != source->key.format)) {
+        return false;
+    }
+
+    debugger_push_group("NV2A: image blit %d -> %d",
+                        source->gl_texture, dest->gl_texture);
+
+    /* The scissor test also applies to glBlitFramebuffer */
+    gl_state_flush(pg);
+    assert(!pg->gl_state.current.caps[GL_STATE_SCISSOR_TEST]);
+
+    glBindFramebufferEXT(GL_READ_FRAMEBUFFER_EXT, pg->blit_framebuffer[0]);
+    glFramebufferTexture2DEXT(GL_READ_FRAMEBUFFER_EXT,
+                              GL_COLOR_ATTACHMENT0_EXT,
+                              GL_TEXTURE_2D, source->gl_texture, 0);
+    glBindFramebufferEXT(GL_DRAW_FRAMEBUFFER_EXT, pg->blit_framebuffer[1]);
+    glFramebufferTexture2DEXT(GL_DRAW_FRAMEBUFFER_EXT,
+                              GL_COLOR_ATTACHMENT0_EXT,
+                              GL_TEXTURE_2D, dest->gl_texture, 0);
+
+    /* Surfaces are stored bottom-up */
+    GLint source_y0 = source->key.height - source_y - height;
+    GLint dest_y0 = dest->key.height - dest_y - height;
+    glBlitFramebufferEXT(source_x, source_y0,
+                         source_x + width, source_y0 + height,
+                         dest_x, dest_y0,
+                         dest_x + width, dest_y0 + height,
+                         GL_COLOR_BUFFER_BIT, GL_NEAREST);
+
+    /* Like after a draw, memory gets the result once someone needs it */
+    glBindFramebufferEXT(GL_READ_FRAMEBUFFER_EXT, pg->blit_framebuffer[1]);
+    start_pixels_readback(d, dest->buffer[0],
+                          &kelvin_texture_format_map[dest->key.format],
+                          DIRTY_MEMORY_NV2A_GPU_COLOR);
+
+    glBindFramebufferEXT(GL_FRAMEBUFFER_EXT,
+                         pg->framebuffer ? pg->framebuffer->gl_framebuffer : 0);
+    assert(glGetError() == GL_NO_ERROR);
+
+    debugger_pop_group();
+    return true;
+}
+
+#ifdef DEBUG_NV2A_GPU_IMAGE_BLIT_STATS
+static void image_blit_report_stats(PGRAPHState* pg)
+{
+    printf("nv2a: image blits: %u on gpu, %u on cpu\n",
+           pg->image_blit_stats.gpu, pg->image_blit_stats.cpu);
+    memset(&pg->image_blit_stats, 0, sizeof(pg->image_blit_stats));
+}
+#endif
+
+/* Switches the inline elements of the current draw to 32 bit */
+static void pgraph_widen_inline_elements(PGRAPHState *pg)
+{
+    unsigned int i;
+    if (pg->inline_elements_wide) {
+        return;
+    }
+    for (i = 0; i < pg->inline_elements_length; i++) {
+        pg->inline_elements[i] = pg->inline_elements16[i];
+    }
+    pg->inline_elements_wide = true;
+}
+
+/* Each ARRAY_ELEMENT16 parameter holds two indices, the first one in the
+   low half */
+static void pgraph_add_inline_elements16(PGRAPHState *pg,
+                                         const uint32_t *parameters,
+                                         unsigned int count)
+{
+    unsigned int i;
+    assert(pg->inline_elements_length + count * 2
+               <= NV2A_GPU_MAX_BATCH_LENGTH);
+    if (pg->inline_elements_wide) {
+        for (i = 0; i < count; i++) {
+            pg->inline_elements[
+                pg->inline_elements_length++] = parameters[i] & 0xFFFF;
+            pg->inline_elements[
+                pg->inline_elements_length++] = parameters[i] >> 16;
+        }
+        return;
+    }
+    uint16_t *out = &pg->inline_elements16[pg->inline_elements_length];
+    for (i = 0; i < count; i++) {
+        out[i * 2] = parameters[i] & 0xFFFF;
+        out[i * 2 + 1] = parameters[i] >> 16;
+    }
+    pg->inline_elements_length += count * 2;
+}
+
 static void pgraph_method(NV2A_GPUState *d,
                           unsigned int subchannel,
                           unsigned int method,
@@ -2609,6 +5149,7 @@ static void pgraph_method(NV2A_GPUState *d,
     VertexAttribute *vertex_attribute;
     VertexShader *vertexshader;
     VertexShaderConstant *constant;
+    ProfileStage outer_stage;
 
     PGRAPHState *pg = &d->pgraph;
 
@@ -2638,6 +5179,16 @@ static void pgraph_method(NV2A_GPUState *d,
     }
 
     uint32_t class_method = (object->graphics_class << 16) | method;
+
+    /* The state of a texture stage comes in a block, start decoding the
+     * new textures once something else comes along */
+    if (pg->texture_decode.prefetch_stages
+        && (class_method < NV097_SET_TEXTURE_OFFSET
+            || class_method >= NV097_SET_TEXTURE_OFFSET
+                                   + NV2A_GPU_MAX_TEXTURES * 64)) {
+        pgraph_prefetch_textures(d);
+    }
+
     switch (class_method) {
     case NV062_SET_CONTEXT_DMA_IMAGE_SOURCE:
         context_surfaces_2d->dma_image_source = parameter;
@@ -2677,8 +5228,6 @@ static void pgraph_method(NV2A_GPUState *d,
         image_blit->width = parameter & 0xFFFF;
         image_blit->height = parameter >> 16;
 
-pgraph_update_surfaces(d,false,true,true);
-
         /* I guess this kicks it off? */
         if (image_blit->operation == NV09F_SET_OPERATION_SRCCOPY) {
             debugger_push_group("NV09F_SET_OPERATION_SRCCOPY");
@@ -2703,17 +5252,62 @@ pgraph_update_surfaces(d,false,true,true);
                 assert(false);
             }
 
-            hwaddr source_dma_len, dest_dma_len;
-            uint8_t *source, *dest;
+            DMAObject source_dma = nv_dma_load(d,
+                context_surfaces->dma_image_source);
+            DMAObject dest_dma = nv_dma_load(d,
+                context_surfaces->dma_image_dest);
+            assert(context_surfaces->source_offset < source_dma.limit);
+            assert(context_surfaces->dest_offset < dest_dma.limit);
 
-            source = nv_dma_load_and_map(d, context_surfaces->dma_image_source,
-                                &source_dma_len);
-            assert(context_surfaces->source_offset < source_dma_len);
-            source += context_surfaces->source_offset;
+            if ((image_blit->width == 0) || (image_blit->height == 0)) {
+                debugger_pop_group();
+                break;
+            }
+
+            /* Bytes touched by the blit, rows are pitch apart */
+            MemoryBlock source_block = {
+                source_dma.address + context_surfaces->source_offset
+                    + image_blit->in_y * context_surfaces->source_pitch
+                    + image_blit->in_x * bytes_per_pixel,
+                (image_blit->height - 1) * context_surfaces->source_pitch
+                    + image_blit->width * bytes_per_pixel
+            };
+            MemoryBlock dest_block = {
+                dest_dma.address + context_surfaces->dest_offset
+                    + image_blit->out_y * context_surfaces->dest_pitch
+                    + image_blit->out_x * bytes_per_pixel,
+                (image_blit->height - 1) * context_surfaces->dest_pitch
+                    + image_blit->width * bytes_per_pixel
+            };
+
+            /* Cleared surfaces might not be cleared anywhere yet */
+            flush_fast_clears_to_memory(d, &source_block);
+            flush_fast_clears_to_memory(d, &dest_block);
+
+            if (pgraph_image_blit_on_gpu(d,
+                                         &source_block,
+                                         context_surfaces->source_pitch,
+                                         &dest_block,
+                                         context_surfaces->dest_pitch,
+                                         image_blit->width,
+                                         image_blit->height,
+                                         bytes_per_pixel)) {
+                pg->image_blit_stats.gpu++;
+                debugger_pop_group();
+                break;
+            }
+            pg->image_blit_stats.cpu++;
+
+            /* The source might still be on the GPU or on its way back, and
+               pending readbacks of dest would overwrite our copy later */
+            pgraph_update_surfaces(d, false, true, true);
+            flush_pixels_to_memory(d, &source_block);
+            flush_pixels_to_memory(d, &dest_block);
 
-            dest = nv_dma_load_and_map(d, context_surfaces->dma_image_dest,
-                              &dest_dma_len);
-            assert(context_surfaces->dest_offset < dest_dma_len);
+            hwaddr source_dma_len, dest_dma_len;
+            uint8_t *source = nv_dma_map(d, &source_dma, &source_dma_len);
+            uint8_t *dest = nv_dma_map(d, &dest_dma, &dest_dma_len);
+            source += context_surfaces->source_offset;
             dest += context_surfaces->dest_offset;
 
             int y;
@@ -2729,8 +5323,10 @@ pgraph_update_surfaces(d,false,true,true);
                 memmove(dest_row, source_row,
                         image_blit->width * bytes_per_pixel);
             }
-//FIXME: Also attempt to copy the same stuff on the GPU [and mark partial/unsuitable resources dirty] -OR- at least mark the memory dirty
-//       First (bad?) idea: copy_memory_resource_to_memory_resources()? Better: copy_pixels_to_pixels?
+
+            /* Our writes don't show up in the dirty log by themselves, this
+               lets the scanout and all cached copies of dest know */
+            set_memory_dirty(d, &dest_block);
             debugger_pop_group();
         } else {
             assert(false);
@@ -2762,7 +5358,9 @@ pgraph_update_surfaces(d,false,true,true);
             qemu_mutex_lock(&pg->lock);
             qemu_mutex_unlock_iothread();
 
-            while (pg->pending_interrupts & NV_PGRAPH_INTR_NOTIFY) {
+            /* During a replay the guest's acknowledgement comes later */
+            while ((pg->pending_interrupts & NV_PGRAPH_INTR_NOTIFY)
+                   && !d->trace.replay) {
                 qemu_cond_wait(&pg->interrupt_cond, &pg->lock);
             }
         }
@@ -2771,6 +5369,7 @@ pgraph_update_surfaces(d,false,true,true);
     case NV097_WAIT_FOR_IDLE:
         glFinish();
         pgraph_update_surfaces(d, false, true, true);
+        download_all_pixels_to_memory(d, true);
         break;
 
     case NV097_FLIP_INCREMENT_WRITE:
@@ -2780,6 +5379,7 @@ pgraph_update_surfaces(d,false,true,true);
 
     case NV097_FLIP_STALL:
         pgraph_update_surfaces(d, false, true, true);
+        pgraph_capture_scanout(d);
 
         /* Tell the debugger that the frame was completed */
         //FIXME: Figure out if this is a good position, we really have to figure out what a frame is:
@@ -2788,10 +5388,69 @@ pgraph_update_surfaces(d,false,true,true);
         //       - When D3D completes a frame?
         //       - ...
         debugger_finish_frame();
+#ifdef DEBUG_NV2A_GPU_TEXTURE_CACHE_STATS
+        texture_cache_report_stats(pg);
+#endif
+#ifdef DEBUG_NV2A_GPU_TEXTURE_DECODE_STATS
+        texture_decode_report_stats(pg);
+        texture_gpu_decode_report_stats(pg);
+#endif
+#ifdef DEBUG_NV2A_GPU_RAMIN_CACHE_STATS
+        ramin_cache_report_stats(d);
+#endif
+#ifdef DEBUG_NV2A_GPU_VERTEX_CACHE_STATS
+        vertex_cache_report_stats(pg);
+#endif
+#ifdef DEBUG_NV2A_GPU_INDEX_CACHE_STATS
+        index_cache_report_stats(pg);
+#endif
+#ifdef DEBUG_NV2A_GPU_SHADER_CACHE_STATS
+        shader_disk_cache_report_stats(pg);
+#endif
+#ifdef DEBUG_NV2A_GPU_SHADER_COMPILE_STATS
+        shader_compile_report_stats(pg);
+#endif
+#ifdef DEBUG_NV2A_GPU_DRAW_TIMING
+        draw_timing_report(pg);
+#endif
+#ifdef DEBUG_NV2A_GPU_GL_STATE_STATS
+        gl_state_report_stats(pg);
+#endif
+#ifdef DEBUG_NV2A_GPU_IMAGE_BLIT_STATS
+        image_blit_report_stats(pg);
+#endif
+#ifdef DEBUG_NV2A_GPU_FAST_CLEAR_STATS
+        fast_clear_report_stats(pg);
+#endif
+#ifdef DEBUG_NV2A_GPU_SCANOUT_STATS
+        scanout_report_stats(pg);
+#endif
+#ifdef DEBUG_NV2A_GPU_SUBPAGE_DIRTY_STATS
+        subpage_dirty_report_stats(pg);
+#endif
+        profile_finish_frame(pg);
+        trace_finish_frame(d);
 #if 1 //HACK: Set to 0 for AntiAlias or SetBackBuffer code
-        qemu_mutex_unlock(&pg->lock);
-        qemu_sem_wait(&pg->read_3d);
-        qemu_mutex_lock(&pg->lock);
+        /* Keep writing back readbacks while we wait, the frame has to be in
+           memory by the time it's scanned out. Each one blocks on its fence,
+           once they are all in only the vblank is left to wait for. Replays
+           don't wait for vblank. */
+        outer_stage = profile_enter(pg, PROFILE_STAGE_IDLE);
+        while (!d->trace.replay) {
+            Pixels *pixels = QLIST_FIRST(&pg->draw_dirty_pixels);
+            if (pixels == NULL) {
+                qemu_mutex_unlock(&pg->lock);
+                qemu_sem_wait(&pg->read_3d);
+                qemu_mutex_lock(&pg->lock);
+                break;
+            }
+            download_pixels_to_memory(d, pixels, true);
+            pgraph_publish_scanout_frames(pg);
+            if (qemu_sem_timedwait(&pg->read_3d, 0) == 0) {
+                break;
+            }
+        }
+        profile_leave(pg, outer_stage);
 #endif
         break;
     
@@ -2999,7 +5658,6 @@ printf("Set zeta dma object at 0x%x\n",parameter);
             NV097_SET_COMPOSITE_MATRIX + 0x3c:
         slot = (class_method - NV097_SET_COMPOSITE_MATRIX) / 4;
         pg->composite_matrix[slot] = *(float*)&parameter;
-        pg->FIXME_REMOVEME_comp_src = 2;
         break;
 
     CASE_4(NV097_SET_TEXTURE_MATRIX_ENABLE, 4):
@@ -3035,7 +5693,7 @@ printf("Set zeta dma object at 0x%x\n",parameter);
 
         //FIXME: Why is this happening?! Is it documented anywhere?
         pg->constants[59].data[slot] = parameter;
-        pg->constants[59].dirty = true;
+        set_bit(59, pg->constants_dirty);
         break;
 
     case NV097_SET_COMBINER_FACTOR0 ...
@@ -3072,7 +5730,7 @@ printf("Set zeta dma object at 0x%x\n",parameter);
         slot = (class_method - NV097_SET_VIEWPORT_SCALE) / 4;
         //FIXME: Why is this happening? Same as NV097_SET_VIEWPORT_OFFSET!
         pg->constants[58].data[slot] = parameter;
-        pg->constants[58].dirty = true;
+        set_bit(58, pg->constants_dirty);
         break;
 
     CASE_RANGE(NV097_SET_TRANSFORM_PROGRAM,32) {
@@ -3089,14 +5747,9 @@ printf("Set zeta dma object at 0x%x\n",parameter);
         //printf("Setting c[%i].%i (c%i) = %f\n",pg->constant_load_slot/4,pg->constant_load_slot%4,pg->constant_load_slot/4-96,*(float*)&parameter);
         assert((pg->constant_load_slot/4) < NV2A_GPU_VERTEXSHADER_CONSTANTS);
         constant = &pg->constants[pg->constant_load_slot/4];
-        if ((pg->constant_load_slot/4) == 58) {
-            printf("SET_TRANSFORM_CONSTANT viewport_scale\n");
-        }
         constant->data[pg->constant_load_slot%4] = parameter;
+        set_bit(pg->constant_load_slot/4, pg->constants_dirty);
         pg->constant_load_slot++;
-        constant->dirty = true;
-
-        pg->FIXME_REMOVEME_comp_src = 1;
         break;
     }
     CASE_RANGE(NV097_SET_VERTEX3F,3) {
@@ -3275,15 +5928,6 @@ printf("Set zeta dma object at 0x%x\n",parameter);
             break;
         }
 
-        if (vertex_attribute->needs_conversion) {
-            vertex_attribute->converted_elements = 0;
-        } else {
-            if (vertex_attribute->converted_buffer) {
-                free(vertex_attribute->converted_buffer);
-                vertex_attribute->converted_buffer = NULL;
-            }
-        }
-
         break;
     }
     CASE_RANGE(NV097_SET_VERTEX_DATA_ARRAY_OFFSET,16) {
@@ -3293,8 +5937,6 @@ printf("Set zeta dma object at 0x%x\n",parameter);
         pg->vertex_attributes[slot].offset =
             parameter & 0x7fffffff;
 
-        pg->vertex_attributes[slot].converted_elements = 0;
-
         break;
     }
     case NV097_SET_BEGIN_END: {
@@ -3322,6 +5964,10 @@ printf("Set zeta dma object at 0x%x\n",parameter);
                 debugger_push_group(buffer);
             }
 
+#ifdef DEBUG_NV2A_GPU_DRAW_TIMING
+            int64_t setup_start = get_clock();
+#endif
+
             /* Upload the surface to the GPU */
             pgraph_update_surfaces(d, true, writeZeta, writeColor);
             //FIXME: Check if pg->framebuffer == NULL and don't do anything if that's the case!
@@ -3341,7 +5987,7 @@ printf("Set zeta dma object at 0x%x\n",parameter);
             unsigned int h;
             get_surface_dimensions(pg, &w, &h);
 
-            glViewport(0, 0, w, h);
+            gl_state_viewport(pg, 0, 0, w, h);
             static unsigned int draw_call = 0;
             draw_call++;
             float zclip_max = *(float*)&pg->regs[NV_PGRAPH_ZCLIPMAX];
@@ -3362,9 +6008,19 @@ printf("Set zeta dma object at 0x%x\n",parameter);
 
             pgraph_update_state(pg);
 
+#ifdef DEBUG_NV2A_GPU_DRAW_TIMING
+            int64_t bind_shaders_start = get_clock();
+#endif
+            outer_stage = profile_enter(pg, PROFILE_STAGE_SHADER_BIND);
             pgraph_bind_shaders(pg);
+            profile_leave(pg, outer_stage);
+#ifdef DEBUG_NV2A_GPU_DRAW_TIMING
+            pg->draw_timing.bind_shaders_ns += get_clock() - bind_shaders_start;
+#endif
 
+            outer_stage = profile_enter(pg, PROFILE_STAGE_TEXTURE_BIND);
             pgraph_bind_textures(d);
+            profile_leave(pg, outer_stage);
 
 
             pg->gl_primitive_mode = kelvin_primitive_map[parameter];
@@ -3377,15 +6033,27 @@ printf("Set zeta dma object at 0x%x\n",parameter);
 #endif
 
             pg->inline_elements_length = 0;
+            pg->inline_elements_wide = false;
             pg->inline_array_length = 0;
             pg->inline_buffer_length = 0;
 
+#ifdef DEBUG_NV2A_GPU_DRAW_TIMING
+            pg->draw_timing.setup_ns += get_clock() - setup_start;
+            pg->draw_timing.draws++;
+#endif
+
         } else {
 
-            if (pg->inline_buffer_length) {
+            if (pg->shader_compile.skip_draw) {
+                /* The program is still being compiled */
+                debugger_message("DRAW: Dropped, no program yet");
+            } else if (pg->inline_buffer_length) {
                 assert(!pg->inline_array_length);
                 assert(!pg->inline_elements_length);
 
+                /* FIXME: Up to 16 MB, too large for the vertex ring */
+                glBindBuffer(GL_ARRAY_BUFFER, 0);
+
                 for(i = 0; i < 16; i++) {
                     glVertexAttribPointer(i, 4, GL_FLOAT, GL_FALSE, sizeof(pg->inline_buffer[0]), pg->inline_buffer[0].v[i]);
                     glEnableVertexAttribArray(i);
@@ -3394,18 +6062,19 @@ printf("Set zeta dma object at 0x%x\n",parameter);
 //                assert(0); //FIXME: This code path needs a major rewrite..
                 debugger_message("BAD!");
                 debugger_message("DRAW: Inline Buffer");
+                outer_stage = profile_enter(pg, PROFILE_STAGE_DRAW);
+                gl_state_flush(pg);
                 glDrawArrays(pg->gl_primitive_mode,
                              0, pg->inline_buffer_length);
+                profile_leave(pg, outer_stage);
+                pg->frame_stats.draws++;
             } else if (pg->inline_array_length) {
                 assert(!pg->inline_buffer_length);
                 assert(!pg->inline_elements_length);
-                unsigned int vertex_size =
-                    pgraph_bind_inline_array(d);
+                outer_stage = profile_enter(pg, PROFILE_STAGE_VERTEX_BIND);
                 unsigned int index_count =
-                    pg->inline_array_length*4 / vertex_size;
-                debugger_message("%d bytes of inline data, vertex is %d bytes",pg->inline_array_length*4,vertex_size);
-                              
-                pgraph_bind_converted_vertex_attributes(d, true, index_count);
+                    pgraph_bind_inline_array(d);
+                profile_leave(pg, outer_stage);
                 debugger_message("DRAW: Inline Array");
       
 /*
@@ -3415,22 +6084,43 @@ printf("Set zeta dma object at 0x%x\n",parameter);
                     glVertexAttribPointer(9,2,GL_FLOAT,(4*2)*2,p+4*2);
                 }
 */
+                outer_stage = profile_enter(pg, PROFILE_STAGE_DRAW);
+                gl_state_flush(pg);
                 glDrawArrays(pg->gl_primitive_mode,
                              0, index_count);
+                profile_leave(pg, outer_stage);
+                pg->frame_stats.draws++;
             } else if (pg->inline_elements_length) {
                 assert(!pg->inline_array_length);
                 assert(!pg->inline_buffer_length);
 
-                uint32_t max_element = 0;
-                uint32_t min_element = (uint32_t)-1;
-                for (i=0; i<pg->inline_elements_length; i++) {
-                    max_element = MAX(pg->inline_elements[i], max_element);
-                    min_element = MIN(pg->inline_elements[i], min_element);
+                uint32_t max_element;
+                uint32_t min_element;
+                const void* indices;
+                GLenum index_type;
+#ifdef DEBUG_NV2A_GPU_EXPORT
+                pgraph_widen_inline_elements(pg);
+#endif
+                if (pg->inline_elements_wide) {
+                    index_range_u32(pg->inline_elements,
+                                    pg->inline_elements_length,
+                                    &min_element, &max_element);
+                    indices = pg->inline_elements;
+                    index_type = GL_UNSIGNED_INT;
+                } else {
+                    index_range_u16(pg->inline_elements16,
+                                    pg->inline_elements_length,
+                                    &min_element, &max_element);
+                    indices = pg->inline_elements16;
+                    index_type = GL_UNSIGNED_SHORT;
                 }
 
-                pgraph_bind_vertex_attributes(d);
-                pgraph_bind_converted_vertex_attributes(d, false,
-                                                        max_element + 1);
+                outer_stage = profile_enter(pg, PROFILE_STAGE_VERTEX_BIND);
+                pgraph_bind_vertex_attributes(d, max_element + 1);
+                size_t index_offset = bind_index_buffer(pg, indices,
+                                          pg->inline_elements_length,
+                                          index_type);
+                profile_leave(pg, outer_stage);
 
 #ifdef DEBUG_NV2A_GPU_EXPORT
                 GLint prog;
@@ -3443,11 +6133,16 @@ printf("Set zeta dma object at 0x%x\n",parameter);
 #endif
 
                 debugger_message("DRAW: Inline Elements");
+                outer_stage = profile_enter(pg, PROFILE_STAGE_DRAW);
+                gl_state_flush(pg);
                 glDrawRangeElements(pg->gl_primitive_mode,
                                     min_element, max_element,
                                     pg->inline_elements_length,
-                                    GL_UNSIGNED_INT,
-                                    pg->inline_elements);
+                                    index_type,
+                                    (const GLvoid*)index_offset);
+                glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+                profile_leave(pg, outer_stage);
+                pg->frame_stats.draws++;
             } else {
                 static unknown_draw = 0;
                 debugger_message("DRAW: Unknown method %d?!",unknown_draw);
@@ -3470,7 +6165,7 @@ printf("Set zeta dma object at 0x%x\n",parameter);
                                    writeColor);
 
 #ifdef ALWAYS_DOWNLOAD_PIXELS
-            start_framebuffer_to_pixels_download(pg->framebuffer);
+            start_framebuffer_to_pixels_download(d, pg->framebuffer);
 #endif
 
             assert(glGetError() == GL_NO_ERROR);
@@ -3492,6 +6187,7 @@ printf("Set zeta dma object at 0x%x\n",parameter);
         slot = (class_method - NV097_SET_TEXTURE_OFFSET) / 64;
         pg->textures[slot].offset = parameter;
         pg->textures[slot].dirty = true;
+        pg->texture_decode.prefetch_stages |= 1 << slot;
         break;
     CASE_4(NV097_SET_TEXTURE_FORMAT, 64):
         slot = (class_method - NV097_SET_TEXTURE_FORMAT) / 64;
@@ -3513,6 +6209,7 @@ printf("Set zeta dma object at 0x%x\n",parameter);
 
         pg->textures[slot].dirty = true;
         pg->dirty.shaders = true; /* FORMAT_COLOR used in combiner */
+        pg->texture_decode.prefetch_stages |= 1 << slot;
         break;
     CASE_4(NV097_SET_TEXTURE_ADDRESS, 64):
         slot = (class_method - NV097_SET_TEXTURE_ADDRESS) / 64;
@@ -3579,32 +6276,52 @@ printf("Set zeta dma object at 0x%x\n",parameter);
         
         pg->textures[slot].dirty = true;
         break;
+    CASE_4(NV097_SET_TEXTURE_PALETTE, 64):
+        slot = (class_method - NV097_SET_TEXTURE_PALETTE) / 64;
+
+        pg->textures[slot].palette_dma_select =
+            GET_MASK(parameter, NV097_SET_TEXTURE_PALETTE_CONTEXT_DMA);
+        pg->textures[slot].palette_length =
+            256 >> GET_MASK(parameter, NV097_SET_TEXTURE_PALETTE_LENGTH);
+        pg->textures[slot].palette_offset =
+            parameter & NV097_SET_TEXTURE_PALETTE_OFFSET;
+
+        pg->textures[slot].dirty = true;
+        pg->texture_decode.prefetch_stages |= 1 << slot;
+        break;
     case NV097_SET_POINT_SIZE: {
         float point_size = *(float*)&parameter; //FIXME: also exists in reg
-        glPointSize(point_size); //FIXME: Defer..
+        gl_state_point_size(pg, point_size);
         break;
     }
     case NV097_ARRAY_ELEMENT16:
-        assert(pg->inline_elements_length < NV2A_GPU_MAX_BATCH_LENGTH);
-        pg->inline_elements[
-            pg->inline_elements_length++] = parameter & 0xFFFF;
-        pg->inline_elements[
-            pg->inline_elements_length++] = parameter >> 16;
+        pgraph_add_inline_elements16(pg, &parameter, 1);
         break;
     case NV097_ARRAY_ELEMENT32:
         assert(pg->inline_elements_length < NV2A_GPU_MAX_BATCH_LENGTH);
+        pgraph_widen_inline_elements(pg);
         pg->inline_elements[
             pg->inline_elements_length++] = parameter;
         break;
     case NV097_DRAW_ARRAYS: {
         /* This should only be callable between begin and end */
 
-        pgraph_bind_vertex_attributes(d);
-
         unsigned int start = GET_MASK(parameter, NV097_DRAW_ARRAYS_START_INDEX);
         unsigned int count = GET_MASK(parameter, NV097_DRAW_ARRAYS_COUNT)+1;
+
+        if (pg->shader_compile.skip_draw) {
+            break;
+        }
+
+        outer_stage = profile_enter(pg, PROFILE_STAGE_VERTEX_BIND);
+        pgraph_bind_vertex_attributes(d, start + count);
+        profile_leave(pg, outer_stage);
         debugger_message("DRAW: Draw Arrays");
+        outer_stage = profile_enter(pg, PROFILE_STAGE_DRAW);
+        gl_state_flush(pg);
         glDrawArrays(pg->gl_primitive_mode, start, count);
+        profile_leave(pg, outer_stage);
+        pg->frame_stats.draws++;
         break;
     }
     case NV097_INLINE_ARRAY:
@@ -3689,7 +6406,9 @@ printf("Set zeta dma object at 0x%x\n",parameter);
         break;
     case NV097_BACK_END_WRITE_SEMAPHORE_RELEASE: {
 
+        /* The guest might look at the results once it sees the semaphore */
         pgraph_update_surfaces(d, false, true, true);
+        download_all_pixels_to_memory(d, true);
 
         //qemu_mutex_unlock(&d->pgraph.lock);
         //qemu_mutex_lock_iothread();
@@ -3732,6 +6451,20 @@ printf("Set zeta dma object at 0x%x\n",parameter);
 
         debugger_push_group("NV2A: CLEAR_SURFACE");
 
+        unsigned int xmin = GET_MASK(d->pgraph.regs[NV_PGRAPH_CLEARRECTX],
+                NV_PGRAPH_CLEARRECTX_XMIN)*2; //FIXME: AA
+        unsigned int xmax = GET_MASK(d->pgraph.regs[NV_PGRAPH_CLEARRECTX],
+                NV_PGRAPH_CLEARRECTX_XMAX)*2; //FIXME: AA
+        unsigned int ymin = GET_MASK(d->pgraph.regs[NV_PGRAPH_CLEARRECTY],
+                NV_PGRAPH_CLEARRECTY_YMIN)*2; //FIXME: AA
+        unsigned int ymax = GET_MASK(d->pgraph.regs[NV_PGRAPH_CLEARRECTY],
+                NV_PGRAPH_CLEARRECTY_YMAX)*2; //FIXME: AA
+
+        if (pgraph_fast_clear(d, parameter, xmin, ymin, xmax, ymax)) {
+            debugger_pop_group();
+            break;
+        }
+
         GLbitfield gl_mask = 0;
 
         pgraph_update_surfaces(d, true, writeZeta, writeColor);
@@ -3757,15 +6490,15 @@ printf("Set zeta dma object at 0x%x\n",parameter);
 
             if (writeDepth) {
                 gl_mask |= GL_DEPTH_BUFFER_BIT;
-                glDepthMask(GL_TRUE);
+                gl_state_depth_mask(pg, true);
                 pg->dirty.depth_mask = true;
-                glClearDepth(gl_clear_depth);
+                gl_state_clear_depth(pg, gl_clear_depth);
             }
             if (writeStencil) {
                 gl_mask |= GL_STENCIL_BUFFER_BIT;
-                glStencilMask(0xFF); /* We have 8 bits maximum anyway */
+                gl_state_stencil_mask(pg, 0xFF); /* We have 8 bits maximum anyway */
                 pg->dirty.stencil_mask = true;
-                glClearStencil(gl_clear_stencil);
+                gl_state_clear_stencil(pg, gl_clear_stencil);
             }
 
         }
@@ -3776,43 +6509,36 @@ printf("Set zeta dma object at 0x%x\n",parameter);
 
             uint32_t clear_color = d->pgraph.regs[NV_PGRAPH_COLORCLEARVALUE];
 
-            glColorMask((parameter & NV097_CLEAR_SURFACE_R)?GL_TRUE:GL_FALSE,
-                        (parameter & NV097_CLEAR_SURFACE_G)?GL_TRUE:GL_FALSE,
-                        (parameter & NV097_CLEAR_SURFACE_B)?GL_TRUE:GL_FALSE,
-                        (parameter & NV097_CLEAR_SURFACE_A)?GL_TRUE:GL_FALSE);
+            gl_state_color_mask(pg, parameter & NV097_CLEAR_SURFACE_R,
+                                    parameter & NV097_CLEAR_SURFACE_G,
+                                    parameter & NV097_CLEAR_SURFACE_B,
+                                    parameter & NV097_CLEAR_SURFACE_A);
             pg->dirty.color_mask = true;
 
-            glClearColor( ((clear_color >> 16) & 0xFF) / 255.0f, /* red */
-                          ((clear_color >> 8) & 0xFF) / 255.0f,  /* green */
-                          (clear_color & 0xFF) / 255.0f,         /* blue */
-                          ((clear_color >> 24) & 0xFF) / 255.0f);/* alpha */
+            gl_state_clear_color(pg,
+                                 ((clear_color >> 16) & 0xFF) / 255.0f, /* red */
+                                 ((clear_color >> 8) & 0xFF) / 255.0f,  /* green */
+                                 (clear_color & 0xFF) / 255.0f,         /* blue */
+                                 ((clear_color >> 24) & 0xFF) / 255.0f);/* alpha */
         }
 
-        glEnable(GL_SCISSOR_TEST);
-
-        unsigned int xmin = GET_MASK(d->pgraph.regs[NV_PGRAPH_CLEARRECTX],
-                NV_PGRAPH_CLEARRECTX_XMIN)*2; //FIXME: AA
-        unsigned int xmax = GET_MASK(d->pgraph.regs[NV_PGRAPH_CLEARRECTX],
-                NV_PGRAPH_CLEARRECTX_XMAX)*2; //FIXME: AA
-        unsigned int ymin = GET_MASK(d->pgraph.regs[NV_PGRAPH_CLEARRECTY],
-                NV_PGRAPH_CLEARRECTY_YMIN)*2; //FIXME: AA
-        unsigned int ymax = GET_MASK(d->pgraph.regs[NV_PGRAPH_CLEARRECTY],
-                NV_PGRAPH_CLEARRECTY_YMAX)*2; //FIXME: AA
-        glScissor(xmin, ymin, xmax-xmin + 1, ymax-ymin + 1);
+        gl_state_enable(pg, GL_STATE_SCISSOR_TEST, true);
+        gl_state_scissor(pg, xmin, ymin, xmax-xmin + 1, ymax-ymin + 1);
         //FIXME: Is this being clipped? If not we need a special case of update_surface
 
         NV2A_GPU_DPRINTF("------------------CLEAR 0x%x %d,%d - %d,%d  %x---------------\n",
             parameter, xmin, ymin, xmax, ymax, d->pgraph.regs[NV_PGRAPH_COLORCLEARVALUE]);
 
+        gl_state_flush(pg);
         glClear(gl_mask);
 
-        glDisable(GL_SCISSOR_TEST);
+        gl_state_enable(pg, GL_STATE_SCISSOR_TEST, false);
 
         mark_framebuffer_dirty(pg->framebuffer,
                                writeZeta,
                                writeColor);
 #ifdef ALWAYS_DOWNLOAD_PIXELS
-        start_framebuffer_to_pixels_download(pg->framebuffer);
+        start_framebuffer_to_pixels_download(d, pg->framebuffer);
 #endif
 
         debugger_pop_group();
@@ -3947,7 +6673,7 @@ printf("Set zeta dma object at 0x%x\n",parameter);
                 default:
                     assert(0);
             }
-            glShadeModel(gl_mode);
+            gl_state_shade_model(pg, gl_mode);
         }
         break;
 
@@ -3957,29 +6683,30 @@ printf("Set zeta dma object at 0x%x\n",parameter);
         pg->dirty.alpha_test = true;
         break;
     case NV097_SET_BLEND_ENABLE:
-        set_gl_state(GL_BLEND,kelvin->blend_enable = parameter);
+        set_gl_state(pg, GL_STATE_BLEND, kelvin->blend_enable = parameter);
         pg->dirty.blend = true;
         break;
     case NV097_SET_BLEND_FUNC_SFACTOR:
-        set_gl_blend_func(kelvin->blend_func_sfactor = parameter,
+        set_gl_blend_func(pg, kelvin->blend_func_sfactor = parameter,
                           kelvin->blend_func_dfactor);
         pg->dirty.blend_func = true;
         break;
     case NV097_SET_BLEND_FUNC_DFACTOR:
-        set_gl_blend_func(kelvin->blend_func_sfactor,
+        set_gl_blend_func(pg, kelvin->blend_func_sfactor,
                           kelvin->blend_func_dfactor = parameter);
         pg->dirty.blend_func = true;
         break;
     case NV097_SET_FRONT_FACE:
-        set_gl_front_face(kelvin->front_face = parameter);
+        set_gl_front_face(pg, kelvin->front_face = parameter);
         pg->dirty.front_face = true;
         break;
     case NV097_SET_CULL_FACE_ENABLE:
-        set_gl_state(GL_CULL_FACE,kelvin->cull_face_enable = parameter);
+        set_gl_state(pg, GL_STATE_CULL_FACE,
+                     kelvin->cull_face_enable = parameter);
         pg->dirty.cull_face = true;
         break;
     case NV097_SET_CULL_FACE:
-        set_gl_cull_face(kelvin->cull_face = parameter);
+        set_gl_cull_face(pg, kelvin->cull_face = parameter);
         pg->dirty.cull_face_mode = true;
         break;
 #endif
@@ -4010,34 +6737,143 @@ printf("Set zeta dma object at 0x%x\n",parameter);
         pg->dirty.edge_flag = true;
         break;
 #endif
-    default:
-        NV2A_GPU_DPRINTF("    unhandled  (0x%04x 0x%04x: 0x%08x)\n",
-                     object->graphics_class, method, parameter);
-        const char* method_name = "";
-        uint32_t nmethod = 0;
-        switch (object->graphics_class) {
-            case NV_KELVIN_PRIMITIVE:
-                nmethod = method | (0x5c << 16);
-                break;
-            case NV_CONTEXT_SURFACES_2D:
-                nmethod = method | (0x6d << 16);
-                break;
-            default:
-                break;
+    default:
+        NV2A_GPU_DPRINTF("    unhandled  (0x%04x 0x%04x: 0x%08x)\n",
+                     object->graphics_class, method, parameter);
+        const char* method_name = pgraph_method_name(object->graphics_class,
+                                                     method);
+        if (method_name == NULL) {
+            method_name = "";
+        }
+        debugger_message("NV2A: unhandled method 0x%04x 0x%04x: 0x%08x = %f (%s)",
+                    object->graphics_class, method, parameter, *(float*)&parameter,method_name);
+        break;
+    }
+    qemu_mutex_unlock(&d->pgraph.lock);
+
+}
+
+/* Handles as many words of a method burst as possible without leaving the
+ * lock. Returns the number of words consumed, 0 if the method has no bulk
+ * path and has to go through pgraph_method. Called with pg->lock held. */
+static unsigned int pgraph_method_burst_run(PGRAPHState *pg,
+                                            uint32_t class_method,
+                                            bool nonincreasing,
+                                            const uint32_t *parameters,
+                                            unsigned int count)
+{
+    unsigned int i;
+    unsigned int slot;
+    VertexShaderConstant *constant;
+
+    switch (class_method) {
+    case NV097_ARRAY_ELEMENT16:
+        count = nonincreasing ? count : 1;
+        pgraph_add_inline_elements16(pg, parameters, count);
+        return count;
+    case NV097_ARRAY_ELEMENT32:
+        count = nonincreasing ? count : 1;
+        assert(pg->inline_elements_length + count
+                   <= NV2A_GPU_MAX_BATCH_LENGTH);
+        pgraph_widen_inline_elements(pg);
+        memcpy(&pg->inline_elements[pg->inline_elements_length],
+               parameters, count * 4);
+        pg->inline_elements_length += count;
+        return count;
+    case NV097_INLINE_ARRAY:
+        count = nonincreasing ? count : 1;
+        assert(pg->inline_array_length + count <= NV2A_GPU_MAX_BATCH_LENGTH);
+        memcpy(&pg->inline_array[pg->inline_array_length],
+               parameters, count * 4);
+        pg->inline_array_length += count;
+        return count;
+    CASE_RANGE(NV097_SET_TRANSFORM_PROGRAM,32) {
+        /* An increasing burst may run past the end of the range */
+        count = nonincreasing ? count : MIN(count, 32 - slot);
+        assert(pg->vertexshader_load_slot + count
+                   <= (NV2A_GPU_MAX_VERTEXSHADER_LENGTH*4));
+        memcpy(&pg->vertexshader.program_data[pg->vertexshader_load_slot],
+               parameters, count * 4);
+        pg->vertexshader_load_slot += count;
+        pg->vertexshader.dirty = true;
+        return count;
+    }
+    CASE_RANGE(NV097_SET_TRANSFORM_CONSTANT,32) {
+        count = nonincreasing ? count : MIN(count, 32 - slot);
+        for (i = 0; i < count; i++) {
+            assert((pg->constant_load_slot/4) < NV2A_GPU_VERTEXSHADER_CONSTANTS);
+            constant = &pg->constants[pg->constant_load_slot/4];
+            constant->data[pg->constant_load_slot%4] = parameters[i];
+            set_bit(pg->constant_load_slot/4, pg->constants_dirty);
+            pg->constant_load_slot++;
+        }
+        return count;
+    }
+    default:
+        return 0;
+    }
+}
+
+/* Dispatches a run of method words as pushed by a single method header.
+ * The bulk methods are handled in one go, everything else goes through
+ * pgraph_method one word at a time. */
+static void pgraph_method_burst(NV2A_GPUState *d,
+                                unsigned int subchannel,
+                                unsigned int method,
+                                bool nonincreasing,
+                                const uint32_t *parameters,
+                                unsigned int count)
+{
+    PGRAPHState *pg = &d->pgraph;
+    unsigned int run;
+
+    while (count > 0) {
+        qemu_mutex_lock(&pg->lock);
+        while (!pg->fifo_access) {
+            qemu_cond_wait(&pg->fifo_access_cond, &pg->lock);
+        }
+
+        assert(pg->channel_valid);
+        GraphicsObject *object = &pg->subchannel_data[subchannel].object;
+        uint32_t class_method = (object->graphics_class << 16) | method;
+        int64_t start = cpu_get_real_ticks();
+
+        run = 0;
+        if (method != NV_SET_OBJECT) {
+            run = pgraph_method_burst_run(pg, class_method, nonincreasing,
+                                          parameters, count);
+        }
+        trace_capture_method(d, subchannel, method, nonincreasing,
+                             parameters, MAX(run, 1));
+
+#ifdef DEBUG_NV2A_GPU
+        unsigned int i;
+        for (i = 0; i < run; i++) {
+            pgraph_method_log(subchannel, object->graphics_class,
+                              nonincreasing ? method : method + i * 4,
+                              parameters[i]);
+        }
+#endif
+
+        qemu_mutex_unlock(&pg->lock);
+
+        if (run == 0) {
+            pgraph_method(d, subchannel, method, parameters[0]);
+            run = 1;
         }
-        if (nmethod != 0
-            && nmethod < sizeof(nv2a_gpu_method_names)/sizeof(const char*)) {
-            method_name = nv2a_gpu_method_names[nmethod];
+        profile_method(pg, class_method, run, start);
+
+        parameters += run;
+        count -= run;
+        if (!nonincreasing) {
+            method += run * 4;
         }
-        debugger_message("NV2A: unhandled method 0x%04x 0x%04x: 0x%08x = %f (%s)",
-                    object->graphics_class, method, parameter, *(float*)&parameter,method_name);
-        break;
     }
-    qemu_mutex_unlock(&d->pgraph.lock);
-
 }
 
 
+static void render_queue_drain(NV2A_GPUState *d);
+
 static void pgraph_context_switch(NV2A_GPUState *d, unsigned int channel_id)
 {
     bool valid;
@@ -4049,7 +6885,11 @@ static void pgraph_context_switch(NV2A_GPUState *d, unsigned int channel_id)
     qemu_mutex_unlock(&d->pgraph.lock);
     if (!valid) {
         NV2A_GPU_DPRINTF("puller needs to switch to ch %d\n", channel_id);
-        
+
+        /* The guest saves the context of the old channel, so everything
+         * of it has to be executed first */
+        render_queue_drain(d);
+
         qemu_mutex_lock_iothread();
         d->pgraph.pending_interrupts |= NV_PGRAPH_INTR_CONTEXT_SWITCH;
         update_irq(d);
@@ -4071,43 +6911,324 @@ static void pgraph_wait_fifo_access(NV2A_GPUState *d) {
     qemu_mutex_unlock(&d->pgraph.lock);
 }
 
+/* Wakes up whoever waits for the render queue, called with its lock held */
+static void render_queue_kick(RenderQueue *q)
+{
+    if (q->waiting) {
+        qemu_cond_broadcast(&q->cond);
+    }
+}
+
+static void render_queue_wait(RenderQueue *q)
+{
+    q->waiting++;
+    qemu_cond_wait(&q->cond, &q->lock);
+    q->waiting--;
+}
+
+/* Hands a method burst to the render thread, blocks while the queue is
+ * full. method 0 binds the object instance in parameters[0]. */
+static void render_queue_push(NV2A_GPUState *d,
+                              unsigned int subchannel,
+                              unsigned int method,
+                              bool nonincreasing,
+                              const uint32_t *parameters,
+                              unsigned int count)
+{
+    RenderQueue *q = &d->render_queue;
+    assert(count > 0 && count <= NV2A_GPU_MAX_BURST_LENGTH);
+
+    qemu_mutex_lock(&q->lock);
+
+    /* The parameters of a command never wrap around */
+    unsigned int first = q->word_put;
+    if ((first % NV2A_GPU_RENDER_QUEUE_WORDS) + count
+            > NV2A_GPU_RENDER_QUEUE_WORDS) {
+        first = ROUND_UP(first, NV2A_GPU_RENDER_QUEUE_WORDS);
+    }
+
+    while (q->put - q->get == NV2A_GPU_RENDER_QUEUE_LENGTH
+           || first + count - q->word_get > NV2A_GPU_RENDER_QUEUE_WORDS) {
+        q->stats.stalls++;
+        render_queue_wait(q);
+    }
+
+    RenderCommand *command =
+        &q->commands[q->put % NV2A_GPU_RENDER_QUEUE_LENGTH];
+    command->method = method;
+    command->subchannel = subchannel;
+    command->nonincreasing = nonincreasing;
+    command->count = count;
+    command->first = first;
+    memcpy(&q->words[first % NV2A_GPU_RENDER_QUEUE_WORDS], parameters,
+           count * sizeof(uint32_t));
+    q->word_put = first + count;
+    atomic_mb_set(&q->put, q->put + 1);
+
+    if (q->put - q->get > q->stats.high_water) {
+        q->stats.high_water = q->put - q->get;
+    }
+
+    render_queue_kick(q);
+    qemu_mutex_unlock(&q->lock);
+}
+
+/* Blocks until the render thread executed everything queued so far */
+static void render_queue_drain(NV2A_GPUState *d)
+{
+    RenderQueue *q = &d->render_queue;
+    qemu_mutex_lock(&q->lock);
+    if (q->get != q->put) {
+        q->stats.drains++;
+    }
+    while (q->get != q->put) {
+        render_queue_wait(q);
+    }
+    qemu_mutex_unlock(&q->lock);
+}
+
+static bool render_queue_idle(RenderQueue *q)
+{
+    return atomic_mb_read(&q->get) == atomic_mb_read(&q->put);
+}
+
+static void *pgraph_render_thread(void *arg)
+{
+    NV2A_GPUState *d = arg;
+    RenderQueue *q = &d->render_queue;
+
+    glo_set_current(d->pgraph.gl_context);
+
+    qemu_mutex_lock(&q->lock);
+    while (true) {
+        if (q->get == q->put) {
+            ProfileStage outer_stage = profile_enter(&d->pgraph,
+                                                     PROFILE_STAGE_IDLE);
+            while (q->get == q->put && !q->exit && !d->trace.replay) {
+                render_queue_wait(q);
+            }
+            profile_leave(&d->pgraph, outer_stage);
+        }
+        if (d->trace.replay) {
+            qemu_mutex_unlock(&q->lock);
+            trace_replay(d);
+            qemu_mutex_lock(&q->lock);
+            continue;
+        }
+        if (q->get == q->put) {
+            break;
+        }
+
+        /* Only the render thread changes get, so the command stays valid */
+        RenderCommand command = q->commands[q->get
+                                            % NV2A_GPU_RENDER_QUEUE_LENGTH];
+        qemu_mutex_unlock(&q->lock);
+
+        const uint32_t *parameters =
+            &q->words[command.first % NV2A_GPU_RENDER_QUEUE_WORDS];
+        if (command.method == 0) {
+            pgraph_wait_fifo_access(d);
+            trace_capture_method(d, command.subchannel, 0, false,
+                                 parameters, 1);
+            pgraph_method(d, command.subchannel, 0, parameters[0]);
+        } else {
+            pgraph_method_burst(d, command.subchannel, command.method,
+                                command.nonincreasing,
+                                parameters, command.count);
+        }
+
+        qemu_mutex_lock(&q->lock);
+        q->word_get = command.first + command.count;
+        atomic_mb_set(&q->get, q->get + 1);
+        render_queue_kick(q);
+    }
+    qemu_mutex_unlock(&q->lock);
+
+    glo_set_current(NULL);
+    return NULL;
+}
+
+static void render_queue_init(NV2A_GPUState *d)
+{
+    RenderQueue *q = &d->render_queue;
+    qemu_mutex_init(&q->lock);
+    qemu_cond_init(&q->cond);
+    qemu_thread_create(&d->render_thread, "nv2a/render",
+                       pgraph_render_thread, d, QEMU_THREAD_JOINABLE);
+}
+
+static void render_queue_destroy(NV2A_GPUState *d)
+{
+    RenderQueue *q = &d->render_queue;
+
+    qemu_mutex_lock(&q->lock);
+    q->exit = true;
+    render_queue_kick(q);
+    qemu_mutex_unlock(&q->lock);
+    qemu_thread_join(&d->render_thread);
+
+    qemu_mutex_destroy(&q->lock);
+    qemu_cond_destroy(&q->cond);
+}
+
+/* Checked for every pop, so this doesn't take pull_lock. A puller which
+ * misses the change here sees it in pfifo_puller_wait, the writer wakes it
+ * up under cache_lock. */
+static bool pfifo_puller_enabled(Cache1State *state)
+{
+    return atomic_read(&state->pull_enabled);
+}
+
+/* Blocks until the pusher published something, returns false if the
+ * puller should die instead */
+static bool pfifo_puller_wait(Cache1State *state)
+{
+    if (state->cache_get != atomic_mb_read(&state->cache_put)) {
+        return true;
+    }
+
+    qemu_mutex_lock(&state->cache_lock);
+    /* The pusher checks this flag after publishing cache_put, so either
+     * it sees us waiting or we see its entries below */
+    atomic_mb_set(&state->cache_puller_waiting, true);
+    while (state->cache_get == atomic_mb_read(&state->cache_put)) {
+        /* we could have been woken up to tell us we should die */
+        if (!pfifo_puller_enabled(state)) {
+            atomic_mb_set(&state->cache_puller_waiting, false);
+            qemu_mutex_unlock(&state->cache_lock);
+            return false;
+        }
+        qemu_cond_wait(&state->cache_cond, &state->cache_lock);
+        state->cache_stats.wakeups++;
+    }
+    atomic_mb_set(&state->cache_puller_waiting, false);
+    qemu_mutex_unlock(&state->cache_lock);
+    return true;
+}
+
+/* methods that take objects.
+ * TODO: Check this range is correct for the nv2a */
+static bool pfifo_method_takes_object(unsigned int method)
+{
+    return method >= 0x180 && method < 0x200;
+}
+
+/* Pops the next entry into command. If it starts a method burst, the
+ * parameters of all directly following entries which continue it are
+ * popped too. Returns the number of parameters stored. */
+static unsigned int pfifo_puller_pop(NV2A_GPUState *d, CacheEntry *command,
+                                     uint32_t *parameters,
+                                     unsigned int max_parameters)
+{
+    Cache1State *state = &d->pfifo.cache1;
+    unsigned int get = state->cache_get;
+    unsigned int put = atomic_mb_read(&state->cache_put);
+    unsigned int used = put - get;
+    unsigned int count = 1;
+    unsigned int method;
+    const CacheEntry *next;
+
+    *command = state->cache[get++ & (NV2A_GPU_CACHE1_SIZE - 1)];
+    parameters[0] = command->parameter;
+
+    if (command->method >= 0x100
+        && !pfifo_method_takes_object(command->method)) {
+        method = command->method;
+        while (count < max_parameters && get != put) {
+            next = &state->cache[get & (NV2A_GPU_CACHE1_SIZE - 1)];
+            if (!command->nonincreasing) {
+                method += 4;
+            }
+            if (next->method != method
+                || next->subchannel != command->subchannel
+                || next->nonincreasing != command->nonincreasing
+                || pfifo_method_takes_object(method)) {
+                break;
+            }
+            parameters[count++] = next->parameter;
+            get++;
+        }
+    }
+
+    /* Hand the slots back to the pusher */
+    atomic_mb_set(&state->cache_get, get);
+
+    if (used > state->cache_stats.high_water) {
+        state->cache_stats.high_water = used;
+    }
+    state->cache_stats.words += count;
+
+    /* Restart a stalled pusher once we drained half of the cache */
+    if (atomic_mb_read(&state->cache_pusher_stalled)
+        && used - count <= NV2A_GPU_CACHE1_SIZE / 2) {
+        atomic_mb_set(&state->cache_pusher_stalled, false);
+        qemu_bh_schedule(d->pfifo.pusher_bh);
+    }
+
+    return count;
+}
+
+#ifdef DEBUG_NV2A_GPU_FIFO_STATS
+static void pfifo_puller_report_stats(NV2A_GPUState *d)
+{
+    static int64_t last_time;
+    static uint64_t last_words, last_wakeups, last_stalls;
+    static uint64_t last_render_stalls, last_render_drains;
+
+    Cache1State *state = &d->pfifo.cache1;
+    RenderQueue *q = &d->render_queue;
+
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    if (now - last_time < get_ticks_per_sec()) {
+        return;
+    }
+
+    uint64_t stalls = atomic_read(&state->cache_stats.stalls);
+    printf("nv2a: pfifo %" PRIu64 " words/s, %" PRIu64 " wakeups, "
+           "%" PRIu64 " stalls, high water %u/%u\n",
+           (state->cache_stats.words - last_words)
+               * get_ticks_per_sec() / (now - last_time),
+           state->cache_stats.wakeups - last_wakeups,
+           stalls - last_stalls,
+           state->cache_stats.high_water, NV2A_GPU_CACHE1_SIZE);
+    printf("nv2a: render queue %" PRIu64 " stalls, %" PRIu64 " drains, "
+           "high water %u/%u\n",
+           q->stats.stalls - last_render_stalls,
+           q->stats.drains - last_render_drains,
+           q->stats.high_water, NV2A_GPU_RENDER_QUEUE_LENGTH);
+
+    last_time = now;
+    last_words = state->cache_stats.words;
+    last_wakeups = state->cache_stats.wakeups;
+    last_stalls = stalls;
+    last_render_stalls = q->stats.stalls;
+    last_render_drains = q->stats.drains;
+}
+#endif
+
 static void *pfifo_puller_thread(void *arg)
 {
     NV2A_GPUState *d = arg;
     Cache1State *state = &d->pfifo.cache1;
-    CacheEntry *command;
+    CacheEntry entry_buf, *command = &entry_buf;
     RAMHTEntry entry;
-
-    PGRAPHState *pg = &d->pgraph;
-    glo_set_current(pg->gl_context);
+    uint32_t parameters[NV2A_GPU_MAX_BURST_LENGTH];
+    unsigned int count;
 
     while (true) {
-        qemu_mutex_lock(&state->pull_lock);
-        if (!state->pull_enabled) {
-            qemu_mutex_unlock(&state->pull_lock);
-            glo_set_current(NULL);
+        if (!pfifo_puller_enabled(state)) {
             return NULL;
         }
-        qemu_mutex_unlock(&state->pull_lock);
-
-        qemu_mutex_lock(&state->cache_lock);
-        while (QSIMPLEQ_EMPTY(&state->cache)) {
-            qemu_cond_wait(&state->cache_cond, &state->cache_lock);
 
-            /* we could have been woken up to tell us we should die */
-            qemu_mutex_lock(&state->pull_lock);
-            if (!state->pull_enabled) {
-                qemu_mutex_unlock(&state->pull_lock);
-                qemu_mutex_unlock(&state->cache_lock);
-                glo_set_current(NULL);
-                return NULL;
-            }
-            qemu_mutex_unlock(&state->pull_lock);
+        if (!pfifo_puller_wait(state)) {
+            return NULL;
         }
-        command = QSIMPLEQ_FIRST(&state->cache);
-        QSIMPLEQ_REMOVE_HEAD(&state->cache, entry);
-        state->cache_size--;
-        qemu_mutex_unlock(&state->cache_lock);
+        count = pfifo_puller_pop(d, command, parameters,
+                                 NV2A_GPU_MAX_BURST_LENGTH);
+
+#ifdef DEBUG_NV2A_GPU_FIFO_STATS
+        pfifo_puller_report_stats(d);
+#endif
 
         if (command->method == 0) {
             //qemu_mutex_lock_iothread();
@@ -4120,8 +7241,9 @@ static void *pfifo_puller_thread(void *arg)
             switch (entry.engine) {
             case ENGINE_GRAPHICS:
                 pgraph_context_switch(d, entry.channel_id);
-                pgraph_wait_fifo_access(d);
-                pgraph_method(d, command->subchannel, 0, entry.instance);
+                parameters[0] = entry.instance;
+                render_queue_push(d, command->subchannel, 0, false,
+                                  parameters, 1);
                 break;
             default:
                 assert(false);
@@ -4136,16 +7258,13 @@ static void *pfifo_puller_thread(void *arg)
         } else if (command->method >= 0x100) {
             /* method passed to engine */
 
-            uint32_t parameter = command->parameter;
-
-            /* methods that take objects.
-             * TODO: Check this range is correct for the nv2a */
-            if (command->method >= 0x180 && command->method < 0x200) {
+            if (pfifo_method_takes_object(command->method)) {
+                assert(count == 1);
                 //qemu_mutex_lock_iothread();
-                entry = ramht_lookup(d, parameter);
+                entry = ramht_lookup(d, parameters[0]);
                 assert(entry.valid);
                 assert(entry.channel_id == state->channel_id);
-                parameter = entry.instance;
+                parameters[0] = entry.instance;
                 //qemu_mutex_unlock_iothread();
             }
 
@@ -4155,9 +7274,9 @@ static void *pfifo_puller_thread(void *arg)
 
             switch (engine) {
             case ENGINE_GRAPHICS:
-                pgraph_wait_fifo_access(d);
-                pgraph_method(d, command->subchannel,
-                                   command->method, parameter);
+                render_queue_push(d, command->subchannel, command->method,
+                                  command->nonincreasing,
+                                  parameters, count);
                 break;
             default:
                 assert(false);
@@ -4168,14 +7287,47 @@ static void *pfifo_puller_thread(void *arg)
             state->last_engine = state->bound_engines[command->subchannel];
             qemu_mutex_unlock(&state->pull_lock);
         }
-
-        g_free(command);
     }
 
-    glo_set_current(NULL);
     return NULL;
 }
 
+/* Makes the entries up to put visible to the puller and wakes it up
+ * if it went to sleep */
+static void pfifo_pusher_publish(Cache1State *state, unsigned int put)
+{
+    if (put == state->cache_put) {
+        return;
+    }
+    atomic_mb_set(&state->cache_put, put);
+    if (atomic_mb_read(&state->cache_puller_waiting)) {
+        qemu_mutex_lock(&state->cache_lock);
+        qemu_cond_signal(&state->cache_cond);
+        qemu_mutex_unlock(&state->cache_lock);
+    }
+}
+
+/* Returns true if the cache is full and the pusher has to wait for the
+ * puller to schedule pusher_bh */
+static bool pfifo_pusher_stall(Cache1State *state, unsigned int put)
+{
+    if (put - atomic_mb_read(&state->cache_get) < NV2A_GPU_CACHE1_SIZE) {
+        return false;
+    }
+
+    pfifo_pusher_publish(state, put);
+
+    /* The puller checks this flag after releasing an entry, so either
+     * it sees us stalled or we see the free entry below */
+    atomic_mb_set(&state->cache_pusher_stalled, true);
+    if (put - atomic_mb_read(&state->cache_get) < NV2A_GPU_CACHE1_SIZE) {
+        atomic_mb_set(&state->cache_pusher_stalled, false);
+        return false;
+    }
+    atomic_inc(&state->cache_stats.stalls);
+    return true;
+}
+
 /* pusher should be fine to run from a mimo handler
  * whenever's it's convenient */
 static void pfifo_run_pusher(NV2A_GPUState *d) {
@@ -4186,6 +7338,7 @@ static void pfifo_run_pusher(NV2A_GPUState *d) {
     uint8_t *dma;
     hwaddr dma_len;
     uint32_t word;
+    unsigned int put;
 
     /* TODO: How is cache1 selected? */
     state = &d->pfifo.cache1;
@@ -4212,6 +7365,8 @@ static void pfifo_run_pusher(NV2A_GPUState *d) {
     NV2A_GPU_DPRINTF("DMA pusher: max 0x%llx, 0x%llx - 0x%llx\n",
                  dma_len, control->dma_get, control->dma_put);
 
+    put = state->cache_put;
+
     /* based on the convenient pseudocode in envytools */
     while (control->dma_get != control->dma_put) {
         if (control->dma_get >= dma_len) {
@@ -4220,6 +7375,11 @@ static void pfifo_run_pusher(NV2A_GPUState *d) {
             break;
         }
 
+        /* Leave the word in the pushbuffer until there is room for it */
+        if (state->method_count && pfifo_pusher_stall(state, put)) {
+            break;
+        }
+
         word = ldl_le_p(dma + control->dma_get);
         control->dma_get += 4;
 
@@ -4227,16 +7387,15 @@ static void pfifo_run_pusher(NV2A_GPUState *d) {
             /* data word of methods command */
             state->data_shadow = word;
 
-            command = g_malloc0(sizeof(CacheEntry));
+            command = &state->cache[put & (NV2A_GPU_CACHE1_SIZE - 1)];
             command->method = state->method;
             command->subchannel = state->subchannel;
             command->nonincreasing = state->method_nonincreasing;
             command->parameter = word;
-            qemu_mutex_lock(&state->cache_lock);
-            QSIMPLEQ_INSERT_TAIL(&state->cache, command, entry);
-            state->cache_size++;
-            qemu_cond_signal(&state->cache_cond);
-            qemu_mutex_unlock(&state->cache_lock);
+            put++;
+            if ((put % NV2A_GPU_CACHE1_PUSH_BATCH) == 0) {
+                pfifo_pusher_publish(state, put);
+            }
 
             if (!state->method_nonincreasing) {
                 state->method += 4;
@@ -4299,6 +7458,8 @@ static void pfifo_run_pusher(NV2A_GPUState *d) {
         }
     }
 
+    pfifo_pusher_publish(state, put);
+
     if (state->error) {
         NV2A_GPU_DPRINTF("pb error: %d\n", state->error);
         assert(false);
@@ -4310,6 +7471,12 @@ static void pfifo_run_pusher(NV2A_GPUState *d) {
     }
 }
 
+static void pfifo_pusher_bh(void *opaque)
+{
+    NV2A_GPUState *d = opaque;
+    pfifo_run_pusher(d);
+}
+
 
 
 
@@ -4514,13 +7681,17 @@ static uint64_t pfifo_read(void *opaque,
         SET_MASK(r, NV_PFIFO_CACHE1_PUSH1_CHID, d->pfifo.cache1.channel_id);
         SET_MASK(r, NV_PFIFO_CACHE1_PUSH1_MODE, d->pfifo.cache1.mode);
         break;
-    case NV_PFIFO_CACHE1_STATUS:
-        qemu_mutex_lock(&d->pfifo.cache1.cache_lock);
-        if (QSIMPLEQ_EMPTY(&d->pfifo.cache1.cache)) {
+    case NV_PFIFO_CACHE1_STATUS: {
+        unsigned int used = d->pfifo.cache1.cache_put
+                              - atomic_mb_read(&d->pfifo.cache1.cache_get);
+        if (used == 0 && render_queue_idle(&d->render_queue)) {
             r |= NV_PFIFO_CACHE1_STATUS_LOW_MARK; /* low mark empty */
         }
-        qemu_mutex_unlock(&d->pfifo.cache1.cache_lock);
+        if (used == NV2A_GPU_CACHE1_SIZE) {
+            r |= NV_PFIFO_CACHE1_STATUS_HIGH_MARK; /* high mark full */
+        }
         break;
+    }
     case NV_PFIFO_CACHE1_DMA_PUSH:
         SET_MASK(r, NV_PFIFO_CACHE1_DMA_PUSH_ACCESS,
                  d->pfifo.cache1.dma_push_enabled);
@@ -4589,6 +7760,7 @@ static void pfifo_write(void *opaque, hwaddr addr,
                         uint64_t val, unsigned int size)
 {
     int i;
+    bool stop_puller = false;
     NV2A_GPUState *d = opaque;
 
     reg_log_write(NV_PFIFO, addr, val);
@@ -4607,6 +7779,11 @@ static void pfifo_write(void *opaque, hwaddr addr,
             GET_MASK(val, NV_PFIFO_RAMHT_BASE_ADDRESS) << 12;
         d->pfifo.ramht_size = 1 << (GET_MASK(val, NV_PFIFO_RAMHT_SIZE)+12);
         d->pfifo.ramht_search = GET_MASK(val, NV_PFIFO_RAMHT_SEARCH);
+
+        /* Entries are somewhere else now */
+        qemu_mutex_lock(&d->ramin_cache.lock);
+        g_hash_table_remove_all(d->ramin_cache.ramht);
+        qemu_mutex_unlock(&d->ramin_cache.lock);
         break;
     case NV_PFIFO_RAMFC:
         d->pfifo.ramfc_address1 =
@@ -4673,19 +7850,24 @@ static void pfifo_write(void *opaque, hwaddr addr,
         qemu_mutex_lock(&d->pfifo.cache1.pull_lock);
         if ((val & NV_PFIFO_CACHE1_PULL0_ACCESS)
              && !d->pfifo.cache1.pull_enabled) {
-            d->pfifo.cache1.pull_enabled = true;
+            atomic_set(&d->pfifo.cache1.pull_enabled, true);
 
             /* fire up puller thread */
             qemu_thread_create(&d->pfifo.puller_thread, "nv2a/pfifo_puller",
                                pfifo_puller_thread, d, QEMU_THREAD_DETACHED);
         } else if (!(val & NV_PFIFO_CACHE1_PULL0_ACCESS)
                      && d->pfifo.cache1.pull_enabled) {
-            d->pfifo.cache1.pull_enabled = false;
+            atomic_set(&d->pfifo.cache1.pull_enabled, false);
+            stop_puller = true;
+        }
+        qemu_mutex_unlock(&d->pfifo.cache1.pull_lock);
 
-            /* the puller thread should die, wake it up. */
+        if (stop_puller) {
+            /* the puller thread should die, wake it up */
+            qemu_mutex_lock(&d->pfifo.cache1.cache_lock);
             qemu_cond_broadcast(&d->pfifo.cache1.cache_cond);
+            qemu_mutex_unlock(&d->pfifo.cache1.cache_lock);
         }
-        qemu_mutex_unlock(&d->pfifo.cache1.pull_lock);
         break;
     case NV_PFIFO_CACHE1_ENGINE:
         qemu_mutex_lock(&d->pfifo.cache1.pull_lock);
@@ -5044,6 +8226,7 @@ static void pgraph_write(void *opaque, hwaddr addr,
     NV2A_GPUState *d = opaque;
 
     reg_log_write(NV_PGRAPH, addr, val);
+    trace_capture_register(d, addr, val);
 
     switch (addr) {
     case NV_PGRAPH_INTR:
@@ -5281,18 +8464,62 @@ static void prmdio_write(void *opaque, hwaddr addr,
 
 
 /* PRAMIN - RAMIN access */
-/*
 static uint64_t pramin_read(void *opaque,
                                  hwaddr addr, unsigned int size)
 {
-    NV2A_GPU_DPRINTF("nv2a PRAMIN: read [0x%llx] -> 0x%llx\n", addr, r);
-    return 0;
+    NV2A_GPUState *d = opaque;
+    uint8_t *ptr = d->ramin_ptr + addr;
+
+    uint64_t r = 0;
+    switch (size) {
+    case 1:
+        r = ldub_p(ptr);
+        break;
+    case 2:
+        r = lduw_le_p(ptr);
+        break;
+    case 4:
+        r = ldl_le_p(ptr);
+        break;
+    default:
+        assert(false);
+        break;
+    }
+
+    NV2A_GPU_DPRINTF("nv2a PRAMIN: read [0x%" HWADDR_PRIx "] -> 0x%" PRIx64 "\n",
+                     addr, r);
+    return r;
 }
 static void pramin_write(void *opaque, hwaddr addr,
                               uint64_t val, unsigned int size)
 {
-    NV2A_GPU_DPRINTF("nv2a PRAMIN: [0x%llx] = 0x%02llx\n", addr, val);
-}*/
+    NV2A_GPUState *d = opaque;
+    uint8_t *ptr = d->ramin_ptr + addr;
+
+    NV2A_GPU_DPRINTF("nv2a PRAMIN: [0x%" HWADDR_PRIx "] = 0x%02" PRIx64 "\n",
+                     addr, val);
+
+    qemu_mutex_lock(&d->ramin_cache.lock);
+    switch (size) {
+    case 1:
+        stb_p(ptr, val);
+        break;
+    case 2:
+        stw_le_p(ptr, val);
+        break;
+    case 4:
+        stl_le_p(ptr, val);
+        break;
+    default:
+        assert(false);
+        break;
+    }
+    ramin_cache_invalidate(d, addr, size);
+    qemu_mutex_unlock(&d->ramin_cache.lock);
+
+    /* For captures */
+    memory_region_set_dirty(&d->ramin, addr, size);
+}
 
 
 /* USER - PFIFO MMIO and DMA submission area */
@@ -5541,7 +8768,7 @@ static const struct NV2A_GPUBlockInfo blocktable[] = {
             .write = prmdio_write,
         },
     },
-    /*[ NV_PRAMIN ]  = {
+    [ NV_PRAMIN ]  = {
         .name = "PRAMIN",
         .offset = 0x700000,
         .size   = 0x100000,
@@ -5549,7 +8776,7 @@ static const struct NV2A_GPUBlockInfo blocktable[] = {
             .read = pramin_read,
             .write = pramin_write,
         },
-    },*/
+    },
     [ NV_USER ]  = {
         .name = "USER",
         .offset = 0x800000,
@@ -5604,22 +8831,7 @@ static void pgraph_method_log(unsigned int subchannel,
                         subchannel, last, count);  
     }
     if (method != 0x1800) {
-        const char* method_name = NULL;
-        unsigned int nmethod = 0;
-        switch (graphics_class) {
-            case NV_KELVIN_PRIMITIVE:
-                nmethod = method | (0x5c << 16);
-                break;
-            case NV_CONTEXT_SURFACES_2D:
-                nmethod = method | (0x6d << 16);
-                break;
-            default:
-                break;
-        }
-        if (nmethod != 0
-            && nmethod < sizeof(nv2a_gpu_method_names)/sizeof(const char*)) {
-            method_name = nv2a_gpu_method_names[nmethod];
-        }
+        const char* method_name = pgraph_method_name(graphics_class, method);
         if (method_name) {
             NV2A_GPU_DPRINTF("pgraph method (%d): %s (0x%x)\n",
                      subchannel, method_name, parameter);
@@ -5634,11 +8846,6 @@ static void pgraph_method_log(unsigned int subchannel,
     last = method;
 }
 
-static uint8_t cliptobyte(int x)
-{
-    return (uint8_t)((x < 0) ? 0 : ((x > 255) ? 255 : x));
-}
-
 static void nv2a_gpu_overlay_draw_line(VGACommonState *vga, uint8_t *line, int y)
 {
     NV2A_GPU_DPRINTF("nv2a_gpu_overlay_draw_line\n");
@@ -5659,6 +8866,7 @@ static void nv2a_gpu_overlay_draw_line(VGACommonState *vga, uint8_t *line, int y
                             NV_PVIDEO_SIZE_IN_WIDTH);
     int in_height = GET_MASK(d->pvideo.regs[NV_PVIDEO_SIZE_IN],
                              NV_PVIDEO_SIZE_IN_HEIGHT);
+    /* 12.4 fixed point */
     int in_s = GET_MASK(d->pvideo.regs[NV_PVIDEO_POINT_IN],
                         NV_PVIDEO_POINT_IN_S);
     int in_t = GET_MASK(d->pvideo.regs[NV_PVIDEO_POINT_IN],
@@ -5667,9 +8875,22 @@ static void nv2a_gpu_overlay_draw_line(VGACommonState *vga, uint8_t *line, int y
                             NV_PVIDEO_FORMAT_PITCH);
     int in_color = GET_MASK(d->pvideo.regs[NV_PVIDEO_FORMAT],
                             NV_PVIDEO_FORMAT_COLOR);
+    /* 12.20 fixed point, FIXME: Find out if 0 really means 1:1 */
+    uint32_t ds_dx = d->pvideo.regs[NV_PVIDEO_DS_DX];
+    uint32_t dt_dy = d->pvideo.regs[NV_PVIDEO_DT_DY];
 
-    // TODO: support other color formats
-    assert(in_color == NV_PVIDEO_FORMAT_COLOR_LE_CR8YB8CB8YA8);
+    YUV422Format format;
+    switch (in_color) {
+    case NV_PVIDEO_FORMAT_COLOR_LE_CR8YB8CB8YA8:
+        format = YUV422_YUYV;
+        break;
+    case NV_PVIDEO_FORMAT_COLOR_LE_YB8CR8YA8CB8:
+        format = YUV422_UYVY;
+        break;
+    default:
+        assert(false);
+        return;
+    }
 
     int out_width = GET_MASK(d->pvideo.regs[NV_PVIDEO_SIZE_OUT],
                              NV_PVIDEO_SIZE_OUT_WIDTH);
@@ -5682,38 +8903,50 @@ static void nv2a_gpu_overlay_draw_line(VGACommonState *vga, uint8_t *line, int y
 
 
     if (y < out_y || y >= out_y + out_height) return;
+    if (in_width == 0 || in_height == 0 || out_x >= surf_width) return;
 
-    // TODO: scaling, color keys
+    // TODO: color keys
 
-    int in_y = y - out_y;
+    /* Positions in 16.16 fixed point source pixels */
+    uint32_t ds = ds_dx ? (ds_dx >> 4) : 0x10000;
+    uint32_t dt = dt_dy ? (dt_dy >> 4) : 0x10000;
+    uint32_t s = in_s << 12;
+    uint64_t t = ((uint64_t)in_t << 12) + (uint64_t)(y - out_y) * dt;
+
+    int in_y = t >> 16;
     if (in_y >= in_height) return;
+    int next_in_y = MIN(in_y + 1, in_height - 1);
+
+    /* Don't scan past the end of the video */
+    uint64_t end = (uint64_t)in_width << 16;
+    if (s >= end) return;
+    int width = MIN(out_width, surf_width - out_x);
+    width = MIN(width, (end - s + ds - 1) / ds);
 
-    assert(offset + in_pitch * (in_y + 1) <= limit);
+    assert(offset + in_pitch * (next_in_y + 1) <= limit);
     uint8_t *in_line = d->vram_ptr + base + offset + in_pitch * in_y;
+    uint8_t *next_in_line = d->vram_ptr + base + offset
+                                + in_pitch * next_in_y;
+
+    /* The overlay always filters */
+#ifndef HOST_WORDS_BIGENDIAN
+    if (surf_bpp == 4) {
+        yuv422_scale_to_bgra(format, in_line, next_in_line, in_width,
+                             s, ds, t & 0xFFFF, true,
+                             line + out_x * 4, width);
+        return;
+    }
+#endif
+
+    uint8_t *pixels = g_malloc(width * 4);
+    yuv422_scale_to_bgra(format, in_line, next_in_line, in_width,
+                         s, ds, t & 0xFFFF, true, pixels, width);
 
     int x;
-    for (x=0; x<out_width; x++) {
+    for (x = 0; x < width; x++) {
         int ox = out_x + x;
-        if (ox >= surf_width) break;
-        int ix = in_s + x;
-        if (ix >= in_width) break;
-
-        // YUY2 to RGB
-        int c, d, e;
-        c = (int)in_line[ix * 2] - 16;
-        if (ix % 2) {
-            d = (int)in_line[ix * 2 - 1] - 128;
-            e = (int)in_line[ix * 2 + 1] - 128;
-        } else {
-            d = (int)in_line[ix * 2 + 1] - 128;
-            e = (int)in_line[ix * 2 + 3] - 128;
-        }
-        int r, g, b;
-        r = cliptobyte((298 * c + 409 * e + 128) >> 8);
-        g = cliptobyte((298 * c - 100 * d - 208 * e + 128) >> 8);
-        b = cliptobyte((298 * c + 516 * d + 128) >> 8);
-
-        unsigned int pixel = vga->rgb_to_pixel(r, g, b);
+        uint8_t *bgra = &pixels[x * 4];
+        unsigned int pixel = vga->rgb_to_pixel(bgra[2], bgra[1], bgra[0]);
         switch (surf_bpp) {
         case 1:
             ((uint8_t*)line)[ox] = pixel;
@@ -5729,6 +8962,7 @@ static void nv2a_gpu_overlay_draw_line(VGACommonState *vga, uint8_t *line, int y
             break;
         }
     }
+    g_free(pixels);
 }
 
 static int nv2a_gpu_get_bpp(VGACommonState *s)
@@ -5763,12 +8997,95 @@ static void nv2a_gpu_get_offsets(VGACommonState *s,
 }
 
 
+/* Shows the newest frame the GPU rendered to the scanout buffer. Returns
+   false if there is none or if the CPU wrote the buffer since, then VGA
+   has to read it from memory. */
+static bool nv2a_gpu_scanout_gpu_frame(NV2A_GPUState *d)
+{
+    PGRAPHState *pg = &d->pgraph;
+    VGACommonState *vga = &d->vga;
+    ScanoutFrame *frame = NULL;
+    uint32_t line_offset, start_addr, line_compare;
+    int width, height;
+    unsigned int i;
+
+    /* Only plain 32 bit modes, the overlay is mixed in by VGA per line */
+    if (!(vga->ar_index & 0x20) ||
+        !(vga->gr[VGA_GFX_MISC] & VGA_GR06_GRAPHICS_MODE) ||
+        (vga->get_bpp(vga) != 32) ||
+        (d->pvideo.regs[NV_PVIDEO_BUFFER] & NV_PVIDEO_BUFFER_0_USE)) {
+        return false;
+    }
+    vga->get_resolution(vga, &width, &height);
+    vga->get_offsets(vga, &line_offset, &start_addr, &line_compare);
+    MemoryBlock memory_block = { start_addr * 4, line_offset * height };
+
+    qemu_mutex_lock(&pg->scanout.lock);
+    for (i = 0; i < NV2A_GPU_SCANOUT_FRAMES; i++) {
+        ScanoutFrame *slot = &pg->scanout.frames[i];
+        if (slot->valid && (slot->address == memory_block.address) &&
+            (slot->pitch == line_offset) &&
+            (slot->width >= width) && (slot->height >= height)) {
+            frame = slot;
+            break;
+        }
+    }
+
+    /* CPU writes the render thread didn't see yet */
+    if (frame) {
+        memory_region_sync_dirty_bitmap(d->vram);
+        if (is_resource_memory_dirty(d, &memory_block)) {
+            frame = NULL;
+        }
+    }
+    if (frame == NULL) {
+        pg->scanout.memory_refreshes++;
+        qemu_mutex_unlock(&pg->scanout.lock);
+        return false;
+    }
+
+    /* VGA might have shared guest memory with the display */
+    DisplaySurface *surface = qemu_console_surface(vga->con);
+    if (!pg->scanout.presenting || is_buffer_shared(surface) ||
+        (surface_width(surface) != width) ||
+        (surface_height(surface) != height) ||
+        (surface_bits_per_pixel(surface) != 32)) {
+        qemu_console_resize(vga->con, width, height);
+        surface = qemu_console_surface(vga->con);
+        pg->scanout.presenting = true;
+        pg->scanout.presented_serial = 0;
+    }
+
+    if (frame->serial != pg->scanout.presented_serial) {
+        uint8_t *dst = surface_data(surface);
+        int y;
+        for (y = 0; y < height; y++) {
+            memcpy(dst + y * surface_stride(surface),
+                   frame->data + y * frame->width * 4,
+                   width * 4);
+        }
+        dpy_gfx_update(vga->con, 0, 0, width, height);
+        pg->scanout.presented_serial = frame->serial;
+    }
+    pg->scanout.gpu_refreshes++;
+    qemu_mutex_unlock(&pg->scanout.lock);
+    return true;
+}
+
 static void nv2a_gpu_vga_gfx_update(void *opaque)
 {
     VGACommonState *vga = opaque;
-    vga->hw_ops->gfx_update(vga);
-
     NV2A_GPUState *d = container_of(vga, NV2A_GPUState, vga);
+
+    if (!nv2a_gpu_scanout_gpu_frame(d)) {
+        if (d->pgraph.scanout.presenting) {
+            /* Our surface isn't what VGA left on the display */
+            d->pgraph.scanout.presenting = false;
+            d->hw_ops.invalidate(vga);
+        }
+        vga->hw_ops->gfx_update(vga);
+    }
+
     d->pcrtc.pending_interrupts |= NV_PCRTC_INTR_0_VBLANK;
     update_irq(d);
 }
@@ -5790,7 +9107,8 @@ static void nv2a_gpu_init_memory(NV2A_GPUState *d, MemoryRegion *ram)
                          memory_region_size(&d->vram) - 0x100000,
                          0x100000); */
 
-    memory_region_add_subregion(&d->mmio, 0x700000, &d->ramin);
+    /* The guest goes through the PRAMIN block, so the ramin cache sees all
+       writes */
 
 
     d->vram_ptr = memory_region_get_ram_ptr(d->vram);
@@ -5799,6 +9117,7 @@ static void nv2a_gpu_init_memory(NV2A_GPUState *d, MemoryRegion *ram)
     memory_region_set_log(d->vram, true, DIRTY_MEMORY_NV2A_GPU_COLOR);
     memory_region_set_log(d->vram, true, DIRTY_MEMORY_NV2A_GPU_ZETA);
     memory_region_set_log(d->vram, true, DIRTY_MEMORY_NV2A_GPU_RESOURCE);
+    memory_region_set_log(d->vram, true, DIRTY_MEMORY_NV2A_GPU_VERTEX);
 
     /* hacky. swap out vga's vram */
     memory_region_destroy(&d->vga.vram);
@@ -5855,13 +9174,23 @@ static int nv2a_gpu_initfn(PCIDevice *dev)
                                     &d->block_mmio[i]);
     }
 
+    qemu_mutex_init(&d->ramin_cache.lock);
+    d->ramin_cache.ramht = g_hash_table_new_full(g_int64_hash, g_int64_equal,
+                                                 NULL, g_free);
+    d->ramin_cache.dma = g_hash_table_new_full(g_int64_hash, g_int64_equal,
+                                               NULL, g_free);
+
     /* init fifo cache1 */
     qemu_mutex_init(&d->pfifo.cache1.pull_lock);
     qemu_mutex_init(&d->pfifo.cache1.cache_lock);
     qemu_cond_init(&d->pfifo.cache1.cache_cond);
-    QSIMPLEQ_INIT(&d->pfifo.cache1.cache);
+    d->pfifo.pusher_bh = qemu_bh_new(pfifo_pusher_bh, d);
 
     pgraph_init(&d->pgraph);
+    render_queue_init(d);
+
+    assert(nv2a_gpu_device == NULL);
+    nv2a_gpu_device = d;
 
     return 0;
 }
@@ -5874,8 +9203,97 @@ static void nv2a_gpu_exitfn(PCIDevice *dev)
     qemu_mutex_destroy(&d->pfifo.cache1.pull_lock);
     qemu_mutex_destroy(&d->pfifo.cache1.cache_lock);
     qemu_cond_destroy(&d->pfifo.cache1.cache_cond);
+    qemu_bh_delete(d->pfifo.pusher_bh);
 
+    nv2a_gpu_device = NULL;
+
+    render_queue_destroy(d);
+    trace_destroy(d);
     pgraph_destroy(&d->pgraph);
+
+    g_hash_table_destroy(d->ramin_cache.ramht);
+    g_hash_table_destroy(d->ramin_cache.dma);
+    qemu_mutex_destroy(&d->ramin_cache.lock);
+}
+
+/* Lower bounds of the frame time histogram buckets in ms */
+static const unsigned int profile_histogram_ms[] = {
+    0, 4, 8, 12, 16, 20, 25, 33, 50, 66, 100
+};
+
+NV2AStats *qmp_query_nv2a_stats(Error **errp)
+{
+    PGRAPHState *pg;
+    ProfileFrame frame;
+    uint64_t frames;
+    int64_t history_ns[NV2A_GPU_PROFILE_HISTORY];
+    unsigned int buckets[ARRAY_SIZE(profile_histogram_ms)];
+    unsigned int i, j;
+
+    if (nv2a_gpu_device == NULL) {
+        error_set(errp, QERR_DEVICE_NOT_FOUND, "nv2a");
+        return NULL;
+    }
+    pg = &nv2a_gpu_device->pgraph;
+
+    qemu_mutex_lock(&pg->profile.lock);
+    frame = pg->profile.last;
+    frames = pg->profile.frames;
+    memcpy(history_ns, pg->profile.history_ns, sizeof(history_ns));
+    qemu_mutex_unlock(&pg->profile.lock);
+
+    NV2AStats *info = g_malloc0(sizeof(*info));
+    info->frame = frame.frame;
+    info->frame_ns = frame.ns;
+    info->draws = frame.draws;
+    info->upload_bytes = frame.upload_bytes;
+
+    /* Lists are built back to front */
+    for (i = PROFILE_STAGE_COUNT; i-- > 0;) {
+        NV2AStageStatsList *entry = g_malloc0(sizeof(*entry));
+        entry->value = g_malloc0(sizeof(*entry->value));
+        entry->value->name = g_strdup(profile_stage_names[i]);
+        entry->value->count = frame.stage_count[i];
+        entry->value->ns = frame.stage_ns[i];
+        entry->next = info->stages;
+        info->stages = entry;
+    }
+
+    for (i = frame.methods; i-- > 0;) {
+        ProfileMethod *m = &frame.top_methods[i];
+        const char *name = pgraph_method_name(m->graphics_class, m->method);
+        NV2AMethodStatsList *entry = g_malloc0(sizeof(*entry));
+        entry->value = g_malloc0(sizeof(*entry->value));
+        entry->value->graphics_class = m->graphics_class;
+        entry->value->method = m->method;
+        entry->value->has_name = (name != NULL);
+        entry->value->name = g_strdup(name);
+        entry->value->count = m->count;
+        entry->value->ns = m->ns;
+        entry->next = info->methods;
+        info->methods = entry;
+    }
+
+    memset(buckets, 0, sizeof(buckets));
+    for (i = 0; i < MIN(frames, NV2A_GPU_PROFILE_HISTORY); i++) {
+        int64_t ms = history_ns[i] / 1000000;
+        for (j = ARRAY_SIZE(buckets) - 1; j > 0; j--) {
+            if (ms >= profile_histogram_ms[j]) {
+                break;
+            }
+        }
+        buckets[j]++;
+    }
+    for (i = ARRAY_SIZE(buckets); i-- > 0;) {
+        NV2AFrameTimeBucketList *entry = g_malloc0(sizeof(*entry));
+        entry->value = g_malloc0(sizeof(*entry->value));
+        entry->value->min_ms = profile_histogram_ms[i];
+        entry->value->frames = buckets[i];
+        entry->next = info->histogram;
+        info->histogram = entry;
+    }
+
+    return info;
 }
 
 static void nv2a_gpu_class_init(ObjectClass *klass, void *data)
@@ -5959,4 +9377,5 @@ void nv2a_gpu_init(PCIBus *bus, int devfn, MemoryRegion *ram)
     PCIDevice *dev = pci_create_simple(bus, devfn, "nv2a");
     NV2A_GPUState *d = NV2A_GPU_DEVICE(dev);
     nv2a_gpu_init_memory(d, ram);
+    trace_init(d);
 }
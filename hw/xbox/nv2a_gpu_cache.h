@@ -37,6 +37,15 @@ static inline bool is_resource_memory_dirty(const NV2A_GPUState* d, const Memory
                                             DIRTY_MEMORY_NV2A_GPU_RESOURCE);
 }
 
+/* What is_resource_memory_dirty says without sub-page tracking */
+static inline bool is_resource_memory_page_dirty(const NV2A_GPUState* d, const MemoryBlock* memory_block)
+{
+    hwaddr start = memory_block->address & TARGET_PAGE_MASK;
+    hwaddr end = TARGET_PAGE_ALIGN(memory_block->address + memory_block->size);
+    return memory_region_get_dirty(d->vram, start, end - start,
+                                   DIRTY_MEMORY_NV2A_GPU_RESOURCE);
+}
+
 static inline void set_resource_memory_clean(const NV2A_GPUState* d, const MemoryBlock* memory_block)
 {
     memory_region_reset_dirty(d->vram,
@@ -69,49 +78,234 @@ static bool contains(const MemoryBlock* a, const MemoryBlock* b)
     return true;
 }
 
-#if 0
-typedef struct {
+/* Address ordered AVL tree of memory blocks, nodes are embedded in the
+   resources. Every node also knows the last byte used by any block in its
+   subtree, so all blocks overlapping a range are found in O(log n + k). */
+typedef struct MemoryBlockNode {
+    hwaddr start;
+    hwaddr end; /* Last byte of the block */
+    hwaddr max_end; /* Largest end in this subtree */
+    int height;
+    struct MemoryBlockNode* left;
+    struct MemoryBlockNode* right;
+} MemoryBlockNode;
+
+static inline int memory_block_node_height(const MemoryBlockNode* node)
+{
+    return node ? node->height : 0;
+}
+
+static void memory_block_node_update(MemoryBlockNode* node)
+{
+    node->height = MAX(memory_block_node_height(node->left),
+                       memory_block_node_height(node->right)) + 1;
+    node->max_end = node->end;
+    if (node->left && (node->left->max_end > node->max_end)) {
+        node->max_end = node->left->max_end;
+    }
+    if (node->right && (node->right->max_end > node->max_end)) {
+        node->max_end = node->right->max_end;
+    }
+}
+
+static MemoryBlockNode* memory_block_node_rotate_left(MemoryBlockNode* node)
+{
+    MemoryBlockNode* pivot = node->right;
+    node->right = pivot->left;
+    pivot->left = node;
+    memory_block_node_update(node);
+    memory_block_node_update(pivot);
+    return pivot;
+}
+
+static MemoryBlockNode* memory_block_node_rotate_right(MemoryBlockNode* node)
+{
+    MemoryBlockNode* pivot = node->left;
+    node->left = pivot->right;
+    pivot->right = node;
+    memory_block_node_update(node);
+    memory_block_node_update(pivot);
+    return pivot;
+}
+
+static MemoryBlockNode* memory_block_node_balance(MemoryBlockNode* node)
+{
+    int balance;
+    memory_block_node_update(node);
+    balance = memory_block_node_height(node->left)
+                  - memory_block_node_height(node->right);
+    if (balance > 1) {
+        if (memory_block_node_height(node->left->left)
+                < memory_block_node_height(node->left->right)) {
+            node->left = memory_block_node_rotate_left(node->left);
+        }
+        return memory_block_node_rotate_right(node);
+    }
+    if (balance < -1) {
+        if (memory_block_node_height(node->right->right)
+                < memory_block_node_height(node->right->left)) {
+            node->right = memory_block_node_rotate_right(node->right);
+        }
+        return memory_block_node_rotate_left(node);
+    }
+    return node;
+}
+
+/* Blocks with the same start address are ordered by node address */
+static int memory_block_node_compare(const MemoryBlockNode* a,
+                                     const MemoryBlockNode* b)
+{
+    if (a->start != b->start) {
+        return (a->start < b->start) ? -1 : 1;
+    }
+    if (a != b) {
+        return ((uintptr_t)a < (uintptr_t)b) ? -1 : 1;
+    }
+    return 0;
+}
+
+static MemoryBlockNode* memory_block_node_insert(MemoryBlockNode* root,
+                                                 MemoryBlockNode* node)
+{
+    if (root == NULL) {
+        node->left = NULL;
+        node->right = NULL;
+        memory_block_node_update(node);
+        return node;
+    }
+    if (memory_block_node_compare(node, root) < 0) {
+        root->left = memory_block_node_insert(root->left, node);
+    } else {
+        root->right = memory_block_node_insert(root->right, node);
+    }
+    return memory_block_node_balance(root);
+}
+
+static MemoryBlockNode* memory_block_node_remove_min(MemoryBlockNode* root,
+                                                     MemoryBlockNode** min)
+{
+    if (root->left == NULL) {
+        *min = root;
+        return root->right;
+    }
+    root->left = memory_block_node_remove_min(root->left, min);
+    return memory_block_node_balance(root);
+}
+
+static MemoryBlockNode* memory_block_node_remove(MemoryBlockNode* root,
+                                                 MemoryBlockNode* node)
+{
+    MemoryBlockNode* successor;
+    MemoryBlockNode* right;
+    int order;
+
+    assert(root != NULL); /* The node wasn't in the tree */
+    order = memory_block_node_compare(node, root);
+    if (order < 0) {
+        root->left = memory_block_node_remove(root->left, node);
+    } else if (order > 0) {
+        root->right = memory_block_node_remove(root->right, node);
+    } else {
+        if (root->left == NULL) { return root->right; }
+        if (root->right == NULL) { return root->left; }
+        right = memory_block_node_remove_min(root->right, &successor);
+        successor->left = root->left;
+        successor->right = right;
+        root = successor;
+    }
+    return memory_block_node_balance(root);
+}
+
+static void memory_block_node_find_overlaps(MemoryBlockNode* root,
+                                            hwaddr start, hwaddr end,
+                                            GPtrArray* nodes)
+{
+    if ((root == NULL) || (root->max_end < start)) {
+        return;
+    }
+    memory_block_node_find_overlaps(root->left, start, end, nodes);
+    if (root->start > end) {
+        return; /* Everything to the right starts even later */
+    }
+    if (root->end >= start) {
+        g_ptr_array_add(nodes, root);
+    }
+    memory_block_node_find_overlaps(root->right, start, end, nodes);
+}
+
+static void index_memory_block(MemoryBlockNode** root,
+                               MemoryBlockNode* node,
+                               const MemoryBlock* memory_block)
+{
+    assert(memory_block->size > 0);
+    node->start = memory_block->address;
+    node->end = memory_block->address + memory_block->size - 1;
+    *root = memory_block_node_insert(*root, node);
+}
+
+static void unindex_memory_block(MemoryBlockNode** root,
+                                 MemoryBlockNode* node)
+{
+    *root = memory_block_node_remove(*root, node);
+}
+
+/* Appends all nodes which overlap memory_block to nodes */
+static void find_overlapping_memory_blocks(MemoryBlockNode* root,
+                                           const MemoryBlock* memory_block,
+                                           GPtrArray* nodes)
+{
+    assert(memory_block->size > 0);
+    memory_block_node_find_overlaps(root, memory_block->address,
+                                    memory_block->address
+                                        + memory_block->size - 1,
+                                    nodes);
+}
+
+typedef struct Vertexshader {
     struct VertexshaderKey {
-        uint32_t hash;
+        guint hash; /* Of the transform program, 0 for fixed function */
+        unsigned int transform_program_length; /* In words */
+        uint32_t* transform_program; /* Owned by the cache entry */
     } key;
     GLuint shader;
 } Vertexshader;
 
-typedef struct {
-    struct FFPVertexshaderKey {
-        //FIXME: Do this properly by shadowing the pgraph regs - this is just an empty placeholder
-        bool textureMatrix[4];
-    } key;
-    GLuint shader;
-} FFPVertexshader;
-
-typedef struct {
+typedef struct Fragmentshader {
     struct FragmentshaderKey {
-        //FIXME: Do this properly by shadowing the pgraph regs - this is just a placeholder from _psh.h
-        uint32_t combiner_control, uint32_t shader_stage_program,
-        uint32_t other_stage_input,
-        uint32_t rgb_inputs[8], uint32_t rgb_outputs[8],
-        uint32_t alpha_inputs[8], uint32_t alpha_outputs[8],
+        //FIXME: Do this properly by shadowing the pgraph regs
+        uint32_t combiner_control;
+        uint32_t shader_stage_program;
+        uint32_t other_stage_input;
+        uint32_t rgb_inputs[8], rgb_outputs[8];
+        uint32_t alpha_inputs[8], alpha_outputs[8];
         /*uint32_t constant_0[8], uint32_t constant_1[8],*/
-        uint32_t final_inputs_0, uint32_t final_inputs_1,
+        uint32_t final_inputs_0, final_inputs_1;
         /*uint32_t final_constant_0, uint32_t final_constant_1,*/
-        bool rect_tex[4], bool compare_mode[4][4],
-        bool alphakill[4]
+        bool rect_tex[4];
+        bool compare_mode[4][4];
+        bool alphakill[4];
     } key;
     GLuint shader;
 } Fragmentshader;
 
-typedef struct {
+typedef struct Shaderprogram {
     struct ShaderprogramKey {
         GLuint vertexshader, fragmentshader;
     } key;
     GLuint program;
 } Shaderprogram;
 
-#endif
 
+/* Readbacks in flight per Pixels, so a new readback never has to wait for
+   the GPU to finish with an older buffer */
+#define NV2A_GPU_READBACK_RING_SIZE 3
 
-typedef struct {
+typedef struct PixelsReadback {
+    GLuint gl_buffer;
+    GLsync fence; /* Signaled once the data arrived in gl_buffer */
+} PixelsReadback;
+
+typedef struct Pixels {
     struct PixelsKey {
         MemoryBlock memory_block; /* Used memory block */ //FIXME: calculate size from MAX(width*bytes_per_pixel,pitch)*height
         bool swizzled; /* Was the texture loaded from swizzled memory? */
@@ -123,6 +317,12 @@ typedef struct {
     GLuint gl_buffer;
     bool draw_dirty; // Content not from RAM / modified by GPU
     bool dirty; // Needs reupload from RAM
+    MemoryBlockNode node; /* In pgraph.cache_index.pixels */
+    QLIST_ENTRY(Pixels) draw_dirty_entry; /* In pgraph.draw_dirty_pixels */
+    /* Framebuffer readbacks, only the newest one is still of interest */
+    PixelsReadback readback[NV2A_GPU_READBACK_RING_SIZE];
+    unsigned int readback_newest;
+    unsigned int readback_dirty_client; /* Shows CPU writes after the readback */
 } Pixels;
 
 typedef struct {
@@ -137,8 +337,31 @@ typedef struct {
 //    unsigned int min_mipmap_level;
 //    unsigned int max_mipmap_level;
     GLuint gl_texture;
+    MemoryBlockNode node; /* In pgraph.cache_index.texture_2d, all levels */
 } Texture2D;
 
+/* Sampled texture, the contents are hashed so memory which was written but
+   didn't change doesn't have to be uploaded again */
+typedef struct Texture {
+    struct TextureKey {
+        hwaddr address;
+        unsigned int color_format;
+        unsigned int width, height;
+        unsigned int pitch;
+        unsigned int levels;
+        uint32_t palette_hash; /* Of the colors, 0 if there is no palette */
+    } key;
+    GLenum gl_target;
+    GLuint gl_texture;
+    size_t data_size; /* Guest memory used by all levels */
+    MemoryBlockNode node; /* In pgraph.cache_index.texture */
+    uint32_t data_hash;
+    bool dirty; /* The guest wrote to the memory since data_hash was taken */
+    bool prefetched; /* A prefetch hashes the memory since the last write */
+    unsigned int bind_stamp; /* Last pgraph_bind_textures which used this */
+    QTAILQ_ENTRY(Texture) lru;
+} Texture;
+
 typedef struct Framebuffer {
     struct FramebufferKey {
         Texture2D* zeta_texture;
@@ -158,6 +381,11 @@ typedef struct {
     MemoryBlock* memory_block;
 } NV2A_GPUStateMemoryBlock;
 
+static bool download_pixels_to_memory(NV2A_GPUState* d, Pixels* pixels,
+                                      bool wait);
+static void invalidate_scanout_frames(PGRAPHState* pg,
+                                      const MemoryBlock* memory_block);
+
 /* Checks if memory_block overlaps pixels and marks pixels dirty.
    If memory_block is NULL this will always mark the pixels dirty. */
 static void mark_pixels_dirty(NV2A_GPUState* d, const MemoryBlock* memory_block, Pixels* pixels)
@@ -169,6 +397,11 @@ static void mark_pixels_dirty(NV2A_GPUState* d, const MemoryBlock* memory_block,
         pixels->key.memory_block.address+pixels->key.memory_block.size-1,
         overlapping?"Hit":"Miss");
     if ((memory_block == NULL) || overlapping) {
+        /* The memory was written after the readback was started, the
+           GPU results still go to the pages the CPU didn't write to */
+        if (pixels->draw_dirty) {
+            download_pixels_to_memory(d, pixels, true);
+        }
         debugger_message("Setting pixels dirty: %d", pixels->gl_buffer);
         pixels->dirty = true;
         debugger_message("Checking pixels dirty: %d", pixels->gl_buffer);
@@ -178,6 +411,12 @@ static void mark_pixels_dirty(NV2A_GPUState* d, const MemoryBlock* memory_block,
     debugger_pop_group();
 }
 
+static void mark_texture_dirty(Texture* texture)
+{
+    texture->dirty = true;
+    texture->prefetched = false;
+}
+
 static void mark_all_pixels_dirty_callback(
     gpointer key,
     gpointer value,
@@ -192,8 +431,12 @@ static void mark_all_pixels_dirty_callback(
 
 /* Checks if memory_block overlaps any resource and marks those resources dirty.
    If memory_block is NULL this will mark every resource dirty.
-   The qemu resource dirty bits are clean for the used block aftwards */
-static void sync_all_resources_memory_dirty(NV2A_GPUState* d, const MemoryBlock* memory_block) {
+   The qemu resource dirty bits are clean for the used block aftwards.
+   gpu_write is set if the memory only got GPU results written back, the
+   frames the display got from the GPU already show those. */
+static void sync_resources_memory_dirty(NV2A_GPUState* d,
+                                        const MemoryBlock* memory_block,
+                                        bool gpu_write) {
     debugger_push_group("NV2A: sync_all_resources_memory_dirty(0x%x - 0x%x)",
                         memory_block?
                             memory_block->address:
@@ -205,85 +448,134 @@ static void sync_all_resources_memory_dirty(NV2A_GPUState* d, const MemoryBlock*
         d, memory_block
     };
     memory_region_sync_dirty_bitmap(d->vram);     //FIXME: Optimally this should only happen once per draw call! so this should be moved into a wrapper functoin which prepares everyting memory related
-    if ((memory_block == NULL) || is_resource_memory_dirty(d, memory_block)) {
+    if (memory_block == NULL) {
+        Texture* texture;
         g_hash_table_foreach(d->pgraph.cache.pixels, mark_all_pixels_dirty_callback, (gpointer)&d_memory_block);
+        QTAILQ_FOREACH(texture, &d->pgraph.texture_cache.lru, lru) {
+            mark_texture_dirty(texture);
+        }
+        if (!gpu_write) {
+            invalidate_scanout_frames(&d->pgraph, NULL);
+        }
+    } else if (is_resource_memory_dirty(d, memory_block)) {
+        GPtrArray* nodes = g_ptr_array_new();
+        unsigned int i;
+        find_overlapping_memory_blocks(d->pgraph.cache_index.pixels,
+                                       memory_block, nodes);
+        for (i = 0; i < nodes->len; i++) {
+            mark_pixels_dirty(d, memory_block,
+                              container_of(g_ptr_array_index(nodes, i),
+                                           Pixels, node));
+        }
+        g_ptr_array_set_size(nodes, 0);
+        find_overlapping_memory_blocks(d->pgraph.cache_index.texture,
+                                       memory_block, nodes);
+        for (i = 0; i < nodes->len; i++) {
+            mark_texture_dirty(container_of(g_ptr_array_index(nodes, i),
+                                            Texture, node));
+        }
+        g_ptr_array_free(nodes, TRUE);
         //FIXME: Add other resources
-        if (memory_block != NULL) {
-            set_resource_memory_clean(d, memory_block);
+        if (!gpu_write) {
+            invalidate_scanout_frames(&d->pgraph, memory_block);
         }
-    }    
+        set_resource_memory_clean(d, memory_block);
+    } else if (d->pgraph.subpage_dirty.enabled &&
+               is_resource_memory_page_dirty(d, memory_block)) {
+        d->pgraph.subpage_dirty.uploads_avoided++;
+    }
     debugger_pop_group();
 }
 
-static gboolean remove_pixels_from_texture_2d_cache_callback(
-    gpointer key,
-    gpointer value,
-    gpointer user_data)
+static void sync_all_resources_memory_dirty(NV2A_GPUState* d, const MemoryBlock* memory_block) {
+    sync_resources_memory_dirty(d, memory_block, false);
+}
+
+static void remove_pixels_from_texture_2d(Texture2D* texture_2d, Pixels* pixels)
 {
-    Pixels* pixels = (Pixels*)user_data;
-    Texture2D* texture_2d = (Texture2D*)key;
     unsigned int level;
-    gboolean exists = FALSE;
     for(level = 0; level < texture_2d->key.levels; level++) {
         /* Remove texture level if this uses the deleted buffer */
         if (texture_2d->buffer[level] == pixels) {
             texture_2d->buffer[level] = NULL;
         }
-        /* Check if any texture level exists to keep this in cache*/
-        if (texture_2d->buffer[level] != NULL) {
-            exists = TRUE;
-        }
     }
-    return exists;
 }
 
+/* The textures stay in the cache, the next bind will find the missing
+   buffer and upload the level again */
 static void remove_pixels_from_textures(PGRAPHState* pg, Pixels* pixels)
 {
     //FIXME: If this is currently a rendertarget we have to write it back to memory, we also have to invalidate the framebuffer because the texture might be deleted!
 
-    /* These are foreach_remove because textures without buffer will be destroyed */
+    /* Only textures overlapping the pixels can use them */
+    GPtrArray* nodes = g_ptr_array_new();
+    unsigned int i;
+    find_overlapping_memory_blocks(pg->cache_index.texture_2d,
+                                   &pixels->key.memory_block, nodes);
+    for (i = 0; i < nodes->len; i++) {
+        remove_pixels_from_texture_2d(container_of(g_ptr_array_index(nodes, i),
+                                                   Texture2D, node),
+                                      pixels);
+    }
+    g_ptr_array_free(nodes, TRUE);
     //FIXME: Add other caches..
-    g_hash_table_foreach_remove(pg->cache.texture_2d,
-                                remove_pixels_from_texture_2d_cache_callback,
-                                pixels);
 }
 
-typedef struct {
-    PGRAPHState* pg;
-    MemoryBlock* memory_block;
-} PGRAPHStateMemoryBlock;
+static void set_pixels_draw_dirty(PGRAPHState* pg, Pixels* pixels,
+                                  bool draw_dirty)
+{
+    if (draw_dirty && !pixels->draw_dirty) {
+        QLIST_INSERT_HEAD(&pg->draw_dirty_pixels, pixels, draw_dirty_entry);
+    } else if (!draw_dirty && pixels->draw_dirty) {
+        QLIST_REMOVE(pixels, draw_dirty_entry);
+    }
+    pixels->draw_dirty = draw_dirty;
+}
 
-static gboolean remove_memory_from_pixels_cache_callback(
-    gpointer key,
-    gpointer value,
-    gpointer user_data)
+static void delete_pixels_readbacks(Pixels* pixels)
 {
-    PGRAPHStateMemoryBlock* pg_memory_block = (PGRAPHStateMemoryBlock*)user_data;
-    Pixels* pixels = (Pixels*)key;
-    
-    /* Remove the pixels if the memory block overlaps the given block */
-    if (overlaps(&pixels->key.memory_block, pg_memory_block->memory_block)) {
-        //FIXME: do this elsewhere?
-        {
-            debugger_message("Deleting pixels %d, draw dirty: %d", pixels->gl_buffer, pixels->draw_dirty);
-            assert(!pixels->draw_dirty); //FIXME: Should be as simle as downloading them now..
-            remove_pixels_from_textures(pg_memory_block->pg, pixels);
-            glDeleteBuffersARB(1, &pixels->gl_buffer); 
+    unsigned int i;
+    for (i = 0; i < NV2A_GPU_READBACK_RING_SIZE; i++) {
+        PixelsReadback* readback = &pixels->readback[i];
+        if (readback->fence) {
+            glDeleteSync(readback->fence);
+            readback->fence = NULL;
+        }
+        if (readback->gl_buffer) {
+            glDeleteBuffersARB(1, &readback->gl_buffer);
+            readback->gl_buffer = 0;
         }
-        return TRUE;
-    } else {
-        return FALSE;
     }
 }
 
-static void remove_memory_from_pixels_cache(PGRAPHState* pg, const MemoryBlock* memory_block)
+static void remove_memory_from_pixels_cache(NV2A_GPUState* d, const MemoryBlock* memory_block)
 {
-    PGRAPHStateMemoryBlock pg_memory_block = {
-        pg, memory_block
-    };
-    g_hash_table_foreach_remove(pg->cache.pixels,
-                                remove_memory_from_pixels_cache_callback,
-                                &pg_memory_block);
+    PGRAPHState* pg = &d->pgraph;
+    GPtrArray* nodes = g_ptr_array_new();
+    unsigned int i;
+    find_overlapping_memory_blocks(pg->cache_index.pixels, memory_block, nodes);
+    for (i = 0; i < nodes->len; i++) {
+        Pixels* pixels = container_of(g_ptr_array_index(nodes, i),
+                                      Pixels, node);
+        //FIXME: do this elsewhere?
+        debugger_message("Deleting pixels %d, draw dirty: %d", pixels->gl_buffer, pixels->draw_dirty);
+        /* Don't kill GPU results which are still on their way to memory */
+        download_pixels_to_memory(d, pixels, true);
+        assert(!pixels->draw_dirty);
+        remove_pixels_from_textures(pg, pixels);
+        delete_pixels_readbacks(pixels);
+        glDeleteBuffersARB(1, &pixels->gl_buffer);
+        if (pg->subpage_dirty.enabled) {
+            memory_region_set_subpage_log(d->vram,
+                                          pixels->key.memory_block.address,
+                                          pixels->key.memory_block.size,
+                                          false);
+        }
+        unindex_memory_block(&pg->cache_index.pixels, &pixels->node);
+        g_hash_table_remove(pg->cache.pixels, pixels);
+    }
+    g_ptr_array_free(nodes, TRUE);
 }
 
 
@@ -348,7 +640,7 @@ gboolean pixels_equal(gconstpointer a, gconstpointer b)
     }
 #endif
 
-Pixels* create_pixels(PGRAPHState* pg,
+Pixels* create_pixels(NV2A_GPUState* d,
     const MemoryBlock* memory_block,
     bool swizzled,
     unsigned int bytes_per_pixel,
@@ -356,7 +648,7 @@ Pixels* create_pixels(PGRAPHState* pg,
     unsigned int data_width,
     unsigned int data_height)
 {
-
+    PGRAPHState* pg = &d->pgraph;
     Pixels* cache_pixels;
     Pixels pixels = {
         .key = {
@@ -395,8 +687,17 @@ Pixels* create_pixels(PGRAPHState* pg,
 //    debugger_label(GL_BUFFER, cache_pixels->gl_buffer, "FIXME: Pixel buffer");
 
     /* Remove any old entry in the same region, then add new entry to cache */
-    remove_memory_from_pixels_cache(pg, &cache_pixels->key.memory_block);
+    remove_memory_from_pixels_cache(d, &cache_pixels->key.memory_block);
     g_hash_table_add(pg->cache.pixels, cache_pixels);
+    index_memory_block(&pg->cache_index.pixels, &cache_pixels->node,
+                       &cache_pixels->key.memory_block);
+    /* Only the pixels' own bytes make them dirty */
+    if (pg->subpage_dirty.enabled) {
+        memory_region_set_subpage_log(d->vram,
+                                      cache_pixels->key.memory_block.address,
+                                      cache_pixels->key.memory_block.size,
+                                      true);
+    }
     return cache_pixels;
 }
 
@@ -405,10 +706,22 @@ Pixels* create_pixels(PGRAPHState* pg,
 
 
 
+/* Drops the newest readback, the pixels keep whatever is in memory */
+static void abort_pixels_readback(PGRAPHState* pg, Pixels* pixels)
+{
+    PixelsReadback* readback = &pixels->readback[pixels->readback_newest];
+    if (readback->fence) {
+        glDeleteSync(readback->fence);
+        readback->fence = NULL;
+    }
+    set_pixels_draw_dirty(pg, pixels, false);
+}
+
 /* If a buffer-copy is still in progress you can use this to get a new buffer
    so you don't have to wait for the old buffer-copy to complete
    Note that this leaves the contents empty */
 static void abort_framebuffer_to_pixels_download(
+    PGRAPHState* pg,
     Framebuffer* framebuffer,
     bool zeta,
     bool color)
@@ -418,10 +731,7 @@ static void abort_framebuffer_to_pixels_download(
     if (zeta) {
         Pixels* pixels = framebuffer->key.zeta_texture->buffer[0];
         if (pixels) {
-            glBindBufferARB(GL_PIXEL_PACK_BUFFER_ARB, pixels->gl_buffer);
-            glBufferDataARB(GL_PIXEL_PACK_BUFFER_ARB,
-                            0,
-                            NULL, GL_STREAM_DRAW_ARB);
+            abort_pixels_readback(pg, pixels);
         }
     }
 
@@ -429,15 +739,77 @@ static void abort_framebuffer_to_pixels_download(
     if (color) {
         Pixels* pixels = framebuffer->key.color_texture->buffer[0];
         if (pixels) {
-            glBindBufferARB(GL_PIXEL_PACK_BUFFER_ARB, pixels->gl_buffer);
-            glBufferDataARB(GL_PIXEL_PACK_BUFFER_ARB,
-                            0,
-                            NULL, GL_STREAM_DRAW_ARB);
+            abort_pixels_readback(pg, pixels);
         }
     }
 
 }
 
+/* Reads the bound framebuffer into the next buffer of the readback ring.
+   This doesn't wait for the GPU, download_pixels_to_memory will pick the
+   data up once it's needed. */
+static void start_pixels_readback(
+    NV2A_GPUState* d,
+    Pixels* pixels,
+    const TextureFormatInfo* mapped_format,
+    unsigned int dirty_client)
+{
+    ProfileStage outer_stage = profile_enter(&d->pgraph,
+                                             PROFILE_STAGE_READBACK);
+
+    /* Older writes are none of the readbacks business, let everyone else
+       know about them now */
+    sync_all_resources_memory_dirty(d, &pixels->key.memory_block);
+    pixels->dirty = false; /* The GPU has the latest contents */
+
+    PixelsReadback* readback = &pixels->readback[pixels->readback_newest];
+
+    /* The last readback is outdated now */
+    if (readback->fence) {
+        glDeleteSync(readback->fence);
+        readback->fence = NULL;
+    }
+
+    pixels->readback_newest = (pixels->readback_newest + 1)
+                                  % NV2A_GPU_READBACK_RING_SIZE;
+    readback = &pixels->readback[pixels->readback_newest];
+    assert(readback->fence == NULL);
+
+    if (readback->gl_buffer == 0) {
+        glGenBuffersARB(1, &readback->gl_buffer);
+        glBindBufferARB(GL_PIXEL_PACK_BUFFER_ARB, readback->gl_buffer);
+        glBufferDataARB(GL_PIXEL_PACK_BUFFER_ARB,
+                        pixels->key.data_width * pixels->key.data_height
+                            * pixels->key.bytes_per_pixel,
+                        NULL, GL_STREAM_READ_ARB);
+    } else {
+        glBindBufferARB(GL_PIXEL_PACK_BUFFER_ARB, readback->gl_buffer);
+    }
+
+/*
+    glo_readpixels(mapped_format->gl_format, mapped_format->gl_type,
+                   pixels->key.bytes_per_pixel,
+                   pixels->key.data_width * pixels->key.bytes_per_pixel,
+                   pixels->key.data_width, pixels->key.data_height, 0);
+*/
+    glReadPixels(0, 0, pixels->key.data_width, pixels->key.data_height,
+                 mapped_format->gl_format, mapped_format->gl_type,
+                 0);
+    glBindBufferARB(GL_PIXEL_PACK_BUFFER_ARB, 0);
+    readback->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+    /* Start watching for CPU writes which would make this readback stale */
+    memory_region_reset_dirty(d->vram,
+                              pixels->key.memory_block.address,
+                              pixels->key.memory_block.size,
+                              dirty_client);
+    pixels->readback_dirty_client = dirty_client;
+
+    debugger_message("Setting pixels draw dirty: %d", pixels->gl_buffer);
+    set_pixels_draw_dirty(&d->pgraph, pixels, true);
+    profile_leave(&d->pgraph, outer_stage);
+}
+
 static void mark_framebuffer_dirty(
     Framebuffer* framebuffer,
     bool zeta,
@@ -452,6 +824,7 @@ static void mark_framebuffer_dirty(
 /* This will be called internally to attempt to download changes using DMA 
    while CPU / GPU do someting else. */
 static void start_framebuffer_to_pixels_download(
+    NV2A_GPUState* d,
     Framebuffer* framebuffer,
     bool zeta,
     bool color)
@@ -473,25 +846,11 @@ static void start_framebuffer_to_pixels_download(
         //       Then bind it to the proper texture on creation so it's fed back instantly.
         Texture2D* texture = framebuffer->key.zeta_texture;
         if (texture != NULL) {
-            Pixels* pixels = texture->buffer[0];
-            const TextureFormatInfo* mapped_format =
-                &kelvin_texture_format_map[texture->key.format];
-            glBindBufferARB(GL_PIXEL_PACK_BUFFER_ARB,
-                            pixels->gl_buffer);
             debugger_push_group("downloading zeta surface");
-/*
-            glo_readpixels(mapped_format->gl_format, mapped_format->gl_type,
-                           pixels->key.bytes_per_pixel,
-                           pixels->key.data_width * pixels->key.bytes_per_pixel,
-                           pixels->key.data_width, pixels->key.data_height, 0);
-*/
-            glReadPixels(0, 0, pixels->key.data_width, pixels->key.data_height,
-                         mapped_format->gl_format, mapped_format->gl_type,
-                         0);
+            start_pixels_readback(d, texture->buffer[0],
+                                  &kelvin_texture_format_map[texture->key.format],
+                                  DIRTY_MEMORY_NV2A_GPU_ZETA);
             debugger_pop_group();
-            debugger_message("Setting pixels draw dirty: %d",
-                             pixels->gl_buffer);
-            pixels->draw_dirty = true;
         }
     }
 
@@ -499,26 +858,11 @@ static void start_framebuffer_to_pixels_download(
     if (color) {
         Texture2D* texture = framebuffer->key.color_texture;
         if (texture != NULL) {
-            Pixels* pixels = texture->buffer[0];
-            const TextureFormatInfo* mapped_format =
-                &kelvin_texture_format_map[texture->key.format];
-            glBindBufferARB(GL_PIXEL_PACK_BUFFER_ARB,
-                            pixels->gl_buffer);
             debugger_push_group("downloading color surface");
-/*
-            glo_readpixels(mapped_format->gl_format, mapped_format->gl_type,
-                           pixels->key.bytes_per_pixel,
-                           pixels->key.data_width * pixels->key.bytes_per_pixel,
-                           pixels->key.data_width, pixels->key.data_height, 0);
-*/
-            glReadPixels(0, 0, pixels->key.data_width, pixels->key.data_height,
-                         mapped_format->gl_format, mapped_format->gl_type,
-                         0);
-
+            start_pixels_readback(d, texture->buffer[0],
+                                  &kelvin_texture_format_map[texture->key.format],
+                                  DIRTY_MEMORY_NV2A_GPU_COLOR);
             debugger_pop_group();
-            debugger_message("Setting pixels draw dirty: %d",
-                             pixels->gl_buffer);
-            pixels->draw_dirty = true;
         }
     }
 
@@ -526,8 +870,228 @@ static void start_framebuffer_to_pixels_download(
 
 }
 
+/* Did the CPU write to the pixels since the last readback was started? */
+static bool is_pixels_memory_cpu_dirty(NV2A_GPUState* d, const Pixels* pixels)
+{
+    memory_region_sync_dirty_bitmap(d->vram);
+    return memory_region_get_dirty(d->vram,
+                                   pixels->key.memory_block.address,
+                                   pixels->key.memory_block.size,
+                                   pixels->readback_dirty_client);
+}
+
+static inline MemoryBlock get_fast_clear_memory_block(
+    const FastClear* fast_clear)
+{
+    MemoryBlock memory_block = { fast_clear->address, fast_clear->size };
+    return memory_block;
+}
+
+/* Returns the pending fast clear which will overwrite all of pixels */
+static FastClear* find_fast_clear(PGRAPHState* pg, const Pixels* pixels)
+{
+    FastClear* fast_clears[] = { &pg->color_fast_clear, &pg->zeta_fast_clear };
+    unsigned int i;
+    if (pixels == NULL) {
+        return NULL;
+    }
+    for (i = 0; i < ARRAY_SIZE(fast_clears); i++) {
+        FastClear* fast_clear = fast_clears[i];
+        if (fast_clear->pending &&
+            (fast_clear->address == pixels->key.memory_block.address) &&
+            (fast_clear->size == pixels->key.memory_block.size) &&
+            (fast_clear->swizzled == pixels->key.swizzled) &&
+            (fast_clear->bytes_per_pixel == pixels->key.bytes_per_pixel)) {
+            return fast_clear;
+        }
+    }
+    return NULL;
+}
+
+/* Does the pending fast clears of the surfaces in the bound framebuffer
+   with glClear. The GPU has the newest contents of them afterwards. */
+static void apply_fast_clears_on_gpu(PGRAPHState* pg)
+{
+    Framebuffer* framebuffer = pg->framebuffer;
+    GLbitfield gl_mask = 0;
+
+    if (framebuffer == NULL) {
+        return;
+    }
+
+    Texture2D* color_texture = framebuffer->key.color_texture;
+    if (color_texture && (find_fast_clear(pg, color_texture->buffer[0])
+                              == &pg->color_fast_clear)) {
+        FastClear* fast_clear = &pg->color_fast_clear;
+        gl_state_color_mask(pg, true, true, true, true);
+        pg->dirty.color_mask = true;
+        gl_state_clear_color(pg, fast_clear->gl_color[0],
+                                 fast_clear->gl_color[1],
+                                 fast_clear->gl_color[2],
+                                 fast_clear->gl_color[3]);
+        gl_mask |= fast_clear->gl_mask;
+        fast_clear->pending = false;
+        color_texture->buffer[0]->dirty = false;
+    }
+
+    Texture2D* zeta_texture = framebuffer->key.zeta_texture;
+    if (zeta_texture && (find_fast_clear(pg, zeta_texture->buffer[0])
+                             == &pg->zeta_fast_clear)) {
+        FastClear* fast_clear = &pg->zeta_fast_clear;
+        if (fast_clear->gl_mask & GL_DEPTH_BUFFER_BIT) {
+            gl_state_depth_mask(pg, true);
+            pg->dirty.depth_mask = true;
+            gl_state_clear_depth(pg, fast_clear->gl_depth);
+        }
+        if (fast_clear->gl_mask & GL_STENCIL_BUFFER_BIT) {
+            gl_state_stencil_mask(pg, 0xFF);
+            pg->dirty.stencil_mask = true;
+            gl_state_clear_stencil(pg, fast_clear->gl_stencil);
+        }
+        gl_mask |= fast_clear->gl_mask;
+        fast_clear->pending = false;
+        zeta_texture->buffer[0]->dirty = false;
+    }
+
+    if (gl_mask) {
+        debugger_push_group("NV2A: apply fast clear 0x%x", gl_mask);
+        gl_state_enable(pg, GL_STATE_SCISSOR_TEST, false);
+        gl_state_flush(pg);
+        glClear(gl_mask);
+        pg->fast_clear_stats.gpu++;
+        debugger_pop_group();
+    }
+}
+
+/* Fills the surface memory with the clear value, swizzling doesn't matter
+   because all pixels are the same */
+static void write_fast_clear_to_memory(NV2A_GPUState* d,
+                                       const FastClear* fast_clear)
+{
+    unsigned int row_length = fast_clear->width * fast_clear->bytes_per_pixel;
+    unsigned int rows = fast_clear->height;
+    unsigned int pitch = fast_clear->pitch;
+    uint8_t* row = d->vram_ptr + fast_clear->address;
+    unsigned int i;
+
+    if (fast_clear->swizzled) {
+        row_length *= rows;
+        rows = 1;
+        pitch = row_length;
+    }
+
+    for (i = 0; i < row_length; i += fast_clear->bytes_per_pixel) {
+        if (fast_clear->bytes_per_pixel == 2) {
+            stw_le_p(row + i, fast_clear->value);
+        } else {
+            assert(fast_clear->bytes_per_pixel == 4);
+            stl_le_p(row + i, fast_clear->value);
+        }
+    }
+    for (i = 1; i < rows; i++) {
+        memcpy(row + i * pitch, row, row_length);
+    }
+
+    /* Cached copies of this memory are outdated now */
+    MemoryBlock memory_block = {
+        fast_clear->address, (rows - 1) * pitch + row_length
+    };
+    set_memory_dirty(d, &memory_block);
+    sync_all_resources_memory_dirty(d, &memory_block);
+    d->pgraph.fast_clear_stats.memory++;
+}
+
+/* Somebody needs the memory of pending fast clears overlapping memory_block
+   (or of all of them if it's NULL). Surfaces in the bound framebuffer are
+   also cleared on the GPU, their next readback would bring back the old
+   contents otherwise. */
+static void flush_fast_clears_to_memory(NV2A_GPUState* d,
+                                        const MemoryBlock* memory_block)
+{
+    PGRAPHState* pg = &d->pgraph;
+    FastClear* fast_clears[] = { &pg->color_fast_clear, &pg->zeta_fast_clear };
+    bool flushed = false;
+    unsigned int i;
+
+    for (i = 0; i < ARRAY_SIZE(fast_clears); i++) {
+        FastClear* fast_clear = fast_clears[i];
+        MemoryBlock fast_clear_memory_block =
+            get_fast_clear_memory_block(fast_clear);
+        if (!fast_clear->pending || (memory_block &&
+            !overlaps(&fast_clear_memory_block, memory_block))) {
+            continue;
+        }
+        write_fast_clear_to_memory(d, fast_clear);
+        flushed = true;
+    }
+    if (!flushed) {
+        return;
+    }
+
+    /* GPU and memory agree on these afterwards */
+    apply_fast_clears_on_gpu(pg);
+
+    for (i = 0; i < ARRAY_SIZE(fast_clears); i++) {
+        FastClear* fast_clear = fast_clears[i];
+        MemoryBlock fast_clear_memory_block =
+            get_fast_clear_memory_block(fast_clear);
+        if (!memory_block || overlaps(&fast_clear_memory_block, memory_block)) {
+            fast_clear->pending = false;
+        }
+    }
+}
+
+/* Writes back all GPU results overlapping memory_block, waiting for the
+   readbacks if necessary */
+static void flush_pixels_to_memory(NV2A_GPUState* d,
+                                   const MemoryBlock* memory_block)
+{
+    GPtrArray* nodes;
+    unsigned int i;
+
+    flush_fast_clears_to_memory(d, memory_block);
+
+    if (QLIST_EMPTY(&d->pgraph.draw_dirty_pixels)) {
+        return;
+    }
+
+    nodes = g_ptr_array_new();
+    find_overlapping_memory_blocks(d->pgraph.cache_index.pixels,
+                                   memory_block, nodes);
+    for (i = 0; i < nodes->len; i++) {
+        download_pixels_to_memory(d, container_of(g_ptr_array_index(nodes, i),
+                                                  Pixels, node),
+                                  true);
+    }
+    g_ptr_array_free(nodes, TRUE);
+}
+
 static void upload_memory_to_pixels(NV2A_GPUState *d, Pixels* pixels) {
     debugger_push_group("NV2A: upload_memory_to_pixels(%d)", pixels->gl_buffer);
+    /* The old contents don't matter if they are about to be cleared */
+    if (find_fast_clear(&d->pgraph, pixels)) {
+        if (pixels->draw_dirty) {
+            abort_pixels_readback(&d->pgraph, pixels);
+        }
+        sync_all_resources_memory_dirty(d, &pixels->key.memory_block);
+        if (pixels->dirty) {
+            glBindBufferARB(GL_PIXEL_UNPACK_BUFFER_ARB, pixels->gl_buffer);
+            glBufferDataARB(GL_PIXEL_UNPACK_BUFFER_ARB,
+                            pixels->key.memory_block.size,
+                            NULL, GL_STREAM_DRAW_ARB);
+            remove_pixels_from_textures(&d->pgraph, pixels);
+            pixels->dirty = false;
+        }
+        debugger_pop_group();
+        return;
+    }
+    /* GPU results which didn't make it to memory yet are newer than the
+       memory, unless the CPU wrote to it in the meantime */
+    if (pixels->draw_dirty && !is_pixels_memory_cpu_dirty(d, pixels)) {
+        debugger_pop_group();
+        return;
+    }
+    flush_pixels_to_memory(d, &pixels->key.memory_block);
     sync_all_resources_memory_dirty(d, &pixels->key.memory_block);
     if (pixels->dirty) {
         assert(!pixels->draw_dirty); /* Make sure we don't kill GPU results */
@@ -560,6 +1124,7 @@ static void upload_memory_to_pixels(NV2A_GPUState *d, Pixels* pixels) {
                  pixels->key.bytes_per_pixel);
         }
         glUnmapBufferARB(GL_PIXEL_UNPACK_BUFFER_ARB);
+        d->pgraph.frame_stats.upload_bytes += pixels->key.memory_block.size;
         debugger_message("Setting pixels clean: %d", pixels->gl_buffer);
         /* Inform all users by removing the pixels from their buffer list,
            they'll have to recreate all pixels and hit this (updated) cache
@@ -570,63 +1135,121 @@ static void upload_memory_to_pixels(NV2A_GPUState *d, Pixels* pixels) {
     debugger_pop_group();
 }
 
-static void download_pixels_to_memory(NV2A_GPUState* d, Pixels* pixels)
+/* Copies readback, laid out like the memory of pixels, to the pages of it
+   the CPU didn't write to since the readback was started. Those the CPU
+   wrote to are newer than the readback. */
+static void merge_readback_to_memory(NV2A_GPUState* d, const Pixels* pixels,
+                                     const uint8_t* readback)
 {
-//return; //XXX: PACKBUFFERHACK
-    if (pixels->draw_dirty) {
-        glBindBuffer(GL_PIXEL_PACK_BUFFER_ARB, pixels->gl_buffer);
-        GLubyte* src = (GLubyte*)glMapBufferARB(GL_PIXEL_PACK_BUFFER_ARB,
-                                                GL_READ_ONLY_ARB);
-        if (!src) {
-            assert(0);
-            return;
-        }
-
-        /* Assert that we don't overwrite changes from the CPU */
-        debugger_message("Checking pixels dirty: %d", pixels->gl_buffer);
-        assert(!pixels->dirty);
-        assert(!is_resource_memory_dirty(d, &pixels->key.memory_block)); /* If this triggers we didn't sync properly! */
-
-        if (pixels->key.swizzled) {
-            assert(pixels->key.data_width * pixels->key.bytes_per_pixel == pixels->key.pitch); /* flip_and_swizzle doesn't handle a dst_pitch yet */
-            flip_and_swizzle(src,
-                             pixels->key.data_width,
-                             pixels->key.data_height,
-                             d->vram_ptr + pixels->key.memory_block.address,
-                             pixels->key.data_width * pixels->key.bytes_per_pixel, /* source row-length is always same as width, we don't store unused pixels for swizzled textures */
-                             pixels->key.bytes_per_pixel);
-        } else {
-            flip(src,
-                 pixels->key.data_width * pixels->key.bytes_per_pixel, /* source row-length is always same as width, we don't store unused pixels for unswizzled textures */
-                 pixels->key.data_width,
-                 pixels->key.data_height,
-                 d->vram_ptr + pixels->key.memory_block.address,
-                 pixels->key.pitch,
-                 pixels->key.bytes_per_pixel);
+    hwaddr start = pixels->key.memory_block.address;
+    hwaddr end = start + pixels->key.memory_block.size;
+    hwaddr address = start;
+
+    while (address < end) {
+        hwaddr next = MIN((address & TARGET_PAGE_MASK) + TARGET_PAGE_SIZE,
+                          end);
+        if (!memory_region_get_dirty(d->vram, address, next - address,
+                                     pixels->readback_dirty_client)) {
+            memcpy(d->vram_ptr + address, readback + (address - start),
+                   next - address);
         }
-        glUnmapBufferARB(GL_PIXEL_PACK_BUFFER_ARB);
-
-        /* Notify everyone (VGA controller, KVM, ..) the memory is dirty */
-        set_memory_dirty(d, &pixels->key.memory_block);
-        pixels->draw_dirty = false; /* Nothing was done by the GPU at this point - we just wrote back all changes */
-        debugger_message("Setting pixels draw clean: %d", pixels->gl_buffer);
-        sync_all_resources_memory_dirty(d, &pixels->key.memory_block); /* Inform other resources using the same memory that it changed */
-        pixels->dirty = false; /* The sync will set this, but we know this is fresh and clean */
-        debugger_message("Setting pixels clean: %d", pixels->gl_buffer);
+        address = next;
     }
 }
 
-static void download_all_pixels_to_memory_callback(
-    gpointer key,
-    gpointer value,
-    gpointer user_data)
+/* Writes the newest readback back to memory. Unless wait is set this will
+   give up and return false if the GPU didn't finish the readback yet. */
+static bool download_pixels_to_memory(NV2A_GPUState* d, Pixels* pixels,
+                                      bool wait)
 {
-    download_pixels_to_memory((NV2A_GPUState*)user_data, (Pixels*)key);
+//return; //XXX: PACKBUFFERHACK
+    if (!pixels->draw_dirty) {
+        return true;
+    }
+
+    PixelsReadback* readback = &pixels->readback[pixels->readback_newest];
+    assert(readback->fence != NULL);
+    GLenum status = glClientWaitSync(readback->fence,
+                                     GL_SYNC_FLUSH_COMMANDS_BIT,
+                                     wait ? GL_TIMEOUT_IGNORED : 0);
+    assert(status != GL_WAIT_FAILED);
+    if (status == GL_TIMEOUT_EXPIRED) {
+        return false;
+    }
+    glDeleteSync(readback->fence);
+    readback->fence = NULL;
+
+    glBindBufferARB(GL_PIXEL_PACK_BUFFER_ARB, readback->gl_buffer);
+    GLubyte* src = (GLubyte*)glMapBufferARB(GL_PIXEL_PACK_BUFFER_ARB,
+                                            GL_READ_ONLY_ARB);
+    if (!src) {
+        assert(0);
+        return true;
+    }
+
+    /* Assert that we don't overwrite changes from the CPU */
+    debugger_message("Checking pixels dirty: %d", pixels->gl_buffer);
+    assert(!pixels->dirty);
+
+    /* If the CPU wrote to the memory after we started the readback, the
+       readback is staged and only the pages the CPU left alone get it */
+    bool cpu_dirty = is_pixels_memory_cpu_dirty(d, pixels);
+    uint8_t* dst = d->vram_ptr + pixels->key.memory_block.address;
+    if (cpu_dirty) {
+        debugger_message("Merging readback of pixels %d, CPU wrote to them",
+                         pixels->gl_buffer);
+        /* Bytes between the rows stay what they are */
+        dst = g_memdup(dst, pixels->key.memory_block.size);
+    }
+
+    if (pixels->key.swizzled) {
+        assert(pixels->key.data_width * pixels->key.bytes_per_pixel == pixels->key.pitch); /* flip_and_swizzle doesn't handle a dst_pitch yet */
+        flip_and_swizzle(src,
+                         pixels->key.data_width,
+                         pixels->key.data_height,
+                         dst,
+                         pixels->key.data_width * pixels->key.bytes_per_pixel, /* source row-length is always same as width, we don't store unused pixels for swizzled textures */
+                         pixels->key.bytes_per_pixel);
+    } else {
+        flip(src,
+             pixels->key.data_width * pixels->key.bytes_per_pixel, /* source row-length is always same as width, we don't store unused pixels for unswizzled textures */
+             pixels->key.data_width,
+             pixels->key.data_height,
+             dst,
+             pixels->key.pitch,
+             pixels->key.bytes_per_pixel);
+    }
+    glUnmapBufferARB(GL_PIXEL_PACK_BUFFER_ARB);
+    glBindBufferARB(GL_PIXEL_PACK_BUFFER_ARB, 0);
+
+    if (cpu_dirty) {
+        merge_readback_to_memory(d, pixels, dst);
+        g_free(dst);
+    }
+
+    /* Notify everyone (VGA controller, KVM, ..) the memory is dirty */
+    set_memory_dirty(d, &pixels->key.memory_block);
+    set_pixels_draw_dirty(&d->pgraph, pixels, false); /* Nothing was done by the GPU at this point - we just wrote back all changes */
+    debugger_message("Setting pixels draw clean: %d", pixels->gl_buffer);
+    sync_resources_memory_dirty(d, &pixels->key.memory_block, !cpu_dirty); /* Inform other resources using the same memory that it changed */
+    pixels->dirty = cpu_dirty; /* The sync will set this, but unless the CPU wrote to it we know this is fresh and clean */
+    debugger_message("Setting pixels clean: %d", pixels->gl_buffer);
+    return true;
 }
 
-static void download_all_pixels_to_memory(NV2A_GPUState *d)
+/* Writes back all GPU results, if wait isn't set only those which already
+   arrived are written */
+static void download_all_pixels_to_memory(NV2A_GPUState *d, bool wait)
 {
-    g_hash_table_foreach(d->pgraph.cache.pixels, download_all_pixels_to_memory_callback, (gpointer)d);
+    Pixels* pixels;
+    Pixels* next_pixels;
+    ProfileStage outer_stage = profile_enter(&d->pgraph,
+                                             PROFILE_STAGE_READBACK);
+    QLIST_FOREACH_SAFE(pixels, &d->pgraph.draw_dirty_pixels,
+                       draw_dirty_entry, next_pixels) {
+        download_pixels_to_memory(d, pixels, wait);
+    }
+    profile_leave(&d->pgraph, outer_stage);
 }
 
 static guint texture_2d_hash(gconstpointer key)
@@ -640,6 +1263,48 @@ static gboolean texture_2d_equal(gconstpointer a, gconstpointer b)
 }
 
 
+/* Returns the memory used by all levels of the texture */
+static MemoryBlock get_texture_2d_memory_block(const struct Texture2DKey* key)
+{
+    const TextureFormatInfo* mapped_format = &kelvin_texture_format_map[key->format];
+    bool swizzled = !mapped_format->linear;
+    unsigned int bytes_per_pixel = mapped_format->bytes_per_pixel;
+    GLenum gl_format = mapped_format->gl_format;
+    unsigned int mipmap_width = key->width;
+    unsigned int mipmap_height = key->height;
+    unsigned int mipmap_pitch = key->pitch;
+    hwaddr mipmap_offset = 0;
+    hwaddr end = 1;
+    unsigned int level;
+
+    /* Same layout as in bind_texture_2d */
+    for(level = 0; level < key->levels; level++) {
+        size_t size = swizzled?(mipmap_pitch * mipmap_height):
+                               (mipmap_width * mipmap_height * bytes_per_pixel);
+        end = MAX(end, mipmap_offset + size);
+        if ((gl_format == GL_COMPRESSED_RGB_S3TC_DXT1_EXT) ||
+            (gl_format == GL_COMPRESSED_RGBA_S3TC_DXT1_EXT) ||
+            (gl_format == GL_COMPRESSED_RGBA_S3TC_DXT3_EXT) ||
+            (gl_format == GL_COMPRESSED_RGBA_S3TC_DXT5_EXT)) {
+            unsigned int block_size;
+            if (mapped_format->gl_internal_format == GL_COMPRESSED_RGBA_S3TC_DXT1_EXT) {
+                block_size = 8;
+            } else {
+                block_size = 16;
+            }
+            mipmap_offset += mipmap_width/4 * mipmap_height/4 * block_size;
+        } else {
+            mipmap_offset += mipmap_width * mipmap_height * bytes_per_pixel;
+        }
+        mipmap_width /= 2;
+        mipmap_height /= 2;
+        mipmap_pitch /= 2;
+    }
+
+    MemoryBlock memory_block = { key->address, end };
+    return memory_block;
+}
+
 static Texture2D* bind_texture_2d(
     NV2A_GPUState *d,
     hwaddr address,
@@ -674,7 +1339,8 @@ update_texture_2d:
 */
         debugger_push_group("%s from cache = %d", __FUNCTION__, cache_texture_2d->gl_texture);
 
-        glBindTexture(GL_TEXTURE_2D, cache_texture_2d->gl_texture);
+        gl_state_bind_texture(&d->pgraph, GL_TEXTURE_2D,
+                              cache_texture_2d->gl_texture);
 
     #if 0
         //FIXME: Unhandled codepath because pitch / 2 != width / 2. No idea is swizzling supports pitch
@@ -707,7 +1373,7 @@ update_texture_2d:
                 swizzled?(mipmap_pitch * mipmap_height):
                          (mipmap_width * mipmap_height * bytes_per_pixel)
             };
-            pixels = create_pixels(&d->pgraph,
+            pixels = create_pixels(d,
                                    &memory_block,
                                    swizzled,
                                    bytes_per_pixel,
@@ -786,14 +1452,236 @@ if (pixels) {
     glGenTextures(1, &cache_texture_2d->gl_texture);
 
     g_hash_table_insert(d->pgraph.cache.texture_2d, cache_texture_2d, cache_texture_2d);
+    MemoryBlock memory_block = get_texture_2d_memory_block(&cache_texture_2d->key);
+    index_memory_block(&d->pgraph.cache_index.texture_2d,
+                       &cache_texture_2d->node, &memory_block);
     goto update_texture_2d;
 }
 
-#if 0
+/* Finds the surface texture which holds the newest contents of the
+   width x height rectangle starting at memory_block on the GPU, x and y
+   receive the position of the rectangle within it. Returns NULL if no
+   texture is up to date or if several could be meant. */
+static Texture2D* find_gpu_surface(NV2A_GPUState* d,
+                                   const MemoryBlock* memory_block,
+                                   unsigned int pitch,
+                                   unsigned int bytes_per_pixel,
+                                   unsigned int width, unsigned int height,
+                                   unsigned int* x, unsigned int* y)
+{
+    PGRAPHState* pg = &d->pgraph;
+    Texture2D* found = NULL;
+    bool ambiguous = false;
+    GPtrArray* nodes = g_ptr_array_new();
+    unsigned int i;
+    find_overlapping_memory_blocks(pg->cache_index.texture_2d,
+                                   memory_block, nodes);
+    for (i = 0; i < nodes->len; i++) {
+        Texture2D* texture_2d = container_of(g_ptr_array_index(nodes, i),
+                                             Texture2D, node);
+        const TextureFormatInfo* mapped_format =
+            &kelvin_texture_format_map[texture_2d->key.format];
+        Pixels* pixels = texture_2d->buffer[0];
+
+        /* Only unswizzled color surfaces with the same layout */
+        if ((texture_2d->key.levels != 1) || !mapped_format->linear ||
+            (mapped_format->gl_format == GL_DEPTH_COMPONENT) ||
+            (mapped_format->gl_format == GL_DEPTH_STENCIL) ||
+            (mapped_format->bytes_per_pixel != bytes_per_pixel) ||
+            (texture_2d->key.pitch != pitch) ||
+            (pixels == NULL) ||
+            !contains(&pixels->key.memory_block, memory_block)) {
+            continue;
+        }
 
-typedef struct {
-    Texture* buffer;
-} TextureRectangle;
+        hwaddr offset = memory_block->address - texture_2d->key.address;
+        unsigned int texture_x = (offset % pitch) / bytes_per_pixel;
+        unsigned int texture_y = offset / pitch;
+        if ((offset % bytes_per_pixel) ||
+            (texture_x + width > texture_2d->key.width) ||
+            (texture_y + height > texture_2d->key.height)) {
+            continue;
+        }
+
+        /* CPU writes since the last upload make the GPU copy outdated,
+           pending GPU results have to be in memory before we look */
+        flush_pixels_to_memory(d, &pixels->key.memory_block);
+        sync_all_resources_memory_dirty(d, &pixels->key.memory_block);
+        if (pixels->dirty) {
+            continue;
+        }
+
+        if (found) {
+            ambiguous = true;
+            break;
+        }
+        found = texture_2d;
+        *x = texture_x;
+        *y = texture_y;
+    }
+    g_ptr_array_free(nodes, TRUE);
+    return ambiguous ? NULL : found;
+}
+
+static guint texture_hash(gconstpointer key)
+{
+    return XXH32(key, sizeof(struct TextureKey), 0);
+}
+
+static gboolean texture_equal(gconstpointer a, gconstpointer b)
+{
+    return memcmp(a, b, sizeof(struct TextureKey)) == 0;
+}
+
+static void delete_texture(NV2A_GPUState* d, Texture* texture)
+{
+    PGRAPHState* pg = &d->pgraph;
+    QTAILQ_REMOVE(&pg->texture_cache.lru, texture, lru);
+    if (pg->subpage_dirty.enabled) {
+        memory_region_set_subpage_log(d->vram, texture->key.address,
+                                      texture->data_size, false);
+    }
+    unindex_memory_block(&pg->cache_index.texture, &texture->node);
+    g_hash_table_remove(pg->cache.texture, texture);
+    pg->texture_cache.size -= texture->data_size;
+    gl_state_forget_texture(pg, texture->gl_texture);
+    glDeleteTextures(1, &texture->gl_texture);
+    g_free(texture);
+}
+
+/* Evicts least recently used textures until size more bytes fit into the
+   budget. Textures used by the current pgraph_bind_textures are kept. */
+static void evict_textures(NV2A_GPUState* d, size_t size)
+{
+    PGRAPHState* pg = &d->pgraph;
+    Texture* texture;
+    Texture* next_texture;
+    QTAILQ_FOREACH_SAFE(texture, &pg->texture_cache.lru, lru, next_texture) {
+        if (pg->texture_cache.size + size <= pg->texture_cache.budget) {
+            break;
+        }
+        if (texture->bind_stamp == pg->texture_cache.bind_stamp) {
+            continue;
+        }
+        debugger_message("Evicting texture %d", texture->gl_texture);
+        delete_texture(d, texture);
+        pg->texture_cache.evictions++;
+    }
+}
+
+static void delete_all_textures(NV2A_GPUState* d)
+{
+    Texture* texture;
+    Texture* next_texture;
+    QTAILQ_FOREACH_SAFE(texture, &d->pgraph.texture_cache.lru, lru,
+                        next_texture) {
+        delete_texture(d, texture);
+    }
+}
+
+/* Binds the cached texture for key, data is the guest memory it is loaded
+   from. upload will be set if the texture contents have to be (re)uploaded
+   by the caller. prefetch_hash is what a prefetch of the texture hashed,
+   or NULL if there wasn't one. */
+static Texture* bind_texture(
+    NV2A_GPUState *d,
+    const struct TextureKey* key,
+    GLenum gl_target,
+    const uint8_t* data,
+    size_t data_size,
+    const uint32_t* prefetch_hash,
+    bool* upload)
+{
+    PGRAPHState* pg = &d->pgraph;
+    Texture* cache_texture;
+    uint32_t data_hash;
+    MemoryBlock memory_block = { key->address, data_size };
+
+    /* Writes go to the dirty flag of every texture in the memory, so the
+       bits can be reset and a texture is only hashed once per write */
+    sync_all_resources_memory_dirty(d, &memory_block);
+
+    if ((cache_texture = g_hash_table_lookup(pg->cache.texture, key))) {
+        assert(cache_texture->gl_target == gl_target);
+        assert(cache_texture->data_size == data_size);
+
+        /* Move to the end of the LRU list */
+        QTAILQ_REMOVE(&pg->texture_cache.lru, cache_texture, lru);
+        QTAILQ_INSERT_TAIL(&pg->texture_cache.lru, cache_texture, lru);
+
+        *upload = false;
+        if (!cache_texture->dirty) {
+            pg->texture_cache.hits++;
+        } else {
+            /* Someone wrote to the memory, only upload if it changed */
+            if (cache_texture->prefetched && prefetch_hash != NULL) {
+                data_hash = *prefetch_hash;
+            } else {
+                data_hash = XXH32(data, data_size, 0);
+            }
+            cache_texture->dirty = false;
+            cache_texture->prefetched = false;
+            if (data_hash == cache_texture->data_hash) {
+                pg->texture_cache.hash_hits++;
+            } else {
+                pg->texture_cache.misses++;
+                cache_texture->data_hash = data_hash;
+                *upload = true;
+            }
+        }
+        debugger_message("%s from cache = %d%s", __FUNCTION__,
+                         cache_texture->gl_texture,
+                         *upload ? " (changed)" : "");
+    } else {
+        pg->texture_cache.misses++;
+        evict_textures(d, data_size);
+
+        cache_texture = g_malloc0(sizeof(Texture));
+        cache_texture->key = *key;
+        cache_texture->gl_target = gl_target;
+        cache_texture->data_size = data_size;
+        cache_texture->data_hash = XXH32(data, data_size, 0);
+        glGenTextures(1, &cache_texture->gl_texture);
+
+        g_hash_table_add(pg->cache.texture, cache_texture);
+        index_memory_block(&pg->cache_index.texture, &cache_texture->node,
+                           &memory_block);
+        /* Writes next to the texture don't make it rehash */
+        if (pg->subpage_dirty.enabled) {
+            memory_region_set_subpage_log(d->vram, key->address, data_size,
+                                          true);
+        }
+        QTAILQ_INSERT_TAIL(&pg->texture_cache.lru, cache_texture, lru);
+        pg->texture_cache.size += data_size;
+
+        debugger_message("%s creating entry = %d", __FUNCTION__,
+                         cache_texture->gl_texture);
+        *upload = true;
+    }
+
+    cache_texture->bind_stamp = pg->texture_cache.bind_stamp;
+    gl_state_bind_texture(pg, gl_target, cache_texture->gl_texture);
+    return cache_texture;
+}
+
+#ifdef DEBUG_NV2A_GPU_TEXTURE_CACHE_STATS
+static void texture_cache_report_stats(PGRAPHState* pg)
+{
+    printf("nv2a: texture cache: %u textures, %zu / %zu bytes, "
+           "%" PRIu64 " hits, %" PRIu64 " hash hits, %" PRIu64 " misses, "
+           "%" PRIu64 " evictions\n",
+           g_hash_table_size(pg->cache.texture),
+           pg->texture_cache.size, pg->texture_cache.budget,
+           pg->texture_cache.hits, pg->texture_cache.hash_hits,
+           pg->texture_cache.misses, pg->texture_cache.evictions);
+}
+#endif
+
+#if 0
+
+typedef struct {
+    Texture* buffer;
+} TextureRectangle;
 
 typedef struct {
     Texture* buffer[layers*levels];
@@ -916,25 +1804,104 @@ return_framebuffer:
     goto return_framebuffer;
 }
 
-#if 0
-
 guint vertexshader_hash(gconstpointer key)
 {
-    return XXH32(key, sizeof(struct VertexshaderKey), 0);
+    return ((const struct VertexshaderKey*)key)->hash;
 }
 
+/* Programs with the same hash aren't necessarily the same */
 gboolean vertexshader_equal(gconstpointer a, gconstpointer b)
 {
-    return memcmp(a, b, sizeof(struct VertexshaderKey)) == 0;
+    const struct VertexshaderKey* ka = a;
+    const struct VertexshaderKey* kb = b;
+    return ka->hash == kb->hash
+        && ka->transform_program_length == kb->transform_program_length
+        && memcmp(ka->transform_program, kb->transform_program,
+                  ka->transform_program_length * 4) == 0;
 }
 
-Vertexshader* create_vertexshader(PGRAPHState* pg)
+static void compile_shader(GLuint shader, const char* code, const char* name)
+{
+    glShaderSource(shader, 1, &code, NULL);
+    glCompileShader(shader);
+
+    NV2A_GPU_DPRINTF("bind new %s shader, code:\n%s\n", name, code);
+
+    /* Check it compiled */
+    GLint compiled;
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &compiled);
+    if (!compiled) {
+        GLchar log[GLSL_LOG_LENGTH];
+        glGetShaderInfoLog(shader, GLSL_LOG_LENGTH, NULL, log);
+        log[GLSL_LOG_LENGTH - 1] = '\0';
+        fprintf(stderr, "\n\n%s\n", code);
+        fprintf(stderr, "nv2a: %s shader compilation failed: %s\n", name, log);
+        abort();
+    }
+    assert(glGetError() == GL_NO_ERROR);
+}
+
+/* GLSL of a vertex shader. A hash of 0 gets the fixed function shader,
+   otherwise the transform program is translated. */
+static QString* generate_vertexshader_code(guint hash,
+                                           uint32_t* transform_program,
+                                           unsigned int transform_program_length)
+{
+    //XXX: This is a loosy check for fixed function
+    if (hash == 0) {
+        /* generate vertex shader mimicking fixed function */
+        return qstring_from_str(
+            "#version 110\n"
+            "\n"
+            "attribute vec4 position;\n"
+            "attribute vec3 normal;\n"
+            "attribute vec4 diffuse;\n"
+            "attribute vec4 specular;\n"
+            "attribute float fogCoord;\n"
+            "attribute vec4 multiTexCoord0;\n"
+            "attribute vec4 multiTexCoord1;\n"
+            "attribute vec4 multiTexCoord2;\n"
+            "attribute vec4 multiTexCoord3;\n"
+
+            "uniform mat4 composite;\n"
+            "uniform mat4 textureMatrix0;\n"
+            "uniform mat4 textureMatrix1;\n"
+            "uniform mat4 textureMatrix2;\n"
+            "uniform mat4 textureMatrix3;\n"
+            "uniform mat4 invViewport;\n"
+            "void main() {\n"
+            "   gl_Position = invViewport * (position * composite);\n"
+            /* temp hack: the composite matrix includes the view transform... */
+            //"   gl_Position = position * composite;\n"
+            //"   gl_Position.x = (gl_Position.x - 320.0) / 320.0;\n"
+            //"   gl_Position.y = -(gl_Position.y - 240.0) / 240.0;\n"
+            "   gl_FogFragCoord = 0.5;\n" //FIXME!!! Probably generated from the vertex attrib?
+            "   gl_Position.z = gl_Position.z * 2.0 - gl_Position.w;\n"
+            "   gl_FrontColor = diffuse;\n"
+            "   gl_TexCoord[0] = textureMatrix0 * multiTexCoord0;\n"
+            "   gl_TexCoord[1] = textureMatrix1 * multiTexCoord1;\n"
+            "   gl_TexCoord[2] = textureMatrix2 * multiTexCoord2;\n"
+            "   gl_TexCoord[3] = textureMatrix3 * multiTexCoord3;\n"
+            "}\n");
+    }
+    return vsh_translate(VSH_VERSION_XVS,
+                         transform_program,
+                         transform_program_length);
+}
+
+/* A hash of 0 gets the fixed function shader, otherwise the transform
+   program is only translated if no shader for the same program exists */
+Vertexshader* create_vertexshader(PGRAPHState* pg, guint hash,
+                                  uint32_t* transform_program,
+                                  unsigned int transform_program_length)
 {
 
     Vertexshader* cache_vertexshader;
     Vertexshader vertexshader = {
         .key = {
-            //FIXME
+            .hash = hash,
+            .transform_program_length = transform_program_length,
+            .transform_program = transform_program
         }
     };
     if ((cache_vertexshader = g_hash_table_lookup(pg->cache.vertexshader,
@@ -943,45 +1910,24 @@ Vertexshader* create_vertexshader(PGRAPHState* pg)
     }
 
     cache_vertexshader = g_memdup(&vertexshader, sizeof(vertexshader));
+    cache_vertexshader->key.transform_program =
+        g_memdup(transform_program, transform_program_length * 4);
 
-    create_shader();
+    cache_vertexshader->shader = glCreateShader(GL_VERTEX_SHADER);
+
+    QString *vertex_shader_code = generate_vertexshader_code(hash,
+                                      transform_program,
+                                      transform_program_length);
+    compile_shader(cache_vertexshader->shader,
+                   qstring_get_str(vertex_shader_code),
+                   "vertex");
+    /* Release shader string */
+    QDECREF(vertex_shader_code);
 
     g_hash_table_add(pg->cache.vertexshader, cache_vertexshader);
     return cache_vertexshader;
 }
 
-guint ffp_vertexshader_hash(gconstpointer key)
-{
-    return XXH32(key, sizeof(struct FFPVertexshaderKey), 0);
-}
-
-gboolean ffp_vertexshader_equal(gconstpointer a, gconstpointer b)
-{
-    return memcmp(a, b, sizeof(struct FFPVertexshaderKey)) == 0;
-}
-
-FFPVertexshader* create_ffp_vertexshader(PGRAPHState* pg)
-{
-
-    FFPVertexshader* cache_ffp_vertexshader;
-    FFPVertexshader ffp_vertexshader = {
-        .key = {
-            //FIXME
-        }
-    };
-    if ((cache_ffp_vertexshader = g_hash_table_lookup(pg->cache.ffp_vertexshader,
-                                                      &ffp_vertexshader))) {
-        return cache_ffp_vertexshader;
-    }
-
-    cache_ffp_vertexshader = g_memdup(&ffp_vertexshader, sizeof(ffp_vertexshader));
-
-    create_shader();
-
-    g_hash_table_add(pg->cache.ffp_vertexshader, cache_ffp_vertexshader);
-    return cache_ffp_vertexshader;
-}
-
 guint fragmentshader_hash(gconstpointer key)
 {
     return XXH32(key, sizeof(struct FragmentshaderKey), 0);
@@ -992,14 +1938,28 @@ gboolean fragmentshader_equal(gconstpointer a, gconstpointer b)
     return memcmp(a, b, sizeof(struct FragmentshaderKey)) == 0;
 }
 
-Fragmentshader* create_fragmentshader(PGRAPHState* pg)
+/* GLSL of a fragment shader generated from the register combiners */
+static QString* generate_fragmentshader_code(struct FragmentshaderKey* k)
+{
+    return psh_translate(k->combiner_control,
+                   k->shader_stage_program,
+                   k->other_stage_input,
+                   k->rgb_inputs, k->rgb_outputs,
+                   k->alpha_inputs, k->alpha_outputs,
+                   /* constant_0, constant_1, */
+                   k->final_inputs_0, k->final_inputs_1,
+                   /* final_constant_0, final_constant_1, */
+                   k->rect_tex, k->compare_mode, k->alphakill);
+}
+
+/* The key has to be cleared before it's filled in, it's compared bytewise */
+Fragmentshader* create_fragmentshader(PGRAPHState* pg,
+                                      const struct FragmentshaderKey* key)
 {
 
     Fragmentshader* cache_fragmentshader;
     Fragmentshader fragmentshader = {
-        .key = {
-            //FIXME
-        }
+        .key = *key
     };
     if ((cache_fragmentshader = g_hash_table_lookup(pg->cache.fragmentshader,
                                                   &fragmentshader))) {
@@ -1008,7 +1968,15 @@ Fragmentshader* create_fragmentshader(PGRAPHState* pg)
 
     cache_fragmentshader = g_memdup(&fragmentshader, sizeof(fragmentshader));
 
-    create_shader();
+    /* generate a fragment hader from register combiners */
+    cache_fragmentshader->shader = glCreateShader(GL_FRAGMENT_SHADER);
+
+    QString *fragment_shader_code =
+        generate_fragmentshader_code(&cache_fragmentshader->key);
+    compile_shader(cache_fragmentshader->shader,
+                   qstring_get_str(fragment_shader_code),
+                   "fragment");
+    QDECREF(fragment_shader_code);
 
     g_hash_table_add(pg->cache.fragmentshader, cache_fragmentshader);
     return cache_fragmentshader;
@@ -1024,13 +1992,77 @@ gboolean shaderprogram_equal(gconstpointer a, gconstpointer b)
     return memcmp(a, b, sizeof(struct ShaderprogramKey)) == 0;
 }
 
-Shaderprogram* create_shaderprogram(PGRAPHState* pg, GLuint vertexshader, GLuint fragmentshader)
+/* Sets up the uniforms which never change and makes sure the program is
+   usable. Also needed for programs loaded from binaries, glProgramBinary
+   resets all uniforms. */
+static void pgraph_setup_program(PGRAPHState* pg, GLuint program)
+{
+    int i;
+
+    gl_state_use_program(pg, program);
+    assert(glGetError() == 0);
+
+    /* set texture samplers */
+    for (i = 0; i < NV2A_GPU_MAX_TEXTURES; i++) {
+        char samplerName[16];
+        snprintf(samplerName, sizeof(samplerName), "texSamp%d", i);
+        GLint texSampLoc = glGetUniformLocation(program, samplerName);
+        if (texSampLoc >= 0) {
+            glUniform1i(texSampLoc, i);
+        }
+    }
+
+    glValidateProgram(program);
+    GLint valid = 0;
+    glGetProgramiv(program, GL_VALIDATE_STATUS, &valid);
+    if (!valid) {
+        GLchar log[GLSL_LOG_LENGTH];
+        glGetProgramInfoLog(program, GLSL_LOG_LENGTH, NULL, log);
+        log[GLSL_LOG_LENGTH - 1] = '\0';
+        fprintf(stderr, "nv2a: shader validation failed: %s\n", log);
+        abort();
+    }
+    assert(glGetError() == GL_NO_ERROR);
+}
+
+/* Attribute locations have to be set before a program is linked */
+static void bind_program_attributes(GLuint program, bool fixed_function)
+{
+    if (fixed_function) {
+        /* Bind attributes for fixed function pipeline */
+        glBindAttribLocation(program, NV2A_GPU_VERTEX_ATTR_POSITION, "position");
+        glBindAttribLocation(program, NV2A_GPU_VERTEX_ATTR_DIFFUSE, "diffuse");
+        glBindAttribLocation(program, NV2A_GPU_VERTEX_ATTR_SPECULAR, "specular");
+        glBindAttribLocation(program, NV2A_GPU_VERTEX_ATTR_FOG, "fog");
+        glBindAttribLocation(program, NV2A_GPU_VERTEX_ATTR_TEXTURE0, "multiTexCoord0");
+        glBindAttribLocation(program, NV2A_GPU_VERTEX_ATTR_TEXTURE1, "multiTexCoord1");
+        glBindAttribLocation(program, NV2A_GPU_VERTEX_ATTR_TEXTURE2, "multiTexCoord2");
+        glBindAttribLocation(program, NV2A_GPU_VERTEX_ATTR_TEXTURE3, "multiTexCoord3");
+    } else {
+        /* Bind attributes for transform program*/
+        char tmp[4];
+        int i;
+        for(i = 0; i < 16; i++) {
+            sprintf(tmp,"v%d",i);
+            glBindAttribLocation(program, i, tmp);
+        }
+
+#ifdef DEBUG_NV2A_GPU_SHADER_FEEDBACK
+        debugger_prepare_feedback(program, 0xFFFF+1); // This should be enough?
+#endif
+
+    }
+}
+
+Shaderprogram* create_shaderprogram(PGRAPHState* pg,
+                                    const Vertexshader* vertexshader,
+                                    const Fragmentshader* fragmentshader)
 {
 
     Shaderprogram* cache_shaderprogram;
     Shaderprogram shaderprogram = {
         .key = {
-            vertexshader, fragmentshader
+            vertexshader->shader, fragmentshader->shader
         }
     };
     if ((cache_shaderprogram = g_hash_table_lookup(pg->cache.shaderprogram,
@@ -1040,17 +2072,743 @@ Shaderprogram* create_shaderprogram(PGRAPHState* pg, GLuint vertexshader, GLuint
 
     cache_shaderprogram = g_memdup(&shaderprogram, sizeof(shaderprogram));
 
-    cache_shaderprogram->program = glCreateProgram();
+    GLuint program = glCreateProgram();
+    cache_shaderprogram->program = program;
+
+    glAttachShader(program, cache_shaderprogram->key.vertexshader);
+    glAttachShader(program, cache_shaderprogram->key.fragmentshader);
+
+    bind_program_attributes(program, vertexshader->key.hash == 0);
 
-    if (cache_shaderprogram->key.vertexshader != 0) {
-        glAttachShader(program, cache_shaderprogram->key.vertexshader);
+    /* link the program */
+    if (pg->shader_disk_cache.binaries) {
+        glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT,
+                            GL_TRUE);
     }
-    if (cache_shaderprogram->key.fragmentshader != 0) {
-        glAttachShader(program, cache_shaderprogram->key.fragmentshader);
+    glLinkProgram(program);
+    GLint linked = 0;
+    glGetProgramiv(program, GL_LINK_STATUS, &linked);
+    if(!linked) {
+        GLchar log[GLSL_LOG_LENGTH];
+        glGetProgramInfoLog(program, GLSL_LOG_LENGTH, NULL, log);
+        log[GLSL_LOG_LENGTH - 1] = '\0';
+        fprintf(stderr, "nv2a: shader linking failed: %s\n", log);
+        abort();
     }
 
+    pgraph_setup_program(pg, program);
+
     g_hash_table_add(pg->cache.shaderprogram, cache_shaderprogram);
     return cache_shaderprogram;
 }
 
+/* Uniform locations of a linked program, looked up once instead of for every
+   draw. Uniform values are per program too, so each binding also remembers
+   which vertex shader constants changed since they were last uploaded to it. */
+typedef struct ShaderBinding {
+    GLuint program;
+    GLint combiner_constant_loc[9][2];
+    GLint eye_vector_loc;
+    GLint composite_matrix_loc;
+    GLint texture_matrix_loc[NV2A_GPU_MAX_TEXTURES];
+    GLint inv_viewport_loc;
+    GLint constant_loc[NV2A_GPU_VERTEXSHADER_CONSTANTS];
+    GLint cliprange_loc;
+    GLint tex_size_loc[NV2A_GPU_MAX_TEXTURES];
+    DECLARE_BITMAP(constants_dirty, NV2A_GPU_VERTEXSHADER_CONSTANTS);
+} ShaderBinding;
+
+static ShaderBinding* get_shader_binding(PGRAPHState* pg, GLuint program)
+{
+    ShaderBinding* binding = g_hash_table_lookup(pg->cache.shader_binding,
+                                                 GUINT_TO_POINTER(program));
+    if (binding) {
+        return binding;
+    }
+
+    binding = g_malloc0(sizeof(ShaderBinding));
+    binding->program = program;
+
+    char tmp[16];
+    int i, j;
+    for (i = 0; i < 9; i++) {
+        for (j = 0; j < 2; j++) {
+            snprintf(tmp, sizeof(tmp), "c_%d_%d", i, j);
+            binding->combiner_constant_loc[i][j] =
+                glGetUniformLocation(program, tmp);
+        }
+    }
+    binding->eye_vector_loc = glGetUniformLocation(program, "eye_vector");
+    binding->composite_matrix_loc = glGetUniformLocation(program, "composite");
+    for (i = 0; i < NV2A_GPU_MAX_TEXTURES; i++) {
+        snprintf(tmp, sizeof(tmp), "textureMatrix%d", i);
+        binding->texture_matrix_loc[i] = glGetUniformLocation(program, tmp);
+    }
+    binding->inv_viewport_loc = glGetUniformLocation(program, "invViewport");
+    for (i = 0; i < NV2A_GPU_VERTEXSHADER_CONSTANTS; i++) {
+        snprintf(tmp, sizeof(tmp), "c[%d]", i);
+        binding->constant_loc[i] = glGetUniformLocation(program, tmp);
+    }
+    binding->cliprange_loc = glGetUniformLocation(program, "cliprange");
+    for (i = 0; i < NV2A_GPU_MAX_TEXTURES; i++) {
+        snprintf(tmp, sizeof(tmp), "texSize%d", i);
+        binding->tex_size_loc[i] = glGetUniformLocation(program, tmp);
+    }
+    assert(glGetError() == GL_NO_ERROR);
+
+    /* Nothing was uploaded to this program yet */
+    bitmap_fill(binding->constants_dirty, NV2A_GPU_VERTEXSHADER_CONSTANTS);
+
+    g_hash_table_insert(pg->cache.shader_binding, GUINT_TO_POINTER(program),
+                        binding);
+    return binding;
+}
+
+/* Hand constants written by the guest to every program */
+static void shader_bindings_mark_constants_dirty(PGRAPHState* pg)
+{
+    if (bitmap_empty(pg->constants_dirty, NV2A_GPU_VERTEXSHADER_CONSTANTS)) {
+        return;
+    }
+
+    GHashTableIter iter;
+    gpointer value;
+    g_hash_table_iter_init(&iter, pg->cache.shader_binding);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        ShaderBinding* binding = value;
+        bitmap_or(binding->constants_dirty, binding->constants_dirty,
+                  pg->constants_dirty, NV2A_GPU_VERTEXSHADER_CONSTANTS);
+    }
+    bitmap_zero(pg->constants_dirty, NV2A_GPU_VERTEXSHADER_CONSTANTS);
+}
+
+/* Uploads the dirty constants of the bound program, one glUniform4fv per run
+   of consecutive constants */
+static void shader_binding_upload_constants(PGRAPHState* pg,
+                                            ShaderBinding* binding)
+{
+    GLfloat data[NV2A_GPU_VERTEXSHADER_CONSTANTS][4];
+    unsigned long start = 0;
+
+    while (true) {
+        start = find_next_bit(binding->constants_dirty,
+                              NV2A_GPU_VERTEXSHADER_CONSTANTS, start);
+        if (start >= NV2A_GPU_VERTEXSHADER_CONSTANTS) {
+            break;
+        }
+        unsigned long end = find_next_zero_bit(binding->constants_dirty,
+                                               NV2A_GPU_VERTEXSHADER_CONSTANTS,
+                                               start);
+        bitmap_clear(binding->constants_dirty, start, end - start);
+
+        /* The driver drops unused array elements, but only from the end */
+        GLint loc = binding->constant_loc[start];
+        if (loc != -1) {
+            unsigned long i;
+            for (i = start; i < end; i++) {
+                memcpy(data[i], pg->constants[i].data, sizeof(data[i]));
+            }
+            glUniform4fv(loc, end - start, data[start]);
+            pg->draw_timing.constant_uploads++;
+        }
+        start = end;
+    }
+}
+
+/* Streaming buffer for vertex and index data which is only used once */
+
+static void vertex_ring_init(PGRAPHState* pg)
+{
+    glGenBuffers(1, &pg->vertex_ring.gl_buffer);
+    glBindBuffer(GL_ARRAY_BUFFER, pg->vertex_ring.gl_buffer);
+    if (glo_check_extension((const GLubyte *)"GL_ARB_buffer_storage")) {
+        GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT
+                               | GL_MAP_COHERENT_BIT;
+        glBufferStorage(GL_ARRAY_BUFFER, NV2A_GPU_VERTEX_RING_SIZE, NULL,
+                        flags);
+        pg->vertex_ring.map = glMapBufferRange(GL_ARRAY_BUFFER, 0,
+                                               NV2A_GPU_VERTEX_RING_SIZE,
+                                               flags);
+        assert(pg->vertex_ring.map != NULL);
+    } else {
+        glBufferData(GL_ARRAY_BUFFER, NV2A_GPU_VERTEX_RING_SIZE, NULL,
+                     GL_STREAM_DRAW);
+        pg->vertex_ring.scratch = g_malloc(NV2A_GPU_VERTEX_RING_SIZE
+                                               / NV2A_GPU_VERTEX_RING_SEGMENTS);
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    assert(glGetError() == GL_NO_ERROR);
+}
+
+static void vertex_ring_destroy(PGRAPHState* pg)
+{
+    int i;
+    for (i = 0; i < NV2A_GPU_VERTEX_RING_SEGMENTS; i++) {
+        if (pg->vertex_ring.fence[i]) {
+            glDeleteSync(pg->vertex_ring.fence[i]);
+            pg->vertex_ring.fence[i] = NULL;
+        }
+    }
+    if (pg->vertex_ring.map) {
+        glBindBuffer(GL_ARRAY_BUFFER, pg->vertex_ring.gl_buffer);
+        glUnmapBuffer(GL_ARRAY_BUFFER);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        pg->vertex_ring.map = NULL;
+    }
+    glDeleteBuffers(1, &pg->vertex_ring.gl_buffer);
+    g_free(pg->vertex_ring.scratch);
+    pg->vertex_ring.scratch = NULL;
+}
+
+/* Reserves size bytes of the ring. Allocations never cross a segment, when
+   moving on to the next segment we wait until the GPU is done with it. */
+static size_t vertex_ring_alloc(PGRAPHState* pg, size_t size)
+{
+    const size_t segment_size = NV2A_GPU_VERTEX_RING_SIZE
+                                    / NV2A_GPU_VERTEX_RING_SEGMENTS;
+    assert(size <= segment_size);
+
+    size_t offset = ROUND_UP(pg->vertex_ring.offset, 16);
+    if (offset + size > (pg->vertex_ring.segment + 1) * segment_size) {
+        unsigned int segment = (pg->vertex_ring.segment + 1)
+                                   % NV2A_GPU_VERTEX_RING_SEGMENTS;
+
+        /* All draws reading the old segment have been issued */
+        assert(pg->vertex_ring.fence[pg->vertex_ring.segment] == NULL);
+        pg->vertex_ring.fence[pg->vertex_ring.segment] =
+            glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+        GLsync fence = pg->vertex_ring.fence[segment];
+        if (fence) {
+            GLenum status = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT,
+                                             GL_TIMEOUT_IGNORED);
+            assert(status != GL_WAIT_FAILED);
+            glDeleteSync(fence);
+            pg->vertex_ring.fence[segment] = NULL;
+        }
+
+        pg->vertex_ring.segment = segment;
+        offset = segment * segment_size;
+    }
+    pg->vertex_ring.offset = offset + size;
+    return offset;
+}
+
+/* Returns where size bytes for the ring have to be written to, the ring will
+   be bound to GL_ARRAY_BUFFER. Must be followed by vertex_ring_end_write. */
+static uint8_t* vertex_ring_begin_write(PGRAPHState* pg, size_t size,
+                                        size_t* offset)
+{
+    *offset = vertex_ring_alloc(pg, size);
+    glBindBuffer(GL_ARRAY_BUFFER, pg->vertex_ring.gl_buffer);
+    pg->vertex_cache.streamed += size;
+    pg->frame_stats.upload_bytes += size;
+    if (pg->vertex_ring.map) {
+        return pg->vertex_ring.map + *offset;
+    }
+    return pg->vertex_ring.scratch;
+}
+
+static void vertex_ring_end_write(PGRAPHState* pg, size_t offset, size_t size)
+{
+    if (!pg->vertex_ring.map) {
+        glBufferSubData(GL_ARRAY_BUFFER, offset, size,
+                        pg->vertex_ring.scratch);
+    }
+}
+
+static inline bool vertex_ring_fits(size_t size)
+{
+    return size <= (NV2A_GPU_VERTEX_RING_SIZE / NV2A_GPU_VERTEX_RING_SEGMENTS);
+}
+
+/* Vertex attribute data */
+
+/* Bytes of guest memory used by num_elements elements */
+static size_t vertex_attribute_memory_size(const VertexAttribute* attribute,
+                                           unsigned int stride,
+                                           unsigned int num_elements)
+{
+    assert(num_elements > 0);
+    return (num_elements - 1) * stride + attribute->size * attribute->count;
+}
+
+/* Stride of the data handed to GL */
+static unsigned int vertex_attribute_gl_stride(const VertexAttribute* attribute,
+                                               unsigned int stride)
+{
+    if (attribute->needs_conversion) {
+        return attribute->converted_size * attribute->converted_count;
+    }
+    return stride;
+}
+
+static size_t vertex_attribute_gl_size(const VertexAttribute* attribute,
+                                       unsigned int stride,
+                                       unsigned int num_elements)
+{
+    if (attribute->needs_conversion) {
+        return num_elements * vertex_attribute_gl_stride(attribute, stride);
+    }
+    return vertex_attribute_memory_size(attribute, stride, num_elements);
+}
+
+/* Writes num_elements elements in a format GL understands to out */
+static void convert_vertex_attribute(const VertexAttribute* attribute,
+                                     const uint8_t* in,
+                                     unsigned int stride,
+                                     unsigned int num_elements,
+                                     uint8_t* out)
+{
+    if (!attribute->needs_conversion) {
+        memcpy(out, in, vertex_attribute_memory_size(attribute, stride,
+                                                     num_elements));
+        return;
+    }
+
+    unsigned int out_stride = vertex_attribute_gl_stride(attribute, stride);
+    unsigned int i, j;
+    for (i = 0; i < num_elements; i++) {
+        const uint8_t* element_in = in + i * stride;
+        float* element_out = (float*)(out + i * out_stride);
+        switch (attribute->format) {
+        case NV097_SET_VERTEX_DATA_ARRAY_FORMAT_TYPE_CMP:
+            for (j = 0; j < attribute->count; j++) {
+                r11g11b10f_to_float3(ldl_le_p(element_in + j * 4),
+                                     &element_out[j * 3]);
+            }
+            break;
+        default:
+            assert(false);
+        }
+    }
+}
+
+/* Streams num_elements elements through the ring, returns the offset */
+static size_t stream_vertex_attribute(PGRAPHState* pg,
+                                      const VertexAttribute* attribute,
+                                      const uint8_t* data,
+                                      unsigned int stride,
+                                      unsigned int num_elements)
+{
+    size_t offset;
+    size_t size = vertex_attribute_gl_size(attribute, stride, num_elements);
+    uint8_t* out = vertex_ring_begin_write(pg, size, &offset);
+    convert_vertex_attribute(attribute, data, stride, num_elements, out);
+    vertex_ring_end_write(pg, offset, size);
+    return offset;
+}
+
+/* Vertex data from guest memory, kept in buffer objects */
+
+typedef struct VertexBuffer {
+    struct VertexBufferKey {
+        hwaddr address; /* First element in VRAM */
+        uint32_t stride;
+        unsigned int format;
+        unsigned int count;
+    } key;
+    MemoryBlockNode node; /* In pgraph.cache_index.vertex_buffer */
+    MemoryBlock memory_block; /* Guest memory of the uploaded elements */
+    unsigned int num_elements;
+    uint32_t data_hash;
+    bool dirty; /* The guest wrote to memory_block since the upload */
+    unsigned int rewrites; /* Uploads because the contents changed */
+    bool streamed; /* Changes too often to be kept, uses the ring */
+    GLuint gl_buffer; /* 0 if streamed */
+    size_t gl_size;
+    unsigned int bind_stamp;
+    QTAILQ_ENTRY(VertexBuffer) lru;
+} VertexBuffer;
+
+static guint vertex_buffer_hash(gconstpointer key)
+{
+    return XXH32(key, sizeof(struct VertexBufferKey), 0);
+}
+
+static gboolean vertex_buffer_equal(gconstpointer a, gconstpointer b)
+{
+    return memcmp(a, b, sizeof(struct VertexBufferKey)) == 0;
+}
+
+static void delete_vertex_buffer(PGRAPHState* pg, VertexBuffer* vertex_buffer)
+{
+    unindex_memory_block(&pg->cache_index.vertex_buffer, &vertex_buffer->node);
+    QTAILQ_REMOVE(&pg->vertex_cache.lru, vertex_buffer, lru);
+    g_hash_table_remove(pg->cache.vertex_buffer, vertex_buffer);
+    pg->vertex_cache.size -= vertex_buffer->gl_size;
+    if (vertex_buffer->gl_buffer) {
+        glDeleteBuffers(1, &vertex_buffer->gl_buffer);
+    }
+    g_free(vertex_buffer);
+}
+
+/* Evicts least recently used vertex buffers until size more bytes fit into
+   the budget. Buffers used by the current draw are kept. */
+static void evict_vertex_buffers(PGRAPHState* pg, size_t size)
+{
+    VertexBuffer* vertex_buffer;
+    VertexBuffer* next_vertex_buffer;
+    QTAILQ_FOREACH_SAFE(vertex_buffer, &pg->vertex_cache.lru, lru,
+                        next_vertex_buffer) {
+        if (pg->vertex_cache.size + size <= pg->vertex_cache.budget) {
+            break;
+        }
+        if (vertex_buffer->bind_stamp == pg->vertex_cache.bind_stamp) {
+            continue;
+        }
+        delete_vertex_buffer(pg, vertex_buffer);
+        pg->vertex_cache.evictions++;
+    }
+}
+
+static void delete_all_vertex_buffers(PGRAPHState* pg)
+{
+    VertexBuffer* vertex_buffer;
+    VertexBuffer* next_vertex_buffer;
+    QTAILQ_FOREACH_SAFE(vertex_buffer, &pg->vertex_cache.lru, lru,
+                        next_vertex_buffer) {
+        delete_vertex_buffer(pg, vertex_buffer);
+    }
+}
+
+/* The dirty bits are per page and shared by all vertex buffers in it. So
+   before clearing them, every vertex buffer in the written pages is told. */
+static void take_vertex_memory_dirty(NV2A_GPUState* d,
+                                     const MemoryBlock* memory_block)
+{
+    PGRAPHState* pg = &d->pgraph;
+
+    if (!memory_region_get_dirty(d->vram, memory_block->address,
+                                 memory_block->size,
+                                 DIRTY_MEMORY_NV2A_GPU_VERTEX)) {
+        return;
+    }
+
+    hwaddr start = memory_block->address & TARGET_PAGE_MASK;
+    hwaddr end = TARGET_PAGE_ALIGN(memory_block->address + memory_block->size);
+    MemoryBlock pages = { start, end - start };
+
+    GPtrArray* nodes = g_ptr_array_new();
+    find_overlapping_memory_blocks(pg->cache_index.vertex_buffer, &pages,
+                                   nodes);
+    unsigned int i;
+    for (i = 0; i < nodes->len; i++) {
+        VertexBuffer* vertex_buffer = container_of(g_ptr_array_index(nodes, i),
+                                                   VertexBuffer, node);
+        vertex_buffer->dirty = true;
+    }
+    g_ptr_array_free(nodes, TRUE);
+
+    memory_region_reset_dirty(d->vram, pages.address, pages.size,
+                              DIRTY_MEMORY_NV2A_GPU_VERTEX);
+}
+
+static void upload_vertex_buffer(PGRAPHState* pg,
+                                 VertexBuffer* vertex_buffer,
+                                 const VertexAttribute* attribute,
+                                 const uint8_t* data)
+{
+    size_t gl_size = vertex_attribute_gl_size(attribute,
+                                              vertex_buffer->key.stride,
+                                              vertex_buffer->num_elements);
+
+    pg->vertex_cache.size -= vertex_buffer->gl_size;
+    evict_vertex_buffers(pg, gl_size);
+    vertex_buffer->gl_size = gl_size;
+    pg->vertex_cache.size += gl_size;
+
+    if (!vertex_buffer->gl_buffer) {
+        glGenBuffers(1, &vertex_buffer->gl_buffer);
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, vertex_buffer->gl_buffer);
+    pg->frame_stats.upload_bytes += gl_size;
+    if (attribute->needs_conversion) {
+        uint8_t* converted = g_malloc(gl_size);
+        convert_vertex_attribute(attribute, data, vertex_buffer->key.stride,
+                                 vertex_buffer->num_elements, converted);
+        glBufferData(GL_ARRAY_BUFFER, gl_size, converted, GL_STATIC_DRAW);
+        g_free(converted);
+    } else {
+        glBufferData(GL_ARRAY_BUFFER, gl_size, data, GL_STATIC_DRAW);
+    }
+}
+
+/* Binds the vertex data of attribute to GL_ARRAY_BUFFER, data points into
+   VRAM. Returns the offset of the first element in the buffer and the stride
+   GL has to use. */
+static size_t bind_vertex_buffer(NV2A_GPUState* d,
+                                 const VertexAttribute* attribute,
+                                 const uint8_t* data,
+                                 unsigned int num_elements,
+                                 GLsizei* gl_stride)
+{
+    PGRAPHState* pg = &d->pgraph;
+    VertexBuffer* vertex_buffer;
+
+    struct VertexBufferKey key;
+    memset(&key, 0, sizeof(key));
+    key.address = data - d->vram_ptr;
+    key.stride = attribute->stride;
+    key.format = attribute->format;
+    key.count = attribute->count;
+
+    *gl_stride = vertex_attribute_gl_stride(attribute, attribute->stride);
+    size_t gl_size = vertex_attribute_gl_size(attribute, attribute->stride,
+                                              num_elements);
+
+    MemoryBlock memory_block = {
+        .address = key.address,
+        .size = vertex_attribute_memory_size(attribute, attribute->stride,
+                                             num_elements)
+    };
+
+    bool upload = false;
+    if ((vertex_buffer = g_hash_table_lookup(pg->cache.vertex_buffer, &key))) {
+        QTAILQ_REMOVE(&pg->vertex_cache.lru, vertex_buffer, lru);
+        QTAILQ_INSERT_TAIL(&pg->vertex_cache.lru, vertex_buffer, lru);
+    } else {
+        vertex_buffer = g_malloc0(sizeof(VertexBuffer));
+        vertex_buffer->key = key;
+        g_hash_table_add(pg->cache.vertex_buffer, vertex_buffer);
+        QTAILQ_INSERT_TAIL(&pg->vertex_cache.lru, vertex_buffer, lru);
+        upload = true;
+    }
+    vertex_buffer->bind_stamp = pg->vertex_cache.bind_stamp;
+
+    /* The whole point of streamed buffers is not looking at them again */
+    if (vertex_buffer->streamed && vertex_ring_fits(gl_size)) {
+        return stream_vertex_attribute(pg, attribute, data, attribute->stride,
+                                       num_elements);
+    }
+
+    if (num_elements > vertex_buffer->num_elements) {
+        /* Also used for new buffers, they are empty */
+        if (vertex_buffer->num_elements) {
+            unindex_memory_block(&pg->cache_index.vertex_buffer,
+                                 &vertex_buffer->node);
+        }
+        vertex_buffer->num_elements = num_elements;
+        vertex_buffer->memory_block = memory_block;
+        index_memory_block(&pg->cache_index.vertex_buffer,
+                           &vertex_buffer->node, &memory_block);
+        upload = true;
+    }
+
+    if (!vertex_buffer->gl_buffer) {
+        /* Streamed before, but this draw is too large for the ring */
+        upload = true;
+    }
+
+    take_vertex_memory_dirty(d, &vertex_buffer->memory_block);
+
+    if (upload) {
+        vertex_buffer->data_hash = XXH32(data, vertex_buffer->memory_block.size,
+                                         0);
+    } else if (vertex_buffer->dirty) {
+        /* Someone wrote to the memory, only upload if it changed */
+        uint32_t data_hash = XXH32(data, vertex_buffer->memory_block.size, 0);
+        if (data_hash == vertex_buffer->data_hash) {
+            pg->vertex_cache.hash_hits++;
+        } else {
+            vertex_buffer->data_hash = data_hash;
+            vertex_buffer->rewrites++;
+            upload = true;
+        }
+    } else {
+        pg->vertex_cache.hits++;
+    }
+    vertex_buffer->dirty = false;
+
+    if (!upload) {
+        glBindBuffer(GL_ARRAY_BUFFER, vertex_buffer->gl_buffer);
+        return 0;
+    }
+
+    pg->vertex_cache.misses++;
+
+    if ((vertex_buffer->rewrites > NV2A_GPU_VERTEX_CACHE_MAX_REWRITES)
+        && vertex_ring_fits(gl_size)) {
+        /* Keeping a copy of this costs more than it helps */
+        vertex_buffer->streamed = true;
+        if (vertex_buffer->gl_buffer) {
+            glDeleteBuffers(1, &vertex_buffer->gl_buffer);
+            vertex_buffer->gl_buffer = 0;
+        }
+        pg->vertex_cache.size -= vertex_buffer->gl_size;
+        vertex_buffer->gl_size = 0;
+        return stream_vertex_attribute(pg, attribute, data, attribute->stride,
+                                       num_elements);
+    }
+
+    upload_vertex_buffer(pg, vertex_buffer, attribute, data);
+    return 0;
+}
+
+#ifdef DEBUG_NV2A_GPU_VERTEX_CACHE_STATS
+static void vertex_cache_report_stats(PGRAPHState* pg)
+{
+    printf("nv2a: vertex cache: %u buffers, %zu / %zu bytes, "
+           "%" PRIu64 " hits, %" PRIu64 " hash hits, %" PRIu64 " misses, "
+           "%" PRIu64 " evictions, %" PRIu64 " bytes streamed\n",
+           g_hash_table_size(pg->cache.vertex_buffer),
+           pg->vertex_cache.size, pg->vertex_cache.budget,
+           pg->vertex_cache.hits, pg->vertex_cache.hash_hits,
+           pg->vertex_cache.misses, pg->vertex_cache.evictions,
+           pg->vertex_cache.streamed);
+}
+#endif
+
+/* Index lists of inline element draws
+ *
+ * Indices are streamed through the vertex ring. Lists which show up a second
+ * time get a buffer object of their own and aren't uploaded again. Lists are
+ * looked up by a hash of their contents, a copy rules out collisions. */
+
+typedef struct IndexBuffer {
+    struct IndexBufferKey {
+        uint32_t hash;
+        uint32_t size; /* In bytes */
+        GLenum type;
+    } key;
+    void* data;
+    GLuint gl_buffer; /* 0 until the list is drawn again */
+    size_t cache_size; /* Bytes it adds to pg->index_cache.size */
+    QTAILQ_ENTRY(IndexBuffer) lru;
+} IndexBuffer;
+
+static guint index_buffer_hash(gconstpointer key)
+{
+    return ((const struct IndexBufferKey*)key)->hash;
+}
+
+static gboolean index_buffer_equal(gconstpointer a, gconstpointer b)
+{
+    return memcmp(a, b, sizeof(struct IndexBufferKey)) == 0;
+}
+
+static void delete_index_buffer(PGRAPHState* pg, IndexBuffer* index_buffer)
+{
+    QTAILQ_REMOVE(&pg->index_cache.lru, index_buffer, lru);
+    g_hash_table_remove(pg->cache.index_buffer, index_buffer);
+    pg->index_cache.size -= index_buffer->cache_size;
+    if (index_buffer->gl_buffer) {
+        glDeleteBuffers(1, &index_buffer->gl_buffer);
+    }
+    g_free(index_buffer->data);
+    g_free(index_buffer);
+}
+
+static void evict_index_buffers(PGRAPHState* pg, size_t size)
+{
+    IndexBuffer* index_buffer;
+    IndexBuffer* next_index_buffer;
+    QTAILQ_FOREACH_SAFE(index_buffer, &pg->index_cache.lru, lru,
+                        next_index_buffer) {
+        if (pg->index_cache.size + size <= NV2A_GPU_INDEX_CACHE_BUDGET) {
+            break;
+        }
+        delete_index_buffer(pg, index_buffer);
+        pg->index_cache.evictions++;
+    }
+}
+
+static void delete_all_index_buffers(PGRAPHState* pg)
+{
+    IndexBuffer* index_buffer;
+    IndexBuffer* next_index_buffer;
+    QTAILQ_FOREACH_SAFE(index_buffer, &pg->index_cache.lru, lru,
+                        next_index_buffer) {
+        delete_index_buffer(pg, index_buffer);
+    }
+}
+
+/* Writes size bytes of indices to the ring, which is left bound to
+   GL_ELEMENT_ARRAY_BUFFER. Returns their offset. */
+static size_t stream_indices(PGRAPHState* pg, const void* indices,
+                             size_t size)
+{
+    size_t offset = vertex_ring_alloc(pg, size);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, pg->vertex_ring.gl_buffer);
+    if (pg->vertex_ring.map) {
+        memcpy(pg->vertex_ring.map + offset, indices, size);
+    } else {
+        glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, offset, size, indices);
+    }
+    pg->index_cache.streamed += size;
+    pg->frame_stats.upload_bytes += size;
+    return offset;
+}
+
+/* Binds a buffer with the count indices of type to GL_ELEMENT_ARRAY_BUFFER,
+   returns the offset of the first one */
+static size_t bind_index_buffer(PGRAPHState* pg, const void* indices,
+                                unsigned int count, GLenum type)
+{
+    size_t size = count * (type == GL_UNSIGNED_SHORT ? 2 : 4);
+    IndexBuffer* index_buffer;
+
+    assert(vertex_ring_fits(size));
+    if (size < NV2A_GPU_INDEX_CACHE_MIN_SIZE) {
+        /* Hashing costs more than streaming */
+        return stream_indices(pg, indices, size);
+    }
+
+    struct IndexBufferKey key;
+    memset(&key, 0, sizeof(key));
+    key.hash = XXH32(indices, size, 0);
+    key.size = size;
+    key.type = type;
+
+    index_buffer = g_hash_table_lookup(pg->cache.index_buffer, &key);
+    if (index_buffer && memcmp(index_buffer->data, indices, size) == 0) {
+        QTAILQ_REMOVE(&pg->index_cache.lru, index_buffer, lru);
+        QTAILQ_INSERT_TAIL(&pg->index_cache.lru, index_buffer, lru);
+        if (index_buffer->gl_buffer) {
+            pg->index_cache.hits++;
+            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, index_buffer->gl_buffer);
+            return 0;
+        }
+
+        /* Drawn a second time, it's probably not the last */
+        pg->index_cache.uploads++;
+        evict_index_buffers(pg, size);
+        index_buffer->cache_size += size;
+        pg->index_cache.size += size;
+        glGenBuffers(1, &index_buffer->gl_buffer);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, index_buffer->gl_buffer);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, size, indices, GL_STATIC_DRAW);
+        pg->frame_stats.upload_bytes += size;
+        return 0;
+    }
+
+    if (index_buffer) {
+        /* Same hash, different indices */
+        delete_index_buffer(pg, index_buffer);
+    }
+
+    pg->index_cache.misses++;
+    evict_index_buffers(pg, size);
+    index_buffer = g_malloc0(sizeof(IndexBuffer));
+    index_buffer->key = key;
+    index_buffer->data = g_memdup(indices, size);
+    index_buffer->cache_size = size;
+    pg->index_cache.size += size;
+    g_hash_table_add(pg->cache.index_buffer, index_buffer);
+    QTAILQ_INSERT_TAIL(&pg->index_cache.lru, index_buffer, lru);
+
+    return stream_indices(pg, indices, size);
+}
+
+#ifdef DEBUG_NV2A_GPU_INDEX_CACHE_STATS
+static void index_cache_report_stats(PGRAPHState* pg)
+{
+    printf("nv2a: index cache: %u lists, %zu bytes, "
+           "%" PRIu64 " hits, %" PRIu64 " uploads, %" PRIu64 " misses, "
+           "%" PRIu64 " evictions, %" PRIu64 " bytes streamed\n",
+           g_hash_table_size(pg->cache.index_buffer), pg->index_cache.size,
+           pg->index_cache.hits, pg->index_cache.uploads,
+           pg->index_cache.misses, pg->index_cache.evictions,
+           pg->index_cache.streamed);
+}
 #endif
@@ -227,6 +227,7 @@
 #           define NV097_SET_TEXTURE_FORMAT_COLOR_SZ_A8             0x19
 #           define NV097_SET_TEXTURE_FORMAT_COLOR_LU_IMAGE_X8R8G8B8 0x1E
 #           define NV097_SET_TEXTURE_FORMAT_COLOR_LC_IMAGE_CR8YB8CB8YA8 0x24
+#           define NV097_SET_TEXTURE_FORMAT_COLOR_LC_IMAGE_YB8CR8YA8CB8 0x25
 #           define NV097_SET_TEXTURE_FORMAT_COLOR_SZ_DEPTH_X8_Y24_FIXED 0x2A
 #           define NV097_SET_TEXTURE_FORMAT_COLOR_SZ_DEPTH_X8_Y24_FLOAT 0x2B
 #           define NV097_SET_TEXTURE_FORMAT_COLOR_SZ_DEPTH_Y16_FIXED 0x2C
@@ -269,6 +270,14 @@
 #   define NV097_SET_TEXTURE_IMAGE_RECT                       0x00971B1C
 #       define NV097_SET_TEXTURE_IMAGE_RECT_WIDTH                 0xFFFF0000
 #       define NV097_SET_TEXTURE_IMAGE_RECT_HEIGHT                0x0000FFFF
+#   define NV097_SET_TEXTURE_PALETTE                          0x00971B20
+#       define NV097_SET_TEXTURE_PALETTE_CONTEXT_DMA              0x00000001
+#       define NV097_SET_TEXTURE_PALETTE_LENGTH                   0x0000000C
+#           define NV097_SET_TEXTURE_PALETTE_LENGTH_256              0
+#           define NV097_SET_TEXTURE_PALETTE_LENGTH_128              1
+#           define NV097_SET_TEXTURE_PALETTE_LENGTH_64               2
+#           define NV097_SET_TEXTURE_PALETTE_LENGTH_32               3
+#       define NV097_SET_TEXTURE_PALETTE_OFFSET                   0xFFFFFFC0
 #   define NV097_SET_SEMAPHORE_OFFSET                         0x00971D6C
 #   define NV097_BACK_END_WRITE_SEMAPHORE_RELEASE             0x00971D70
 #   define NV097_SET_ZSTENCIL_CLEAR_VALUE                     0x00971D8C
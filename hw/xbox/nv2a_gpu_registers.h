@@ -443,6 +443,7 @@
 #define NV_PVIDEO_FORMAT                                 0x00000958
 #   define NV_PVIDEO_FORMAT_PITCH                             0x00001FFF
 #   define NV_PVIDEO_FORMAT_COLOR                             0x00030000
+#       define NV_PVIDEO_FORMAT_COLOR_LE_YB8CR8YA8CB8             0
 #       define NV_PVIDEO_FORMAT_COLOR_LE_CR8YB8CB8YA8             1
 #   define NV_PVIDEO_FORMAT_DISPLAY                            (1 << 20)
 
@@ -0,0 +1,416 @@
+/*
+ * QEMU Geforce NV2A GPU texture decoding on worker threads
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 or
+ * (at your option) version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Guest textures are turned into something glTexImage2D takes (unswizzled,
+ * converted and flipped) by a small pool of threads, one job per mip level.
+ * Decodes are started when the texture state of a stage was written and
+ * only joined by pgraph_bind_textures, or started and joined right there if
+ * nobody saw the texture coming. The render thread runs queued jobs itself
+ * while it waits.
+ *
+ * The guest may write to the texture while it's being decoded. Prefetches
+ * hash the source before decoding it, the result is only used if the
+ * memory still hashes the same when the texture is bound. */
+
+typedef struct TextureDecodeJob {
+    struct TextureDecode *decode;
+    int level; /* -1 hashes the source */
+    bool queued;
+    QTAILQ_ENTRY(TextureDecodeJob) entry;
+} TextureDecodeJob;
+
+typedef struct TextureDecodeLevel {
+    const uint8_t *src;
+    unsigned int width, height;
+    unsigned int row_length; /* In pixels, for GL_UNPACK_ROW_LENGTH */
+    uint8_t *data; /* Staging buffer, bottom-up */
+    size_t size;
+} TextureDecodeLevel;
+
+typedef struct TextureDecode {
+    struct TextureKey key;
+    TextureFormatInfo f;
+    const uint8_t *data;
+    size_t data_size;
+    bool palettized;
+    uint32_t palette[256]; /* Copied, the guest might change it meanwhile */
+
+    /* All of these are protected by the pool lock */
+    unsigned int pending; /* Queued or running jobs */
+    bool cancelled;
+    bool hashed;
+    bool check_hash; /* Don't decode if the source hashes to old_hash */
+    bool skipped;
+    uint32_t old_hash;
+    uint32_t data_hash;
+
+    unsigned int levels;
+    TextureDecodeJob hash_job;
+    TextureDecodeJob jobs[NV2A_GPU_TEXTURE_MAX_LEVELS];
+    TextureDecodeLevel level[NV2A_GPU_TEXTURE_MAX_LEVELS];
+} TextureDecode;
+
+/* Staging buffers are only handed out and returned by the render thread */
+static uint8_t* texture_staging_get(PGRAPHState* pg, size_t size)
+{
+    unsigned int i;
+    int best = -1;
+    for (i = 0; i < pg->texture_decode.staging_count; i++) {
+        if (pg->texture_decode.staging[i].size >= size
+            && (best == -1
+                || pg->texture_decode.staging[i].size
+                       < pg->texture_decode.staging[best].size)) {
+            best = i;
+        }
+    }
+    if (best == -1) {
+        return g_malloc(MAX(size, 1));
+    }
+    uint8_t* data = pg->texture_decode.staging[best].data;
+    pg->texture_decode.staging[best] =
+        pg->texture_decode.staging[--pg->texture_decode.staging_count];
+    return data;
+}
+
+static void texture_staging_put(PGRAPHState* pg, uint8_t* data, size_t size)
+{
+    unsigned int i;
+    unsigned int smallest = 0;
+    if (pg->texture_decode.staging_count < NV2A_GPU_TEXTURE_STAGING_BUFFERS) {
+        i = pg->texture_decode.staging_count++;
+        pg->texture_decode.staging[i].data = data;
+        pg->texture_decode.staging[i].size = MAX(size, 1);
+        return;
+    }
+    /* Keep the big ones, they are the expensive ones to allocate */
+    for (i = 1; i < NV2A_GPU_TEXTURE_STAGING_BUFFERS; i++) {
+        if (pg->texture_decode.staging[i].size
+                < pg->texture_decode.staging[smallest].size) {
+            smallest = i;
+        }
+    }
+    if (pg->texture_decode.staging[smallest].size < size) {
+        g_free(pg->texture_decode.staging[smallest].data);
+        pg->texture_decode.staging[smallest].data = data;
+        pg->texture_decode.staging[smallest].size = size;
+    } else {
+        g_free(data);
+    }
+}
+
+static void texture_decode_level(TextureDecode* decode,
+                                 TextureDecodeLevel* level)
+{
+    const TextureFormatInfo* f = &decode->f;
+
+    if (decode->palettized) {
+        /* The indices go to the start of the buffer, expanding them from
+         * the back doesn't overwrite any which are still needed */
+        unsigned int count = level->width * level->height;
+        uint32_t* colors = (uint32_t*)level->data;
+        unswizzle_and_flip(level->src, level->width, level->height,
+                           level->data, level->width, 1);
+        while (count-- > 0) {
+            colors[count] = decode->palette[level->data[count]];
+        }
+    } else if (!f->linear) {
+        unswizzle_and_flip(level->src, level->width, level->height,
+                           level->data, level->width * f->bytes_per_pixel,
+                           f->bytes_per_pixel);
+    } else if (f->convert_to_gl != NULL) {
+        /* Converters write tightly packed 32 bit pixels */
+        uint8_t* converted = f->convert_to_gl(decode->key.color_format,
+                                              level->width, level->height,
+                                              decode->key.pitch, level->src);
+        assert(converted != NULL);
+        flip(converted, level->width * 4, level->width, level->height,
+             level->data, level->width * 4, 4);
+        g_free(converted);
+    } else {
+        flip(level->src, decode->key.pitch, level->width, level->height,
+             level->data, decode->key.pitch, f->bytes_per_pixel);
+    }
+}
+
+/* Called with the pool lock held */
+static void texture_decode_queue(PGRAPHState* pg, TextureDecodeJob* job)
+{
+    job->queued = true;
+    job->decode->pending++;
+    QTAILQ_INSERT_TAIL(&pg->texture_decode.queue, job, entry);
+}
+
+/* Runs the oldest queued job, called with the pool lock held */
+static void texture_decode_run_job(PGRAPHState* pg)
+{
+    unsigned int i;
+    TextureDecodeJob* job = QTAILQ_FIRST(&pg->texture_decode.queue);
+    TextureDecode* decode = job->decode;
+
+    QTAILQ_REMOVE(&pg->texture_decode.queue, job, entry);
+    job->queued = false;
+    qemu_mutex_unlock(&pg->texture_decode.lock);
+
+    uint32_t data_hash = 0;
+    if (job->level < 0) {
+        data_hash = XXH32(decode->data, decode->data_size, 0);
+    } else {
+        texture_decode_level(decode, &decode->level[job->level]);
+    }
+
+    qemu_mutex_lock(&pg->texture_decode.lock);
+    if (job->level < 0) {
+        decode->data_hash = data_hash;
+        decode->hashed = true;
+        if (decode->check_hash && data_hash == decode->old_hash) {
+            /* Still what the cache has, nothing to do */
+            decode->skipped = true;
+        } else if (!decode->cancelled) {
+            for (i = 0; i < decode->levels; i++) {
+                texture_decode_queue(pg, &decode->jobs[i]);
+            }
+            qemu_cond_broadcast(&pg->texture_decode.work_cond);
+        }
+    }
+    decode->pending--;
+    qemu_cond_broadcast(&pg->texture_decode.done_cond);
+}
+
+static void* texture_decode_thread(void* opaque)
+{
+    PGRAPHState* pg = opaque;
+
+    qemu_mutex_lock(&pg->texture_decode.lock);
+    while (true) {
+        while (QTAILQ_EMPTY(&pg->texture_decode.queue)
+               && !pg->texture_decode.exit) {
+            qemu_cond_wait(&pg->texture_decode.work_cond,
+                           &pg->texture_decode.lock);
+        }
+        if (pg->texture_decode.exit) {
+            break;
+        }
+        texture_decode_run_job(pg);
+    }
+    qemu_mutex_unlock(&pg->texture_decode.lock);
+
+    return NULL;
+}
+
+/* Starts decoding all levels of the texture described by key and f from
+ * data, palette has the colors of palettized textures. If hash is set the
+ * source is hashed first, and if old_hash is given too nothing is decoded
+ * if the source still hashes to it. */
+static TextureDecode* texture_decode_start(PGRAPHState* pg,
+                                           const struct TextureKey* key,
+                                           const TextureFormatInfo* f,
+                                           const uint8_t* data,
+                                           size_t data_size,
+                                           const uint32_t* palette,
+                                           bool hash,
+                                           const uint32_t* old_hash)
+{
+    unsigned int i;
+    unsigned int width = key->width;
+    unsigned int height = key->height;
+    const uint8_t* src = data;
+
+    assert(f->gl_format != 0); /* Compressed textures are used as they are */
+    assert(key->levels <= NV2A_GPU_TEXTURE_MAX_LEVELS);
+
+    TextureDecode* decode = g_malloc0(sizeof(TextureDecode));
+    decode->key = *key;
+    decode->f = *f;
+    decode->data = data;
+    decode->data_size = data_size;
+    decode->levels = f->linear ? 1 : key->levels;
+    if (key->palette_hash != 0) {
+        assert(palette != NULL && !f->linear);
+        decode->palettized = true;
+        memcpy(decode->palette, palette, sizeof(decode->palette));
+    }
+
+    for (i = 0; i < decode->levels; i++) {
+        TextureDecodeLevel* level = &decode->level[i];
+        level->src = src;
+        level->width = width;
+        level->height = height;
+        if (decode->palettized) {
+            level->row_length = width;
+            level->size = width * height * 4;
+            src += width * height;
+        } else if (!f->linear) {
+            level->row_length = width;
+            level->size = width * height * f->bytes_per_pixel;
+            src += level->size;
+        } else if (f->convert_to_gl != NULL) {
+            level->row_length = width;
+            level->size = width * height * 4;
+        } else {
+            /* Can't handle retarded strides */
+            assert(key->pitch % f->bytes_per_pixel == 0);
+            level->row_length = key->pitch / f->bytes_per_pixel;
+            level->size = key->pitch * height;
+        }
+        level->data = texture_staging_get(pg, level->size);
+
+        decode->jobs[i].decode = decode;
+        decode->jobs[i].level = i;
+
+        width /= 2;
+        height /= 2;
+    }
+    decode->hash_job.decode = decode;
+    decode->hash_job.level = -1;
+    if (old_hash != NULL) {
+        decode->check_hash = true;
+        decode->old_hash = *old_hash;
+    }
+
+    qemu_mutex_lock(&pg->texture_decode.lock);
+    if (hash) {
+        texture_decode_queue(pg, &decode->hash_job);
+    } else {
+        for (i = 0; i < decode->levels; i++) {
+            texture_decode_queue(pg, &decode->jobs[i]);
+        }
+    }
+    qemu_cond_broadcast(&pg->texture_decode.work_cond);
+    qemu_mutex_unlock(&pg->texture_decode.lock);
+
+    pg->texture_decode.decodes++;
+    return decode;
+}
+
+/* Blocks until all jobs of decode are done, helps out meanwhile */
+static void texture_decode_wait(PGRAPHState* pg, TextureDecode* decode)
+{
+    qemu_mutex_lock(&pg->texture_decode.lock);
+    while (decode->pending > 0) {
+        if (!QTAILQ_EMPTY(&pg->texture_decode.queue)) {
+            texture_decode_run_job(pg);
+        } else {
+            qemu_cond_wait(&pg->texture_decode.done_cond,
+                           &pg->texture_decode.lock);
+        }
+    }
+    qemu_mutex_unlock(&pg->texture_decode.lock);
+}
+
+/* Drops decode, jobs which didn't start yet are thrown away */
+static void texture_decode_release(PGRAPHState* pg, TextureDecode* decode)
+{
+    unsigned int i;
+
+    qemu_mutex_lock(&pg->texture_decode.lock);
+    decode->cancelled = true;
+    if (decode->hash_job.queued) {
+        QTAILQ_REMOVE(&pg->texture_decode.queue, &decode->hash_job, entry);
+        decode->hash_job.queued = false;
+        decode->pending--;
+    }
+    for (i = 0; i < decode->levels; i++) {
+        if (decode->jobs[i].queued) {
+            QTAILQ_REMOVE(&pg->texture_decode.queue, &decode->jobs[i], entry);
+            decode->jobs[i].queued = false;
+            decode->pending--;
+        }
+    }
+    while (decode->pending > 0) {
+        qemu_cond_wait(&pg->texture_decode.done_cond,
+                       &pg->texture_decode.lock);
+    }
+    qemu_mutex_unlock(&pg->texture_decode.lock);
+
+    for (i = 0; i < decode->levels; i++) {
+        texture_staging_put(pg, decode->level[i].data, decode->level[i].size);
+    }
+    g_free(decode);
+}
+
+/* Hands out the prefetched decode of a stage if it's for key, the caller
+ * has to wait for it and release it. Any other prefetch is dropped. */
+static TextureDecode* texture_decode_claim(PGRAPHState* pg, unsigned int slot,
+                                           const struct TextureKey* key)
+{
+    TextureDecode* decode = pg->texture_decode.prefetch[slot];
+    if (decode == NULL) {
+        return NULL;
+    }
+    pg->texture_decode.prefetch[slot] = NULL;
+    if (memcmp(&decode->key, key, sizeof(struct TextureKey)) != 0) {
+        texture_decode_release(pg, decode);
+        return NULL;
+    }
+    return decode;
+}
+
+static void texture_decode_init(PGRAPHState* pg)
+{
+    unsigned int i;
+
+    qemu_mutex_init(&pg->texture_decode.lock);
+    qemu_cond_init(&pg->texture_decode.work_cond);
+    qemu_cond_init(&pg->texture_decode.done_cond);
+    QTAILQ_INIT(&pg->texture_decode.queue);
+    for (i = 0; i < NV2A_GPU_TEXTURE_DECODE_THREADS; i++) {
+        qemu_thread_create(&pg->texture_decode.threads[i], "nv2a/texture",
+                           texture_decode_thread, pg, QEMU_THREAD_JOINABLE);
+    }
+}
+
+static void texture_decode_destroy(PGRAPHState* pg)
+{
+    unsigned int i;
+
+    for (i = 0; i < NV2A_GPU_MAX_TEXTURES; i++) {
+        if (pg->texture_decode.prefetch[i] != NULL) {
+            texture_decode_release(pg, pg->texture_decode.prefetch[i]);
+            pg->texture_decode.prefetch[i] = NULL;
+        }
+    }
+
+    qemu_mutex_lock(&pg->texture_decode.lock);
+    pg->texture_decode.exit = true;
+    qemu_cond_broadcast(&pg->texture_decode.work_cond);
+    qemu_mutex_unlock(&pg->texture_decode.lock);
+    for (i = 0; i < NV2A_GPU_TEXTURE_DECODE_THREADS; i++) {
+        qemu_thread_join(&pg->texture_decode.threads[i]);
+    }
+
+    for (i = 0; i < pg->texture_decode.staging_count; i++) {
+        g_free(pg->texture_decode.staging[i].data);
+    }
+    pg->texture_decode.staging_count = 0;
+
+    qemu_mutex_destroy(&pg->texture_decode.lock);
+    qemu_cond_destroy(&pg->texture_decode.work_cond);
+    qemu_cond_destroy(&pg->texture_decode.done_cond);
+}
+
+#ifdef DEBUG_NV2A_GPU_TEXTURE_DECODE_STATS
+static void texture_decode_report_stats(PGRAPHState* pg)
+{
+    printf("nv2a: texture decode: %" PRIu64 " decodes, %" PRIu64
+           " prefetches used, %" PRIu64 " wasted\n",
+           pg->texture_decode.decodes, pg->texture_decode.prefetch_hits,
+           pg->texture_decode.prefetch_misses);
+    pg->texture_decode.decodes = 0;
+    pg->texture_decode.prefetch_hits = 0;
+    pg->texture_decode.prefetch_misses = 0;
+}
+#endif
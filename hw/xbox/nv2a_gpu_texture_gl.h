@@ -0,0 +1,539 @@
+/*
+ * QEMU Geforce NV2A GPU texture decoding on the host GPU
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 or
+ * (at your option) version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Instead of going through the decode workers the guest bytes of a texture
+ * can be uploaded as they are, into a buffer texture, and turned into the
+ * texture by drawing into each of its levels. The fragment shader does the
+ * unswizzling, flipping, YUV conversion and palette lookup.
+ *
+ * The buffer texture has the palette in its first 256 words, the texture
+ * data follows. Which color formats are decoded this way is picked with
+ * -machine nv2a_texture_decode=gpu (all it can do) or a list of color
+ * formats, like nv2a_texture_decode=0x6:0xb. Textures it can't do (odd
+ * pitches, too big for a buffer texture) still go to the workers.
+ *
+ * DEBUG_NV2A_GPU_TEXTURE_GPU_DECODE_VERIFY decodes every texture on the CPU
+ * too and compares the results. LIBGL_ALWAYS_SOFTWARE=1 gets Mesa's
+ * software rasterizer for that. */
+
+/* Has to match the fragment shader */
+typedef enum TextureGPUDecodeKind {
+    TEXTURE_GPU_DECODE_NONE = 0,
+    TEXTURE_GPU_DECODE_A8R8G8B8 = 1,
+    TEXTURE_GPU_DECODE_A8B8G8R8 = 2,
+    TEXTURE_GPU_DECODE_A1R5G5B5 = 3,
+    TEXTURE_GPU_DECODE_A4R4G4B4 = 4,
+    TEXTURE_GPU_DECODE_R5G6B5 = 5,
+    TEXTURE_GPU_DECODE_YUYV = 6,
+    TEXTURE_GPU_DECODE_UYVY = 7,
+    TEXTURE_GPU_DECODE_I8_A8R8G8B8 = 8,
+} TextureGPUDecodeKind;
+
+/* Formats the fragment shader can decode, all of them end up as RGB(A) */
+static const TextureGPUDecodeKind kelvin_texture_gpu_decode_map[] = {
+    [NV097_SET_TEXTURE_FORMAT_COLOR_SZ_A1R5G5B5] = TEXTURE_GPU_DECODE_A1R5G5B5,
+    [NV097_SET_TEXTURE_FORMAT_COLOR_SZ_X1R5G5B5] = TEXTURE_GPU_DECODE_A1R5G5B5,
+    [NV097_SET_TEXTURE_FORMAT_COLOR_SZ_A4R4G4B4] = TEXTURE_GPU_DECODE_A4R4G4B4,
+    [NV097_SET_TEXTURE_FORMAT_COLOR_SZ_R5G6B5] = TEXTURE_GPU_DECODE_R5G6B5,
+    [NV097_SET_TEXTURE_FORMAT_COLOR_SZ_A8R8G8B8] = TEXTURE_GPU_DECODE_A8R8G8B8,
+    [NV097_SET_TEXTURE_FORMAT_COLOR_SZ_X8R8G8B8] = TEXTURE_GPU_DECODE_A8R8G8B8,
+    [NV097_SET_TEXTURE_FORMAT_COLOR_SZ_I8_A8R8G8B8] =
+        TEXTURE_GPU_DECODE_I8_A8R8G8B8,
+    /* Same mapping as convert_yuv422_to_a8r8g8b8 */
+    [NV097_SET_TEXTURE_FORMAT_COLOR_LC_IMAGE_CR8YB8CB8YA8] =
+        TEXTURE_GPU_DECODE_YUYV,
+    [NV097_SET_TEXTURE_FORMAT_COLOR_LC_IMAGE_YB8CR8YA8CB8] =
+        TEXTURE_GPU_DECODE_UYVY,
+    [NV097_SET_TEXTURE_FORMAT_COLOR_LU_IMAGE_R5G6B5] =
+        TEXTURE_GPU_DECODE_R5G6B5,
+    [NV097_SET_TEXTURE_FORMAT_COLOR_LU_IMAGE_A8R8G8B8] =
+        TEXTURE_GPU_DECODE_A8R8G8B8,
+    [NV097_SET_TEXTURE_FORMAT_COLOR_LU_IMAGE_X8R8G8B8] =
+        TEXTURE_GPU_DECODE_A8R8G8B8,
+    [NV097_SET_TEXTURE_FORMAT_COLOR_SZ_A8B8G8R8] = TEXTURE_GPU_DECODE_A8B8G8R8,
+    [NV097_SET_TEXTURE_FORMAT_COLOR_LU_IMAGE_A8B8G8R8] =
+        TEXTURE_GPU_DECODE_A8B8G8R8,
+};
+
+/* Bytes in front of the texture data */
+#define TEXTURE_GPU_DECODE_PALETTE_SIZE (256 * 4)
+
+static const char* texture_gpu_decode_vertex_shader =
+    "#version 140\n"
+    "\n"
+    "in vec2 position;\n"
+    "void main() {\n"
+    "    gl_Position = vec4(position, 0.0, 1.0);\n"
+    "}\n";
+
+static const char* texture_gpu_decode_fragment_shader =
+    "#version 140\n"
+    "\n"
+    "uniform usamplerBuffer data;\n"
+    "uniform int kind;\n"
+    "uniform bool swizzled;\n"
+    "uniform int height;\n"
+    "uniform int log_min_size;\n" /* Of the smaller side, when swizzled */
+    "uniform int pitch;\n"
+    "uniform int bytes_per_pixel;\n"
+    "uniform int level_offset;\n" /* In bytes, from the start of data */
+    "out vec4 color;\n"
+    "\n"
+    /* size bytes at address, they are never split over two words */
+    "uint fetch(int address, int size) {\n"
+    "    uint word = texelFetch(data, address >> 2).r;\n"
+    "    word >>= uint((address & 3) * 8);\n"
+    "    return size == 4 ? word : word & ((1u << uint(size * 8)) - 1u);\n"
+    "}\n"
+    "\n"
+    /* Same as get_swizzled_offset */
+    "int swizzle(int x, int y) {\n"
+    "    int offset = 0;\n"
+    "    for (int i = 0; i < log_min_size; i++) {\n"
+    "        offset |= ((x >> i) & 1) << (2 * i);\n"
+    "        offset |= ((y >> i) & 1) << (2 * i + 1);\n"
+    "    }\n"
+    "    return offset | ((x >> log_min_size) << (2 * log_min_size))\n"
+    "                  | ((y >> log_min_size) << (2 * log_min_size));\n"
+    "}\n"
+    "\n"
+    /* Components at shift with bits each, in red, green, blue, alpha
+     * order. A width of 0 is always 1. */
+    "vec4 unpack(uint v, uvec4 shift, uvec4 bits) {\n"
+    "    uvec4 mask = (uvec4(1u) << bits) - 1u;\n"
+    "    vec4 c = vec4((uvec4(v) >> shift) & mask) / vec4(max(mask, 1u));\n"
+    "    return mix(c, vec4(1.0), equal(bits, uvec4(0u)));\n"
+    "}\n"
+    "\n"
+    /* Like yuv.c, c, d and e are Y - 16, U - 128 and V - 128 */
+    "vec4 yuv(int c, int d, int e) {\n"
+    "    int y = 298 * c + 128;\n"
+    "    ivec3 rgb = ivec3(y + 409 * e, y - 100 * d - 208 * e, y + 516 * d);\n"
+    "    return vec4(vec3(clamp(rgb >> 8, 0, 255)) / 255.0, 1.0);\n"
+    "}\n"
+    "\n"
+    "void main() {\n"
+    "    int x = int(gl_FragCoord.x);\n"
+    /* The guest has the top row first */
+    "    int y = height - 1 - int(gl_FragCoord.y);\n"
+    "    if (kind == 6 || kind == 7) {\n"
+    "        uint pair = fetch(level_offset + y * pitch + (x & ~1) * 2, 4);\n"
+    "        uint b0 = pair & 0xFFu;\n"
+    "        uint b1 = (pair >> 8) & 0xFFu;\n"
+    "        uint b2 = (pair >> 16) & 0xFFu;\n"
+    "        uint b3 = pair >> 24;\n"
+    "        if (kind == 6) {\n"
+    "            color = yuv(int((x & 1) != 0 ? b2 : b0) - 16,\n"
+    "                        int(b1) - 128, int(b3) - 128);\n"
+    "        } else {\n"
+    "            color = yuv(int((x & 1) != 0 ? b3 : b1) - 16,\n"
+    "                        int(b0) - 128, int(b2) - 128);\n"
+    "        }\n"
+    "        return;\n"
+    "    }\n"
+    "    int address = level_offset + bytes_per_pixel *\n"
+    "        (swizzled ? swizzle(x, y) : y * (pitch / bytes_per_pixel) + x);\n"
+    "    uint v = fetch(address, bytes_per_pixel);\n"
+    "    if (kind == 8) {\n"
+    "        v = texelFetch(data, int(v)).r;\n"
+    "    }\n"
+    "    if (kind == 1 || kind == 8) {\n"
+    "        color = unpack(v, uvec4(16u, 8u, 0u, 24u), uvec4(8u));\n"
+    "    } else if (kind == 2) {\n"
+    "        color = unpack(v, uvec4(0u, 8u, 16u, 24u), uvec4(8u));\n"
+    "    } else if (kind == 3) {\n"
+    "        color = unpack(v, uvec4(10u, 5u, 0u, 15u), uvec4(5u, 5u, 5u, 1u));\n"
+    "    } else if (kind == 4) {\n"
+    "        color = unpack(v, uvec4(8u, 4u, 0u, 12u), uvec4(4u));\n"
+    "    } else {\n"
+    "        color = unpack(v, uvec4(11u, 5u, 0u, 0u), uvec4(5u, 6u, 5u, 0u));\n"
+    "    }\n"
+    "}\n";
+
+/* A rectangle covering the viewport */
+static const GLfloat texture_gpu_decode_quad[] = {
+    -1.0f, -1.0f,   1.0f, -1.0f,   -1.0f, 1.0f,   1.0f, 1.0f
+};
+
+static bool texture_gpu_decode_selected(PGRAPHState* pg,
+                                        unsigned int color_format)
+{
+    return color_format < 64
+        && (pg->texture_gpu_decode.formats & (1ULL << color_format));
+}
+
+/* Returns the color formats picked by the nv2a_texture_decode option */
+static uint64_t texture_gpu_decode_parse_formats(const char* option)
+{
+    uint64_t formats = 0;
+    unsigned int i;
+
+    if (!option || !strcmp(option, "cpu")) {
+        return 0;
+    }
+    if (!strcmp(option, "gpu")) {
+        for (i = 0; i < ARRAY_SIZE(kelvin_texture_gpu_decode_map); i++) {
+            if (kelvin_texture_gpu_decode_map[i] != TEXTURE_GPU_DECODE_NONE) {
+                formats |= 1ULL << i;
+            }
+        }
+        return formats;
+    }
+
+    const char* p = option;
+    while (*p != '\0') {
+        char* end;
+        unsigned long color_format = strtoul(p, &end, 0);
+        if (end == p || (*end != ':' && *end != '\0')
+            || color_format >= ARRAY_SIZE(kelvin_texture_gpu_decode_map)
+            || kelvin_texture_gpu_decode_map[color_format]
+                   == TEXTURE_GPU_DECODE_NONE) {
+            fprintf(stderr, "nv2a: can't decode textures %s on the gpu\n",
+                    option);
+            return 0;
+        }
+        formats |= 1ULL << color_format;
+        p = (*end == ':') ? end + 1 : end;
+    }
+    return formats;
+}
+
+/* Needs the render thread's context */
+static void texture_gpu_decode_init(PGRAPHState* pg)
+{
+    QemuOpts *machine_opts = qemu_opts_find(qemu_find_opts("machine"), 0);
+    if (!machine_opts) {
+        return;
+    }
+    pg->texture_gpu_decode.formats = texture_gpu_decode_parse_formats(
+        qemu_opt_get(machine_opts, "nv2a_texture_decode"));
+    if (pg->texture_gpu_decode.formats == 0) {
+        return;
+    }
+
+    int glsl_major = 0, glsl_minor = 0;
+    const char* glsl_version =
+        (const char*)glGetString(GL_SHADING_LANGUAGE_VERSION);
+    if (glsl_version) {
+        sscanf(glsl_version, "%d.%d", &glsl_major, &glsl_minor);
+    }
+    if (glsl_major * 100 + glsl_minor < 140
+        || !glo_check_extension((const GLubyte *)
+                                "GL_ARB_texture_buffer_object")
+        || !glo_check_extension((const GLubyte *)
+                                "GL_ARB_vertex_array_object")) {
+        fprintf(stderr, "nv2a: no buffer textures or GLSL 1.40, textures "
+                        "are decoded on the cpu\n");
+        pg->texture_gpu_decode.formats = 0;
+        return;
+    }
+
+    GLint max_texels;
+    glGetIntegerv(GL_MAX_TEXTURE_BUFFER_SIZE_ARB, &max_texels);
+    pg->texture_gpu_decode.max_size = (size_t)max_texels * 4;
+
+    GLuint vertex_shader = glCreateShader(GL_VERTEX_SHADER);
+    compile_shader(vertex_shader, texture_gpu_decode_vertex_shader,
+                   "texture decode vertex");
+    GLuint fragment_shader = glCreateShader(GL_FRAGMENT_SHADER);
+    compile_shader(fragment_shader, texture_gpu_decode_fragment_shader,
+                   "texture decode fragment");
+
+    GLuint program = glCreateProgram();
+    glAttachShader(program, vertex_shader);
+    glAttachShader(program, fragment_shader);
+    glBindAttribLocation(program, 0, "position");
+    glBindFragDataLocation(program, 0, "color");
+    glLinkProgram(program);
+    GLint linked = 0;
+    glGetProgramiv(program, GL_LINK_STATUS, &linked);
+    if (!linked) {
+        GLchar log[GLSL_LOG_LENGTH];
+        glGetProgramInfoLog(program, GLSL_LOG_LENGTH, NULL, log);
+        log[GLSL_LOG_LENGTH - 1] = '\0';
+        fprintf(stderr, "nv2a: texture decode shader linking failed: %s\n",
+                log);
+        abort();
+    }
+    /* The program keeps them */
+    glDeleteShader(vertex_shader);
+    glDeleteShader(fragment_shader);
+
+    pg->texture_gpu_decode.gl_program = program;
+    pg->texture_gpu_decode.uniform.kind =
+        glGetUniformLocation(program, "kind");
+    pg->texture_gpu_decode.uniform.swizzled =
+        glGetUniformLocation(program, "swizzled");
+    pg->texture_gpu_decode.uniform.height =
+        glGetUniformLocation(program, "height");
+    pg->texture_gpu_decode.uniform.log_min_size =
+        glGetUniformLocation(program, "log_min_size");
+    pg->texture_gpu_decode.uniform.pitch =
+        glGetUniformLocation(program, "pitch");
+    pg->texture_gpu_decode.uniform.bytes_per_pixel =
+        glGetUniformLocation(program, "bytes_per_pixel");
+    pg->texture_gpu_decode.uniform.level_offset =
+        glGetUniformLocation(program, "level_offset");
+
+    GLuint previous_program = pg->gl_state.program;
+    gl_state_use_program(pg, program);
+    glUniform1i(glGetUniformLocation(program, "data"),
+                NV2A_GPU_MAX_TEXTURES);
+    gl_state_use_program(pg, previous_program);
+
+    /* Our own vertex array, the one of the draws stays untouched */
+    glGenVertexArrays(1, &pg->texture_gpu_decode.gl_vertex_array);
+    glBindVertexArray(pg->texture_gpu_decode.gl_vertex_array);
+    glGenBuffersARB(1, &pg->texture_gpu_decode.gl_vertex_buffer);
+    glBindBufferARB(GL_ARRAY_BUFFER_ARB,
+                    pg->texture_gpu_decode.gl_vertex_buffer);
+    glBufferDataARB(GL_ARRAY_BUFFER_ARB, sizeof(texture_gpu_decode_quad),
+                    texture_gpu_decode_quad, GL_STATIC_DRAW_ARB);
+    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, 0);
+    glEnableVertexAttribArray(0);
+    glBindVertexArray(0);
+    glBindBufferARB(GL_ARRAY_BUFFER_ARB, 0);
+
+    glGenBuffersARB(1, &pg->texture_gpu_decode.gl_buffer);
+    glGenTextures(1, &pg->texture_gpu_decode.gl_buffer_texture);
+    glBindBufferARB(GL_TEXTURE_BUFFER_ARB, pg->texture_gpu_decode.gl_buffer);
+    glBufferDataARB(GL_TEXTURE_BUFFER_ARB, TEXTURE_GPU_DECODE_PALETTE_SIZE,
+                    NULL, GL_STREAM_DRAW_ARB);
+    glBindBufferARB(GL_TEXTURE_BUFFER_ARB, 0);
+    glGenFramebuffersEXT(1, &pg->texture_gpu_decode.gl_framebuffer);
+
+    assert(glGetError() == GL_NO_ERROR);
+}
+
+static void texture_gpu_decode_destroy(PGRAPHState* pg)
+{
+    if (pg->texture_gpu_decode.gl_program == 0) {
+        return;
+    }
+    glDeleteProgram(pg->texture_gpu_decode.gl_program);
+    glDeleteVertexArrays(1, &pg->texture_gpu_decode.gl_vertex_array);
+    glDeleteBuffersARB(1, &pg->texture_gpu_decode.gl_vertex_buffer);
+    glDeleteTextures(1, &pg->texture_gpu_decode.gl_buffer_texture);
+    glDeleteBuffersARB(1, &pg->texture_gpu_decode.gl_buffer);
+    glDeleteFramebuffersEXT(1, &pg->texture_gpu_decode.gl_framebuffer);
+    pg->texture_gpu_decode.gl_program = 0;
+}
+
+#ifdef DEBUG_NV2A_GPU_TEXTURE_GPU_DECODE_VERIFY
+/* Decodes the texture on the CPU into a scratch texture and compares all
+ * levels with what the GPU made. One step of difference is fine, the
+ * drivers don't all round the same. */
+static void texture_gpu_decode_verify(PGRAPHState* pg,
+                                      GLuint gl_texture,
+                                      GLenum gl_target,
+                                      const struct TextureKey* key,
+                                      const TextureFormatInfo* f,
+                                      const uint8_t* data,
+                                      size_t data_size,
+                                      const uint32_t* palette)
+{
+    TextureDecode* decode = texture_decode_start(pg, key, f, data, data_size,
+                                                 palette, false, NULL);
+    texture_decode_wait(pg, decode);
+
+    GLuint scratch;
+    glGenTextures(1, &scratch);
+    /* Not through gl_state, it's unbound again right away */
+    glBindTexture(gl_target, scratch);
+
+    unsigned int level;
+    for (level = 0; level < decode->levels; level++) {
+        TextureDecodeLevel* l = &decode->level[level];
+        size_t size = l->width * l->height * 4;
+        if (size == 0) {
+            continue;
+        }
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, l->row_length);
+        glTexImage2D(gl_target, 0, f->gl_internal_format,
+                     l->width, l->height, 0, f->gl_format, f->gl_type,
+                     l->data);
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+
+        uint8_t* expected = g_malloc(size);
+        uint8_t* result = g_malloc(size);
+        glGetTexImage(gl_target, 0, GL_BGRA, GL_UNSIGNED_BYTE, expected);
+        glBindTexture(gl_target, gl_texture);
+        glGetTexImage(gl_target, level, GL_BGRA, GL_UNSIGNED_BYTE, result);
+        glBindTexture(gl_target, scratch);
+
+        size_t i;
+        unsigned int mismatches = 0;
+        for (i = 0; i < size; i++) {
+            if (abs((int)expected[i] - (int)result[i]) > 1) {
+                mismatches++;
+            }
+        }
+        if (mismatches > 0) {
+            fprintf(stderr, "nv2a: gpu texture decode of 0x%" HWADDR_PRIx
+                            " (color format 0x%x, level %u, %ux%u) is off "
+                            "in %u bytes\n",
+                    key->address, key->color_format, level,
+                    l->width, l->height, mismatches);
+        }
+        g_free(expected);
+        g_free(result);
+    }
+
+    glBindTexture(gl_target, gl_texture);
+    glDeleteTextures(1, &scratch);
+    texture_decode_release(pg, decode);
+}
+#endif
+
+/* Decodes all levels of a palettized, swizzled or linear texture into
+ * gl_texture, which has to be bound to gl_target of the active unit.
+ * Returns false if this texture has to be decoded on the CPU. */
+static bool texture_gpu_decode(NV2A_GPUState* d,
+                               GLuint gl_texture,
+                               GLenum gl_target,
+                               const struct TextureKey* key,
+                               const TextureFormatInfo* f,
+                               const uint8_t* data,
+                               size_t data_size,
+                               const uint32_t* palette)
+{
+    PGRAPHState* pg = &d->pgraph;
+    TextureGPUDecodeKind kind = kelvin_texture_gpu_decode_map[key->color_format];
+    size_t size = TEXTURE_GPU_DECODE_PALETTE_SIZE + data_size;
+
+    assert(kind != TEXTURE_GPU_DECODE_NONE);
+    /* Every pixel (or pair of them) has to be inside a word */
+    if ((f->linear && (key->pitch % 4 != 0))
+        || size > pg->texture_gpu_decode.max_size) {
+        pg->texture_gpu_decode.rejected++;
+        return false;
+    }
+
+    debugger_push_group("NV2A: gpu texture decode 0x%" HWADDR_PRIx,
+                        key->address);
+
+    /* Replaced, not overwritten, the last decode might still read it */
+    size = ROUND_UP(size, 4);
+    glBindBufferARB(GL_TEXTURE_BUFFER_ARB, pg->texture_gpu_decode.gl_buffer);
+    glBufferDataARB(GL_TEXTURE_BUFFER_ARB, size, NULL, GL_STREAM_DRAW_ARB);
+    if (palette != NULL) {
+        glBufferSubDataARB(GL_TEXTURE_BUFFER_ARB, 0,
+                           TEXTURE_GPU_DECODE_PALETTE_SIZE, palette);
+    }
+    glBufferSubDataARB(GL_TEXTURE_BUFFER_ARB, TEXTURE_GPU_DECODE_PALETTE_SIZE,
+                       data_size, data);
+    glBindBufferARB(GL_TEXTURE_BUFFER_ARB, 0);
+    pg->frame_stats.upload_bytes += size;
+
+    /* Allocate all levels, then draw into them */
+    unsigned int levels = f->linear ? 1 : key->levels;
+    unsigned int width = key->width;
+    unsigned int height = key->height;
+    unsigned int level;
+    for (level = 0; level < levels; level++) {
+        glTexImage2D(gl_target, level, f->gl_internal_format,
+                     width, height, 0, GL_BGRA, GL_UNSIGNED_BYTE, NULL);
+        width /= 2;
+        height /= 2;
+    }
+
+    GLenum active_texture = pg->gl_state.active_texture;
+    gl_state_active_texture(pg, GL_TEXTURE0 + NV2A_GPU_MAX_TEXTURES);
+    glBindTexture(GL_TEXTURE_BUFFER_ARB,
+                  pg->texture_gpu_decode.gl_buffer_texture);
+    glTexBufferARB(GL_TEXTURE_BUFFER_ARB, GL_R32UI,
+                   pg->texture_gpu_decode.gl_buffer);
+
+    /* Nothing of the draw state may get in the way */
+    GLState wanted = pg->gl_state.wanted;
+    GLuint program = pg->gl_state.program;
+    memset(pg->gl_state.wanted.caps, 0, sizeof(pg->gl_state.wanted.caps));
+    memset(pg->gl_state.wanted.color_mask, GL_TRUE,
+           sizeof(pg->gl_state.wanted.color_mask));
+    gl_state_use_program(pg, pg->texture_gpu_decode.gl_program);
+    glUniform1i(pg->texture_gpu_decode.uniform.kind, kind);
+    glUniform1i(pg->texture_gpu_decode.uniform.swizzled, !f->linear);
+    glUniform1i(pg->texture_gpu_decode.uniform.pitch, key->pitch);
+    glUniform1i(pg->texture_gpu_decode.uniform.bytes_per_pixel,
+                f->bytes_per_pixel);
+    glBindVertexArray(pg->texture_gpu_decode.gl_vertex_array);
+    glBindFramebufferEXT(GL_FRAMEBUFFER_EXT,
+                         pg->texture_gpu_decode.gl_framebuffer);
+
+    width = key->width;
+    height = key->height;
+    unsigned int level_offset = TEXTURE_GPU_DECODE_PALETTE_SIZE;
+    for (level = 0; level < levels; level++) {
+        if (width == 0 || height == 0) {
+            break;
+        }
+        glFramebufferTexture2DEXT(GL_FRAMEBUFFER_EXT,
+                                  GL_COLOR_ATTACHMENT0_EXT,
+                                  gl_target, gl_texture, level);
+        assert(glCheckFramebufferStatusEXT(GL_FRAMEBUFFER_EXT)
+                   == GL_FRAMEBUFFER_COMPLETE_EXT);
+        gl_state_viewport(pg, 0, 0, width, height);
+        gl_state_flush(pg);
+
+        glUniform1i(pg->texture_gpu_decode.uniform.height, height);
+        glUniform1i(pg->texture_gpu_decode.uniform.log_min_size,
+                    log2i(MIN(width, height)));
+        glUniform1i(pg->texture_gpu_decode.uniform.level_offset,
+                    level_offset);
+        glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+
+        level_offset += width * height * f->bytes_per_pixel;
+        width /= 2;
+        height /= 2;
+    }
+
+    glFramebufferTexture2DEXT(GL_FRAMEBUFFER_EXT, GL_COLOR_ATTACHMENT0_EXT,
+                              gl_target, 0, 0);
+    glBindFramebufferEXT(GL_FRAMEBUFFER_EXT,
+                         pg->framebuffer ? pg->framebuffer->gl_framebuffer : 0);
+    glBindVertexArray(0);
+    glBindTexture(GL_TEXTURE_BUFFER_ARB, 0);
+    gl_state_active_texture(pg, active_texture);
+    gl_state_use_program(pg, program);
+    pg->gl_state.wanted = wanted;
+    gl_state_flush(pg);
+
+#ifdef DEBUG_NV2A_GPU_TEXTURE_GPU_DECODE_VERIFY
+    texture_gpu_decode_verify(pg, gl_texture, gl_target, key, f,
+                              data, data_size, palette);
+#endif
+
+    assert(glGetError() == GL_NO_ERROR);
+    debugger_pop_group();
+
+    pg->texture_gpu_decode.decodes++;
+    return true;
+}
+
+#ifdef DEBUG_NV2A_GPU_TEXTURE_DECODE_STATS
+static void texture_gpu_decode_report_stats(PGRAPHState* pg)
+{
+    if (pg->texture_gpu_decode.formats == 0) {
+        return;
+    }
+    printf("nv2a: gpu texture decode: %" PRIu64 " decodes, %" PRIu64
+           " left to the cpu\n",
+           pg->texture_gpu_decode.decodes, pg->texture_gpu_decode.rejected);
+    pg->texture_gpu_decode.decodes = 0;
+    pg->texture_gpu_decode.rejected = 0;
+}
+#endif
@@ -0,0 +1,419 @@
+/*
+ * QEMU Geforce NV2A GPU method stream capture and replay
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 or
+ * (at your option) version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* -machine nv2a_capture=FILE records everything PGRAPH gets to see from
+ * boot on: the methods the render thread executes, the PGRAPH registers the
+ * guest writes and the guest memory the methods may read.
+ *
+ * -machine nv2a_replay=FILE runs such a capture on the render thread instead
+ * of the guest, as fast as possible, and prints the time, draws and uploads
+ * of every frame. Use -display none for headless runs, QEMU quits when the
+ * capture is done.
+ *
+ * A capture is a TraceHeader followed by records, each a TraceRecord and
+ * its payload, all host endian:
+ *
+ *   TRACE_METHOD    args: subchannel, method | TRACE_NONINCREASING, count
+ *                   payload: count parameters, objects already resolved to
+ *                   instances by the puller
+ *   TRACE_REGISTER  args: PGRAPH register, value
+ *   TRACE_MEMORY    args: TRACE_REGION_*, offset, size
+ *                   payload: size bytes of pages written since the last
+ *                   record, the first ones are a snapshot of all non-zero
+ *                   memory
+ */
+
+#define TRACE_MAGIC 0x5254564e /* "NVTR" */
+#define TRACE_VERSION 1
+
+#define TRACE_NONINCREASING 0x80000000
+
+/* Dirty pages are looked for in chunks of this size first */
+#define TRACE_CHUNK_SIZE 0x100000
+
+enum {
+    TRACE_METHOD = 1,
+    TRACE_REGISTER,
+    TRACE_MEMORY,
+};
+
+enum {
+    TRACE_REGION_VRAM,
+    TRACE_REGION_RAMIN,
+};
+
+typedef struct TraceHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t vram_size;
+    uint32_t ramin_size;
+} TraceHeader;
+
+typedef struct TraceRecord {
+    uint32_t type;
+    uint32_t args[3];
+} TraceRecord;
+
+static void pgraph_method(NV2A_GPUState *d,
+                          unsigned int subchannel,
+                          unsigned int method,
+                          uint32_t parameter);
+static void pgraph_method_burst(NV2A_GPUState *d,
+                                unsigned int subchannel,
+                                unsigned int method,
+                                bool nonincreasing,
+                                const uint32_t *parameters,
+                                unsigned int count);
+static void pgraph_write(void *opaque, hwaddr addr,
+                         uint64_t val, unsigned int size);
+static void ramin_cache_invalidate(NV2A_GPUState *d, hwaddr addr, hwaddr size);
+
+/* Called with the trace lock held */
+static void trace_write(TraceState *trace, uint32_t type,
+                        uint32_t arg0, uint32_t arg1, uint32_t arg2,
+                        const void *payload, size_t size)
+{
+    TraceRecord record = { type, { arg0, arg1, arg2 } };
+    if (fwrite(&record, sizeof(record), 1, trace->capture) != 1
+        || (size && fwrite(payload, size, 1, trace->capture) != 1)) {
+        fprintf(stderr, "nv2a: capture failed, stopping it\n");
+        fclose(trace->capture);
+        trace->capture = NULL;
+    }
+}
+
+static void trace_capture_region(NV2A_GPUState *d, unsigned int region,
+                                 MemoryRegion *mr, const uint8_t *ptr)
+{
+    TraceState *trace = &d->trace;
+    hwaddr size = memory_region_size(mr);
+    hwaddr chunk, chunk_end, page, end;
+
+    for (chunk = 0; chunk < size; chunk = chunk_end) {
+        chunk_end = MIN(chunk + TRACE_CHUNK_SIZE, size);
+        if (!memory_region_get_dirty(mr, chunk, chunk_end - chunk,
+                                     DIRTY_MEMORY_NV2A_GPU_CAPTURE)) {
+            continue;
+        }
+        for (page = chunk; page < chunk_end; page = end) {
+            end = page + TARGET_PAGE_SIZE;
+            if (!memory_region_get_dirty(mr, page, TARGET_PAGE_SIZE,
+                                         DIRTY_MEMORY_NV2A_GPU_CAPTURE)) {
+                continue;
+            }
+            while (end < chunk_end
+                   && memory_region_get_dirty(mr, end, TARGET_PAGE_SIZE,
+                                              DIRTY_MEMORY_NV2A_GPU_CAPTURE)) {
+                end += TARGET_PAGE_SIZE;
+            }
+
+            /* Reset before copying, so writes racing with us show up in
+             * the next record */
+            memory_region_reset_dirty(mr, page, end - page,
+                                      DIRTY_MEMORY_NV2A_GPU_CAPTURE);
+
+            /* A replay starts with zeroed memory */
+            if (trace->snapshot && buffer_is_zero(ptr + page, end - page)) {
+                continue;
+            }
+            trace_write(trace, TRACE_MEMORY, region, page, end - page,
+                        ptr + page, end - page);
+            if (!trace->capture) {
+                return;
+            }
+        }
+    }
+}
+
+/* Records the memory written since the last call, with the trace lock held */
+static void trace_capture_memory(NV2A_GPUState *d)
+{
+    memory_region_sync_dirty_bitmap(d->vram);
+    trace_capture_region(d, TRACE_REGION_VRAM, d->vram, d->vram_ptr);
+    trace_capture_region(d, TRACE_REGION_RAMIN, &d->ramin, d->ramin_ptr);
+    d->trace.snapshot = false;
+}
+
+/* Called by the render thread right before it executes a method */
+static void trace_capture_method(NV2A_GPUState *d,
+                                 unsigned int subchannel,
+                                 unsigned int method,
+                                 bool nonincreasing,
+                                 const uint32_t *parameters,
+                                 unsigned int count)
+{
+    TraceState *trace = &d->trace;
+    if (!trace->capture) {
+        return;
+    }
+    qemu_mutex_lock(&trace->lock);
+    if (trace->capture) {
+        trace_capture_memory(d);
+    }
+    if (trace->capture) {
+        trace_write(trace, TRACE_METHOD, subchannel,
+                    method | (nonincreasing ? TRACE_NONINCREASING : 0),
+                    count, parameters, count * sizeof(uint32_t));
+    }
+    qemu_mutex_unlock(&trace->lock);
+}
+
+static void trace_capture_register(NV2A_GPUState *d, hwaddr addr,
+                                   uint32_t value)
+{
+    TraceState *trace = &d->trace;
+    if (!trace->capture) {
+        return;
+    }
+    qemu_mutex_lock(&trace->lock);
+    if (trace->capture) {
+        /* Context switches read and write RAMIN */
+        trace_capture_memory(d);
+    }
+    if (trace->capture) {
+        trace_write(trace, TRACE_REGISTER, addr, value, 0, NULL, 0);
+    }
+    qemu_mutex_unlock(&trace->lock);
+}
+
+/* Called at every flip with the pgraph lock held */
+static void trace_finish_frame(NV2A_GPUState *d)
+{
+    TraceState *trace = &d->trace;
+    PGRAPHState *pg = &d->pgraph;
+
+    if (trace->capture) {
+        /* Keep everything up to the last frame if QEMU doesn't exit cleanly */
+        qemu_mutex_lock(&trace->lock);
+        if (trace->capture) {
+            fflush(trace->capture);
+        }
+        qemu_mutex_unlock(&trace->lock);
+    }
+
+    if (trace->replay) {
+        /* Measure the work, not how long it takes the driver to queue it */
+        glFinish();
+        int64_t now = get_clock();
+        int64_t ns = now - trace->frame_start;
+        printf("nv2a: replay frame %u: %.3f ms, %u draws, "
+               "%" PRIu64 " KiB uploaded\n",
+               trace->frame, ns / 1000000.0, pg->frame_stats.draws,
+               pg->frame_stats.upload_bytes / 1024);
+        trace->totals.ns += ns;
+        trace->totals.draws += pg->frame_stats.draws;
+        trace->totals.upload_bytes += pg->frame_stats.upload_bytes;
+        trace->frame++;
+        trace->frame_start = now;
+    }
+
+    memset(&pg->frame_stats, 0, sizeof(pg->frame_stats));
+}
+
+/* Returns the payload size of a record or -1 if it's broken */
+static ssize_t trace_payload_size(NV2A_GPUState *d, const TraceRecord *record)
+{
+    switch (record->type) {
+    case TRACE_METHOD:
+        if (record->args[0] >= 8 || record->args[2] == 0
+            || record->args[2] > NV2A_GPU_MAX_BURST_LENGTH) {
+            return -1;
+        }
+        return record->args[2] * sizeof(uint32_t);
+    case TRACE_REGISTER:
+        return 0;
+    case TRACE_MEMORY: {
+        MemoryRegion *mr = (record->args[0] == TRACE_REGION_RAMIN)
+                               ? &d->ramin : d->vram;
+        if (record->args[0] > TRACE_REGION_RAMIN
+            || (uint64_t)record->args[1] + record->args[2]
+                   > memory_region_size(mr)) {
+            return -1;
+        }
+        return record->args[2];
+    }
+    default:
+        return -1;
+    }
+}
+
+/* Runs the whole capture, called by the render thread which owns the GL
+ * context */
+static void trace_replay(NV2A_GPUState *d)
+{
+    TraceState *trace = &d->trace;
+    PGRAPHState *pg = &d->pgraph;
+    const uint8_t *data = trace->replay + sizeof(TraceHeader);
+    const uint8_t *end = trace->replay + trace->replay_size;
+    TraceRecord record;
+    ssize_t size;
+
+    memset(d->vram_ptr, 0, memory_region_size(d->vram));
+    memory_region_set_dirty(d->vram, 0, memory_region_size(d->vram));
+    qemu_mutex_lock(&d->ramin_cache.lock);
+    memset(d->ramin_ptr, 0, memory_region_size(&d->ramin));
+    ramin_cache_invalidate(d, 0, memory_region_size(&d->ramin));
+    qemu_mutex_unlock(&d->ramin_cache.lock);
+    memory_region_set_dirty(&d->ramin, 0, memory_region_size(&d->ramin));
+
+    /* Nobody is going to stop us */
+    qemu_mutex_lock(&pg->lock);
+    pg->fifo_access = true;
+    qemu_mutex_unlock(&pg->lock);
+
+    trace->frame_start = get_clock();
+
+    while (end - data >= sizeof(record)) {
+        memcpy(&record, data, sizeof(record));
+        data += sizeof(record);
+        size = trace_payload_size(d, &record);
+        if (size < 0 || end - data < size) {
+            fprintf(stderr, "nv2a: broken capture record at offset %zu\n",
+                    (size_t)(data - sizeof(record) - trace->replay));
+            break;
+        }
+
+        switch (record.type) {
+        case TRACE_METHOD: {
+            unsigned int method = record.args[1] & ~TRACE_NONINCREASING;
+            const uint32_t *parameters = (const uint32_t *)data;
+            if (method == 0) {
+                pgraph_method(d, record.args[0], 0, parameters[0]);
+            } else {
+                pgraph_method_burst(d, record.args[0], method,
+                                    record.args[1] & TRACE_NONINCREASING,
+                                    parameters, record.args[2]);
+            }
+            break;
+        }
+        case TRACE_REGISTER:
+            /* The guest only paced the methods with these */
+            if (record.args[0] != NV_PGRAPH_FIFO
+                && record.args[0] != NV_PGRAPH_INCREMENT) {
+                pgraph_write(d, record.args[0], record.args[1], 4);
+            }
+            break;
+        case TRACE_MEMORY:
+            if (record.args[0] == TRACE_REGION_RAMIN) {
+                qemu_mutex_lock(&d->ramin_cache.lock);
+                memcpy(d->ramin_ptr + record.args[1], data, size);
+                ramin_cache_invalidate(d, record.args[1], size);
+                qemu_mutex_unlock(&d->ramin_cache.lock);
+                memory_region_set_dirty(&d->ramin, record.args[1], size);
+            } else {
+                memcpy(d->vram_ptr + record.args[1], data, size);
+                memory_region_set_dirty(d->vram, record.args[1], size);
+            }
+            break;
+        default:
+            assert(false);
+            break;
+        }
+        data += size;
+    }
+
+    glFinish();
+    unsigned int frames = MAX(trace->frame, 1);
+    printf("nv2a: replayed %u frames, %.3f ms, %" PRIu64 " draws and "
+           "%" PRIu64 " KiB uploaded per frame\n",
+           trace->frame, trace->totals.ns / 1000000.0 / frames,
+           trace->totals.draws / frames,
+           trace->totals.upload_bytes / 1024 / frames);
+
+    g_free(trace->replay);
+    trace->replay = NULL;
+    qemu_system_shutdown_request();
+}
+
+/* Needs the memory regions, so it's called once they are set up */
+static void trace_init(NV2A_GPUState *d)
+{
+    TraceState *trace = &d->trace;
+    TraceHeader header = {
+        .magic = TRACE_MAGIC,
+        .version = TRACE_VERSION,
+        .vram_size = memory_region_size(d->vram),
+        .ramin_size = memory_region_size(&d->ramin),
+    };
+
+    qemu_mutex_init(&trace->lock);
+
+    QemuOpts *machine_opts = qemu_opts_find(qemu_find_opts("machine"), 0);
+    if (!machine_opts) {
+        return;
+    }
+
+    const char *replay = qemu_opt_get(machine_opts, "nv2a_replay");
+    if (replay) {
+        gchar *contents;
+        gsize length;
+        TraceHeader file_header;
+        if (!g_file_get_contents(replay, &contents, &length, NULL)) {
+            fprintf(stderr, "nv2a: could not read capture %s\n", replay);
+            exit(1);
+        }
+        if (length < sizeof(file_header)) {
+            memset(&file_header, 0, sizeof(file_header));
+        } else {
+            memcpy(&file_header, contents, sizeof(file_header));
+        }
+        if (memcmp(&file_header, &header, sizeof(header)) != 0) {
+            fprintf(stderr, "nv2a: %s is no capture of this machine\n",
+                    replay);
+            exit(1);
+        }
+
+        /* The guest must not touch the memory or the GPU */
+        autostart = 0;
+
+        RenderQueue *q = &d->render_queue;
+        qemu_mutex_lock(&q->lock);
+        trace->replay = (uint8_t *)contents;
+        trace->replay_size = length;
+        qemu_cond_broadcast(&q->cond);
+        qemu_mutex_unlock(&q->lock);
+        return;
+    }
+
+    const char *capture = qemu_opt_get(machine_opts, "nv2a_capture");
+    if (capture) {
+        FILE *file = fopen(capture, "wb");
+        if (!file || fwrite(&header, sizeof(header), 1, file) != 1) {
+            fprintf(stderr, "nv2a: could not create capture %s\n", capture);
+            if (file) {
+                fclose(file);
+            }
+            return;
+        }
+        /* Memory is dirty for every client from the start, so the first
+         * sync records all of it */
+        memory_region_set_log(d->vram, true, DIRTY_MEMORY_NV2A_GPU_CAPTURE);
+        memory_region_set_log(&d->ramin, true, DIRTY_MEMORY_NV2A_GPU_CAPTURE);
+        trace->snapshot = true;
+        trace->capture = file;
+    }
+}
+
+static void trace_destroy(NV2A_GPUState *d)
+{
+    TraceState *trace = &d->trace;
+    if (trace->capture) {
+        fclose(trace->capture);
+        trace->capture = NULL;
+    }
+    qemu_mutex_destroy(&trace->lock);
+}
@@ -0,0 +1,366 @@
+/*
+* QEMU texture swizzling routines
+*
+* Copyright (c) 2013 espes
+* Copyright (c) 2007-2010 The Nouveau Project.
+*
+* This library is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Lesser General Public
+* License version 2 as published by the Free Software Foundation.
+*
+* This library is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+* Lesser General Public License for more details.
+*
+* You should have received a copy of the GNU Lesser General Public
+* License along with this library; if not, see <http://www.gnu.org/licenses/>
+*
+* Contributions after 2012-01-13 are licensed under the terms of the
+* GNU GPL, version 2 or (at your option) any later version.
+*/
+
+#include <assert.h>
+#include <glib.h>
+
+#include "qemu-common.h"
+#include "hw/xbox/swizzle.h"
+
+/* The swizzled offset of (x, y) is the sum of the offsets of (x, 0) and
+   (0, y): the bits of x and y never end up in the same place. So we only
+   have to evaluate get_swizzled_offset for each column and each row once
+   and the per pixel work is reduced to a table lookup.
+
+   The low bits are interleaved x0 y0 x1 y1 .., so for images which are at
+   least 4x4 pixels every aligned 4x4 tile is stored as 16 consecutive
+   pixels. The SIMD kernels convert whole tiles at once. */
+
+#if defined(CONFIG_CPUID_H) && (defined(__x86_64__) || defined(__i386__))
+#define SWIZZLE_SSE2
+#include <cpuid.h>
+#include <emmintrin.h>
+#endif
+
+static bool have_sse2;
+static bool force_generic;
+
+static void swizzle_init(void) __attribute__((constructor));
+static void swizzle_init(void)
+{
+#ifdef SWIZZLE_SSE2
+    unsigned int a, b, c, d;
+    if (__get_cpuid_max(0, 0) >= 1) {
+        __cpuid(1, a, b, c, d);
+        have_sse2 = (d & bit_SSE2) != 0;
+    }
+#endif
+}
+
+const char *swizzle_get_implementation(void)
+{
+    if (have_sse2 && !force_generic) {
+        return "sse2";
+    }
+    return "generic";
+}
+
+void swizzle_force_generic(bool force)
+{
+    force_generic = force;
+}
+
+static unsigned int *get_swizzled_offset_tables(unsigned int width,
+                                                unsigned int height,
+                                                unsigned int bytes_per_pixel)
+{
+    unsigned int *tables = g_new(unsigned int, width + height);
+    unsigned int i;
+    for (i = 0; i < width; i++) {
+        tables[i] = get_swizzled_offset(i, 0, width, height, bytes_per_pixel);
+    }
+    for (i = 0; i < height; i++) {
+        tables[width + i] = get_swizzled_offset(0, i, width, height,
+                                                bytes_per_pixel);
+    }
+    return tables;
+}
+
+/* bytes_per_pixel is a constant after inlining, so the memcpy calls turn
+   into plain moves. Pixels 2n and 2n+1 are always next to each other. */
+static inline void swizzle_rows_generic(
+    const uint8_t *src_buf, unsigned int width, unsigned int height,
+    uint8_t *dst_buf, unsigned int src_pitch,
+    const unsigned int *x_offsets, const unsigned int *y_offsets,
+    const unsigned int bytes_per_pixel)
+{
+    unsigned int x, y;
+    for (y = 0; y < height; y++) {
+        const uint8_t *src = src_buf + (height - y - 1) * src_pitch;
+        uint8_t *dst = dst_buf + y_offsets[y];
+        if (width == 1) {
+            memcpy(dst, src, bytes_per_pixel);
+            continue;
+        }
+        for (x = 0; x < width; x += 2) {
+            memcpy(dst + x_offsets[x], src + x * bytes_per_pixel,
+                   2 * bytes_per_pixel);
+        }
+    }
+}
+
+static inline void unswizzle_rows_generic(
+    const uint8_t *src_buf, unsigned int width, unsigned int height,
+    uint8_t *dst_buf, unsigned int dst_pitch,
+    const unsigned int *x_offsets, const unsigned int *y_offsets,
+    const unsigned int bytes_per_pixel)
+{
+    unsigned int x, y;
+    for (y = 0; y < height; y++) {
+        const uint8_t *src = src_buf + y_offsets[y];
+        uint8_t *dst = dst_buf + (height - y - 1) * dst_pitch;
+        if (width == 1) {
+            memcpy(dst, src, bytes_per_pixel);
+            continue;
+        }
+        for (x = 0; x < width; x += 2) {
+            memcpy(dst + x * bytes_per_pixel, src + x_offsets[x],
+                   2 * bytes_per_pixel);
+        }
+    }
+}
+
+#ifdef SWIZZLE_SSE2
+
+/* A tile is made of 2x2 blocks. With 4 bytes per pixel a block is one
+   vector, the low half of 2 blocks is one row of the tile and the high
+   half is the next row. */
+__attribute__((target("sse2")))
+static void swizzle_tiles_sse2_32(
+    const uint8_t *src_buf, unsigned int width, unsigned int height,
+    uint8_t *dst_buf, unsigned int src_pitch,
+    const unsigned int *x_offsets, const unsigned int *y_offsets)
+{
+    unsigned int x, y;
+    for (y = 0; y < height; y += 4) {
+        const uint8_t *src_row = src_buf + (height - y - 1) * src_pitch;
+        for (x = 0; x < width; x += 4) {
+            const uint8_t *src = src_row + x * 4;
+            __m128i r0 = _mm_loadu_si128((const __m128i *)src);
+            __m128i r1 = _mm_loadu_si128((const __m128i *)(src - src_pitch));
+            __m128i r2 = _mm_loadu_si128((const __m128i *)(src - 2 * src_pitch));
+            __m128i r3 = _mm_loadu_si128((const __m128i *)(src - 3 * src_pitch));
+            __m128i *dst = (__m128i *)(dst_buf + y_offsets[y] + x_offsets[x]);
+            _mm_storeu_si128(dst + 0, _mm_unpacklo_epi64(r0, r1));
+            _mm_storeu_si128(dst + 1, _mm_unpackhi_epi64(r0, r1));
+            _mm_storeu_si128(dst + 2, _mm_unpacklo_epi64(r2, r3));
+            _mm_storeu_si128(dst + 3, _mm_unpackhi_epi64(r2, r3));
+        }
+    }
+}
+
+__attribute__((target("sse2")))
+static void unswizzle_tiles_sse2_32(
+    const uint8_t *src_buf, unsigned int width, unsigned int height,
+    uint8_t *dst_buf, unsigned int dst_pitch,
+    const unsigned int *x_offsets, const unsigned int *y_offsets)
+{
+    unsigned int x, y;
+    for (y = 0; y < height; y += 4) {
+        uint8_t *dst_row = dst_buf + (height - y - 1) * dst_pitch;
+        for (x = 0; x < width; x += 4) {
+            const __m128i *src = (const __m128i *)(src_buf + y_offsets[y]
+                                                           + x_offsets[x]);
+            __m128i b0 = _mm_loadu_si128(src + 0);
+            __m128i b1 = _mm_loadu_si128(src + 1);
+            __m128i b2 = _mm_loadu_si128(src + 2);
+            __m128i b3 = _mm_loadu_si128(src + 3);
+            uint8_t *dst = dst_row + x * 4;
+            _mm_storeu_si128((__m128i *)dst, _mm_unpacklo_epi64(b0, b1));
+            _mm_storeu_si128((__m128i *)(dst - dst_pitch),
+                             _mm_unpackhi_epi64(b0, b1));
+            _mm_storeu_si128((__m128i *)(dst - 2 * dst_pitch),
+                             _mm_unpacklo_epi64(b2, b3));
+            _mm_storeu_si128((__m128i *)(dst - 3 * dst_pitch),
+                             _mm_unpackhi_epi64(b2, b3));
+        }
+    }
+}
+
+/* With 2 bytes per pixel a block row is 32 bits, so a vector holds the
+   blocks of 2 rows and only has to be reordered: 0xD8 swaps the 2 middle
+   dwords and is its own inverse */
+__attribute__((target("sse2")))
+static void swizzle_tiles_sse2_16(
+    const uint8_t *src_buf, unsigned int width, unsigned int height,
+    uint8_t *dst_buf, unsigned int src_pitch,
+    const unsigned int *x_offsets, const unsigned int *y_offsets)
+{
+    unsigned int x, y;
+    for (y = 0; y < height; y += 4) {
+        const uint8_t *src_row = src_buf + (height - y - 1) * src_pitch;
+        for (x = 0; x < width; x += 4) {
+            const uint8_t *src = src_row + x * 2;
+            __m128i r0 = _mm_loadl_epi64((const __m128i *)src);
+            __m128i r1 = _mm_loadl_epi64((const __m128i *)(src - src_pitch));
+            __m128i r2 = _mm_loadl_epi64((const __m128i *)(src - 2 * src_pitch));
+            __m128i r3 = _mm_loadl_epi64((const __m128i *)(src - 3 * src_pitch));
+            __m128i *dst = (__m128i *)(dst_buf + y_offsets[y] + x_offsets[x]);
+            _mm_storeu_si128(dst + 0,
+                             _mm_shuffle_epi32(_mm_unpacklo_epi64(r0, r1),
+                                               0xD8));
+            _mm_storeu_si128(dst + 1,
+                             _mm_shuffle_epi32(_mm_unpacklo_epi64(r2, r3),
+                                               0xD8));
+        }
+    }
+}
+
+__attribute__((target("sse2")))
+static void unswizzle_tiles_sse2_16(
+    const uint8_t *src_buf, unsigned int width, unsigned int height,
+    uint8_t *dst_buf, unsigned int dst_pitch,
+    const unsigned int *x_offsets, const unsigned int *y_offsets)
+{
+    unsigned int x, y;
+    for (y = 0; y < height; y += 4) {
+        uint8_t *dst_row = dst_buf + (height - y - 1) * dst_pitch;
+        for (x = 0; x < width; x += 4) {
+            const __m128i *src = (const __m128i *)(src_buf + y_offsets[y]
+                                                           + x_offsets[x]);
+            __m128i r01 = _mm_shuffle_epi32(_mm_loadu_si128(src + 0), 0xD8);
+            __m128i r23 = _mm_shuffle_epi32(_mm_loadu_si128(src + 1), 0xD8);
+            uint8_t *dst = dst_row + x * 2;
+            _mm_storel_epi64((__m128i *)dst, r01);
+            _mm_storel_epi64((__m128i *)(dst - dst_pitch),
+                             _mm_unpackhi_epi64(r01, r01));
+            _mm_storel_epi64((__m128i *)(dst - 2 * dst_pitch), r23);
+            _mm_storel_epi64((__m128i *)(dst - 3 * dst_pitch),
+                             _mm_unpackhi_epi64(r23, r23));
+        }
+    }
+}
+
+/* Can the tile kernels handle this image? */
+static bool use_tiles(unsigned int width, unsigned int height,
+                      unsigned int bytes_per_pixel)
+{
+    if (!have_sse2 || force_generic) {
+        return false;
+    }
+    if (width < 4 || height < 4) {
+        return false;
+    }
+    return (bytes_per_pixel == 2) || (bytes_per_pixel == 4);
+}
+
+#endif
+
+void flip_and_swizzle(
+    const uint8_t *src_buf,
+    unsigned int width,
+    unsigned int height,
+    uint8_t *dst_buf,
+    unsigned int src_pitch,
+    unsigned int bytes_per_pixel)
+{
+    unsigned int *x_offsets;
+    unsigned int *y_offsets;
+
+    if (width == 0 || height == 0) {
+        return;
+    }
+
+    x_offsets = get_swizzled_offset_tables(width, height, bytes_per_pixel);
+    y_offsets = &x_offsets[width];
+
+#ifdef SWIZZLE_SSE2
+    if (use_tiles(width, height, bytes_per_pixel)) {
+        if (bytes_per_pixel == 4) {
+            swizzle_tiles_sse2_32(src_buf, width, height, dst_buf, src_pitch,
+                                  x_offsets, y_offsets);
+        } else {
+            swizzle_tiles_sse2_16(src_buf, width, height, dst_buf, src_pitch,
+                                  x_offsets, y_offsets);
+        }
+        g_free(x_offsets);
+        return;
+    }
+#endif
+
+    switch (bytes_per_pixel) {
+    case 1:
+        swizzle_rows_generic(src_buf, width, height, dst_buf, src_pitch,
+                             x_offsets, y_offsets, 1);
+        break;
+    case 2:
+        swizzle_rows_generic(src_buf, width, height, dst_buf, src_pitch,
+                             x_offsets, y_offsets, 2);
+        break;
+    case 4:
+        swizzle_rows_generic(src_buf, width, height, dst_buf, src_pitch,
+                             x_offsets, y_offsets, 4);
+        break;
+    case 8:
+        swizzle_rows_generic(src_buf, width, height, dst_buf, src_pitch,
+                             x_offsets, y_offsets, 8);
+        break;
+    default:
+        assert(false);
+    }
+    g_free(x_offsets);
+}
+
+void unswizzle_and_flip(
+    const uint8_t *src_buf,
+    unsigned int width,
+    unsigned int height,
+    uint8_t *dst_buf,
+    unsigned int dst_pitch,
+    unsigned int bytes_per_pixel)
+{
+    unsigned int *x_offsets;
+    unsigned int *y_offsets;
+
+    if (width == 0 || height == 0) {
+        return;
+    }
+
+    x_offsets = get_swizzled_offset_tables(width, height, bytes_per_pixel);
+    y_offsets = &x_offsets[width];
+
+#ifdef SWIZZLE_SSE2
+    if (use_tiles(width, height, bytes_per_pixel)) {
+        if (bytes_per_pixel == 4) {
+            unswizzle_tiles_sse2_32(src_buf, width, height, dst_buf, dst_pitch,
+                                    x_offsets, y_offsets);
+        } else {
+            unswizzle_tiles_sse2_16(src_buf, width, height, dst_buf, dst_pitch,
+                                    x_offsets, y_offsets);
+        }
+        g_free(x_offsets);
+        return;
+    }
+#endif
+
+    switch (bytes_per_pixel) {
+    case 1:
+        unswizzle_rows_generic(src_buf, width, height, dst_buf, dst_pitch,
+                               x_offsets, y_offsets, 1);
+        break;
+    case 2:
+        unswizzle_rows_generic(src_buf, width, height, dst_buf, dst_pitch,
+                               x_offsets, y_offsets, 2);
+        break;
+    case 4:
+        unswizzle_rows_generic(src_buf, width, height, dst_buf, dst_pitch,
+                               x_offsets, y_offsets, 4);
+        break;
+    case 8:
+        unswizzle_rows_generic(src_buf, width, height, dst_buf, dst_pitch,
+                               x_offsets, y_offsets, 8);
+        break;
+    default:
+        assert(false);
+    }
+    g_free(x_offsets);
+}
@@ -20,6 +20,9 @@
 * GNU GPL, version 2 or (at your option) any later version.
 */
 
+#ifndef HW_XBOX_SWIZZLE_H
+#define HW_XBOX_SWIZZLE_H
+
 #include <stdint.h>
 #include <string.h>
 #include "qemu/osdep.h"
@@ -31,6 +34,8 @@ static inline unsigned int log2i(unsigned int i)
     return r;
 }
 
+/* Reference implementation, this is slow. Use the functions below when
+   converting whole textures. */
 static inline unsigned int get_swizzled_offset(
     unsigned int x, unsigned int y,
     unsigned int width, unsigned int height,
@@ -69,38 +74,28 @@ static inline unsigned int get_swizzled_offset(
              (y & (~0 << k)) << k);
 }
 
-static inline void flip_and_swizzle(
-    uint8_t *src_buf,
+/* Both of these expect power of two dimensions and 1, 2, 4 or 8 bytes per
+   pixel. The linear image is stored bottom-up (GL style). */
+void flip_and_swizzle(
+    const uint8_t *src_buf,
     unsigned int width,
     unsigned int height,
     uint8_t *dst_buf,
     unsigned int src_pitch,
-    unsigned int bytes_per_pixel)
-{
-    int x, y;
-    for (y = 0; y < height; y++) {
-        for (x = 0; x < width; x++) {
-            uint8_t *src = src_buf + ((height - y - 1) * src_pitch + x * bytes_per_pixel);
-            uint8_t *dst = dst_buf + get_swizzled_offset(x, y, width, height, bytes_per_pixel);
-            memcpy(dst, src, bytes_per_pixel);
-        }
-    }
-}
+    unsigned int bytes_per_pixel);
 
-static inline void unswizzle_and_flip(
-    uint8_t *src_buf,
+void unswizzle_and_flip(
+    const uint8_t *src_buf,
     unsigned int width,
     unsigned int height,
     uint8_t *dst_buf,
     unsigned int dst_pitch,
-    unsigned int bytes_per_pixel)
-{
-    int x, y;
-    for (y = 0; y < height; y++) {
-        for (x = 0; x < width; x++) {
-            uint8_t *src = src_buf + get_swizzled_offset(x, y, width, height, bytes_per_pixel);
-            uint8_t *dst = dst_buf + ((height - y - 1) * dst_pitch + x * bytes_per_pixel);
-            memcpy(dst, src, bytes_per_pixel);
-        }
-    }
-}
+    unsigned int bytes_per_pixel);
+
+/* Name of the kernels picked for this host, for benchmarks and tests */
+const char *swizzle_get_implementation(void);
+
+/* Only use the portable kernels (for tests) */
+void swizzle_force_generic(bool force);
+
+#endif
@@ -0,0 +1,312 @@
+/*
+ * QEMU packed 4:2:2 YUV to RGB conversion
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ *
+ */
+
+#include <assert.h>
+#include <glib.h>
+
+#include "qemu-common.h"
+#include "hw/xbox/yuv.h"
+
+/* With c = Y - 16, d = U - 128 and e = V - 128 (BT.601, studio range):
+
+     R = (298 * c + 409 * e + 128) >> 8
+     G = (298 * c - 100 * d - 208 * e + 128) >> 8
+     B = (298 * c + 516 * d + 128) >> 8
+
+   All terms fit in 16 bits, so the SIMD kernels can use pmaddwd on pairs
+   of (c, 1) and (d, e) and get exactly the same results as the generic
+   code. */
+
+#if defined(CONFIG_CPUID_H) && (defined(__x86_64__) || defined(__i386__))
+#define YUV_SSE2
+#include <cpuid.h>
+#include <emmintrin.h>
+#endif
+
+/* Pixels converted at once when scaling */
+#define YUV_CHUNK 256
+
+static bool have_sse2;
+static bool force_generic;
+
+static void yuv_init(void) __attribute__((constructor));
+static void yuv_init(void)
+{
+#ifdef YUV_SSE2
+    unsigned int a, b, c, d;
+    if (__get_cpuid_max(0, 0) >= 1) {
+        __cpuid(1, a, b, c, d);
+        have_sse2 = (d & bit_SSE2) != 0;
+    }
+#endif
+}
+
+const char *yuv_get_implementation(void)
+{
+    if (have_sse2 && !force_generic) {
+        return "sse2";
+    }
+    return "generic";
+}
+
+void yuv_force_generic(bool force)
+{
+    force_generic = force;
+}
+
+/* Byte offsets of the components within a pixel pair */
+static void get_offsets(YUV422Format format, unsigned int *luma,
+                        unsigned int *u, unsigned int *v)
+{
+    switch (format) {
+    case YUV422_YUYV:
+        *luma = 0;
+        *u = 1;
+        *v = 3;
+        break;
+    case YUV422_UYVY:
+        *luma = 1;
+        *u = 0;
+        *v = 2;
+        break;
+    default:
+        assert(false);
+    }
+}
+
+static inline uint8_t clip(int x)
+{
+    return (x < 0) ? 0 : ((x > 255) ? 255 : x);
+}
+
+static inline void convert_pixel(int c, int d, int e, uint8_t *dst)
+{
+    int y_term = 298 * c + 128;
+    dst[0] = clip((y_term + 516 * d) >> 8);
+    dst[1] = clip((y_term - 100 * d - 208 * e) >> 8);
+    dst[2] = clip((y_term + 409 * e) >> 8);
+    dst[3] = 0xFF;
+}
+
+static void packed_to_bgra_generic(YUV422Format format, const uint8_t *src,
+                                   unsigned int first, unsigned int width,
+                                   uint8_t *dst)
+{
+    unsigned int luma, u, v, x;
+    get_offsets(format, &luma, &u, &v);
+    for (x = first; x < width; x++) {
+        const uint8_t *pair = src + (x & ~1) * 2;
+        convert_pixel((int)src[x * 2 + luma] - 16,
+                      (int)pair[u] - 128,
+                      (int)pair[v] - 128,
+                      dst + x * 4);
+    }
+}
+
+static void planar_to_bgra_generic(const int16_t *c, const int16_t *d,
+                                   const int16_t *e, unsigned int first,
+                                   unsigned int width, uint8_t *dst)
+{
+    unsigned int x;
+    for (x = first; x < width; x++) {
+        convert_pixel(c[x], d[x], e[x], dst + x * 4);
+    }
+}
+
+#ifdef YUV_SSE2
+
+/* One channel of 8 pixels as 16 bit values, not clipped yet */
+__attribute__((target("sse2")))
+static inline __m128i channel_sse2(__m128i y_lo, __m128i y_hi,
+                                   __m128i de_lo, __m128i de_hi,
+                                   __m128i coefficients)
+{
+    __m128i lo = _mm_add_epi32(y_lo, _mm_madd_epi16(de_lo, coefficients));
+    __m128i hi = _mm_add_epi32(y_hi, _mm_madd_epi16(de_hi, coefficients));
+    return _mm_packs_epi32(_mm_srai_epi32(lo, 8), _mm_srai_epi32(hi, 8));
+}
+
+/* c, d and e hold Y - 16, U - 128 and V - 128 of 8 pixels */
+__attribute__((target("sse2")))
+static inline void store_bgra_sse2(__m128i c, __m128i d, __m128i e,
+                                   uint8_t *dst)
+{
+    const __m128i one = _mm_set1_epi16(1);
+    const __m128i y_coefficients = _mm_set_epi16(128, 298, 128, 298,
+                                                 128, 298, 128, 298);
+    const __m128i b_coefficients = _mm_set_epi16(0, 516, 0, 516,
+                                                 0, 516, 0, 516);
+    const __m128i g_coefficients = _mm_set_epi16(-208, -100, -208, -100,
+                                                 -208, -100, -208, -100);
+    const __m128i r_coefficients = _mm_set_epi16(409, 0, 409, 0,
+                                                 409, 0, 409, 0);
+
+    __m128i y_lo = _mm_madd_epi16(_mm_unpacklo_epi16(c, one), y_coefficients);
+    __m128i y_hi = _mm_madd_epi16(_mm_unpackhi_epi16(c, one), y_coefficients);
+    __m128i de_lo = _mm_unpacklo_epi16(d, e);
+    __m128i de_hi = _mm_unpackhi_epi16(d, e);
+
+    __m128i b = channel_sse2(y_lo, y_hi, de_lo, de_hi, b_coefficients);
+    __m128i g = channel_sse2(y_lo, y_hi, de_lo, de_hi, g_coefficients);
+    __m128i r = channel_sse2(y_lo, y_hi, de_lo, de_hi, r_coefficients);
+
+    /* Saturating to bytes does the clipping */
+    __m128i bg = _mm_unpacklo_epi8(_mm_packus_epi16(b, b),
+                                   _mm_packus_epi16(g, g));
+    __m128i ra = _mm_unpacklo_epi8(_mm_packus_epi16(r, r),
+                                   _mm_set1_epi8(-1));
+    _mm_storeu_si128((__m128i *)dst, _mm_unpacklo_epi16(bg, ra));
+    _mm_storeu_si128((__m128i *)(dst + 16), _mm_unpackhi_epi16(bg, ra));
+}
+
+/* Returns the number of pixels done, the rest is left for the generic code */
+__attribute__((target("sse2")))
+static unsigned int packed_to_bgra_sse2(YUV422Format format,
+                                        const uint8_t *src,
+                                        unsigned int width, uint8_t *dst)
+{
+    const __m128i low_bytes = _mm_set1_epi16(0x00FF);
+    const __m128i luma_bias = _mm_set1_epi16(16);
+    const __m128i chroma_bias = _mm_set1_epi16(128);
+    unsigned int x;
+    for (x = 0; x + 8 <= width; x += 8) {
+        __m128i pixels = _mm_loadu_si128((const __m128i *)(src + x * 2));
+        __m128i luma;
+        __m128i chroma;
+        if (format == YUV422_YUYV) {
+            luma = _mm_and_si128(pixels, low_bytes);
+            chroma = _mm_srli_epi16(pixels, 8);
+        } else {
+            luma = _mm_srli_epi16(pixels, 8);
+            chroma = _mm_and_si128(pixels, low_bytes);
+        }
+        /* chroma is U0 V0 U1 V1 U2 V2 U3 V3, both pixels of a pair use it */
+        __m128i u = _mm_shufflehi_epi16(
+                        _mm_shufflelo_epi16(chroma, _MM_SHUFFLE(2, 2, 0, 0)),
+                        _MM_SHUFFLE(2, 2, 0, 0));
+        __m128i v = _mm_shufflehi_epi16(
+                        _mm_shufflelo_epi16(chroma, _MM_SHUFFLE(3, 3, 1, 1)),
+                        _MM_SHUFFLE(3, 3, 1, 1));
+        store_bgra_sse2(_mm_sub_epi16(luma, luma_bias),
+                        _mm_sub_epi16(u, chroma_bias),
+                        _mm_sub_epi16(v, chroma_bias),
+                        dst + x * 4);
+    }
+    return x;
+}
+
+__attribute__((target("sse2")))
+static unsigned int planar_to_bgra_sse2(const int16_t *c, const int16_t *d,
+                                        const int16_t *e, unsigned int width,
+                                        uint8_t *dst)
+{
+    unsigned int x;
+    for (x = 0; x + 8 <= width; x += 8) {
+        store_bgra_sse2(_mm_loadu_si128((const __m128i *)&c[x]),
+                        _mm_loadu_si128((const __m128i *)&d[x]),
+                        _mm_loadu_si128((const __m128i *)&e[x]),
+                        dst + x * 4);
+    }
+    return x;
+}
+
+#endif
+
+static inline bool use_sse2(void)
+{
+    return have_sse2 && !force_generic;
+}
+
+void yuv422_to_bgra(YUV422Format format, const uint8_t *src,
+                    unsigned int width, uint8_t *dst)
+{
+    unsigned int done = 0;
+#ifdef YUV_SSE2
+    if (use_sse2()) {
+        done = packed_to_bgra_sse2(format, src, width, dst);
+    }
+#endif
+    packed_to_bgra_generic(format, src, done, width, dst);
+}
+
+/* Blends a and b, f is a 16 bit fraction */
+static inline int lerp(int a, int b, uint32_t f)
+{
+    return (a * (int)(65536 - f) + b * (int)f + 32768) >> 16;
+}
+
+/* Bilinear sample of component offset in the pixel pairs of src and
+   next_src, position is 16.16 fixed point in units of stride bytes */
+static inline int sample(const uint8_t *src, const uint8_t *next_src,
+                         uint64_t position, unsigned int count,
+                         unsigned int stride, unsigned int offset, uint32_t t)
+{
+    unsigned int i0 = MIN(position >> 16, count - 1);
+    unsigned int i1 = MIN(i0 + 1, count - 1);
+    uint32_t f = position & 0xFFFF;
+    int top = lerp(src[i0 * stride + offset], src[i1 * stride + offset], f);
+    int bottom = lerp(next_src[i0 * stride + offset],
+                      next_src[i1 * stride + offset], f);
+    return lerp(top, bottom, t);
+}
+
+void yuv422_scale_to_bgra(YUV422Format format,
+                          const uint8_t *src, const uint8_t *next_src,
+                          unsigned int src_width,
+                          uint32_t s, uint32_t ds, uint32_t t, bool filter,
+                          uint8_t *dst, unsigned int dst_width)
+{
+    int16_t c[YUV_CHUNK];
+    int16_t d[YUV_CHUNK];
+    int16_t e[YUV_CHUNK];
+    unsigned int luma, u, v;
+    unsigned int pairs = (src_width + 1) / 2;
+    unsigned int first, i;
+
+    if (src_width == 0) {
+        return;
+    }
+
+    /* 1:1 from the start of a pair is a plain conversion */
+    if ((ds == 0x10000) && ((s & 0x1FFFF) == 0) && (!filter || (t == 0)) &&
+        ((s >> 16) + dst_width <= src_width)) {
+        yuv422_to_bgra(format, src + (s >> 16) * 2, dst_width, dst);
+        return;
+    }
+
+    get_offsets(format, &luma, &u, &v);
+    for (first = 0; first < dst_width; first += YUV_CHUNK) {
+        unsigned int count = MIN(dst_width - first, YUV_CHUNK);
+        for (i = 0; i < count; i++) {
+            uint64_t position = s + (uint64_t)(first + i) * ds;
+            if (filter) {
+                /* Chroma is sited on the first pixel of each pair */
+                c[i] = sample(src, next_src, position, src_width, 2, luma, t)
+                       - 16;
+                d[i] = sample(src, next_src, position / 2, pairs, 4, u, t)
+                       - 128;
+                e[i] = sample(src, next_src, position / 2, pairs, 4, v, t)
+                       - 128;
+            } else {
+                unsigned int x = MIN(position >> 16, src_width - 1);
+                const uint8_t *pair = src + (x & ~1) * 2;
+                c[i] = (int)src[x * 2 + luma] - 16;
+                d[i] = (int)pair[u] - 128;
+                e[i] = (int)pair[v] - 128;
+            }
+        }
+
+        unsigned int done = 0;
+#ifdef YUV_SSE2
+        if (use_sse2()) {
+            done = planar_to_bgra_sse2(c, d, e, count, dst + first * 4);
+        }
+#endif
+        planar_to_bgra_generic(c, d, e, done, count, dst + first * 4);
+    }
+}
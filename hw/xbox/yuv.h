@@ -0,0 +1,45 @@
+/*
+ * QEMU packed 4:2:2 YUV to RGB conversion
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ *
+ */
+
+#ifndef HW_XBOX_YUV_H
+#define HW_XBOX_YUV_H
+
+#include <stdint.h>
+#include "qemu/osdep.h"
+
+/* Named after the byte order in memory */
+typedef enum YUV422Format {
+    YUV422_YUYV, /* YUY2, NV2A CR8YB8CB8YA8 */
+    YUV422_UYVY, /* NV2A YB8CR8YA8CB8 */
+} YUV422Format;
+
+/* Converts width pixels of BT.601 studio range video to 32 bit pixels which
+   are B, G, R, 0xFF in memory (A8R8G8B8 on little endian hosts).
+   src has to hold (width + 1) / 2 pixel pairs. */
+void yuv422_to_bgra(YUV422Format format, const uint8_t *src,
+                    unsigned int width, uint8_t *dst);
+
+/* Scales a line of src_width pixels to dst_width pixels. Pixel i samples
+   src at s + i * ds, both are 16.16 fixed point source pixels.
+   Unless filter is set the nearest pixel is used. Otherwise neighbouring
+   pixels are blended and next_src, the line below src, is blended in by the
+   16 bit fraction t. next_src may be src. Samples past the end of the line
+   repeat the last pixel. */
+void yuv422_scale_to_bgra(YUV422Format format,
+                          const uint8_t *src, const uint8_t *next_src,
+                          unsigned int src_width,
+                          uint32_t s, uint32_t ds, uint32_t t, bool filter,
+                          uint8_t *dst, unsigned int dst_width);
+
+/* Name of the kernels picked for this host, for benchmarks and tests */
+const char *yuv_get_implementation(void);
+
+/* Only use the portable kernels (for tests) */
+void yuv_force_generic(bool force);
+
+#endif
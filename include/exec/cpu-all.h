@@ -435,8 +435,9 @@ typedef struct RAMBlock {
 
 typedef struct RAMList {
     QemuMutex mutex;
-    /* Protected by the iothread lock.  */
-    unsigned long *dirty_memory[DIRTY_MEMORY_NUM];
+    /* One byte per page, bit n set if the page is dirty for client n.
+     * Updated atomically, grown under the iothread lock.  */
+    uint8_t *dirty_memory;
     RAMBlock *mru_block;
     /* Protected by the ramlist lock.  */
     QTAILQ_HEAD(, RAMBlock) blocks;
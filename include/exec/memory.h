@@ -22,7 +22,13 @@
 #define DIRTY_MEMORY_NV2A_GPU_COLOR    3
 #define DIRTY_MEMORY_NV2A_GPU_ZETA     4
 #define DIRTY_MEMORY_NV2A_GPU_RESOURCE 5
-#define DIRTY_MEMORY_NUM               6        /* num of dirty bits */
+#define DIRTY_MEMORY_NV2A_GPU_VERTEX   6
+#define DIRTY_MEMORY_NV2A_GPU_CAPTURE  7
+#define DIRTY_MEMORY_NUM               8        /* num of dirty bits */
+
+/* The client that can track writes below page granularity, see
+ * memory_region_set_subpage_log() */
+#define DIRTY_MEMORY_SUBPAGE           DIRTY_MEMORY_NV2A_GPU_RESOURCE
 
 #include <stdint.h>
 #include <stdbool.h>
@@ -539,6 +545,25 @@ void *memory_region_get_ram_ptr(MemoryRegion *mr);
  */
 void memory_region_set_log(MemoryRegion *mr, bool log, unsigned client);
 
+/**
+ * memory_region_set_subpage_log: Turn sub-page dirty logging on or off for
+ *                                a range.
+ *
+ * Guest CPU writes to the pages of the range only make the parts of the
+ * page they hit dirty for %DIRTY_MEMORY_SUBPAGE, so memory_region_get_dirty()
+ * for a range sharing a page with them stays clean. Every write to such a
+ * page traps until the page is fully dirty, so only use it for ranges which
+ * are read often. Calls nest, the range is tracked until every enabling call
+ * was matched. Only meaningful for RAM regions.
+ *
+ * @mr: the memory region being updated.
+ * @addr: the start of the range.
+ * @size: the size of the range.
+ * @log: whether sub-page logging is to be enabled or disabled.
+ */
+void memory_region_set_subpage_log(MemoryRegion *mr, hwaddr addr,
+                                   hwaddr size, bool log);
+
 /**
  * memory_region_get_dirty: Check whether a range of bytes is dirty
  *                          for a specified client.
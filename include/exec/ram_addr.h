@@ -21,6 +21,8 @@
 
 #ifndef CONFIG_USER_ONLY
 #include "hw/xen/xen.h"
+#include "qemu/atomic.h"
+#include "qemu/bytemap.h"
 
 ram_addr_t qemu_ram_alloc_from_ptr(ram_addr_t size, void *host,
                                    MemoryRegion *mr);
@@ -29,19 +31,32 @@ void *qemu_get_ram_ptr(ram_addr_t addr);
 void qemu_ram_free(ram_addr_t addr);
 void qemu_ram_free_from_ptr(ram_addr_t addr);
 
+/* Dirty clients that track every page and are never switched off */
+#define DIRTY_CLIENTS_ALWAYS ((1 << DIRTY_MEMORY_VGA) | \
+                              (1 << DIRTY_MEMORY_CODE))
+#define DIRTY_CLIENTS_ALL    ((1 << DIRTY_MEMORY_NUM) - 1)
+#define DIRTY_CLIENTS_NOCODE (DIRTY_CLIENTS_ALL & ~(1 << DIRTY_MEMORY_CODE))
+
+bool cpu_physical_memory_get_dirty_subpage(ram_addr_t start,
+                                           ram_addr_t length);
+
 static inline bool cpu_physical_memory_get_dirty(ram_addr_t start,
                                                  ram_addr_t length,
                                                  unsigned client)
 {
-    unsigned long end, page, next;
+    unsigned long end, page;
 
     assert(client < DIRTY_MEMORY_NUM);
+    if (client == DIRTY_MEMORY_SUBPAGE) {
+        return cpu_physical_memory_get_dirty_subpage(start, length);
+    }
 
     end = TARGET_PAGE_ALIGN(start + length) >> TARGET_PAGE_BITS;
     page = start >> TARGET_PAGE_BITS;
-    next = find_next_bit(ram_list.dirty_memory[client], end, page);
-
-    return next < end;
+    if (end - page == 1) {
+        return ram_list.dirty_memory[page] & (1 << client);
+    }
+    return bytemap_find(ram_list.dirty_memory, page, end, 1 << client) < end;
 }
 
 static inline bool cpu_physical_memory_get_dirty_flag(ram_addr_t addr,
@@ -50,25 +65,28 @@ static inline bool cpu_physical_memory_get_dirty_flag(ram_addr_t addr,
     return cpu_physical_memory_get_dirty(addr, 1, client);
 }
 
+/* Clients that aren't logging keep their bit set, so a page is only clean
+ * for one that is */
 static inline bool cpu_physical_memory_is_clean(ram_addr_t addr)
 {
-    bool vga = cpu_physical_memory_get_dirty_flag(addr, DIRTY_MEMORY_VGA);
-    bool code = cpu_physical_memory_get_dirty_flag(addr, DIRTY_MEMORY_CODE);
-    bool migration =
-        cpu_physical_memory_get_dirty_flag(addr, DIRTY_MEMORY_MIGRATION);
-    /*FIXME: Loop using DIRTY_MEMORY_NUM */
-    bool nv2a_gpu = true;
-    nv2a_gpu = nv2a_gpu && cpu_physical_memory_get_dirty_flag(addr, DIRTY_MEMORY_NV2A_GPU_ZETA);
-    nv2a_gpu = nv2a_gpu && cpu_physical_memory_get_dirty_flag(addr, DIRTY_MEMORY_NV2A_GPU_COLOR);
-    nv2a_gpu = nv2a_gpu && cpu_physical_memory_get_dirty_flag(addr, DIRTY_MEMORY_NV2A_GPU_RESOURCE);
-    return !(vga && code && migration && nv2a_gpu);
+    return ram_list.dirty_memory[addr >> TARGET_PAGE_BITS]
+           != DIRTY_CLIENTS_ALL;
+}
+
+static inline void cpu_physical_memory_set_dirty_clients(ram_addr_t addr,
+                                                         uint8_t clients)
+{
+    uint8_t *p = &ram_list.dirty_memory[addr >> TARGET_PAGE_BITS];
+    if ((*p & clients) != clients) {
+        atomic_or(p, clients);
+    }
 }
 
 static inline void cpu_physical_memory_set_dirty_flag(ram_addr_t addr,
                                                       unsigned client)
 {
     assert(client < DIRTY_MEMORY_NUM);
-    set_bit(addr >> TARGET_PAGE_BITS, ram_list.dirty_memory[client]);
+    cpu_physical_memory_set_dirty_clients(addr, 1 << client);
 }
 
 static inline void cpu_physical_memory_set_dirty_range(ram_addr_t start,
@@ -78,13 +96,7 @@ static inline void cpu_physical_memory_set_dirty_range(ram_addr_t start,
 
     end = TARGET_PAGE_ALIGN(start + length) >> TARGET_PAGE_BITS;
     page = start >> TARGET_PAGE_BITS;
-    bitmap_set(ram_list.dirty_memory[DIRTY_MEMORY_MIGRATION], page, end - page);
-    bitmap_set(ram_list.dirty_memory[DIRTY_MEMORY_VGA], page, end - page);
-    bitmap_set(ram_list.dirty_memory[DIRTY_MEMORY_CODE], page, end - page);
-    /* FIXME: Loop using DIRTY_MEMORY_NUM */
-    bitmap_set(ram_list.dirty_memory[DIRTY_MEMORY_NV2A_GPU_ZETA], page, end - page);
-    bitmap_set(ram_list.dirty_memory[DIRTY_MEMORY_NV2A_GPU_COLOR], page, end - page);
-    bitmap_set(ram_list.dirty_memory[DIRTY_MEMORY_NV2A_GPU_RESOURCE], page, end - page);
+    bytemap_set(ram_list.dirty_memory, page, end, DIRTY_CLIENTS_ALL);
     xen_modified_memory(start, length);
 }
 
@@ -99,46 +111,23 @@ static inline void cpu_physical_memory_set_dirty_lebitmap(unsigned long *bitmap,
     ram_addr_t ram_addr;
     unsigned long len = (pages + HOST_LONG_BITS - 1) / HOST_LONG_BITS;
     unsigned long hpratio = getpagesize() / TARGET_PAGE_SIZE;
-    unsigned long page = BIT_WORD(start >> TARGET_PAGE_BITS);
-
-    /* start address is aligned at the start of a word? */
-    if ((((page * BITS_PER_LONG) << TARGET_PAGE_BITS) == start) &&
-        (hpratio == 1)) {
-        long k;
-        long nr = BITS_TO_LONGS(pages);
-
-        for (k = 0; k < nr; k++) {
-            if (bitmap[k]) {
-                unsigned long temp = leul_to_cpu(bitmap[k]);
-
-                ram_list.dirty_memory[DIRTY_MEMORY_MIGRATION][page + k] |= temp;
-                ram_list.dirty_memory[DIRTY_MEMORY_VGA][page + k] |= temp;
-                ram_list.dirty_memory[DIRTY_MEMORY_CODE][page + k] |= temp;
-                /* FIXME: Loop using DIRTY_MEMORY_NUM */
-                ram_list.dirty_memory[DIRTY_MEMORY_NV2A_GPU_ZETA][page + k] |= temp;
-                ram_list.dirty_memory[DIRTY_MEMORY_NV2A_GPU_COLOR][page + k] |= temp;
-                ram_list.dirty_memory[DIRTY_MEMORY_NV2A_GPU_RESOURCE][page + k] |= temp;
-            }
-        }
-        xen_modified_memory(start, pages);
-    } else {
-        /*
-         * bitmap-traveling is faster than memory-traveling (for addr...)
-         * especially when most of the memory is not dirty.
-         */
-        for (i = 0; i < len; i++) {
-            if (bitmap[i] != 0) {
-                c = leul_to_cpu(bitmap[i]);
-                do {
-                    j = ffsl(c) - 1;
-                    c &= ~(1ul << j);
-                    page_number = (i * HOST_LONG_BITS + j) * hpratio;
-                    addr = page_number * TARGET_PAGE_SIZE;
-                    ram_addr = start + addr;
-                    cpu_physical_memory_set_dirty_range(ram_addr,
-                                       TARGET_PAGE_SIZE * hpratio);
-                } while (c != 0);
-            }
+
+    /*
+     * bitmap-traveling is faster than memory-traveling (for addr...)
+     * especially when most of the memory is not dirty.
+     */
+    for (i = 0; i < len; i++) {
+        if (bitmap[i] != 0) {
+            c = leul_to_cpu(bitmap[i]);
+            do {
+                j = ffsl(c) - 1;
+                c &= ~(1ul << j);
+                page_number = (i * HOST_LONG_BITS + j) * hpratio;
+                addr = page_number * TARGET_PAGE_SIZE;
+                ram_addr = start + addr;
+                cpu_physical_memory_set_dirty_range(ram_addr,
+                                   TARGET_PAGE_SIZE * hpratio);
+            } while (c != 0);
         }
     }
 }
@@ -153,11 +142,18 @@ static inline void cpu_physical_memory_clear_dirty_range(ram_addr_t start,
     assert(client < DIRTY_MEMORY_NUM);
     end = TARGET_PAGE_ALIGN(start + length) >> TARGET_PAGE_BITS;
     page = start >> TARGET_PAGE_BITS;
-    bitmap_clear(ram_list.dirty_memory[client], page, end - page);
+    bytemap_clear(ram_list.dirty_memory, page, end, 1 << client);
 }
 
 void cpu_physical_memory_reset_dirty(ram_addr_t start, ram_addr_t length,
                                      unsigned client);
 
+/* Start or stop a user of a dirty client, pages read as dirty for it while
+ * there are none */
+void cpu_physical_memory_log_client(unsigned client, bool enable);
+
+void cpu_physical_memory_set_subpage_log(ram_addr_t start, ram_addr_t length,
+                                         bool log);
+
 #endif
 #endif
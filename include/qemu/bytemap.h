@@ -0,0 +1,38 @@
+/*
+ * Byte map module
+ *
+ * One byte per item, each bit of it an independent flag. Used for the
+ * per-page dirty client masks.
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_BYTEMAP_H
+#define QEMU_BYTEMAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/* First index in [start, end) with any of the mask bits set, or end */
+size_t bytemap_find(const uint8_t *map, size_t start, size_t end,
+                    uint8_t mask);
+
+/* First index in [start, end) with any of the mask bits clear, or end */
+size_t bytemap_find_clear(const uint8_t *map, size_t start, size_t end,
+                          uint8_t mask);
+
+/* Atomically set or clear the mask bits in [start, end). Stretches that
+ * already have the wanted value are only read. */
+void bytemap_set(uint8_t *map, size_t start, size_t end, uint8_t mask);
+void bytemap_clear(uint8_t *map, size_t start, size_t end, uint8_t mask);
+
+/* Name of the kernels picked for this host, for benchmarks and tests */
+const char *bytemap_get_implementation(void);
+
+/* Only use the portable kernels (for tests) */
+void bytemap_force_generic(bool force);
+
+#endif
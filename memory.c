@@ -1165,12 +1165,27 @@ void memory_region_set_log(MemoryRegion *mr, bool log, unsigned client)
 {
     uint8_t mask = 1 << client;
 
+    if (!!(mr->dirty_log_mask & mask) != log) {
+        cpu_physical_memory_log_client(client, log);
+    }
     memory_region_transaction_begin();
     mr->dirty_log_mask = (mr->dirty_log_mask & ~mask) | (log * mask);
     memory_region_update_pending |= mr->enabled;
     memory_region_transaction_commit();
 }
 
+void memory_region_set_subpage_log(MemoryRegion *mr, hwaddr addr,
+                                   hwaddr size, bool log)
+{
+    if (mr->alias) {
+        memory_region_set_subpage_log(mr->alias, addr + mr->alias_offset,
+                                      size, log);
+        return;
+    }
+    assert(mr->terminates);
+    cpu_physical_memory_set_subpage_log(mr->ram_addr + addr, size, log);
+}
+
 bool memory_region_get_dirty(MemoryRegion *mr, hwaddr addr,
                              hwaddr size, unsigned client)
 {
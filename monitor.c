@@ -2930,6 +2930,13 @@ static mon_cmd_t info_cmds[] = {
         .help       = "show balloon information",
         .mhandler.cmd = hmp_info_balloon,
     },
+    {
+        .name       = "nv2a-stats",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show where the NV2A GPU spent the last frame",
+        .mhandler.cmd = hmp_info_nv2a_stats,
+    },
     {
         .name       = "qtree",
         .args_type  = "",
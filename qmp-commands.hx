@@ -3170,6 +3170,66 @@ EQMP
         .mhandler.cmd_new = qmp_marshal_input_query_balloon,
     },
 
+SQMP
+query-nv2a-stats
+----------------
+
+Show where the NV2A GPU spent its time during the last frame.
+
+Return a json-object with the following information:
+
+- "frame": number of the frame (json-int)
+- "frame-ns": host time from the previous flip to this one (json-int)
+- "draws": number of draw calls (json-int)
+- "upload-bytes": texture and vertex data handed to the host GPU (json-int)
+- "stages": json-array of json-objects with
+  - "name": stage name (json-string)
+  - "count": how often the stage was entered (json-int)
+  - "ns": host time spent in the stage, without nested stages (json-int)
+- "methods": json-array of the slowest methods, each a json-object with
+  - "graphics-class": object class (json-int)
+  - "method": method offset (json-int)
+  - "name": method name, optional (json-string)
+  - "count": parameter words handled (json-int)
+  - "ns": host time spent (json-int)
+- "histogram": frame times of recent frames, json-array of json-objects with
+  - "min-ms": lower bound of the bucket in milliseconds (json-int)
+  - "frames": number of frames in the bucket (json-int)
+
+Example:
+
+-> { "execute": "query-nv2a-stats" }
+<- {
+      "return":{
+         "frame":1234,
+         "frame-ns":16702133,
+         "draws":212,
+         "upload-bytes":1048576,
+         "stages":[
+            { "name":"other", "count":0, "ns":1203312 },
+            { "name":"idle", "count":215, "ns":9012455 },
+            { "name":"draw", "count":212, "ns":3100234 }
+         ],
+         "methods":[
+            { "graphics-class":151, "method":6140, "count":212,
+              "ns":4021990 }
+         ],
+         "histogram":[
+            { "min-ms":0, "frames":0 },
+            { "min-ms":16, "frames":250 },
+            { "min-ms":33, "frames":6 }
+         ]
+      }
+   }
+
+EQMP
+
+    {
+        .name       = "query-nv2a-stats",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_nv2a_stats,
+    },
+
     {
         .name       = "query-block-jobs",
         .args_type  = "",
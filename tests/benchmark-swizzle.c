@@ -0,0 +1,79 @@
+/*
+ * Texture swizzling benchmark
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ *
+ * Usage: benchmark-swizzle [iterations]
+ */
+
+#include <glib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "qemu-common.h"
+#include "hw/xbox/swizzle.h"
+
+static const unsigned int sizes[][2] = {
+    { 64, 64 }, { 256, 256 }, { 512, 512 }, { 1024, 1024 }, { 1024, 256 },
+};
+
+static const unsigned int bytes_per_pixel_list[] = { 1, 2, 4, 8 };
+
+/* Returns megapixels per second */
+static double run(bool swizzle, unsigned int width, unsigned int height,
+                  unsigned int bytes_per_pixel, unsigned int iterations)
+{
+    size_t size = width * height * bytes_per_pixel;
+    uint8_t *src = g_malloc0(size);
+    uint8_t *dst = g_malloc0(size);
+    unsigned int pitch = width * bytes_per_pixel;
+    unsigned int i;
+    gint64 start;
+    gint64 duration;
+
+    start = g_get_monotonic_time();
+    for (i = 0; i < iterations; i++) {
+        if (swizzle) {
+            flip_and_swizzle(src, width, height, dst, pitch, bytes_per_pixel);
+        } else {
+            unswizzle_and_flip(src, width, height, dst, pitch,
+                               bytes_per_pixel);
+        }
+    }
+    duration = MAX(g_get_monotonic_time() - start, 1);
+
+    g_free(src);
+    g_free(dst);
+    return (double)width * height * iterations / duration;
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int iterations = 100;
+    unsigned int generic, i, j;
+
+    if (argc > 1) {
+        iterations = atoi(argv[1]);
+    }
+
+    printf("%-9s %-10s %4s %12s %12s\n",
+           "kernels", "size", "Bpp", "unswizzle", "swizzle");
+    for (generic = 0; generic < 2; generic++) {
+        swizzle_force_generic(generic);
+        for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+            for (j = 0; j < ARRAY_SIZE(bytes_per_pixel_list); j++) {
+                unsigned int width = sizes[i][0];
+                unsigned int height = sizes[i][1];
+                unsigned int bytes_per_pixel = bytes_per_pixel_list[j];
+                char size[16];
+                snprintf(size, sizeof(size), "%ux%u", width, height);
+                printf("%-9s %-10s %4u %8.1f MP/s %8.1f MP/s\n",
+                       swizzle_get_implementation(), size, bytes_per_pixel,
+                       run(false, width, height, bytes_per_pixel, iterations),
+                       run(true, width, height, bytes_per_pixel, iterations));
+            }
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,91 @@
+/*
+ * Packed YUV to RGB conversion benchmark
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ *
+ * Usage: benchmark-yuv [iterations]
+ */
+
+#include <glib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "qemu-common.h"
+#include "hw/xbox/yuv.h"
+
+/* Video size and size on screen */
+static const unsigned int sizes[][4] = {
+    { 640, 480, 640, 480 }, { 720, 480, 640, 480 }, { 320, 240, 640, 480 },
+    { 1280, 720, 1280, 720 },
+};
+
+/* Returns megapixels per second written */
+static double run(bool scale, bool filter,
+                  unsigned int in_width, unsigned int in_height,
+                  unsigned int out_width, unsigned int out_height,
+                  unsigned int iterations)
+{
+    unsigned int in_pitch = in_width * 2;
+    uint8_t *src = g_malloc0(in_pitch * in_height);
+    uint8_t *dst = g_malloc0(out_width * 4);
+    uint32_t ds = ((uint64_t)in_width << 16) / out_width;
+    uint32_t dt = ((uint64_t)in_height << 16) / out_height;
+    unsigned int i, y;
+    gint64 start;
+    gint64 duration;
+
+    start = g_get_monotonic_time();
+    for (i = 0; i < iterations; i++) {
+        for (y = 0; y < out_height; y++) {
+            if (scale) {
+                uint32_t t = y * dt;
+                unsigned int row = MIN(t >> 16, in_height - 1);
+                unsigned int next_row = MIN(row + 1, in_height - 1);
+                yuv422_scale_to_bgra(YUV422_YUYV, src + row * in_pitch,
+                                     src + next_row * in_pitch, in_width,
+                                     0, ds, t & 0xFFFF, filter,
+                                     dst, out_width);
+            } else {
+                yuv422_to_bgra(YUV422_YUYV,
+                               src + MIN(y, in_height - 1) * in_pitch,
+                               MIN(in_width, out_width), dst);
+            }
+        }
+    }
+    duration = MAX(g_get_monotonic_time() - start, 1);
+
+    g_free(src);
+    g_free(dst);
+    return (double)out_width * out_height * iterations / duration;
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int iterations = 100;
+    unsigned int generic, i;
+
+    if (argc > 1) {
+        iterations = atoi(argv[1]);
+    }
+
+    printf("%-9s %-20s %12s %12s %12s\n",
+           "kernels", "size", "convert", "nearest", "bilinear");
+    for (generic = 0; generic < 2; generic++) {
+        yuv_force_generic(generic);
+        for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+            char size[32];
+            snprintf(size, sizeof(size), "%ux%u->%ux%u",
+                     sizes[i][0], sizes[i][1], sizes[i][2], sizes[i][3]);
+            printf("%-9s %-20s %7.1f MP/s %7.1f MP/s %7.1f MP/s\n",
+                   yuv_get_implementation(), size,
+                   run(false, false, sizes[i][0], sizes[i][1],
+                       sizes[i][2], sizes[i][3], iterations),
+                   run(true, false, sizes[i][0], sizes[i][1],
+                       sizes[i][2], sizes[i][3], iterations),
+                   run(true, true, sizes[i][0], sizes[i][1],
+                       sizes[i][2], sizes[i][3], iterations));
+        }
+    }
+    return 0;
+}
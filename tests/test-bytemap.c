@@ -0,0 +1,139 @@
+/*
+ * Test the byte map scans and updates against plain loops
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ *
+ */
+
+#include <glib.h>
+#include <stdint.h>
+#include <string.h>
+#include "qemu-common.h"
+#include "qemu/bytemap.h"
+
+#define MAP_SIZE 300
+#define ROUNDS 2000
+
+/* Mostly long runs of all clear or all set, like dirty pages are, with a
+ * few random bytes in between */
+static void fill_map(uint8_t *map)
+{
+    uint8_t run = 0;
+    unsigned int i;
+
+    for (i = 0; i < MAP_SIZE; i++) {
+        switch (g_test_rand_int_range(0, 40)) {
+        case 0:
+            run = 0;
+            break;
+        case 1:
+            run = 0xFF;
+            break;
+        case 2:
+            map[i] = g_test_rand_int();
+            continue;
+        }
+        map[i] = run;
+    }
+}
+
+static void pick_range(size_t *start, size_t *end)
+{
+    *start = g_test_rand_int_range(0, MAP_SIZE);
+    *end = g_test_rand_int_range(*start, MAP_SIZE + 1);
+}
+
+static void check_find(void)
+{
+    uint8_t buf[MAP_SIZE + 1];
+    uint8_t *map = &buf[1]; /* Not aligned */
+    unsigned int round;
+
+    for (round = 0; round < ROUNDS; round++) {
+        uint8_t mask = 1 << g_test_rand_int_range(0, 8);
+        size_t start, end, i, ref;
+
+        if (round & 1) {
+            mask |= g_test_rand_int();
+        }
+        fill_map(map);
+        pick_range(&start, &end);
+
+        for (ref = start; ref < end && !(map[ref] & mask); ref++) {
+        }
+        g_assert_cmpuint(bytemap_find(map, start, end, mask), ==, ref);
+
+        for (ref = start; ref < end && (map[ref] & mask) == mask; ref++) {
+        }
+        g_assert_cmpuint(bytemap_find_clear(map, start, end, mask), ==, ref);
+
+        /* A single match at every position */
+        memset(map, 0, MAP_SIZE);
+        for (i = start; i < end; i++) {
+            map[i] = mask;
+            g_assert_cmpuint(bytemap_find(map, start, end, mask), ==, i);
+            map[i] = 0;
+        }
+    }
+}
+
+static void check_update(void)
+{
+    uint8_t buf[MAP_SIZE + 1];
+    uint8_t ref[MAP_SIZE];
+    uint8_t *map = &buf[1]; /* Not aligned */
+    unsigned int round;
+
+    for (round = 0; round < ROUNDS; round++) {
+        uint8_t mask = 1 << g_test_rand_int_range(0, 8);
+        size_t start, end, i;
+
+        if (round & 1) {
+            mask |= g_test_rand_int();
+        }
+        fill_map(map);
+        pick_range(&start, &end);
+
+        memcpy(ref, map, MAP_SIZE);
+        for (i = start; i < end; i++) {
+            ref[i] |= mask;
+        }
+        bytemap_set(map, start, end, mask);
+        g_assert(memcmp(map, ref, MAP_SIZE) == 0);
+
+        fill_map(map);
+        memcpy(ref, map, MAP_SIZE);
+        for (i = start; i < end; i++) {
+            ref[i] &= ~mask;
+        }
+        bytemap_clear(map, start, end, mask);
+        g_assert(memcmp(map, ref, MAP_SIZE) == 0);
+    }
+}
+
+static void test_bytemap_host(void)
+{
+    bytemap_force_generic(false);
+    if (g_test_verbose()) {
+        g_test_message("Using %s kernels", bytemap_get_implementation());
+    }
+    check_find();
+    check_update();
+}
+
+static void test_bytemap_generic(void)
+{
+    bytemap_force_generic(true);
+    check_find();
+    check_update();
+    bytemap_force_generic(false);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/bytemap/host", test_bytemap_host);
+    g_test_add_func("/bytemap/generic", test_bytemap_generic);
+    return g_test_run();
+}
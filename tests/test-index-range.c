@@ -0,0 +1,105 @@
+/*
+ * Test the index range scan against a plain loop
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ *
+ */
+
+#include <glib.h>
+#include <stdint.h>
+#include "qemu-common.h"
+#include "hw/xbox/index_range.h"
+
+#define MAX_COUNT 67
+
+static void check_u16(void)
+{
+    uint16_t indices[MAX_COUNT + 1];
+    unsigned int count, offset, i;
+
+    for (count = 1; count <= MAX_COUNT; count++) {
+        /* Unaligned too */
+        for (offset = 0; offset < 2; offset++) {
+            uint32_t ref_min = UINT16_MAX, ref_max = 0;
+            uint32_t min, max;
+            for (i = 0; i < count; i++) {
+                /* Both halves of the range, the top bit matters */
+                indices[offset + i] = g_test_rand_int();
+                ref_min = MIN(ref_min, indices[offset + i]);
+                ref_max = MAX(ref_max, indices[offset + i]);
+            }
+            index_range_u16(&indices[offset], count, &min, &max);
+            g_assert_cmpuint(min, ==, ref_min);
+            g_assert_cmpuint(max, ==, ref_max);
+        }
+    }
+
+    /* The extremes */
+    for (i = 0; i < MAX_COUNT; i++) {
+        indices[i] = 0x7FFF + (i & 1) * 2;
+    }
+    indices[MAX_COUNT / 2] = 0xFFFF;
+    indices[MAX_COUNT / 3] = 0;
+    uint32_t min, max;
+    index_range_u16(indices, MAX_COUNT, &min, &max);
+    g_assert_cmpuint(min, ==, 0);
+    g_assert_cmpuint(max, ==, 0xFFFF);
+}
+
+static void check_u32(void)
+{
+    uint32_t indices[MAX_COUNT + 1];
+    unsigned int count, offset, i;
+
+    for (count = 1; count <= MAX_COUNT; count++) {
+        for (offset = 0; offset < 2; offset++) {
+            uint32_t ref_min = UINT32_MAX, ref_max = 0;
+            uint32_t min, max;
+            for (i = 0; i < count; i++) {
+                indices[offset + i] = g_test_rand_int();
+                ref_min = MIN(ref_min, indices[offset + i]);
+                ref_max = MAX(ref_max, indices[offset + i]);
+            }
+            index_range_u32(&indices[offset], count, &min, &max);
+            g_assert_cmpuint(min, ==, ref_min);
+            g_assert_cmpuint(max, ==, ref_max);
+        }
+    }
+
+    for (i = 0; i < MAX_COUNT; i++) {
+        indices[i] = 0x7FFFFFFF + (i & 1) * 2;
+    }
+    indices[MAX_COUNT / 2] = 0xFFFFFFFF;
+    indices[MAX_COUNT / 3] = 0;
+    uint32_t min, max;
+    index_range_u32(indices, MAX_COUNT, &min, &max);
+    g_assert_cmpuint(min, ==, 0);
+    g_assert_cmpuint(max, ==, 0xFFFFFFFF);
+}
+
+static void test_index_range_host(void)
+{
+    index_range_force_generic(false);
+    if (g_test_verbose()) {
+        g_test_message("Using %s kernels", index_range_get_implementation());
+    }
+    check_u16();
+    check_u32();
+}
+
+static void test_index_range_generic(void)
+{
+    index_range_force_generic(true);
+    check_u16();
+    check_u32();
+    index_range_force_generic(false);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/index-range/host", test_index_range_host);
+    g_test_add_func("/index-range/generic", test_index_range_generic);
+    return g_test_run();
+}
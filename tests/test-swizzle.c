@@ -0,0 +1,97 @@
+/*
+ * Test the texture swizzling routines against the reference offsets
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ *
+ */
+
+#include <glib.h>
+#include <stdint.h>
+#include <string.h>
+#include "qemu-common.h"
+#include "hw/xbox/swizzle.h"
+
+#define MAX_SIZE_SHIFT 10
+
+static const unsigned int bytes_per_pixel_list[] = { 1, 2, 4, 8 };
+
+static void check_size(unsigned int width, unsigned int height,
+                       unsigned int bytes_per_pixel)
+{
+    /* Odd pitches make sure padding bytes are left alone */
+    unsigned int pitch = width * bytes_per_pixel + (width & 1) * 12;
+    size_t swizzled_size = width * height * bytes_per_pixel;
+    size_t linear_size = pitch * height;
+    uint8_t *swizzled = g_malloc(swizzled_size);
+    uint8_t *linear = g_malloc0(linear_size);
+    uint8_t *linear_ref = g_malloc0(linear_size);
+    uint8_t *swizzled_again = g_malloc(swizzled_size);
+    unsigned int x, y;
+    size_t i;
+
+    for (i = 0; i < swizzled_size; i++) {
+        swizzled[i] = g_test_rand_int();
+    }
+    for (y = 0; y < height; y++) {
+        for (x = 0; x < width; x++) {
+            memcpy(linear_ref + (height - y - 1) * pitch + x * bytes_per_pixel,
+                   swizzled + get_swizzled_offset(x, y, width, height,
+                                                  bytes_per_pixel),
+                   bytes_per_pixel);
+        }
+    }
+
+    unswizzle_and_flip(swizzled, width, height, linear, pitch,
+                       bytes_per_pixel);
+    g_assert(memcmp(linear, linear_ref, linear_size) == 0);
+
+    /* Every pixel is written once, so this has to restore the original */
+    memset(swizzled_again, 0, swizzled_size);
+    flip_and_swizzle(linear_ref, width, height, swizzled_again, pitch,
+                     bytes_per_pixel);
+    g_assert(memcmp(swizzled_again, swizzled, swizzled_size) == 0);
+
+    g_free(swizzled);
+    g_free(linear);
+    g_free(linear_ref);
+    g_free(swizzled_again);
+}
+
+static void check_all_sizes(void)
+{
+    unsigned int width_shift, height_shift, i;
+
+    for (width_shift = 0; width_shift <= MAX_SIZE_SHIFT; width_shift++) {
+        for (height_shift = 0; height_shift <= MAX_SIZE_SHIFT; height_shift++) {
+            for (i = 0; i < ARRAY_SIZE(bytes_per_pixel_list); i++) {
+                check_size(1 << width_shift, 1 << height_shift,
+                           bytes_per_pixel_list[i]);
+            }
+        }
+    }
+}
+
+static void test_swizzle_host(void)
+{
+    swizzle_force_generic(false);
+    if (g_test_verbose()) {
+        g_test_message("Using %s kernels", swizzle_get_implementation());
+    }
+    check_all_sizes();
+}
+
+static void test_swizzle_generic(void)
+{
+    swizzle_force_generic(true);
+    check_all_sizes();
+    swizzle_force_generic(false);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/swizzle/host", test_swizzle_host);
+    g_test_add_func("/swizzle/generic", test_swizzle_generic);
+    return g_test_run();
+}
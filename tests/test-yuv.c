@@ -0,0 +1,176 @@
+/*
+ * Test the packed YUV to RGB conversion against the reference formula
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ *
+ */
+
+#include <glib.h>
+#include <stdint.h>
+#include <string.h>
+#include "qemu-common.h"
+#include "hw/xbox/yuv.h"
+
+#define MAX_WIDTH 67
+
+static const YUV422Format formats[] = { YUV422_YUYV, YUV422_UYVY };
+
+static uint8_t cliptobyte(int x)
+{
+    return (uint8_t)((x < 0) ? 0 : ((x > 255) ? 255 : x));
+}
+
+/* The per pixel conversion the overlay used to do */
+static void reference_pixel(YUV422Format format, const uint8_t *src,
+                            unsigned int x, uint8_t *dst)
+{
+    const uint8_t *pair = src + (x & ~1) * 2;
+    int y, u, v;
+    if (format == YUV422_YUYV) {
+        y = src[x * 2];
+        u = pair[1];
+        v = pair[3];
+    } else {
+        y = src[x * 2 + 1];
+        u = pair[0];
+        v = pair[2];
+    }
+    int c = y - 16;
+    int d = u - 128;
+    int e = v - 128;
+    dst[0] = cliptobyte((298 * c + 516 * d + 128) >> 8);
+    dst[1] = cliptobyte((298 * c - 100 * d - 208 * e + 128) >> 8);
+    dst[2] = cliptobyte((298 * c + 409 * e + 128) >> 8);
+    dst[3] = 0xFF;
+}
+
+static void fill_random(uint8_t *buf, size_t size)
+{
+    size_t i;
+    for (i = 0; i < size; i++) {
+        buf[i] = g_test_rand_int();
+    }
+}
+
+static void check_convert(void)
+{
+    uint8_t src[(MAX_WIDTH + 1) * 2];
+    uint8_t dst[MAX_WIDTH * 4 + 4];
+    uint8_t ref[MAX_WIDTH * 4];
+    unsigned int width, x, i;
+
+    for (i = 0; i < ARRAY_SIZE(formats); i++) {
+        for (width = 1; width <= MAX_WIDTH; width++) {
+            fill_random(src, sizeof(src));
+            for (x = 0; x < width; x++) {
+                reference_pixel(formats[i], src, x, &ref[x * 4]);
+            }
+            /* Nothing past the last pixel may be written */
+            memset(dst, 0xAA, sizeof(dst));
+            yuv422_to_bgra(formats[i], src, width, dst);
+            g_assert(memcmp(dst, ref, width * 4) == 0);
+            g_assert(dst[width * 4] == 0xAA);
+        }
+    }
+}
+
+static void check_scale(void)
+{
+    uint8_t src[(MAX_WIDTH + 1) * 2];
+    uint8_t next_src[(MAX_WIDTH + 1) * 2];
+    uint8_t dst[MAX_WIDTH * 4 * 2];
+    uint8_t ref[MAX_WIDTH * 4 * 2];
+    unsigned int width, x, i;
+
+    for (i = 0; i < ARRAY_SIZE(formats); i++) {
+        for (width = 1; width <= MAX_WIDTH; width++) {
+            fill_random(src, sizeof(src));
+            fill_random(next_src, sizeof(next_src));
+
+            /* Nearest with a 2x zoom repeats every pixel */
+            for (x = 0; x < width * 2; x++) {
+                reference_pixel(formats[i], src, x / 2, &ref[x * 4]);
+            }
+            yuv422_scale_to_bgra(formats[i], src, next_src, width,
+                                 0, 0x8000, 0x8000, false, dst, width * 2);
+            g_assert(memcmp(dst, ref, width * 2 * 4) == 0);
+
+            /* Filtering at the first pixel of each pair of the top line
+               doesn't change anything, chroma is sited there */
+            for (x = 0; x < (width + 1) / 2; x++) {
+                reference_pixel(formats[i], src, x * 2, &ref[x * 4]);
+            }
+            yuv422_scale_to_bgra(formats[i], src, next_src, width,
+                                 0, 0x20000, 0, true, dst, (width + 1) / 2);
+            g_assert(memcmp(dst, ref, (width + 1) / 2 * 4) == 0);
+
+            /* Halfway between two equal lines is the line */
+            yuv422_scale_to_bgra(formats[i], src, src, width,
+                                 0, 0x20000, 0x8000, true,
+                                 dst, (width + 1) / 2);
+            g_assert(memcmp(dst, ref, (width + 1) / 2 * 4) == 0);
+
+            /* Sampling past the end repeats the last pixel */
+            reference_pixel(formats[i], src, width - 1, ref);
+            yuv422_scale_to_bgra(formats[i], src, next_src, width,
+                                 (width + 3) << 16, 0x10000, 0, true,
+                                 dst, 1);
+            g_assert(memcmp(dst, ref, 4) == 0);
+        }
+    }
+}
+
+/* Both kernel sets have to produce the same bytes for filtered output */
+static void check_filter_matches_generic(void)
+{
+    uint8_t src[(MAX_WIDTH + 1) * 2];
+    uint8_t next_src[(MAX_WIDTH + 1) * 2];
+    uint8_t dst[MAX_WIDTH * 3 * 4];
+    uint8_t ref[MAX_WIDTH * 3 * 4];
+    unsigned int width, i;
+
+    for (i = 0; i < ARRAY_SIZE(formats); i++) {
+        for (width = 1; width <= MAX_WIDTH; width++) {
+            uint32_t ds = 0x5555 + g_test_rand_int_range(0, 0x20000);
+            uint32_t t = g_test_rand_int_range(0, 0x10000);
+            fill_random(src, sizeof(src));
+            fill_random(next_src, sizeof(next_src));
+
+            yuv_force_generic(true);
+            yuv422_scale_to_bgra(formats[i], src, next_src, width,
+                                 0x1234, ds, t, true, ref, width * 3);
+            yuv_force_generic(false);
+            yuv422_scale_to_bgra(formats[i], src, next_src, width,
+                                 0x1234, ds, t, true, dst, width * 3);
+            g_assert(memcmp(dst, ref, width * 3 * 4) == 0);
+        }
+    }
+}
+
+static void test_yuv_host(void)
+{
+    yuv_force_generic(false);
+    if (g_test_verbose()) {
+        g_test_message("Using %s kernels", yuv_get_implementation());
+    }
+    check_convert();
+    check_scale();
+    check_filter_matches_generic();
+}
+
+static void test_yuv_generic(void)
+{
+    yuv_force_generic(true);
+    check_convert();
+    check_scale();
+    yuv_force_generic(false);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/yuv/host", test_yuv_host);
+    g_test_add_func("/yuv/generic", test_yuv_generic);
+    return g_test_run();
+}
@@ -0,0 +1,227 @@
+/*
+ * Byte map module
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ *
+ */
+
+#include "qemu-common.h"
+#include "qemu/atomic.h"
+#include "qemu/host-utils.h"
+#include "qemu/bytemap.h"
+
+#if defined(CONFIG_CPUID_H) && (defined(__x86_64__) || defined(__i386__))
+#define BYTEMAP_SSE2
+#include <cpuid.h>
+#include <emmintrin.h>
+#endif
+
+/* The mask in every byte of a word */
+#define WORD_MASK(mask) ((unsigned long)(mask) * (~0UL / 0xFF))
+
+/* Writers go back to scanning after this many bytes, so long runs that
+ * need no change are skipped by the vector code */
+#define BYTEMAP_CHUNK 64
+
+static inline bool word_aligned(const uint8_t *p)
+{
+    return ((uintptr_t)p % sizeof(unsigned long)) == 0;
+}
+
+static bool have_sse2;
+static bool force_generic;
+
+static void bytemap_init(void) __attribute__((constructor));
+static void bytemap_init(void)
+{
+#ifdef BYTEMAP_SSE2
+    unsigned int a, b, c, d;
+    if (__get_cpuid_max(0, 0) >= 1) {
+        __cpuid(1, a, b, c, d);
+        have_sse2 = (d & bit_SSE2) != 0;
+    }
+#endif
+}
+
+const char *bytemap_get_implementation(void)
+{
+    if (have_sse2 && !force_generic) {
+        return "sse2";
+    }
+    return "generic";
+}
+
+void bytemap_force_generic(bool force)
+{
+    force_generic = force;
+}
+
+static inline bool use_sse2(void)
+{
+    return have_sse2 && !force_generic;
+}
+
+#ifdef BYTEMAP_SSE2
+
+/* A bit for each of the 16 bytes that differs from ref once masked */
+__attribute__((target("sse2")))
+static inline unsigned int match_sse2(const uint8_t *p, __m128i m,
+                                      __m128i ref)
+{
+    __m128i v = _mm_and_si128(_mm_loadu_si128((const __m128i *)p), m);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(v, ref)) ^ 0xFFFF;
+}
+
+/* Returns the index of the first match, or the index the generic code has
+   to continue at. With invert a match is a byte that doesn't have all of
+   the mask bits, otherwise one that has any of them. */
+__attribute__((target("sse2")))
+static size_t find_sse2(const uint8_t *map, size_t i, size_t end,
+                        uint8_t mask, bool invert)
+{
+    const __m128i m = _mm_set1_epi8(mask);
+    const __m128i ref = invert ? m : _mm_setzero_si128();
+    unsigned int bits;
+
+    /* Four vectors at a time, for runs of untouched pages */
+    for (; i + 64 <= end; i += 64) {
+        __m128i v0 = _mm_and_si128(
+            _mm_loadu_si128((const __m128i *)&map[i]), m);
+        __m128i v1 = _mm_and_si128(
+            _mm_loadu_si128((const __m128i *)&map[i + 16]), m);
+        __m128i v2 = _mm_and_si128(
+            _mm_loadu_si128((const __m128i *)&map[i + 32]), m);
+        __m128i v3 = _mm_and_si128(
+            _mm_loadu_si128((const __m128i *)&map[i + 48]), m);
+        __m128i eq = _mm_and_si128(
+            _mm_and_si128(_mm_cmpeq_epi8(v0, ref), _mm_cmpeq_epi8(v1, ref)),
+            _mm_and_si128(_mm_cmpeq_epi8(v2, ref), _mm_cmpeq_epi8(v3, ref)));
+        if (_mm_movemask_epi8(eq) != 0xFFFF) {
+            break;
+        }
+    }
+    for (; i + 16 <= end; i += 16) {
+        bits = match_sse2(&map[i], m, ref);
+        if (bits) {
+            return i + ctz32(bits);
+        }
+    }
+    return i;
+}
+
+#endif
+
+size_t bytemap_find(const uint8_t *map, size_t start, size_t end,
+                    uint8_t mask)
+{
+    const unsigned long wmask = WORD_MASK(mask);
+    size_t i = start;
+
+#ifdef BYTEMAP_SSE2
+    if (use_sse2()) {
+        i = find_sse2(map, i, end, mask, false);
+    }
+#endif
+    for (; i < end && !word_aligned(&map[i]); i++) {
+        if (map[i] & mask) {
+            return i;
+        }
+    }
+    for (; i + sizeof(unsigned long) <= end; i += sizeof(unsigned long)) {
+        if (*(const unsigned long *)&map[i] & wmask) {
+            break;
+        }
+    }
+    for (; i < end; i++) {
+        if (map[i] & mask) {
+            return i;
+        }
+    }
+    return end;
+}
+
+size_t bytemap_find_clear(const uint8_t *map, size_t start, size_t end,
+                          uint8_t mask)
+{
+    const unsigned long wmask = WORD_MASK(mask);
+    size_t i = start;
+
+#ifdef BYTEMAP_SSE2
+    if (use_sse2()) {
+        i = find_sse2(map, i, end, mask, true);
+    }
+#endif
+    for (; i < end && !word_aligned(&map[i]); i++) {
+        if ((map[i] & mask) != mask) {
+            return i;
+        }
+    }
+    for (; i + sizeof(unsigned long) <= end; i += sizeof(unsigned long)) {
+        if ((*(const unsigned long *)&map[i] & wmask) != wmask) {
+            break;
+        }
+    }
+    for (; i < end; i++) {
+        if ((map[i] & mask) != mask) {
+            return i;
+        }
+    }
+    return end;
+}
+
+void bytemap_set(uint8_t *map, size_t start, size_t end, uint8_t mask)
+{
+    const unsigned long wmask = WORD_MASK(mask);
+    size_t i = bytemap_find_clear(map, start, end, mask);
+
+    while (i < end) {
+        size_t stop = MIN(ROUND_UP(i + 1, BYTEMAP_CHUNK), end);
+
+        for (; i < stop && !word_aligned(&map[i]); i++) {
+            if ((map[i] & mask) != mask) {
+                atomic_or(&map[i], mask);
+            }
+        }
+        for (; i + sizeof(unsigned long) <= stop; i += sizeof(unsigned long)) {
+            unsigned long *word = (unsigned long *)&map[i];
+            if ((*word & wmask) != wmask) {
+                atomic_or(word, wmask);
+            }
+        }
+        for (; i < stop; i++) {
+            if ((map[i] & mask) != mask) {
+                atomic_or(&map[i], mask);
+            }
+        }
+        i = bytemap_find_clear(map, i, end, mask);
+    }
+}
+
+void bytemap_clear(uint8_t *map, size_t start, size_t end, uint8_t mask)
+{
+    const unsigned long wmask = WORD_MASK(mask);
+    size_t i = bytemap_find(map, start, end, mask);
+
+    while (i < end) {
+        size_t stop = MIN(ROUND_UP(i + 1, BYTEMAP_CHUNK), end);
+
+        for (; i < stop && !word_aligned(&map[i]); i++) {
+            if (map[i] & mask) {
+                atomic_and(&map[i], (uint8_t)~mask);
+            }
+        }
+        for (; i + sizeof(unsigned long) <= stop; i += sizeof(unsigned long)) {
+            unsigned long *word = (unsigned long *)&map[i];
+            if (*word & wmask) {
+                atomic_and(word, ~wmask);
+            }
+        }
+        for (; i < stop; i++) {
+            if (map[i] & mask) {
+                atomic_and(&map[i], (uint8_t)~mask);
+            }
+        }
+        i = bytemap_find(map, i, end, mask);
+    }
+}
@@ -426,6 +426,37 @@ static QemuOptsList qemu_machine_opts = {
             .name = "mediaboard_filesystem",
             .type = QEMU_OPT_STRING,
             .help = "Chihiro mediaboard filesystem file",
+        },{
+            .name = "nv2a_shader_cache",
+            .type = QEMU_OPT_STRING,
+            .help = "NV2A shader cache directory",
+        },{
+            .name = "nv2a_shader_cache_size",
+            .type = QEMU_OPT_SIZE,
+            .help = "NV2A shader cache size limit",
+        },{
+            .name = "nv2a_shader_compile",
+            .type = QEMU_OPT_STRING,
+            .help = "What NV2A draws do while their shaders compile "
+                    "(block, skip or fallback)",
+        },{
+            .name = "nv2a_texture_decode",
+            .type = QEMU_OPT_STRING,
+            .help = "Where NV2A textures are decoded (cpu, gpu or a list "
+                    "of color formats for the gpu like 0x6:0xb)",
+        },{
+            .name = "nv2a_subpage_dirty",
+            .type = QEMU_OPT_BOOL,
+            .help = "Track CPU writes to NV2A surfaces in 256 byte blocks "
+                    "instead of pages",
+        },{
+            .name = "nv2a_capture",
+            .type = QEMU_OPT_STRING,
+            .help = "File to capture the NV2A method stream to",
+        },{
+            .name = "nv2a_replay",
+            .type = QEMU_OPT_STRING,
+            .help = "NV2A capture to replay instead of running the guest",
         },
         { /* End of list */ }
     },